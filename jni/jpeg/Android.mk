@@ -14,7 +14,7 @@ LOCAL_SRC_FILES := \
 	jdpostct.c jdsample.c jdtrans.c jerror.c jfdctflt.c jfdctfst.c \
 	jfdctint.c jidctflt.c jidctred.c jquant1.c \
 	jquant2.c jutils.c jmemmgr.c \
-	jmem-android.c
+	jmem-android.c jsimd.c
 
 # the assembler is only for the ARM version, don't break the Linux sim
 ifneq ($(TARGET_ARCH),arm)
@@ -30,6 +30,12 @@ else
 LOCAL_SRC_FILES += jidctint.c jidctfst.S
 endif
 
+# NEON encoder kernels; jsimd.c checks the CPU before using them
+ifeq ($(TARGET_ARCH_ABI),armeabi-v7a)
+	LOCAL_CFLAGS += -DJSIMD_HAVE_NEON
+	LOCAL_SRC_FILES += jsimd_neon.c.neon
+endif
+
 LOCAL_CFLAGS += -DAVOID_TABLES 
 LOCAL_CFLAGS += -O3 -fstrict-aliasing -fprefetch-loop-arrays
 #LOCAL_CFLAGS += -march=armv6j
@@ -174,6 +174,107 @@ rgb_ycc_convert (j_compress_ptr cinfo,
 }
 
 
+#ifdef ANDROID_RGB
+
+/**************** Android pixels -> YCbCr **************/
+
+/*
+ * These read Android's RGBA_8888 and RGB_565 surfaces (and the BGRA and
+ * ABGR orders of the former) directly, so that callers need not repack
+ * them into RGB triplets first.  They multiply instead of looking up
+ * rgb_ycc_tab; the table holds exactly these products, so the results are
+ * the same, but with no lookups left in the inner loop the compiler can
+ * vectorize it.  The sums fit easily in an int.
+ */
+
+#define Y_R	((int) FIX(0.29900))
+#define Y_G	((int) FIX(0.58700))
+#define Y_B	((int) FIX(0.11400))
+#define CB_R	((int) -FIX(0.16874))
+#define CB_G	((int) -FIX(0.33126))
+#define CB_B	((int) FIX(0.50000))
+#define CR_R	CB_B
+#define CR_G	((int) -FIX(0.41869))
+#define CR_B	((int) -FIX(0.08131))
+
+/*
+ * rindex, gindex and bindex are byte offsets within 4-byte pixels, or -1
+ * for 16-bit 565 pixels in native byte order.  Every caller passes
+ * constants, so each gets its own copy of the loop once this is inlined.
+ */
+
+LOCAL(void)
+android_convert (j_compress_ptr cinfo,
+		 JSAMPARRAY input_buf, JSAMPIMAGE output_buf,
+		 JDIMENSION output_row, int num_rows,
+		 int rindex, int gindex, int bindex, boolean gray)
+{
+  int r, g, b;
+  JSAMPROW inptr;
+  JSAMPROW outptr0, outptr1 = NULL, outptr2 = NULL;
+  JDIMENSION col;
+  JDIMENSION num_cols = cinfo->image_width;
+
+  while (--num_rows >= 0) {
+    inptr = *input_buf++;
+    outptr0 = output_buf[0][output_row];
+    if (!gray) {
+      outptr1 = output_buf[1][output_row];
+      outptr2 = output_buf[2][output_row];
+    }
+    output_row++;
+    for (col = 0; col < num_cols; col++) {
+      if (rindex < 0) {
+	int pixel = ((const unsigned short *) inptr)[col];
+	r = pixel >> 11;
+	g = (pixel >> 5) & 0x3F;
+	b = pixel & 0x1F;
+	r = (r << 3) | (r >> 2);
+	g = (g << 2) | (g >> 4);
+	b = (b << 3) | (b >> 2);
+      } else {
+	r = GETJSAMPLE(inptr[4 * col + rindex]);
+	g = GETJSAMPLE(inptr[4 * col + gindex]);
+	b = GETJSAMPLE(inptr[4 * col + bindex]);
+      }
+      /* Y */
+      outptr0[col] = (JSAMPLE)
+		((Y_R * r + Y_G * g + Y_B * b + ONE_HALF) >> SCALEBITS);
+      if (!gray) {
+	/* Cb */
+	outptr1[col] = (JSAMPLE)
+		((CB_R * r + CB_G * g + CB_B * b + CBCR_OFFSET + ONE_HALF-1)
+		 >> SCALEBITS);
+	/* Cr */
+	outptr2[col] = (JSAMPLE)
+		((CR_R * r + CR_G * g + CR_B * b + CBCR_OFFSET + ONE_HALF-1)
+		 >> SCALEBITS);
+      }
+    }
+  }
+}
+
+#define ANDROID_CONVERTER(name, rindex, gindex, bindex, gray) \
+METHODDEF(void) \
+name (j_compress_ptr cinfo, JSAMPARRAY input_buf, JSAMPIMAGE output_buf, \
+      JDIMENSION output_row, int num_rows) \
+{ \
+  android_convert(cinfo, input_buf, output_buf, output_row, num_rows, \
+		  rindex, gindex, bindex, gray); \
+}
+
+ANDROID_CONVERTER(rgba_ycc_convert, 0, 1, 2, FALSE)
+ANDROID_CONVERTER(bgra_ycc_convert, 2, 1, 0, FALSE)
+ANDROID_CONVERTER(abgr_ycc_convert, 3, 2, 1, FALSE)
+ANDROID_CONVERTER(rgb565_ycc_convert, -1, -1, -1, FALSE)
+ANDROID_CONVERTER(rgba_gray_convert, 0, 1, 2, TRUE)
+ANDROID_CONVERTER(bgra_gray_convert, 2, 1, 0, TRUE)
+ANDROID_CONVERTER(abgr_gray_convert, 3, 2, 1, TRUE)
+ANDROID_CONVERTER(rgb565_gray_convert, -1, -1, -1, TRUE)
+
+#endif /* ANDROID_RGB */
+
+
 /**************** Cases other than RGB -> YCbCr **************/
 
 
@@ -430,6 +531,20 @@ jinit_color_converter (j_compress_ptr cinfo)
 
   /* Make sure input_components agrees with in_color_space */
   switch (cinfo->in_color_space) {
+#ifdef ANDROID_RGB
+  case JCS_RGBA_8888:
+  case JCS_BGRA_8888:
+  case JCS_ABGR_8888:
+    if (cinfo->input_components != 4)
+      ERREXIT(cinfo, JERR_BAD_IN_COLORSPACE);
+    break;
+
+  case JCS_RGB_565:
+    if (cinfo->input_components != 2)
+      ERREXIT(cinfo, JERR_BAD_IN_COLORSPACE);
+    break;
+#endif
+
   case JCS_GRAYSCALE:
     if (cinfo->input_components != 1)
       ERREXIT(cinfo, JERR_BAD_IN_COLORSPACE);
@@ -471,6 +586,16 @@ jinit_color_converter (j_compress_ptr cinfo)
       cconvert->pub.color_convert = rgb_gray_convert;
     } else if (cinfo->in_color_space == JCS_YCbCr)
       cconvert->pub.color_convert = grayscale_convert;
+#ifdef ANDROID_RGB
+    else if (cinfo->in_color_space == JCS_RGBA_8888)
+      cconvert->pub.color_convert = rgba_gray_convert;
+    else if (cinfo->in_color_space == JCS_BGRA_8888)
+      cconvert->pub.color_convert = bgra_gray_convert;
+    else if (cinfo->in_color_space == JCS_ABGR_8888)
+      cconvert->pub.color_convert = abgr_gray_convert;
+    else if (cinfo->in_color_space == JCS_RGB_565)
+      cconvert->pub.color_convert = rgb565_gray_convert;
+#endif
     else
       ERREXIT(cinfo, JERR_CONVERSION_NOTIMPL);
     break;
@@ -492,6 +617,16 @@ jinit_color_converter (j_compress_ptr cinfo)
       cconvert->pub.color_convert = rgb_ycc_convert;
     } else if (cinfo->in_color_space == JCS_YCbCr)
       cconvert->pub.color_convert = null_convert;
+#ifdef ANDROID_RGB
+    else if (cinfo->in_color_space == JCS_RGBA_8888)
+      cconvert->pub.color_convert = rgba_ycc_convert;
+    else if (cinfo->in_color_space == JCS_BGRA_8888)
+      cconvert->pub.color_convert = bgra_ycc_convert;
+    else if (cinfo->in_color_space == JCS_ABGR_8888)
+      cconvert->pub.color_convert = abgr_ycc_convert;
+    else if (cinfo->in_color_space == JCS_RGB_565)
+      cconvert->pub.color_convert = rgb565_ycc_convert;
+#endif
     else
       ERREXIT(cinfo, JERR_CONVERSION_NOTIMPL);
     break;
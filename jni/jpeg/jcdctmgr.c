@@ -15,6 +15,7 @@
 #include "jinclude.h"
 #include "jpeglib.h"
 #include "jdct.h"		/* Private declarations for DCT subsystem */
+#include "jsimd.h"
 
 
 /* Private subobject for this module */
@@ -31,6 +32,12 @@ typedef struct {
    */
   DCTELEM * divisors[NUM_QUANT_TBLS];
 
+  /* SIMD kernel doing load, DCT and quantization in one, or NULL.
+   * It takes the divisors in the form described in jsimd.h.
+   */
+  jsimd_fdct_ptr simd_dct;
+  float * simd_qtbls[NUM_QUANT_TBLS];
+
 #ifdef DCT_FLOAT_SUPPORTED
   /* Same as above for the floating-point case. */
   float_DCT_method_ptr do_float_dct;
@@ -41,6 +48,23 @@ typedef struct {
 typedef my_fdct_controller * my_fdct_ptr;
 
 
+/*
+ * Convert integer divisors for the SIMD kernels; see jsimd.h for why the
+ * result is the same.
+ */
+
+LOCAL(void)
+simd_quant_table (const DCTELEM * divisors, float * qtbl)
+{
+  int i;
+
+  for (i = 0; i < DCTSIZE2; i++) {
+    qtbl[i] = 1.0f / (float) divisors[i];
+    qtbl[DCTSIZE2 + i] = (float) (divisors[i] >> 1) + 0.5f;
+  }
+}
+
+
 /*
  * Initialize for a processing pass.
  * Verify that all referenced Q-tables are present, and set up
@@ -164,6 +188,14 @@ start_pass_fdctmgr (j_compress_ptr cinfo)
       ERREXIT(cinfo, JERR_NOT_COMPILED);
       break;
     }
+    if (fdct->simd_dct != NULL) {
+      if (fdct->simd_qtbls[qtblno] == NULL) {
+	fdct->simd_qtbls[qtblno] = (float *)
+	  (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_IMAGE,
+				      JSIMD_QTBL_SIZE * SIZEOF(float));
+      }
+      simd_quant_table(fdct->divisors[qtblno], fdct->simd_qtbls[qtblno]);
+    }
   }
 }
 
@@ -264,6 +296,25 @@ forward_DCT (j_compress_ptr cinfo, jpeg_component_info * compptr,
 }
 
 
+METHODDEF(void)
+forward_DCT_simd (j_compress_ptr cinfo, jpeg_component_info * compptr,
+		  JSAMPARRAY sample_data, JBLOCKROW coef_blocks,
+		  JDIMENSION start_row, JDIMENSION start_col,
+		  JDIMENSION num_blocks)
+/* This version is used when there is a SIMD kernel for the integer DCT. */
+{
+  my_fdct_ptr fdct = (my_fdct_ptr) cinfo->fdct;
+  jsimd_fdct_ptr simd_dct = fdct->simd_dct;
+  float * qtbl = fdct->simd_qtbls[compptr->quant_tbl_no];
+  JDIMENSION bi;
+
+  sample_data += start_row;	/* fold in the vertical offset once */
+
+  for (bi = 0; bi < num_blocks; bi++, start_col += DCTSIZE)
+    (*simd_dct) (sample_data, start_col, qtbl, coef_blocks[bi]);
+}
+
+
 #ifdef DCT_FLOAT_SUPPORTED
 
 METHODDEF(void)
@@ -345,6 +396,7 @@ GLOBAL(void)
 jinit_forward_dct (j_compress_ptr cinfo)
 {
   my_fdct_ptr fdct;
+  const jsimd_kernels * simd = jpeg_simd_kernels();
   int i;
 
   fdct = (my_fdct_ptr)
@@ -352,18 +404,21 @@ jinit_forward_dct (j_compress_ptr cinfo)
 				SIZEOF(my_fdct_controller));
   cinfo->fdct = (struct jpeg_forward_dct *) fdct;
   fdct->pub.start_pass = start_pass_fdctmgr;
+  fdct->simd_dct = NULL;
 
   switch (cinfo->dct_method) {
 #ifdef DCT_ISLOW_SUPPORTED
   case JDCT_ISLOW:
     fdct->pub.forward_DCT = forward_DCT;
     fdct->do_dct = jpeg_fdct_islow;
+    fdct->simd_dct = simd->fdct_islow;
     break;
 #endif
 #ifdef DCT_IFAST_SUPPORTED
   case JDCT_IFAST:
     fdct->pub.forward_DCT = forward_DCT;
     fdct->do_dct = jpeg_fdct_ifast;
+    fdct->simd_dct = simd->fdct_ifast;
     break;
 #endif
 #ifdef DCT_FLOAT_SUPPORTED
@@ -376,10 +431,13 @@ jinit_forward_dct (j_compress_ptr cinfo)
     ERREXIT(cinfo, JERR_NOT_COMPILED);
     break;
   }
+  if (fdct->simd_dct != NULL)
+    fdct->pub.forward_DCT = forward_DCT_simd;
 
   /* Mark divisor tables unallocated */
   for (i = 0; i < NUM_QUANT_TBLS; i++) {
     fdct->divisors[i] = NULL;
+    fdct->simd_qtbls[i] = NULL;
 #ifdef DCT_FLOAT_SUPPORTED
     fdct->float_divisors[i] = NULL;
 #endif
@@ -347,6 +347,33 @@ flush_bits (working_state * state)
 }
 
 
+/* Number of bits needed for the magnitude x, which is at least 0.
+ * GCC has a count-leading-zeros builtin that is a single instruction on
+ * ARMv5 and later and on x86; elsewhere, count the bits one at a time.
+ * JCHUFF_NONZERO_MASK, below, depends on GCC builtins as well.
+ */
+
+#ifdef __GNUC__
+#define JPEG_NBITS(x)  ((x) == 0 ? 0 : 32 - __builtin_clz((unsigned int) (x)))
+#define JCHUFF_NONZERO_MASK
+#else
+#define JPEG_NBITS(x)  jpeg_nbits(x)
+
+INLINE
+LOCAL(int)
+jpeg_nbits (register int x)
+{
+  register int nbits = 0;
+
+  while (x) {
+    nbits++;
+    x >>= 1;
+  }
+  return nbits;
+}
+#endif
+
+
 /* Encode a single block's worth of coefficients */
 
 LOCAL(boolean)
@@ -356,6 +383,9 @@ encode_one_block (working_state * state, JCOEFPTR block, int last_dc_val,
   register int temp, temp2;
   register int nbits;
   register int k, r, i;
+#ifdef JCHUFF_NONZERO_MASK
+  unsigned long long nonzero;
+#endif
   
   /* Encode the DC coefficient difference per section F.1.2.1 */
   
@@ -369,11 +399,7 @@ encode_one_block (working_state * state, JCOEFPTR block, int last_dc_val,
   }
   
   /* Find the number of bits needed for the magnitude of the coefficient */
-  nbits = 0;
-  while (temp) {
-    nbits++;
-    temp >>= 1;
-  }
+  nbits = JPEG_NBITS(temp);
   /* Check for out-of-range coefficient values.
    * Since we're encoding a difference, the range limit is twice as much.
    */
@@ -394,10 +420,26 @@ encode_one_block (working_state * state, JCOEFPTR block, int last_dc_val,
   
   r = 0;			/* r = run length of zeros */
   
+#ifdef JCHUFF_NONZERO_MASK
+  /* Most AC coefficients are zero after quantization.  Note the nonzero
+   * ones first, without branching, then go straight from one to the next.
+   */
+  nonzero = 0;
+  for (k = 1; k < DCTSIZE2; k++)
+    nonzero |= (unsigned long long) (block[jpeg_natural_order[k]] != 0) << k;
+
+  for (k = 0; nonzero != 0; nonzero &= nonzero - 1) {
+    i = __builtin_ctzll(nonzero);
+    r = i - k - 1;
+    k = i;
+    temp = block[jpeg_natural_order[k]];
+    {
+#else
   for (k = 1; k < DCTSIZE2; k++) {
     if ((temp = block[jpeg_natural_order[k]]) == 0) {
       r++;
     } else {
+#endif
       /* if run length > 15, must emit special run-length-16 codes (0xF0) */
       while (r > 15) {
 	if (! emit_bits(state, actbl->ehufco[0xF0], actbl->ehufsi[0xF0]))
@@ -413,9 +455,7 @@ encode_one_block (working_state * state, JCOEFPTR block, int last_dc_val,
       }
       
       /* Find the number of bits needed for the magnitude of the coefficient */
-      nbits = 1;		/* there must be at least one 1 bit */
-      while ((temp >>= 1))
-	nbits++;
+      nbits = JPEG_NBITS(temp);
       /* Check for out-of-range coefficient values */
       if (nbits > MAX_COEF_BITS)
 	ERREXIT(state->cinfo, JERR_BAD_DCT_COEF);
@@ -435,7 +475,11 @@ encode_one_block (working_state * state, JCOEFPTR block, int last_dc_val,
   }
 
   /* If the last coef(s) were zero, emit an end-of-block code */
+#ifdef JCHUFF_NONZERO_MASK
+  if (k < DCTSIZE2-1)
+#else
   if (r > 0)
+#endif
     if (! emit_bits(state, actbl->ehufco[0], actbl->ehufsi[0]))
       return FALSE;
 
@@ -377,6 +377,14 @@ jpeg_default_colorspace (j_compress_ptr cinfo)
   case JCS_UNKNOWN:
     jpeg_set_colorspace(cinfo, JCS_UNKNOWN);
     break;
+#ifdef ANDROID_RGB
+  case JCS_RGBA_8888:
+  case JCS_RGB_565:
+  case JCS_BGRA_8888:
+  case JCS_ABGR_8888:
+    jpeg_set_colorspace(cinfo, JCS_YCbCr);
+    break;
+#endif
   default:
     ERREXIT(cinfo, JERR_BAD_IN_COLORSPACE);
   }
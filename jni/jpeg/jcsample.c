@@ -48,6 +48,7 @@
 #define JPEG_INTERNALS
 #include "jinclude.h"
 #include "jpeglib.h"
+#include "jsimd.h"
 
 
 /* Pointer to routine to downsample a single component */
@@ -62,6 +63,10 @@ typedef struct {
 
   /* Downsampling method pointers, one per component */
   downsample1_ptr methods[MAX_COMPONENTS];
+
+  /* SIMD row kernels, or NULL */
+  jsimd_h2v1_ptr simd_h2v1;
+  jsimd_h2v2_ptr simd_h2v2;
 } my_downsampler;
 
 typedef my_downsampler * my_downsample_ptr;
@@ -280,6 +285,44 @@ h2v2_downsample (j_compress_ptr cinfo, jpeg_component_info * compptr,
 }
 
 
+/*
+ * The same two cases, one row at a time through the SIMD kernels.
+ */
+
+METHODDEF(void)
+h2v1_downsample_simd (j_compress_ptr cinfo, jpeg_component_info * compptr,
+		      JSAMPARRAY input_data, JSAMPARRAY output_data)
+{
+  my_downsample_ptr downsample = (my_downsample_ptr) cinfo->downsample;
+  int outrow;
+  JDIMENSION output_cols = compptr->width_in_blocks * DCTSIZE;
+
+  expand_right_edge(input_data, cinfo->max_v_samp_factor,
+		    cinfo->image_width, output_cols * 2);
+
+  for (outrow = 0; outrow < compptr->v_samp_factor; outrow++)
+    (*downsample->simd_h2v1) (output_cols, input_data[outrow],
+			      output_data[outrow]);
+}
+
+METHODDEF(void)
+h2v2_downsample_simd (j_compress_ptr cinfo, jpeg_component_info * compptr,
+		      JSAMPARRAY input_data, JSAMPARRAY output_data)
+{
+  my_downsample_ptr downsample = (my_downsample_ptr) cinfo->downsample;
+  int outrow;
+  JDIMENSION output_cols = compptr->width_in_blocks * DCTSIZE;
+
+  expand_right_edge(input_data, cinfo->max_v_samp_factor,
+		    cinfo->image_width, output_cols * 2);
+
+  for (outrow = 0; outrow < compptr->v_samp_factor; outrow++)
+    (*downsample->simd_h2v2) (output_cols, input_data[outrow * 2],
+			      input_data[outrow * 2 + 1],
+			      output_data[outrow]);
+}
+
+
 #ifdef INPUT_SMOOTHING_SUPPORTED
 
 /*
@@ -467,6 +510,7 @@ jinit_downsampler (j_compress_ptr cinfo)
   int ci;
   jpeg_component_info * compptr;
   boolean smoothok = TRUE;
+  const jsimd_kernels * simd = jpeg_simd_kernels();
 
   downsample = (my_downsample_ptr)
     (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_IMAGE,
@@ -475,6 +519,8 @@ jinit_downsampler (j_compress_ptr cinfo)
   downsample->pub.start_pass = start_pass_downsample;
   downsample->pub.downsample = sep_downsample;
   downsample->pub.need_context_rows = FALSE;
+  downsample->simd_h2v1 = simd->h2v1_downsample;
+  downsample->simd_h2v2 = simd->h2v2_downsample;
 
   if (cinfo->CCIR601_sampling)
     ERREXIT(cinfo, JERR_CCIR601_NOTIMPL);
@@ -494,7 +540,10 @@ jinit_downsampler (j_compress_ptr cinfo)
     } else if (compptr->h_samp_factor * 2 == cinfo->max_h_samp_factor &&
 	       compptr->v_samp_factor == cinfo->max_v_samp_factor) {
       smoothok = FALSE;
-      downsample->methods[ci] = h2v1_downsample;
+      if (downsample->simd_h2v1 != NULL)
+	downsample->methods[ci] = h2v1_downsample_simd;
+      else
+	downsample->methods[ci] = h2v1_downsample;
     } else if (compptr->h_samp_factor * 2 == cinfo->max_h_samp_factor &&
 	       compptr->v_samp_factor * 2 == cinfo->max_v_samp_factor) {
 #ifdef INPUT_SMOOTHING_SUPPORTED
@@ -503,6 +552,9 @@ jinit_downsampler (j_compress_ptr cinfo)
 	downsample->pub.need_context_rows = TRUE;
       } else
 #endif
+      if (downsample->simd_h2v2 != NULL)
+	downsample->methods[ci] = h2v2_downsample_simd;
+      else
 	downsample->methods[ci] = h2v2_downsample;
     } else if ((cinfo->max_h_samp_factor % compptr->h_samp_factor) == 0 &&
 	       (cinfo->max_v_samp_factor % compptr->v_samp_factor) == 0) {
@@ -212,7 +212,9 @@ typedef enum {
 	JCS_YCCK,		/* Y/Cb/Cr/K */
 #ifdef ANDROID_RGB
     JCS_RGBA_8888,  /* red/green/blue/alpha */
-    JCS_RGB_565     /* red/green/blue in 565 format */
+    JCS_RGB_565,    /* red/green/blue in 565 format */
+    JCS_BGRA_8888,  /* blue/green/red/alpha, compression only */
+    JCS_ABGR_8888   /* alpha/blue/green/red, compression only */
 #endif
 } J_COLOR_SPACE;
 
@@ -0,0 +1,240 @@
+/*
+ * jsimd.c
+ *
+ * This file is not part of the Independent JPEG Group's software; it is
+ * an addition for the Android VNC server.
+ *
+ * This file picks the SIMD kernel set (see jsimd.h) and holds the SSE2
+ * kernels.  The NEON kernels are in jsimd_neon.c, which is only built for
+ * armeabi-v7a; since that ABI does not promise NEON, the CPU is asked
+ * before they are used.
+ */
+
+#define JPEG_INTERNALS
+#include "jinclude.h"
+#include "jpeglib.h"
+#include "jsimd.h"
+
+#if defined(__SSE2__) && BITS_IN_JSAMPLE == 8
+
+#include <emmintrin.h>
+
+/* Low 32 bits of each product; SSE2 has no pmulld. */
+
+INLINE
+LOCAL(__m128i)
+mul_sse2 (__m128i a, int c)
+{
+  __m128i k = _mm_set1_epi32(c);
+  __m128i even = _mm_mul_epu32(a, k);
+  __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), k);
+
+  return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, 0x08),
+			    _mm_shuffle_epi32(odd, 0x08));
+}
+
+INLINE
+LOCAL(__m128i)
+quantize_sse2 (__m128i v, const float * q)
+{
+  __m128i sign = _mm_srai_epi32(v, 31);
+  __m128 f = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_xor_si128(v, sign), sign));
+
+  f = _mm_mul_ps(_mm_add_ps(f, _mm_loadu_ps(q + DCTSIZE2)), _mm_loadu_ps(q));
+  v = _mm_cvttps_epi32(f);
+  return _mm_sub_epi32(_mm_xor_si128(v, sign), sign);
+}
+
+#define JSIMD_VEC  __m128i
+#define VADD(a,b)  _mm_add_epi32(a, b)
+#define VSUB(a,b)  _mm_sub_epi32(a, b)
+#define VMUL(a,c)  mul_sse2(a, c)
+#define VSRA(a,n)  _mm_srai_epi32(a, n)
+#define VSHL(a,n)  _mm_slli_epi32(a, n)
+#define VSET1(c)   _mm_set1_epi32(c)
+
+#define JSIMD_TRANSPOSE4(a,b,c,d)  \
+  { __m128i t0 = _mm_unpacklo_epi32(a, b), t1 = _mm_unpacklo_epi32(c, d);  \
+    __m128i t2 = _mm_unpackhi_epi32(a, b), t3 = _mm_unpackhi_epi32(c, d);  \
+    a = _mm_unpacklo_epi64(t0, t1);  b = _mm_unpackhi_epi64(t0, t1);  \
+    c = _mm_unpacklo_epi64(t2, t3);  d = _mm_unpackhi_epi64(t2, t3); }
+
+#define JSIMD_LOAD_ROW(p,lo,hi)  \
+  { __m128i s = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (p)),  \
+				  _mm_setzero_si128());  \
+    s = _mm_sub_epi16(s, _mm_set1_epi16(CENTERJSAMPLE));  \
+    lo = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);  \
+    hi = _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16); }
+
+#define JSIMD_QUANTIZE(v,q)  quantize_sse2(v, q)
+
+#define JSIMD_STORE_ROW(p,lo,hi)  \
+  _mm_storeu_si128((__m128i *) (p), _mm_packs_epi32(lo, hi))
+
+#include "jsimdfdct.h"
+
+METHODDEF(void)
+fdct_islow_sse2 (JSAMPARRAY rows, JDIMENSION col, const float * qtbl,
+		 JCOEFPTR coef)
+{
+  simd_fdct(rows, col, qtbl, coef, TRUE);
+}
+
+METHODDEF(void)
+fdct_ifast_sse2 (JSAMPARRAY rows, JDIMENSION col, const float * qtbl,
+		 JCOEFPTR coef)
+{
+  simd_fdct(rows, col, qtbl, coef, FALSE);
+}
+
+/* Eight outputs from sixteen inputs per step; the 16-bit lanes of the
+ * bias vectors follow the alternating bias of jcsample.c.
+ */
+
+METHODDEF(void)
+h2v1_downsample_sse2 (JDIMENSION output_cols, JSAMPROW inptr,
+		      JSAMPROW outptr)
+{
+  __m128i mask = _mm_set1_epi16(0xFF), bias = _mm_set1_epi32(0x00010000);
+  __m128i in, sum;
+  JDIMENSION outcol;
+  int b = 0;
+
+  for (outcol = 0; outcol + 8 <= output_cols; outcol += 8) {
+    in = _mm_loadu_si128((const __m128i *) inptr);
+    sum = _mm_add_epi16(_mm_and_si128(in, mask), _mm_srli_epi16(in, 8));
+    sum = _mm_srli_epi16(_mm_add_epi16(sum, bias), 1);
+    _mm_storel_epi64((__m128i *) outptr, _mm_packus_epi16(sum, sum));
+    inptr += 16;
+    outptr += 8;
+  }
+  for (; outcol < output_cols; outcol++) {
+    *outptr++ = (JSAMPLE) ((GETJSAMPLE(*inptr) + GETJSAMPLE(inptr[1])
+			    + b) >> 1);
+    b ^= 1;
+    inptr += 2;
+  }
+}
+
+METHODDEF(void)
+h2v2_downsample_sse2 (JDIMENSION output_cols, JSAMPROW inptr0,
+		      JSAMPROW inptr1, JSAMPROW outptr)
+{
+  __m128i mask = _mm_set1_epi16(0xFF), bias = _mm_set1_epi32(0x00020001);
+  __m128i in0, in1, sum;
+  JDIMENSION outcol;
+  int b = 1;
+
+  for (outcol = 0; outcol + 8 <= output_cols; outcol += 8) {
+    in0 = _mm_loadu_si128((const __m128i *) inptr0);
+    in1 = _mm_loadu_si128((const __m128i *) inptr1);
+    sum = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(in0, mask),
+				      _mm_srli_epi16(in0, 8)),
+			_mm_add_epi16(_mm_and_si128(in1, mask),
+				      _mm_srli_epi16(in1, 8)));
+    sum = _mm_srli_epi16(_mm_add_epi16(sum, bias), 2);
+    _mm_storel_epi64((__m128i *) outptr, _mm_packus_epi16(sum, sum));
+    inptr0 += 16;
+    inptr1 += 16;
+    outptr += 8;
+  }
+  for (; outcol < output_cols; outcol++) {
+    *outptr++ = (JSAMPLE) ((GETJSAMPLE(*inptr0) + GETJSAMPLE(inptr0[1]) +
+			    GETJSAMPLE(*inptr1) + GETJSAMPLE(inptr1[1])
+			    + b) >> 2);
+    b ^= 3;
+    inptr0 += 2; inptr1 += 2;
+  }
+}
+
+#define JSIMD_HAVE_SSE2
+
+#endif /* __SSE2__ */
+
+
+/* The first usable entry is the default; "c" must stay last. */
+
+static const jsimd_kernels kernels[] = {
+#ifdef JSIMD_HAVE_NEON
+  { "neon", jpeg_fdct_islow_neon, jpeg_fdct_ifast_neon,
+    jpeg_h2v1_downsample_neon, jpeg_h2v2_downsample_neon },
+#endif
+#ifdef JSIMD_HAVE_SSE2
+  { "sse2", fdct_islow_sse2, fdct_ifast_sse2,
+    h2v1_downsample_sse2, h2v2_downsample_sse2 },
+#endif
+  { "c", NULL, NULL, NULL, NULL }
+};
+
+#define NUM_KERNELS  ((int) (SIZEOF(kernels) / SIZEOF(kernels[0])))
+
+/* Set on first use.  Compressors on several threads may race to set it,
+ * but they all pick the same entry.
+ */
+static const jsimd_kernels * kernel = NULL;
+
+
+#ifdef JSIMD_HAVE_NEON
+
+/* armeabi-v7a does not guarantee NEON, so ask the kernel. */
+
+LOCAL(boolean)
+cpu_has_neon (void)
+{
+  char line[512];
+  boolean found = FALSE;
+  FILE * f = fopen("/proc/cpuinfo", "r");
+
+  if (f == NULL)
+    return FALSE;
+  while (!found && fgets(line, SIZEOF(line), f) != NULL)
+    if (strncmp(line, "Features", 8) == 0 && strstr(line, " neon") != NULL)
+      found = TRUE;
+  fclose(f);
+  return found;
+}
+
+#endif
+
+
+LOCAL(boolean)
+kernels_usable (const jsimd_kernels * k)
+{
+#ifdef JSIMD_HAVE_NEON
+  if (k->fdct_islow == jpeg_fdct_islow_neon)
+    return cpu_has_neon();
+#endif
+  return TRUE;
+}
+
+
+GLOBAL(const jsimd_kernels *)
+jpeg_simd_kernels (void)
+{
+  const char * env;
+  int i;
+
+  if (kernel == NULL) {
+    env = getenv("JSIMD_FORCENONE");
+    if (env != NULL && strcmp(env, "1") == 0)
+      kernel = &kernels[NUM_KERNELS-1];
+    for (i = 0; kernel == NULL; i++)
+      if (kernels_usable(&kernels[i]))
+	kernel = &kernels[i];
+  }
+  return kernel;
+}
+
+
+GLOBAL(boolean)
+jpeg_simd_use (const char * name)
+{
+  int i;
+
+  for (i = 0; i < NUM_KERNELS; i++)
+    if (strcmp(kernels[i].name, name) == 0 && kernels_usable(&kernels[i])) {
+      kernel = &kernels[i];
+      return TRUE;
+    }
+  return FALSE;
+}
@@ -0,0 +1,79 @@
+/*
+ * jsimd.h
+ *
+ * This file is not part of the Independent JPEG Group's software; it is
+ * an addition for the Android VNC server, which only ever compresses.
+ *
+ * SIMD versions of the compressor's inner loops.  The kernel set is chosen
+ * once at run time from what the CPU offers ("neon" on ARMv7 devices that
+ * report it, "sse2" on x86); the "c" set has no kernels, which makes every
+ * caller fall back to the portable code it always had.  The SIMD kernels
+ * produce exactly the same coefficients and samples as the C code, so the
+ * compressed data does not depend on which set is in use.
+ */
+
+/* Short forms of external names for systems with brain-damaged linkers. */
+
+#ifdef NEED_SHORT_EXTERNAL_NAMES
+#define jpeg_simd_kernels	jSIMDKernels
+#define jpeg_simd_use		jSIMDUse
+#define jpeg_fdct_islow_neon	jFDislowNEON
+#define jpeg_fdct_ifast_neon	jFDifastNEON
+#define jpeg_h2v1_downsample_neon	jDh2v1NEON
+#define jpeg_h2v2_downsample_neon	jDh2v2NEON
+#endif /* NEED_SHORT_EXTERNAL_NAMES */
+
+
+/* Forward DCT of the 8x8 block at rows[0..7] + col, quantized with a
+ * JSIMD_QTBL_SIZE table (below) and stored in natural order.
+ */
+typedef JMETHOD(void, jsimd_fdct_ptr,
+		(JSAMPARRAY rows, JDIMENSION col, const float * qtbl,
+		 JCOEFPTR coef));
+
+/* 2:1 horizontal (h2v1) or 2:1 both ways (h2v2) downsampling of one
+ * output row, as in jcsample.c without smoothing.  output_cols is a
+ * multiple of DCTSIZE and the input rows are padded to twice that.
+ */
+typedef JMETHOD(void, jsimd_h2v1_ptr,
+		(JDIMENSION output_cols, JSAMPROW inptr, JSAMPROW outptr));
+typedef JMETHOD(void, jsimd_h2v2_ptr,
+		(JDIMENSION output_cols, JSAMPROW inptr0, JSAMPROW inptr1,
+		 JSAMPROW outptr));
+
+typedef struct {
+  const char * name;
+  jsimd_fdct_ptr fdct_islow;	/* NULL where there is no kernel */
+  jsimd_fdct_ptr fdct_ifast;
+  jsimd_h2v1_ptr h2v1_downsample;
+  jsimd_h2v2_ptr h2v2_downsample;
+} jsimd_kernels;
+
+/* The set in use.  Setting JSIMD_FORCENONE=1 in the environment, as
+ * turbojpeg does, selects the "c" set.
+ */
+EXTERN(const jsimd_kernels *) jpeg_simd_kernels JPP((void));
+/* Switch to the named set, for tests; FALSE if this CPU can't run it. */
+EXTERN(boolean) jpeg_simd_use JPP((const char * name));
+
+/* Quantization table for the fdct kernels, made by jcdctmgr.c from its
+ * divisors: 1/divisor in qtbl[0..63], and divisor/2 rounded down plus 0.5
+ * in qtbl[64..127].  A coefficient c then quantizes to the truncation of
+ * (|c| + qtbl[64+i]) * qtbl[i], with the sign of c.  For 8-bit samples
+ * |c| + divisor/2 stays below 2^22, and the two float roundings are then
+ * too small to carry the product across an integer, so this equals the
+ * rounded division jcdctmgr.c does.
+ */
+#define JSIMD_QTBL_SIZE  (DCTSIZE2 * 2)
+
+#ifdef JSIMD_HAVE_NEON
+EXTERN(void) jpeg_fdct_islow_neon
+    JPP((JSAMPARRAY rows, JDIMENSION col, const float * qtbl, JCOEFPTR coef));
+EXTERN(void) jpeg_fdct_ifast_neon
+    JPP((JSAMPARRAY rows, JDIMENSION col, const float * qtbl, JCOEFPTR coef));
+EXTERN(void) jpeg_h2v1_downsample_neon
+    JPP((JDIMENSION output_cols, JSAMPROW inptr, JSAMPROW outptr));
+EXTERN(void) jpeg_h2v2_downsample_neon
+    JPP((JDIMENSION output_cols, JSAMPROW inptr0, JSAMPROW inptr1,
+	 JSAMPROW outptr));
+#endif
@@ -0,0 +1,123 @@
+/*
+ * jsimd_neon.c
+ *
+ * This file is not part of the Independent JPEG Group's software; it is
+ * an addition for the Android VNC server.
+ *
+ * NEON kernels for jsimd.h.  Built with -mfpu=neon for armeabi-v7a only;
+ * jsimd.c checks the CPU before using them.
+ */
+
+#define JPEG_INTERNALS
+#include "jinclude.h"
+#include "jpeglib.h"
+#include "jsimd.h"
+
+#include <arm_neon.h>
+
+INLINE
+LOCAL(int32x4_t)
+quantize_neon (int32x4_t v, const float * q)
+{
+  int32x4_t sign = vshrq_n_s32(v, 31);
+  float32x4_t f = vcvtq_f32_s32(vabsq_s32(v));
+
+  f = vmulq_f32(vaddq_f32(f, vld1q_f32(q + DCTSIZE2)), vld1q_f32(q));
+  v = vcvtq_s32_f32(f);
+  return vsubq_s32(veorq_s32(v, sign), sign);
+}
+
+#define JSIMD_VEC  int32x4_t
+#define VADD(a,b)  vaddq_s32(a, b)
+#define VSUB(a,b)  vsubq_s32(a, b)
+#define VMUL(a,c)  vmulq_n_s32(a, c)
+/* vshlq_s32 takes the count from a register, so it may be a variable */
+#define VSRA(a,n)  vshlq_s32(a, vdupq_n_s32(-(n)))
+#define VSHL(a,n)  vshlq_s32(a, vdupq_n_s32(n))
+#define VSET1(c)   vdupq_n_s32(c)
+
+#define JSIMD_TRANSPOSE4(a,b,c,d)  \
+  { int32x4x2_t t0 = vtrnq_s32(a, b), t1 = vtrnq_s32(c, d);  \
+    a = vcombine_s32(vget_low_s32(t0.val[0]), vget_low_s32(t1.val[0]));  \
+    b = vcombine_s32(vget_low_s32(t0.val[1]), vget_low_s32(t1.val[1]));  \
+    c = vcombine_s32(vget_high_s32(t0.val[0]), vget_high_s32(t1.val[0]));  \
+    d = vcombine_s32(vget_high_s32(t0.val[1]), vget_high_s32(t1.val[1])); }
+
+#define JSIMD_LOAD_ROW(p,lo,hi)  \
+  { int16x8_t s = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(p))),  \
+			    vdupq_n_s16(CENTERJSAMPLE));  \
+    lo = vmovl_s16(vget_low_s16(s));  \
+    hi = vmovl_s16(vget_high_s16(s)); }
+
+#define JSIMD_QUANTIZE(v,q)  quantize_neon(v, q)
+
+#define JSIMD_STORE_ROW(p,lo,hi)  \
+  vst1q_s16(p, vcombine_s16(vmovn_s32(lo), vmovn_s32(hi)))
+
+#include "jsimdfdct.h"
+
+GLOBAL(void)
+jpeg_fdct_islow_neon (JSAMPARRAY rows, JDIMENSION col, const float * qtbl,
+		      JCOEFPTR coef)
+{
+  simd_fdct(rows, col, qtbl, coef, TRUE);
+}
+
+GLOBAL(void)
+jpeg_fdct_ifast_neon (JSAMPARRAY rows, JDIMENSION col, const float * qtbl,
+		      JCOEFPTR coef)
+{
+  simd_fdct(rows, col, qtbl, coef, FALSE);
+}
+
+/* Eight outputs from sixteen inputs per step; the 16-bit lanes of the
+ * bias vectors follow the alternating bias of jcsample.c.
+ */
+
+GLOBAL(void)
+jpeg_h2v1_downsample_neon (JDIMENSION output_cols, JSAMPROW inptr,
+			   JSAMPROW outptr)
+{
+  uint16x8_t bias = vreinterpretq_u16_u32(vdupq_n_u32(0x00010000));
+  uint16x8_t sum;
+  JDIMENSION outcol;
+  int b = 0;
+
+  for (outcol = 0; outcol + 8 <= output_cols; outcol += 8) {
+    sum = vpaddlq_u8(vld1q_u8(inptr));
+    vst1_u8(outptr, vshrn_n_u16(vaddq_u16(sum, bias), 1));
+    inptr += 16;
+    outptr += 8;
+  }
+  for (; outcol < output_cols; outcol++) {
+    *outptr++ = (JSAMPLE) ((GETJSAMPLE(*inptr) + GETJSAMPLE(inptr[1])
+			    + b) >> 1);
+    b ^= 1;
+    inptr += 2;
+  }
+}
+
+GLOBAL(void)
+jpeg_h2v2_downsample_neon (JDIMENSION output_cols, JSAMPROW inptr0,
+			   JSAMPROW inptr1, JSAMPROW outptr)
+{
+  uint16x8_t bias = vreinterpretq_u16_u32(vdupq_n_u32(0x00020001));
+  uint16x8_t sum;
+  JDIMENSION outcol;
+  int b = 1;
+
+  for (outcol = 0; outcol + 8 <= output_cols; outcol += 8) {
+    sum = vpadalq_u8(vpaddlq_u8(vld1q_u8(inptr0)), vld1q_u8(inptr1));
+    vst1_u8(outptr, vshrn_n_u16(vaddq_u16(sum, bias), 2));
+    inptr0 += 16;
+    inptr1 += 16;
+    outptr += 8;
+  }
+  for (; outcol < output_cols; outcol++) {
+    *outptr++ = (JSAMPLE) ((GETJSAMPLE(*inptr0) + GETJSAMPLE(inptr0[1]) +
+			    GETJSAMPLE(*inptr1) + GETJSAMPLE(inptr1[1])
+			    + b) >> 2);
+    b ^= 3;
+    inptr0 += 2; inptr1 += 2;
+  }
+}
@@ -0,0 +1,259 @@
+/*
+ * jsimdfdct.h
+ *
+ * This file is not part of the Independent JPEG Group's software; it is
+ * an addition for the Android VNC server.
+ *
+ * The forward DCTs of jfdctint.c and jfdctfst.c, plus sample loading and
+ * quantization, written once for a vector unit with four 32-bit lanes.
+ * jsimd.c (SSE2) and jsimd_neon.c include this file after defining:
+ *
+ *   JSIMD_VEC			four INT32 lanes
+ *   VADD(a,b), VSUB(a,b)	lane-wise add, subtract
+ *   VMUL(a,c)			multiply by an integer constant
+ *   VSRA(a,n), VSHL(a,n)	arithmetic right and left shift by n bits
+ *   VSET1(c)			all lanes c
+ *   JSIMD_TRANSPOSE4(a,b,c,d)	transpose the 4x4 matrix a,b,c,d in place
+ *   JSIMD_LOAD_ROW(p,lo,hi)	8 samples at p, less CENTERJSAMPLE
+ *   JSIMD_QUANTIZE(v,q)	v quantized by qtbl entries q[0..3], q[64..67]
+ *   JSIMD_STORE_ROW(p,lo,hi)	8 coefficients to p
+ *
+ * Each lane runs the same integer operations as the C code does for one
+ * row or column, so the coefficients are identical.  The first pass works
+ * on four rows at once, the second on four columns; the block is
+ * transposed in between.
+ */
+
+
+/* From jfdctint.c */
+
+#define ISLOW_CONST_BITS  13
+#define ISLOW_PASS1_BITS  2
+
+#define ISLOW_0_298631336  2446
+#define ISLOW_0_390180644  3196
+#define ISLOW_0_541196100  4433
+#define ISLOW_0_765366865  6270
+#define ISLOW_0_899976223  7373
+#define ISLOW_1_175875602  9633
+#define ISLOW_1_501321110  12299
+#define ISLOW_1_847759065  15137
+#define ISLOW_1_961570560  16069
+#define ISLOW_2_053119869  16819
+#define ISLOW_2_562915447  20995
+#define ISLOW_3_072711026  25172
+
+/* From jfdctfst.c */
+
+#define IFAST_CONST_BITS  8
+
+#define IFAST_0_382683433  98
+#define IFAST_0_541196100  139
+#define IFAST_0_707106781  181
+#define IFAST_1_306562965  334
+
+#define SIMD_DESCALE(x,n)  VSRA(VADD(x, VSET1(1 << ((n)-1))), n)
+
+#ifdef USE_ACCURATE_ROUNDING
+#define IFAST_MULTIPLY(v,c)  SIMD_DESCALE(VMUL(v, c), IFAST_CONST_BITS)
+#else
+#define IFAST_MULTIPLY(v,c)  VSRA(VMUL(v, c), IFAST_CONST_BITS)
+#endif
+
+
+/* One pass of jpeg_fdct_islow() over d[0..7]; pass is 1 or 2. */
+
+INLINE
+LOCAL(void)
+simd_fdct_islow_pass (JSIMD_VEC * d, int pass)
+{
+  JSIMD_VEC tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+  JSIMD_VEC tmp10, tmp11, tmp12, tmp13;
+  JSIMD_VEC z1, z2, z3, z4, z5;
+  int shift = (pass == 1) ? ISLOW_CONST_BITS - ISLOW_PASS1_BITS
+			  : ISLOW_CONST_BITS + ISLOW_PASS1_BITS;
+
+  tmp0 = VADD(d[0], d[7]);
+  tmp7 = VSUB(d[0], d[7]);
+  tmp1 = VADD(d[1], d[6]);
+  tmp6 = VSUB(d[1], d[6]);
+  tmp2 = VADD(d[2], d[5]);
+  tmp5 = VSUB(d[2], d[5]);
+  tmp3 = VADD(d[3], d[4]);
+  tmp4 = VSUB(d[3], d[4]);
+
+  /* Even part */
+
+  tmp10 = VADD(tmp0, tmp3);
+  tmp13 = VSUB(tmp0, tmp3);
+  tmp11 = VADD(tmp1, tmp2);
+  tmp12 = VSUB(tmp1, tmp2);
+
+  if (pass == 1) {
+    d[0] = VSHL(VADD(tmp10, tmp11), ISLOW_PASS1_BITS);
+    d[4] = VSHL(VSUB(tmp10, tmp11), ISLOW_PASS1_BITS);
+  } else {
+    d[0] = SIMD_DESCALE(VADD(tmp10, tmp11), ISLOW_PASS1_BITS);
+    d[4] = SIMD_DESCALE(VSUB(tmp10, tmp11), ISLOW_PASS1_BITS);
+  }
+
+  z1 = VMUL(VADD(tmp12, tmp13), ISLOW_0_541196100);
+  d[2] = SIMD_DESCALE(VADD(z1, VMUL(tmp13, ISLOW_0_765366865)), shift);
+  d[6] = SIMD_DESCALE(VADD(z1, VMUL(tmp12, - ISLOW_1_847759065)), shift);
+
+  /* Odd part */
+
+  z1 = VADD(tmp4, tmp7);
+  z2 = VADD(tmp5, tmp6);
+  z3 = VADD(tmp4, tmp6);
+  z4 = VADD(tmp5, tmp7);
+  z5 = VMUL(VADD(z3, z4), ISLOW_1_175875602);
+
+  tmp4 = VMUL(tmp4, ISLOW_0_298631336);
+  tmp5 = VMUL(tmp5, ISLOW_2_053119869);
+  tmp6 = VMUL(tmp6, ISLOW_3_072711026);
+  tmp7 = VMUL(tmp7, ISLOW_1_501321110);
+  z1 = VMUL(z1, - ISLOW_0_899976223);
+  z2 = VMUL(z2, - ISLOW_2_562915447);
+  z3 = VMUL(z3, - ISLOW_1_961570560);
+  z4 = VMUL(z4, - ISLOW_0_390180644);
+
+  z3 = VADD(z3, z5);
+  z4 = VADD(z4, z5);
+
+  d[7] = SIMD_DESCALE(VADD(VADD(tmp4, z1), z3), shift);
+  d[5] = SIMD_DESCALE(VADD(VADD(tmp5, z2), z4), shift);
+  d[3] = SIMD_DESCALE(VADD(VADD(tmp6, z2), z3), shift);
+  d[1] = SIMD_DESCALE(VADD(VADD(tmp7, z1), z4), shift);
+}
+
+
+/* One pass of jpeg_fdct_ifast() over d[0..7]; both passes are alike. */
+
+INLINE
+LOCAL(void)
+simd_fdct_ifast_pass (JSIMD_VEC * d)
+{
+  JSIMD_VEC tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+  JSIMD_VEC tmp10, tmp11, tmp12, tmp13;
+  JSIMD_VEC z1, z2, z3, z4, z5, z11, z13;
+
+  tmp0 = VADD(d[0], d[7]);
+  tmp7 = VSUB(d[0], d[7]);
+  tmp1 = VADD(d[1], d[6]);
+  tmp6 = VSUB(d[1], d[6]);
+  tmp2 = VADD(d[2], d[5]);
+  tmp5 = VSUB(d[2], d[5]);
+  tmp3 = VADD(d[3], d[4]);
+  tmp4 = VSUB(d[3], d[4]);
+
+  /* Even part */
+
+  tmp10 = VADD(tmp0, tmp3);
+  tmp13 = VSUB(tmp0, tmp3);
+  tmp11 = VADD(tmp1, tmp2);
+  tmp12 = VSUB(tmp1, tmp2);
+
+  d[0] = VADD(tmp10, tmp11);
+  d[4] = VSUB(tmp10, tmp11);
+
+  z1 = IFAST_MULTIPLY(VADD(tmp12, tmp13), IFAST_0_707106781);
+  d[2] = VADD(tmp13, z1);
+  d[6] = VSUB(tmp13, z1);
+
+  /* Odd part */
+
+  tmp10 = VADD(tmp4, tmp5);
+  tmp11 = VADD(tmp5, tmp6);
+  tmp12 = VADD(tmp6, tmp7);
+
+  z5 = IFAST_MULTIPLY(VSUB(tmp10, tmp12), IFAST_0_382683433);
+  z2 = VADD(IFAST_MULTIPLY(tmp10, IFAST_0_541196100), z5);
+  z4 = VADD(IFAST_MULTIPLY(tmp12, IFAST_1_306562965), z5);
+  z3 = IFAST_MULTIPLY(tmp11, IFAST_0_707106781);
+
+  z11 = VADD(tmp7, z3);
+  z13 = VSUB(tmp7, z3);
+
+  d[5] = VADD(z13, z2);
+  d[3] = VSUB(z13, z2);
+  d[1] = VADD(z11, z4);
+  d[7] = VSUB(z11, z4);
+}
+
+
+/* 8x8 transpose of rows held as two vectors: out[c][h] = column c of
+ * rows 4h..4h+3.
+ */
+
+INLINE
+LOCAL(void)
+simd_transpose8 (JSIMD_VEC in[DCTSIZE][2], JSIMD_VEC out[DCTSIZE][2])
+{
+  JSIMD_VEC a, b, c, d;
+  int i, j;
+
+  for (i = 0; i < 2; i++) {
+    for (j = 0; j < 2; j++) {
+      a = in[4*i][j];
+      b = in[4*i+1][j];
+      c = in[4*i+2][j];
+      d = in[4*i+3][j];
+      JSIMD_TRANSPOSE4(a, b, c, d);
+      out[4*j][i] = a;
+      out[4*j+1][i] = b;
+      out[4*j+2][i] = c;
+      out[4*j+3][i] = d;
+    }
+  }
+}
+
+
+/* Load, transform and quantize one block; see jsimd_fdct_ptr. */
+
+INLINE
+LOCAL(void)
+simd_fdct (JSAMPARRAY rows, JDIMENSION col, const float * qtbl,
+	   JCOEFPTR coef, boolean islow)
+{
+  JSIMD_VEC a[DCTSIZE][2], b[DCTSIZE][2], d[DCTSIZE];
+  int i, h;
+
+  for (i = 0; i < DCTSIZE; i++)
+    JSIMD_LOAD_ROW(rows[i] + col, a[i][0], a[i][1]);
+
+  /* Pass 1: process rows, four to a vector. */
+
+  simd_transpose8(a, b);
+  for (h = 0; h < 2; h++) {
+    for (i = 0; i < DCTSIZE; i++)
+      d[i] = b[i][h];
+    if (islow)
+      simd_fdct_islow_pass(d, 1);
+    else
+      simd_fdct_ifast_pass(d);
+    for (i = 0; i < DCTSIZE; i++)
+      b[i][h] = d[i];
+  }
+
+  /* Pass 2: process columns, four to a vector. */
+
+  simd_transpose8(b, a);
+  for (h = 0; h < 2; h++) {
+    for (i = 0; i < DCTSIZE; i++)
+      d[i] = a[i][h];
+    if (islow)
+      simd_fdct_islow_pass(d, 2);
+    else
+      simd_fdct_ifast_pass(d);
+    for (i = 0; i < DCTSIZE; i++)
+      a[i][h] = d[i];
+  }
+
+  /* Quantize and store in natural order. */
+
+  for (i = 0; i < DCTSIZE; i++)
+    JSIMD_STORE_ROW(coef + i * DCTSIZE,
+		    JSIMD_QUANTIZE(a[i][0], qtbl + i * DCTSIZE),
+		    JSIMD_QUANTIZE(a[i][1], qtbl + i * DCTSIZE + 4));
+}
@@ -1,5 +1,4 @@
 LOCAL_PATH:= $(call my-dir)
-include $(CLEAR_VARS)
 
 LIBVNCSERVER_ROOT:=./LibVNCServer-0.9.9
 
@@ -16,6 +15,7 @@ LIBVNCSERVER_SRC_FILES:= \
 	$(LIBVNCSERVER_ROOT)/libvncserver/hextile.c \
 	$(LIBVNCSERVER_ROOT)/libvncserver/rre.c \
 	$(LIBVNCSERVER_ROOT)/libvncserver/translate.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/translateshift.c \
 	$(LIBVNCSERVER_ROOT)/libvncserver/cutpaste.c \
 	$(LIBVNCSERVER_ROOT)/libvncserver/httpd.c \
 	$(LIBVNCSERVER_ROOT)/libvncserver/cursor.c \
@@ -26,30 +26,92 @@ LIBVNCSERVER_SRC_FILES:= \
 	$(LIBVNCSERVER_ROOT)/libvncserver/cargs.c \
 	$(LIBVNCSERVER_ROOT)/libvncserver/ultra.c \
 	$(LIBVNCSERVER_ROOT)/libvncserver/scale.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/scalebox.c \
 	$(LIBVNCSERVER_ROOT)/libvncserver/zlib.c \
 	$(LIBVNCSERVER_ROOT)/libvncserver/zrle.c \
 	$(LIBVNCSERVER_ROOT)/libvncserver/zrleoutstream.c \
 	$(LIBVNCSERVER_ROOT)/libvncserver/zrlepalettehelper.c \
 	$(LIBVNCSERVER_ROOT)/libvncserver/tight.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/encodepool.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/encodecache.c \
 	$(LIBVNCSERVER_ROOT)/common/d3des.c \
 	$(LIBVNCSERVER_ROOT)/common/vncauth.c \
 	$(LIBVNCSERVER_ROOT)/common/minilzo.c \
 	$(LIBVNCSERVER_ROOT)/common/zywrletemplate.c \
 	$(LIBVNCSERVER_ROOT)/common/turbojpeg.c
 
-LOCAL_CFLAGS  +=  -Wall \
-									-O3 \
+# built with -mfpu=neon; the library checks the CPU before using them
+LIBVNCSERVER_NEON_SRC_FILES:= \
+	$(LIBVNCSERVER_ROOT)/libvncserver/translateshift_neon.c.neon \
+	$(LIBVNCSERVER_ROOT)/libvncserver/scalebox_neon.c.neon
+
+LIBVNCSERVER_CFLAGS:= \
 									-DLIBVNCSERVER_WITH_WEBSOCKETS \
 									-DLIBVNCSERVER_HAVE_LIBPNG \
 									-DLIBVNCSERVER_HAVE_ZLIB \
 									-DLIBVNCSERVER_HAVE_LIBJPEG
 
-LOCAL_LDLIBS +=  -llog -lz -ldl 
+LIBVNCSERVER_C_INCLUDES:= \
+										$(LOCAL_PATH)/../libpng \
+										$(LOCAL_PATH)/../jpeg \
+										$(LOCAL_PATH)/../jpeg-turbo \
+										$(LOCAL_PATH)/../openssl/include \
+										$(LOCAL_PATH)/$(LIBVNCSERVER_ROOT)/libvncserver \
+										$(LOCAL_PATH)/$(LIBVNCSERVER_ROOT)/common \
+										$(LOCAL_PATH)/$(LIBVNCSERVER_ROOT)/rfb \
+										$(LOCAL_PATH)/$(LIBVNCSERVER_ROOT)/
+
+ifeq ($(TARGET_ARCH_ABI),armeabi-v7a)
+	LIBVNCSERVER_CFLAGS += -DLIBVNCSERVER_HAVE_NEON
+endif
+
+# libvncserver and the tile diff engine are built once, for the server and
+# the tests in test/ to link against
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := $(LIBVNCSERVER_SRC_FILES)
+
+ifeq ($(TARGET_ARCH_ABI),armeabi-v7a)
+	LOCAL_SRC_FILES += $(LIBVNCSERVER_NEON_SRC_FILES)
+endif
+
+LOCAL_CFLAGS += -Wall -O3 $(LIBVNCSERVER_CFLAGS)
+LOCAL_C_INCLUDES += $(LIBVNCSERVER_C_INCLUDES)
+
+LOCAL_EXPORT_CFLAGS := $(LIBVNCSERVER_CFLAGS)
+LOCAL_EXPORT_C_INCLUDES := $(LIBVNCSERVER_C_INCLUDES)
+LOCAL_EXPORT_LDLIBS := -llog -lz -ldl
+
+LOCAL_STATIC_LIBRARIES := libjpeg libpng libssl_static libcrypto_static
+
+LOCAL_MODULE := libvncserver_static
+
+include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := tileDiff.c
+
+ifeq ($(TARGET_ARCH_ABI),armeabi-v7a)
+	LOCAL_CFLAGS += -DDVNC_HAVE_NEON
+	LOCAL_SRC_FILES += tileDiff_neon.c.neon
+endif
+
+LOCAL_CFLAGS += -Wall -O3
+LOCAL_EXPORT_C_INCLUDES := $(LOCAL_PATH)
+
+LOCAL_MODULE := libtilediff_static
+
+include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_CFLAGS += -Wall -O3
 
 LOCAL_SRC_FILES += \
-									 $(LIBVNCSERVER_SRC_FILES)\
 									 droidvncserver.c \
 									 gui.c \
+									 governor.c \
 									 inputMethods/input.c \
 									 screenMethods/adb.c \
 									 screenMethods/framebuffer.c \
@@ -62,17 +124,9 @@ LOCAL_C_INCLUDES += \
 										$(LOCAL_PATH)/screenMethods \
 										$(LOCAL_PATH)/inputMethods \
 										$(LOCAL_PATH)/suinput \
-										$(LOCAL_PATH)/../libpng \
-										$(LOCAL_PATH)/../jpeg \
-										$(LOCAL_PATH)/../jpeg-turbo \
-										$(LOCAL_PATH)/../openssl/include \
-										$(LOCAL_PATH)/$(LIBVNCSERVER_ROOT)/libvncserver \
-										$(LOCAL_PATH)/$(LIBVNCSERVER_ROOT)/common \
-										$(LOCAL_PATH)/$(LIBVNCSERVER_ROOT)/rfb \
-										$(LOCAL_PATH)/$(LIBVNCSERVER_ROOT)/ \
 										$(LOCAL_PATH)/../../nativeMethods/
 
-LOCAL_STATIC_LIBRARIES := libjpeg libpng libssl_static libcrypto_static
+LOCAL_STATIC_LIBRARIES := libvncserver_static libtilediff_static
 
 LOCAL_MODULE := androidvncserver
 
@@ -80,3 +134,8 @@ LOCAL_MODULE := androidvncserver
 #LOCAL_LDFLAGS += -fPIE -pie
 
 include $(BUILD_EXECUTABLE)
+
+# the benchmarks and stress tests, only with ndk-build DVNC_TESTS=1
+ifdef DVNC_TESTS
+include $(LOCAL_PATH)/test/Android.mk
+endif
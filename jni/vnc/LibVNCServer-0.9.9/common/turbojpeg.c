@@ -92,6 +92,11 @@ typedef struct _tjinstance
 	struct jpeg_source_mgr jsrc;
 	struct my_error_mgr jerr;
 	int init;
+	/* Scratch space kept from one tjCompress2() call to the next */
+	JSAMPROW *rowPointers;
+	int rowPointersSize;
+	unsigned char *rgbBuf;
+	size_t rgbBufSize;
 } tjinstance;
 
 static const int pixelsize[TJ_NUMSAMP]={3, 3, 3, 1, 3};
@@ -163,6 +168,25 @@ static int setCompDefaults(struct jpeg_compress_struct *cinfo,
 		case TJPF_XBGR:
 		case TJPF_ABGR:
 			cinfo->in_color_space=JCS_EXT_XBGR;  break;
+		#elif defined(ANDROID_RGB)
+		/* The bundled libjpeg reads Android's pixel layouts as they are */
+		case TJPF_RGBX:
+		case TJPF_RGBA:
+			cinfo->in_color_space=JCS_RGBA_8888;  break;
+		case TJPF_BGRX:
+		case TJPF_BGRA:
+			cinfo->in_color_space=JCS_BGRA_8888;  break;
+		case TJPF_XBGR:
+		case TJPF_ABGR:
+			cinfo->in_color_space=JCS_ABGR_8888;  break;
+		case TJPF_RGB565:
+			cinfo->in_color_space=JCS_RGB_565;  break;
+		case TJPF_RGB:
+		case TJPF_BGR:
+		case TJPF_XRGB:
+		case TJPF_ARGB:
+			cinfo->in_color_space=JCS_RGB;  pixelFormat=TJPF_RGB;
+			break;
 		#else
 		case TJPF_RGB:
 		case TJPF_BGR:
@@ -174,6 +198,7 @@ static int setCompDefaults(struct jpeg_compress_struct *cinfo,
 		case TJPF_BGRA:
 		case TJPF_ARGB:
 		case TJPF_ABGR:
+		case TJPF_RGB565:
 			cinfo->in_color_space=JCS_RGB;  pixelFormat=TJPF_RGB;
 			break;
 		#endif
@@ -284,7 +309,18 @@ static int getSubsamp(j_decompress_ptr dinfo)
 }
 
 
-#ifndef JCS_EXTENSIONS
+/* Whether libjpeg takes pixelFormat as it is, see setCompDefaults() */
+static int nativeInput(int pixelFormat)
+{
+	#ifdef JCS_EXTENSIONS
+	return pixelFormat!=TJPF_RGB565;
+	#elif defined(ANDROID_RGB)
+	return pixelFormat!=TJPF_RGB && pixelFormat!=TJPF_BGR
+		&& pixelFormat!=TJPF_XRGB && pixelFormat!=TJPF_ARGB;
+	#else
+	return pixelFormat==TJPF_GRAY;
+	#endif
+}
 
 /* Conversion functions to emulate the colorspace extensions.  This allows the
    TurboJPEG wrapper to be used with libjpeg */
@@ -345,10 +381,32 @@ static unsigned char *toRGB(unsigned char *src, int width, int pitch,
 			retval=dst;  TORGB(4, 3, 2, 1);
 			#endif
 			break;
+		case TJPF_RGB565:
+		{
+			int rowPad=pitch-width*2;
+			retval=dst;
+			while(height--)
+			{
+				unsigned short *pixel=(unsigned short *)src;
+				unsigned short *endOfRow=pixel+width;
+				while(pixel<endOfRow)
+				{
+					int r=*pixel>>11, g=(*pixel>>5)&0x3F, b=*pixel&0x1F;
+					dst[RGB_RED]=(r<<3)|(r>>2);
+					dst[RGB_GREEN]=(g<<2)|(g>>4);
+					dst[RGB_BLUE]=(b<<3)|(b>>2);
+					dst+=RGB_PIXELSIZE;  pixel++;
+				}
+				src=(unsigned char *)pixel+rowPad;
+			}
+			break;
+		}
 	}
 	return retval;
 }
 
+#ifndef JCS_EXTENSIONS
+
 #define FROMRGB(PS, ROFFSET, GOFFSET, BOFFSET, SETALPHA) {  \
 	int rowPad=pitch-width*PS;  \
 	while(height--)  \
@@ -441,6 +499,8 @@ DLLEXPORT int DLLCALL tjDestroy(tjhandle handle)
 	if(setjmp(this->jerr.setjmp_buffer)) return -1;
 	if(this->init&COMPRESS) jpeg_destroy_compress(cinfo);
 	if(this->init&DECOMPRESS) jpeg_destroy_decompress(dinfo);
+	free(this->rowPointers);
+	free(this->rgbBuf);
 	free(this);
 	return 0;
 }
@@ -536,9 +596,6 @@ DLLEXPORT int DLLCALL tjCompress2(tjhandle handle, unsigned char *srcBuf,
 	unsigned long *jpegSize, int jpegSubsamp, int jpegQual, int flags)
 {
 	int i, retval=0;  JSAMPROW *row_pointer=NULL;
-	#ifndef JCS_EXTENSIONS
-	unsigned char *rgbBuf=NULL;
-	#endif
 
 	getinstance(handle)
 	if((this->init&COMPRESS)==0)
@@ -558,15 +615,25 @@ DLLEXPORT int DLLCALL tjCompress2(tjhandle handle, unsigned char *srcBuf,
 
 	if(pitch==0) pitch=width*tjPixelSize[pixelFormat];
 
-	#ifndef JCS_EXTENSIONS
-	if(pixelFormat!=TJPF_GRAY)
+	if(!nativeInput(pixelFormat))
 	{
-		rgbBuf=(unsigned char *)malloc(width*height*RGB_PIXELSIZE);
-		if(!rgbBuf) _throw("tjCompress2(): Memory allocation failure");
-		srcBuf=toRGB(srcBuf, width, pitch, height, pixelFormat, rgbBuf);
-		pitch=width*RGB_PIXELSIZE;
+		size_t size=(size_t)width*height*RGB_PIXELSIZE;
+		if(this->rgbBufSize<size)
+		{
+			free(this->rgbBuf);
+			if((this->rgbBuf=(unsigned char *)malloc(size))==NULL)
+			{
+				this->rgbBufSize=0;
+				_throw("tjCompress2(): Memory allocation failure");
+			}
+			this->rgbBufSize=size;
+		}
+		if((srcBuf=toRGB(srcBuf, width, pitch, height, pixelFormat,
+			this->rgbBuf))==this->rgbBuf)
+		{
+			pitch=width*RGB_PIXELSIZE;  pixelFormat=TJPF_RGB;
+		}
 	}
-	#endif
 
 	cinfo->image_width=width;
 	cinfo->image_height=height;
@@ -582,8 +649,17 @@ DLLEXPORT int DLLCALL tjCompress2(tjhandle handle, unsigned char *srcBuf,
 	this->jdst.free_in_buffer=tjBufSize(width, height, jpegSubsamp);
 
 	jpeg_start_compress(cinfo, TRUE);
-	if((row_pointer=(JSAMPROW *)malloc(sizeof(JSAMPROW)*height))==NULL)
-		_throw("tjCompress2(): Memory allocation failure");
+	if(this->rowPointersSize<height)
+	{
+		free(this->rowPointers);
+		if((this->rowPointers=(JSAMPROW *)malloc(sizeof(JSAMPROW)*height))==NULL)
+		{
+			this->rowPointersSize=0;
+			_throw("tjCompress2(): Memory allocation failure");
+		}
+		this->rowPointersSize=height;
+	}
+	row_pointer=this->rowPointers;
 	for(i=0; i<height; i++)
 	{
 		if(flags&TJFLAG_BOTTOMUP) row_pointer[i]=&srcBuf[(height-i-1)*pitch];
@@ -600,10 +676,6 @@ DLLEXPORT int DLLCALL tjCompress2(tjhandle handle, unsigned char *srcBuf,
 
 	bailout:
 	if(cinfo->global_state>CSTATE_START) jpeg_abort_compress(cinfo);
-	#ifndef JCS_EXTENSIONS
-	if(rgbBuf) free(rgbBuf);
-	#endif
-	if(row_pointer) free(row_pointer);
 	return retval;
 }
 
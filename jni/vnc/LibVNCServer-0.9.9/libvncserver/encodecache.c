@@ -0,0 +1,305 @@
+/*
+ * encodecache.c
+ *
+ * Encode once, send to many. Viewers with the same pixel format and
+ * encoding settings would all encode the same rectangles of the same
+ * frame. With screen->shareEncodedRects set, the first of them to send a
+ * rectangle keeps the encoded bytes here and the others copy them out.
+ * Entries only live until the framebuffer is next marked as modified.
+ *
+ * Hextile output depends on nothing but the pixels. Tight is encoded for
+ * sharing with its zlib streams reset for every rectangle (see tight.c).
+ * ZRLE runs one zlib stream through the whole session and has no way to
+ * reset it, so it is not shared.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+
+#define ENCODE_CACHE_BUCKETS 256
+/* one frame's worth for a few groups of viewers */
+#define ENCODE_CACHE_MAX_BYTES (32 * 1024 * 1024)
+
+typedef struct _rfbEncodeCacheEntry {
+    rfbEncodeKey key;
+    int flags;
+    int len;
+    struct _rfbEncodeCacheEntry *next;
+    /* followed by len bytes of captured output */
+} rfbEncodeCacheEntry;
+
+typedef struct _rfbEncodeCache {
+    MUTEX(mutex);
+    unsigned int frameSerial;
+    size_t bytes;
+    rfbEncodeCacheEntry *buckets[ENCODE_CACHE_BUCKETS];
+} rfbEncodeCache;
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+static pthread_mutex_t cacheCreateMutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* The settings besides the pixel format that change an encoder's output. */
+static rfbBool
+EncodeSettings(rfbClientPtr cl, int encoding, int *settings)
+{
+    memset(settings, 0, 4 * sizeof(int));
+    switch (encoding) {
+    case rfbEncodingHextile:
+        return TRUE;
+#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && defined(LIBVNCSERVER_HAVE_LIBZ)
+    case rfbEncodingTight:
+        settings[0] = cl->tightCompressLevel;
+        settings[1] = cl->turboQualityLevel;
+        settings[2] = cl->turboSubsampLevel;
+        settings[3] = cl->enableLastRectEncoding;
+        return TRUE;
+#endif
+    }
+    return FALSE;
+}
+
+void
+rfbEncodeKeyInit(rfbEncodeKey *key, rfbClientPtr cl, int encoding,
+                 int x, int y, int w, int h)
+{
+    memset(key, 0, sizeof(*key));
+    key->format = cl->format;
+    key->frameBuffer = cl->scaledScreen->frameBuffer;
+    key->encoding = encoding;
+    EncodeSettings(cl, encoding, key->settings);
+    key->x = x;
+    key->y = y;
+    key->w = w;
+    key->h = h;
+}
+
+/* The client's cursor must not be drawn into the framebuffer it shares. */
+static rfbBool
+CanShare(rfbClientPtr cl, int encoding, int *settings)
+{
+    return cl->state == RFB_NORMAL && cl->preferredEncoding == encoding &&
+           cl->format.trueColour &&
+           (cl->enableCursorShapeUpdates || cl->screen->cursor == NULL) &&
+           EncodeSettings(cl, encoding, settings);
+}
+
+rfbBool
+rfbEncodeCacheUsable(rfbClientPtr cl)
+{
+    rfbClientIteratorPtr i;
+    rfbClientPtr other;
+    int settings[4], otherSettings[4];
+    rfbBool found = FALSE;
+
+    if (!cl->screen->shareEncodedRects ||
+        !CanShare(cl, cl->preferredEncoding, settings))
+        return FALSE;
+
+    i = rfbGetClientIterator(cl->screen);
+    while (!found && (other = rfbClientIteratorNext(i)) != NULL) {
+        found = other != cl && other->scaledScreen == cl->scaledScreen &&
+                CanShare(other, cl->preferredEncoding, otherSettings) &&
+                memcmp(&other->format, &cl->format, sizeof(cl->format)) == 0 &&
+                memcmp(otherSettings, settings, sizeof(settings)) == 0;
+    }
+    rfbReleaseClientIterator(i);
+    return found;
+}
+
+static unsigned int
+KeyHash(const rfbEncodeKey *key)
+{
+    unsigned int h = key->encoding;
+
+    h = h * 31 + key->x;
+    h = h * 31 + key->y;
+    h = h * 31 + key->w;
+    h = h * 31 + key->h;
+    return h % ENCODE_CACHE_BUCKETS;
+}
+
+static void
+DropEntries(rfbEncodeCache *cache)
+{
+    rfbEncodeCacheEntry *e, *next;
+    int i;
+
+    for (i = 0; i < ENCODE_CACHE_BUCKETS; i++) {
+        for (e = cache->buckets[i]; e != NULL; e = next) {
+            next = e->next;
+            free(e);
+        }
+        cache->buckets[i] = NULL;
+    }
+    cache->bytes = 0;
+}
+
+/* Returns the cache, emptied if the frame has changed since. */
+static rfbEncodeCache *
+LockCache(rfbScreenInfoPtr screen)
+{
+    rfbEncodeCache *cache;
+
+    LOCK(cacheCreateMutex);
+    if (screen->encodeCache == NULL) {
+        cache = (rfbEncodeCache *)calloc(1, sizeof(rfbEncodeCache));
+        if (cache != NULL) {
+            INIT_MUTEX(cache->mutex);
+            cache->frameSerial = screen->frameSerial;
+            screen->encodeCache = cache;
+        }
+    }
+    cache = screen->encodeCache;
+    UNLOCK(cacheCreateMutex);
+
+    if (cache == NULL)
+        return NULL;
+    LOCK(cache->mutex);
+    if (cache->frameSerial != screen->frameSerial) {
+        DropEntries(cache);
+        cache->frameSerial = screen->frameSerial;
+    }
+    return cache;
+}
+
+rfbBool
+rfbEncodeCacheLookup(rfbScreenInfoPtr screen, const rfbEncodeKey *key,
+                     rfbEncodeSink *out, int *flags)
+{
+    rfbEncodeCache *cache = LockCache(screen);
+    rfbEncodeCacheEntry *e;
+    rfbBool found = FALSE;
+
+    if (cache == NULL)
+        return FALSE;
+
+    for (e = cache->buckets[KeyHash(key)]; e != NULL; e = e->next) {
+        if (memcmp(&e->key, key, sizeof(*key)) != 0)
+            continue;
+        if (out->size < e->len) {
+            char *p = (char *)realloc(out->data, e->len);
+            if (p == NULL)
+                break;
+            out->data = p;
+            out->size = e->len;
+        }
+        memcpy(out->data, e + 1, e->len);
+        out->len = e->len;
+        /* whole records, so nothing to merge raw output into */
+        out->last = -1;
+        *flags = e->flags;
+        found = TRUE;
+        break;
+    }
+    UNLOCK(cache->mutex);
+    return found;
+}
+
+void
+rfbEncodeCacheStore(rfbScreenInfoPtr screen, const rfbEncodeKey *key,
+                    const rfbEncodeSink *sink, int flags)
+{
+    rfbEncodeCache *cache = LockCache(screen);
+    rfbEncodeCacheEntry *e;
+    unsigned int bucket;
+
+    if (cache == NULL)
+        return;
+
+    if (cache->bytes + sink->len <= ENCODE_CACHE_MAX_BYTES &&
+        (e = (rfbEncodeCacheEntry *)malloc(sizeof(*e) + sink->len)) != NULL) {
+        bucket = KeyHash(key);
+        e->key = *key;
+        e->flags = flags;
+        e->len = sink->len;
+        memcpy(e + 1, sink->data, sink->len);
+        e->next = cache->buckets[bucket];
+        cache->buckets[bucket] = e;
+        cache->bytes += sink->len;
+    }
+    UNLOCK(cache->mutex);
+}
+
+void
+rfbEncodeCacheFree(rfbScreenInfoPtr screen)
+{
+    rfbEncodeCache *cache = screen->encodeCache;
+
+    if (cache == NULL)
+        return;
+    DropEntries(cache);
+    TINI_MUTEX(cache->mutex);
+    free(cache);
+    screen->encodeCache = NULL;
+}
+
+/* Queues captured raw output for the client, see rfbSendUpdateData(). */
+rfbBool
+rfbEncodeSinkWrite(rfbClientPtr cl, const rfbEncodeSink *sink)
+{
+    rfbEncodeRecord rec;
+    char *p = sink->data, *end = p + sink->len;
+
+    while (p < end) {
+        memcpy(&rec, p, sizeof(rec));
+        p += sizeof(rec);
+        if (rec.kind != rfbEncodeRecordRaw)
+            return FALSE;
+        if (!rfbSendUpdateData(cl, p, rec.len))
+            return FALSE;
+        p += rec.len;
+    }
+    return TRUE;
+}
+
+/* Sends a rectangle of a stateless encoding through the cache. */
+rfbBool
+rfbSendRectEncodingShared(rfbClientPtr cl, int x, int y, int w, int h,
+                          rfbSendRectProcPtr encode)
+{
+    rfbEncodeKey key;
+    rfbEncodeSink sink;
+    int flags;
+    rfbBool ok = TRUE;
+
+    memset(&sink, 0, sizeof(sink));
+    sink.last = -1;
+    rfbEncodeKeyInit(&key, cl, cl->preferredEncoding, x, y, w, h);
+
+    if (rfbEncodeCacheLookup(cl->screen, &key, &sink, &flags)) {
+        rfbStatRecordEncodingSent(cl, key.encoding, sink.len,
+            sz_rfbFramebufferUpdateRectHeader +
+            w * h * (cl->format.bitsPerPixel / 8));
+    } else {
+        /* flush what is queued so the capture holds this rectangle only */
+        if (!rfbSendUpdateBuf(cl))
+            return FALSE;
+        cl->encodeSink = &sink;
+        ok = encode(cl, x, y, w, h) && rfbSendUpdateBuf(cl);
+        cl->encodeSink = NULL;
+        if (ok)
+            rfbEncodeCacheStore(cl->screen, &key, &sink, 0);
+    }
+
+    ok = ok && rfbEncodeSinkWrite(cl, &sink);
+    rfbEncodeSinkFree(&sink);
+    return ok;
+}
@@ -0,0 +1,276 @@
+/*
+ * encodepool.c
+ *
+ * A small, bounded pool of threads that encode the rectangles of one
+ * framebuffer update side by side. The thread sending the update hands
+ * out a batch of jobs, works on them itself along with the pool, and
+ * returns once all of them are done. Encoders capture their output in an
+ * rfbEncodeSink per job, and the sender writes the sinks out in order.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+
+/*
+ * Output capture.
+ */
+
+rfbBool
+rfbEncodeSinkAppend(rfbEncodeSink *sink, int kind, const char *data, int len)
+{
+    rfbEncodeRecord rec;
+    rfbBool merge = FALSE;
+    int need;
+
+    if (len == 0)
+        return TRUE;
+
+    /* Raw output arrives one updateBuf at a time, keep it in one record. */
+    if (kind == rfbEncodeRecordRaw && sink->last >= 0) {
+        memcpy(&rec, sink->data + sink->last, sizeof(rec));
+        merge = (rec.kind == rfbEncodeRecordRaw);
+    }
+    need = merge ? len : (int)sizeof(rec) + len;
+
+    if (sink->len + need > sink->size) {
+        int size = sink->size ? sink->size : 65536;
+        char *p;
+
+        while (size < sink->len + need)
+            size *= 2;
+        p = (char *)realloc(sink->data, size);
+        if (p == NULL)
+            return FALSE;
+        sink->data = p;
+        sink->size = size;
+    }
+
+    if (merge) {
+        rec.len += len;
+        memcpy(sink->data + sink->last, &rec, sizeof(rec));
+    } else {
+        rec.kind = kind;
+        rec.len = len;
+        sink->last = sink->len;
+        memcpy(sink->data + sink->len, &rec, sizeof(rec));
+        sink->len += sizeof(rec);
+    }
+    memcpy(sink->data + sink->len, data, len);
+    sink->len += len;
+    return TRUE;
+}
+
+void
+rfbEncodeSinkReset(rfbEncodeSink *sink)
+{
+    sink->len = 0;
+    sink->last = -1;
+}
+
+void
+rfbEncodeSinkFree(rfbEncodeSink *sink)
+{
+    free(sink->data);
+    sink->data = NULL;
+    sink->len = sink->size = 0;
+    sink->last = -1;
+}
+
+/*
+ * The pool.
+ */
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+
+typedef struct _rfbEncodePool {
+    MUTEX(mutex);
+    COND(work);         /* a batch was posted, or the pool is going away */
+    COND(done);         /* the last job of the batch has finished */
+    MUTEX(runMutex);    /* one batch at a time */
+    pthread_t *threads;
+    int nThreads;
+    int started;
+    rfbBool quit;
+
+    rfbEncodeJobProcPtr proc;
+    char *jobs;
+    size_t jobSize;
+    int nJobs, next, pending;
+} rfbEncodePool;
+
+static pthread_mutex_t poolCreateMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void *
+EncodeWorker(void *arg)
+{
+    rfbEncodePool *pool = (rfbEncodePool *)arg;
+    int worker, n;
+
+    LOCK(pool->mutex);
+    worker = ++pool->started;
+    for (;;) {
+        while (!pool->quit && pool->next >= pool->nJobs)
+            WAIT(pool->work, pool->mutex);
+        if (pool->quit)
+            break;
+        n = pool->next++;
+        UNLOCK(pool->mutex);
+
+        pool->proc(pool->jobs + n * pool->jobSize, worker);
+
+        LOCK(pool->mutex);
+        if (--pool->pending == 0)
+            TSIGNAL(pool->done);
+    }
+    UNLOCK(pool->mutex);
+    return NULL;
+}
+
+/* Pool threads are workers 1..n, the sending thread is worker 0. */
+static rfbEncodePool *
+GetEncodePool(rfbScreenInfoPtr screen)
+{
+    rfbEncodePool *pool;
+    int i;
+
+    LOCK(poolCreateMutex);
+    pool = screen->encodePool;
+    if (pool == NULL && screen->encodeThreads > 1) {
+        pool = (rfbEncodePool *)calloc(1, sizeof(rfbEncodePool));
+        if (pool != NULL)
+            pool->threads = (pthread_t *)calloc(screen->encodeThreads - 1,
+                                                sizeof(pthread_t));
+        if (pool == NULL || pool->threads == NULL) {
+            free(pool);
+            UNLOCK(poolCreateMutex);
+            return NULL;
+        }
+        INIT_MUTEX(pool->mutex);
+        INIT_MUTEX(pool->runMutex);
+        INIT_COND(pool->work);
+        INIT_COND(pool->done);
+        for (i = 0; i < screen->encodeThreads - 1; i++) {
+            if (pthread_create(&pool->threads[i], NULL, EncodeWorker, pool) != 0)
+                break;
+            pool->nThreads++;
+        }
+        rfbLog("Encoding updates with %d threads\n", pool->nThreads + 1);
+        screen->encodePool = pool;
+    }
+    UNLOCK(poolCreateMutex);
+    return pool;
+}
+
+int
+rfbEncodePoolSize(rfbScreenInfoPtr screen)
+{
+    rfbEncodePool *pool = GetEncodePool(screen);
+
+    return pool != NULL ? pool->nThreads + 1 : 1;
+}
+
+void
+rfbEncodePoolRun(rfbScreenInfoPtr screen, rfbEncodeJobProcPtr proc,
+                 void *jobs, size_t jobSize, int nJobs)
+{
+    rfbEncodePool *pool = GetEncodePool(screen);
+    int n;
+
+    if (pool == NULL || pool->nThreads == 0 || nJobs < 2) {
+        for (n = 0; n < nJobs; n++)
+            proc((char *)jobs + n * jobSize, 0);
+        return;
+    }
+
+    LOCK(pool->runMutex);
+    LOCK(pool->mutex);
+    pool->proc = proc;
+    pool->jobs = (char *)jobs;
+    pool->jobSize = jobSize;
+    pool->nJobs = nJobs;
+    pool->next = 0;
+    pool->pending = nJobs;
+    pthread_cond_broadcast(&pool->work);
+
+    while (pool->next < pool->nJobs) {
+        n = pool->next++;
+        UNLOCK(pool->mutex);
+
+        proc((char *)jobs + n * jobSize, 0);
+
+        LOCK(pool->mutex);
+        pool->pending--;
+    }
+    while (pool->pending > 0)
+        WAIT(pool->done, pool->mutex);
+    pool->nJobs = 0;
+    UNLOCK(pool->mutex);
+    UNLOCK(pool->runMutex);
+}
+
+void
+rfbEncodePoolShutdown(rfbScreenInfoPtr screen)
+{
+    rfbEncodePool *pool = screen->encodePool;
+    int i;
+
+    if (pool == NULL)
+        return;
+
+    LOCK(pool->mutex);
+    pool->quit = TRUE;
+    pthread_cond_broadcast(&pool->work);
+    UNLOCK(pool->mutex);
+    for (i = 0; i < pool->nThreads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    TINI_COND(pool->done);
+    TINI_COND(pool->work);
+    TINI_MUTEX(pool->runMutex);
+    TINI_MUTEX(pool->mutex);
+    free(pool->threads);
+    free(pool);
+    screen->encodePool = NULL;
+}
+
+#else
+
+int
+rfbEncodePoolSize(rfbScreenInfoPtr screen)
+{
+    return 1;
+}
+
+void
+rfbEncodePoolRun(rfbScreenInfoPtr screen, rfbEncodeJobProcPtr proc,
+                 void *jobs, size_t jobSize, int nJobs)
+{
+    int n;
+
+    for (n = 0; n < nJobs; n++)
+        proc((char *)jobs + n * jobSize, 0);
+}
+
+void
+rfbEncodePoolShutdown(rfbScreenInfoPtr screen)
+{
+}
+
+#endif
@@ -36,6 +36,8 @@
 #include <fcntl.h>
 #endif
 #include <errno.h>
+#include <strings.h>
+#include <sys/stat.h>
 
 #ifdef WIN32
 #include <winsock.h>
@@ -54,6 +56,11 @@
 #include <arpa/inet.h>
 #endif
 #include <pwd.h>
+#include <poll.h>
+#include <sys/uio.h>
+#ifdef LIBVNCSERVER_HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 #endif
 
 #ifdef USE_LIBWRAP
@@ -69,20 +76,112 @@
     "<HEAD><TITLE>Invalid Request</TITLE></HEAD>\n" \
     "<BODY><H1>Invalid request</H1></BODY>\n"
 
-#define OK_STR "HTTP/1.0 200 OK\r\nConnection: close\r\n\r\n"
-#define OK_STR_HTML "HTTP/1.0 200 OK\r\nConnection: close\r\nContent-Type: text/html\r\n\r\n"
+/* browsers check back with If-None-Match each time and mostly get a 304 */
+#define CACHE_CONTROL_STR "Cache-Control: no-cache\r\n"
 
 
+/*
+ * Browsers loading a web client open several connections and keep them
+ * alive between requests, and a room full of them opens many more, so
+ * connections are served side by side: each reads its request and sends
+ * its response as its socket allows, from rfbHttpCheckFds(), and nothing
+ * waits on one of them.
+ *
+ * The files are served from a cache.  Those of up to HTTP_CACHE_FILE_MAX
+ * bytes are kept in memory, up to HTTP_CACHE_MAX bytes in all, and sent
+ * with their headers by one writev(); bigger ones are kept open and sent
+ * with sendfile().  A request that accepts gzip gets name.gz instead of
+ * name where there is one.  Entries are checked against the file with
+ * stat() when HTTP_CACHE_RECHECK seconds old.
+ */
 
-static void httpProcessInput(rfbScreenInfoPtr screen);
-static rfbBool compareAndSkip(char **ptr, const char *str);
-static rfbBool parseParams(const char *request, char *result, int max_bytes);
-static rfbBool validateString(char *str);
+#define HTTP_REQUEST_MAX 8192
+#define HTTP_HEAD_MAX 512
+/* keep-alive connections idle for longer are closed */
+#define HTTP_IDLE_TIMEOUT 30
+#define HTTP_CACHE_FILE_MAX (64 * 1024)
+#define HTTP_CACHE_MAX (1024 * 1024)
+#define HTTP_CACHE_RECHECK 2
 
-#define BUF_SIZE 32768
+/*
+ * A file under httpDir as last read: in data, or open in fd.  exists is
+ * FALSE where there is no such file, which is remembered for .gz files
+ * only.  A .vnc template also keeps the page it made last without
+ * parameters, and the screen size it was for.  refs counts the cache and
+ * each connection sending the file.
+ */
 
-static char buf[BUF_SIZE];
-static size_t buf_filled=0;
+typedef struct _rfbHttpFile {
+    struct _rfbHttpFile *next;
+    int refs;
+    char *name;
+    rfbBool exists;
+    time_t checked;
+    time_t mtime;
+    off_t size;
+    char etag[48];
+    char *data;
+    int fd;
+    char *page;
+    size_t pageLen;
+    int pageWidth, pageHeight;
+} rfbHttpFile;
+
+/*
+ * A connection and the response it is sending, if any: the head, then
+ * body (a file's data or page, or ownBody) or fd from offset.
+ */
+
+typedef struct _rfbHttpConnection {
+    struct _rfbHttpConnection *next;
+    int sock;
+    char host[64];
+    time_t lastActive;
+    char request[HTTP_REQUEST_MAX];
+    size_t requestLen;
+    rfbBool sending;
+    rfbBool keepAlive;
+    char head[HTTP_HEAD_MAX];
+    size_t headLen, headSent;
+    rfbHttpFile *file;
+    const char *body;
+    char *ownBody;
+    int fd;
+    off_t offset;
+    size_t bodyLen, bodySent;
+} rfbHttpConnection;
+
+static const struct {
+    const char *suffix, *type;
+} contentTypes[] = {
+    { ".html", "text/html" },
+    { ".htm", "text/html" },
+    { ".vnc", "text/html" },
+    { ".js", "application/javascript" },
+    { ".css", "text/css" },
+    { ".png", "image/png" },
+    { ".ico", "image/x-icon" },
+    { ".gif", "image/gif" },
+    { ".jpg", "image/jpeg" },
+    { ".svg", "image/svg+xml" },
+    { ".json", "application/json" },
+    { ".txt", "text/plain" },
+    { ".jar", "application/java-archive" },
+    { ".swf", "application/x-shockwave-flash" },
+    { ".ttf", "application/x-font-ttf" },
+    { ".woff", "application/font-woff" },
+};
+
+static void httpAccept(rfbScreenInfoPtr rfbScreen, int listenSock);
+static rfbBool httpProcessInput(rfbScreenInfoPtr rfbScreen, rfbHttpConnection *c);
+static rfbBool httpAnswer(rfbScreenInfoPtr rfbScreen, rfbHttpConnection *c);
+static rfbBool httpSend(rfbScreenInfoPtr rfbScreen, rfbHttpConnection *c);
+static void httpCloseConnection(rfbScreenInfoPtr rfbScreen, rfbHttpConnection *c,
+                                rfbBool closeSock);
+static void httpReleaseFile(rfbHttpFile *f);
+static rfbBool compareAndSkip(const char **ptr, const char *str);
+static rfbBool parseParams(const char *request, char *result, int max_bytes);
+static rfbBool validateString(char *str);
 
 /*
  * httpInitSockets sets up the TCP socket to listen for HTTP connections.
@@ -127,6 +226,15 @@ rfbHttpInitSockets(rfbScreenInfoPtr rfbScreen)
 }
 
 void rfbHttpShutdownSockets(rfbScreenInfoPtr rfbScreen) {
+    rfbHttpFile *f;
+
+    while (rfbScreen->httpConns)
+	httpCloseConnection(rfbScreen, rfbScreen->httpConns, TRUE);
+    while ((f = rfbScreen->httpCache) != NULL) {
+	rfbScreen->httpCache = f->next;
+	httpReleaseFile(f);
+    }
+
     if(rfbScreen->httpSock>-1) {
 	close(rfbScreen->httpSock);
 	FD_CLR(rfbScreen->httpSock,&rfbScreen->allFds);
@@ -146,256 +254,609 @@ void rfbHttpShutdownSockets(rfbScreenInfoPtr rfbScreen) {
     }
 }
 
+/*
+ * rfbHttpPollFds fills in up to max entries of fds with what the HTTP
+ * server waits for: connections on its listening sockets, requests, and
+ * room to send responses in.  Applications that wait for events themselves
+ * before calling rfbProcessEvents() wait on these too.  Returns the number
+ * of entries filled in.
+ */
+
+int
+rfbHttpPollFds(rfbScreenInfoPtr rfbScreen, struct pollfd *fds, int max)
+{
+    rfbHttpConnection *c;
+    int n = 0;
+
+    if (!rfbScreen->httpDir || rfbScreen->httpListenSock < 0)
+	return 0;
+
+    if (n < max) {
+	fds[n].fd = rfbScreen->httpListenSock;
+	fds[n++].events = POLLIN;
+    }
+    if (rfbScreen->httpListen6Sock >= 0 && n < max) {
+	fds[n].fd = rfbScreen->httpListen6Sock;
+	fds[n++].events = POLLIN;
+    }
+    for (c = rfbScreen->httpConns; c != NULL && n < max; c = c->next) {
+	fds[n].fd = c->sock;
+	fds[n++].events = c->sending ? POLLOUT : POLLIN;
+    }
+    return n;
+}
+
 /*
  * httpCheckFds is called from ProcessInputEvents to check for input on the
- * HTTP socket(s).  If there is input to process, httpProcessInput is called.
+ * HTTP socket(s).  Connections with something to read or room to write in
+ * are served, and new ones accepted.
  */
 
 void
 rfbHttpCheckFds(rfbScreenInfoPtr rfbScreen)
 {
-    int nfds;
-    fd_set fds;
-    struct timeval tv;
+    struct pollfd fds[2 + RFB_HTTP_MAX_CONNECTIONS];
+    rfbHttpConnection *c, *next;
+    time_t now;
+    int n, nfds;
+
+    if (!rfbScreen->httpDir)
+	return;
+
+    if (rfbScreen->httpListenSock < 0)
+	return;
+
+    n = rfbHttpPollFds(rfbScreen, fds, 2 + RFB_HTTP_MAX_CONNECTIONS);
+    nfds = poll(fds, n, 0);
+    if (nfds < 0) {
+	if (errno != EINTR)
+		rfbLogPerror("httpCheckFds: poll");
+	return;
+    }
+
+    /* the connections follow the listening sockets, in list order */
+    now = time(NULL);
+    n = rfbScreen->httpListen6Sock >= 0 ? 2 : 1;
+    for (c = rfbScreen->httpConns; c != NULL; c = next, n++) {
+	next = c->next;
+	if (fds[n].revents != 0) {
+	    if (c->sending)
+		httpAnswer(rfbScreen, c);
+	    else
+		httpProcessInput(rfbScreen, c);
+	} else if (now - c->lastActive > HTTP_IDLE_TIMEOUT) {
+	    httpCloseConnection(rfbScreen, c, TRUE);
+	}
+    }
+
+    if (fds[0].revents & POLLIN)
+	httpAccept(rfbScreen, rfbScreen->httpListenSock);
+    if (rfbScreen->httpListen6Sock >= 0 && (fds[1].revents & POLLIN))
+	httpAccept(rfbScreen, rfbScreen->httpListen6Sock);
+}
+
+
+static void
+httpAccept(rfbScreenInfoPtr rfbScreen, int listenSock)
+{
 #ifdef LIBVNCSERVER_IPv6
     struct sockaddr_storage addr;
 #else
     struct sockaddr_in addr;
 #endif
     socklen_t addrlen = sizeof(addr);
+    rfbHttpConnection *c, *idle = NULL;
+    int sock, n = 0;
 
-    if (!rfbScreen->httpDir)
+    if ((sock = accept(listenSock, (struct sockaddr *)&addr, &addrlen)) < 0) {
+	rfbLogPerror("httpCheckFds: accept");
 	return;
+    }
 
-    if (rfbScreen->httpListenSock < 0)
+    if ((c = calloc(1, sizeof(rfbHttpConnection))) == NULL) {
+	rfbErr("httpCheckFds: out of memory\n");
+	close(sock);
 	return;
-
-    FD_ZERO(&fds);
-    FD_SET(rfbScreen->httpListenSock, &fds);
-    if (rfbScreen->httpListen6Sock >= 0) {
-	FD_SET(rfbScreen->httpListen6Sock, &fds);
     }
-    if (rfbScreen->httpSock >= 0) {
-	FD_SET(rfbScreen->httpSock, &fds);
+    c->sock = sock;
+    c->fd = -1;
+    c->lastActive = time(NULL);
+#ifdef LIBVNCSERVER_IPv6
+    if(getnameinfo((struct sockaddr*)&addr, addrlen, c->host, sizeof(c->host), NULL, 0, NI_NUMERICHOST) != 0) {
+      rfbLogPerror("httpCheckFds: error in getnameinfo");
+      c->host[0] = '\0';
     }
-    tv.tv_sec = 0;
-    tv.tv_usec = 0;
-    nfds = select(max(rfbScreen->httpListen6Sock, max(rfbScreen->httpSock,rfbScreen->httpListenSock)) + 1, &fds, NULL, NULL, &tv);
-    if (nfds == 0) {
-	return;
+#else
+    strncpy(c->host, inet_ntoa(addr.sin_addr), sizeof(c->host) - 1);
+#endif
+
+#ifdef USE_LIBWRAP
+    if(!hosts_ctl("vnc",STRING_UNKNOWN, c->host,
+		  STRING_UNKNOWN)) {
+      rfbLog("Rejected HTTP connection from client %s\n",
+	     c->host);
+      close(sock);
+      free(c);
+      return;
     }
-    if (nfds < 0) {
-#ifdef WIN32
-		errno = WSAGetLastError();
 #endif
-	if (errno != EINTR)
-		rfbLogPerror("httpCheckFds: select");
+    if(!rfbSetNonBlocking(sock)) {
+	close(sock);
+	free(c);
 	return;
     }
 
-    if ((rfbScreen->httpSock >= 0) && FD_ISSET(rfbScreen->httpSock, &fds)) {
-	httpProcessInput(rfbScreen);
+    /* when full, a connection waiting for its next request makes room */
+    for (c->next = rfbScreen->httpConns; c->next != NULL; c->next = c->next->next) {
+	n++;
+	if (!c->next->sending && c->next->requestLen == 0 &&
+	    (idle == NULL || c->next->lastActive < idle->lastActive))
+	    idle = c->next;
     }
+    if (n >= RFB_HTTP_MAX_CONNECTIONS) {
+	if (idle == NULL) {
+	    rfbErr("httpd: too many connections, closing the one from %s\n", c->host);
+	    close(sock);
+	    free(c);
+	    return;
+	}
+	httpCloseConnection(rfbScreen, idle, TRUE);
+    }
+    c->next = rfbScreen->httpConns;
+    rfbScreen->httpConns = c;
+}
 
-    if (FD_ISSET(rfbScreen->httpListenSock, &fds) || FD_ISSET(rfbScreen->httpListen6Sock, &fds)) {
-	if (rfbScreen->httpSock >= 0) close(rfbScreen->httpSock);
 
-	if(FD_ISSET(rfbScreen->httpListenSock, &fds)) {
-	    if ((rfbScreen->httpSock = accept(rfbScreen->httpListenSock, (struct sockaddr *)&addr, &addrlen)) < 0) {
-	      rfbLogPerror("httpCheckFds: accept");
-	      return;
-	    }
-	}
-	else if(FD_ISSET(rfbScreen->httpListen6Sock, &fds)) {
-	    if ((rfbScreen->httpSock = accept(rfbScreen->httpListen6Sock, (struct sockaddr *)&addr, &addrlen)) < 0) {
-	      rfbLogPerror("httpCheckFds: accept");
-	      return;
-	    }
+/*
+ * httpCloseConnection ends a connection, or only forgets it if closeSock
+ * is FALSE because the socket was handed over to the RFB server.
+ */
+
+static void
+httpCloseConnection(rfbScreenInfoPtr rfbScreen, rfbHttpConnection *c,
+                    rfbBool closeSock)
+{
+    rfbHttpConnection **link;
+
+    for (link = &rfbScreen->httpConns; *link != NULL; link = &(*link)->next)
+	if (*link == c) {
+	    *link = c->next;
+	    break;
 	}
+    if (closeSock)
+	close(c->sock);
+    if (c->file)
+	httpReleaseFile(c->file);
+    free(c->ownBody);
+    free(c);
+}
 
-#ifdef USE_LIBWRAP
-	char host[1024];
-#ifdef LIBVNCSERVER_IPv6
-	if(getnameinfo((struct sockaddr*)&addr, addrlen, host, sizeof(host), NULL, 0, NI_NUMERICHOST) != 0) {
-	  rfbLogPerror("httpCheckFds: error in getnameinfo");
-	  host[0] = '\0';
+
+static void
+httpReleaseFile(rfbHttpFile *f)
+{
+    if (--f->refs > 0)
+	return;
+    if (f->fd >= 0)
+	close(f->fd);
+    free(f->data);
+    free(f->page);
+    free(f->name);
+    free(f);
+}
+
+
+static size_t
+httpCacheBytes(rfbScreenInfoPtr rfbScreen)
+{
+    rfbHttpFile *f;
+    size_t bytes = 0;
+
+    for (f = rfbScreen->httpCache; f != NULL; f = f->next)
+	if (f->data)
+	    bytes += f->size;
+    return bytes;
+}
+
+/*
+ * httpGetFile returns the cache entry for name, a path in httpDir, reading
+ * the file if the entry is missing or out of date.  inMemory asks for its
+ * contents in data, whatever the size.  If there is no such file, it
+ * returns NULL, or if rememberMissing an entry saying so.
+ */
+
+static rfbHttpFile *
+httpGetFile(rfbScreenInfoPtr rfbScreen, const char *name, rfbBool inMemory,
+            rfbBool rememberMissing)
+{
+    rfbHttpFile *f, **link;
+    char path[1024];
+    struct stat st;
+    time_t now = time(NULL);
+    int fd;
+    ssize_t got;
+    off_t done;
+
+    for (link = &rfbScreen->httpCache; (f = *link) != NULL; link = &f->next)
+	if (strcmp(f->name, name) == 0)
+	    break;
+    if (f && now >= f->checked && now - f->checked < HTTP_CACHE_RECHECK)
+	return f->exists || rememberMissing ? f : NULL;
+
+    snprintf(path, sizeof(path), "%s%s", rfbScreen->httpDir, name);
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+	st.st_size = -1;
+    if (f) {
+	if ((!f->exists && st.st_size < 0) ||
+	    (f->exists && st.st_size == f->size && st.st_mtime == f->mtime)) {
+	    f->checked = now;
+	    return f->exists || rememberMissing ? f : NULL;
 	}
-#else
-	memcpy(host, inet_ntoa(addr.sin_addr), sizeof(host));
-#endif
-	if(!hosts_ctl("vnc",STRING_UNKNOWN, host,
-		      STRING_UNKNOWN)) {
-	  rfbLog("Rejected HTTP connection from client %s\n",
-		 host);
-	  close(rfbScreen->httpSock);
-	  rfbScreen->httpSock=-1;
-	  return;
+	/* connections still sending it keep it until they are done */
+	*link = f->next;
+	httpReleaseFile(f);
+    }
+
+    if (st.st_size < 0 && !rememberMissing)
+	return NULL;
+    if ((f = calloc(1, sizeof(rfbHttpFile))) == NULL ||
+        (f->name = strdup(name)) == NULL) {
+	rfbErr("httpd: out of memory\n");
+	free(f);
+	return NULL;
+    }
+    f->refs = 1;
+    f->fd = -1;
+    f->checked = now;
+    f->size = st.st_size;
+
+    if (st.st_size >= 0) {
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+	    rfbLogPerror("httpProcessInput: open");
+	    if (fd >= 0)
+		close(fd);
+	    httpReleaseFile(f);
+	    return NULL;
 	}
-#endif
-        if(!rfbSetNonBlocking(rfbScreen->httpSock)) {
-	    close(rfbScreen->httpSock);
-	    rfbScreen->httpSock=-1;
-	    return;
+	f->exists = TRUE;
+	f->size = st.st_size;
+	f->mtime = st.st_mtime;
+	snprintf(f->etag, sizeof(f->etag), "\"%lx-%llx\"",
+		 (unsigned long)f->mtime, (unsigned long long)f->size);
+
+	if (inMemory || (f->size <= HTTP_CACHE_FILE_MAX &&
+			 httpCacheBytes(rfbScreen) + f->size <= HTTP_CACHE_MAX)) {
+	    /* one more byte, so that .vnc templates end in a NUL */
+	    if ((f->data = malloc(f->size + 1)) == NULL) {
+		rfbErr("httpd: out of memory\n");
+		close(fd);
+		httpReleaseFile(f);
+		return NULL;
+	    }
+	    for (done = 0; done < f->size; done += got)
+		if ((got = read(fd, f->data + done, f->size - done)) <= 0) {
+		    rfbLogPerror("httpProcessInput: read");
+		    close(fd);
+		    httpReleaseFile(f);
+		    return NULL;
+		}
+	    f->data[f->size] = '\0';
+	    close(fd);
+	} else {
+	    fcntl(fd, F_SETFD, FD_CLOEXEC);
+	    f->fd = fd;
 	}
-	/*AddEnabledDevice(httpSock);*/
     }
+
+    f->next = rfbScreen->httpCache;
+    rfbScreen->httpCache = f;
+    return f;
 }
 
 
+typedef struct {
+    char *data;
+    size_t len, size;
+} httpBuffer;
+
 static void
-httpCloseSock(rfbScreenInfoPtr rfbScreen)
+httpAppend(httpBuffer *b, const char *s, size_t len)
 {
-    close(rfbScreen->httpSock);
-    rfbScreen->httpSock = -1;
-    buf_filled = 0;
+    char *data;
+
+    if (b->data == NULL)
+	return;
+    if (b->len + len > b->size) {
+	b->size = (b->len + len) * 2;
+	if ((data = realloc(b->data, b->size)) == NULL)
+	    free(b->data);
+	b->data = data;
+	if (data == NULL)
+	    return;
+    }
+    memcpy(b->data + b->len, s, len);
+    b->len += len;
 }
 
-static rfbClientRec cl;
+static void
+httpAppendString(httpBuffer *b, const char *s)
+{
+    httpAppend(b, s, strlen(s));
+}
 
 /*
- * httpProcessInput is called when input is received on the HTTP socket.
+ * httpMakePage substitutes $WIDTH, $HEIGHT, etc in a .vnc template with
+ * the appropriate values.  Returns the page, of *len bytes, or NULL.
  */
 
-static void
-httpProcessInput(rfbScreenInfoPtr rfbScreen)
+static char *
+httpMakePage(rfbScreenInfoPtr rfbScreen, const char *template,
+             const char *params, size_t *len)
 {
-#ifdef LIBVNCSERVER_IPv6
-    struct sockaddr_storage addr;
-#else
-    struct sockaddr_in addr;
-#endif
-    socklen_t addrlen = sizeof(addr);
-    char fullFname[512];
-    char params[1024];
-    char *ptr;
-    char *fname;
-    unsigned int maxFnameLen;
-    FILE* fd;
-    rfbBool performSubstitutions = FALSE;
+    httpBuffer b;
+    const char *ptr = template;
+    const char *dollar;
     char str[256+32];
 #ifndef WIN32
     char* user=getenv("USER");
 #endif
-   
-    cl.sock=rfbScreen->httpSock;
 
-    if (strlen(rfbScreen->httpDir) > 255) {
-	rfbErr("-httpd directory too long\n");
-	httpCloseSock(rfbScreen);
-	return;
-    }
-    strcpy(fullFname, rfbScreen->httpDir);
-    fname = &fullFname[strlen(fullFname)];
-    maxFnameLen = 511 - strlen(fullFname);
+    b.len = 0;
+    b.size = strlen(template) + 256;
+    b.data = malloc(b.size);
 
-    buf_filled=0;
+    while ((dollar = strchr(ptr, '$'))!=NULL) {
+	httpAppend(&b, ptr, dollar - ptr);
 
-    /* Read data from the HTTP client until we get a complete request. */
-    while (1) {
-	ssize_t got;
+	ptr = dollar;
 
-        if (buf_filled > sizeof (buf)) {
-	    rfbErr("httpProcessInput: HTTP request is too long\n");
-	    httpCloseSock(rfbScreen);
-	    return;
+	if (compareAndSkip(&ptr, "$WIDTH")) {
+
+	    sprintf(str, "%d", rfbScreen->width);
+	    httpAppendString(&b, str);
+
+	} else if (compareAndSkip(&ptr, "$HEIGHT")) {
+
+	    sprintf(str, "%d", rfbScreen->height);
+	    httpAppendString(&b, str);
+
+	} else if (compareAndSkip(&ptr, "$APPLETWIDTH")) {
+
+	    sprintf(str, "%d", rfbScreen->width);
+	    httpAppendString(&b, str);
+
+	} else if (compareAndSkip(&ptr, "$APPLETHEIGHT")) {
+
+	    sprintf(str, "%d", rfbScreen->height + 32);
+	    httpAppendString(&b, str);
+
+	} else if (compareAndSkip(&ptr, "$PORT")) {
+
+	    sprintf(str, "%d", rfbScreen->port);
+	    httpAppendString(&b, str);
+
+	} else if (compareAndSkip(&ptr, "$DESKTOP")) {
+
+	    httpAppendString(&b, rfbScreen->desktopName);
+
+	} else if (compareAndSkip(&ptr, "$DISPLAY")) {
+
+	    sprintf(str, "%s:%d", rfbScreen->thisHost, rfbScreen->port-5900);
+	    httpAppendString(&b, str);
+
+	} else if (compareAndSkip(&ptr, "$USER")) {
+#ifndef WIN32
+	    if (user) {
+		httpAppendString(&b, user);
+	    } else
+#endif
+		httpAppend(&b, "?", 1);
+	} else if (compareAndSkip(&ptr, "$PARAMS")) {
+	    httpAppendString(&b, params);
+	} else {
+	    if (!compareAndSkip(&ptr, "$$"))
+		ptr++;
+
+	    httpAppend(&b, "$", 1);
 	}
+    }
+    httpAppendString(&b, ptr);
 
-	got = read (rfbScreen->httpSock, buf + buf_filled,
-			    sizeof (buf) - buf_filled - 1);
+    if (b.data == NULL)
+	rfbErr("httpd: out of memory\n");
+    *len = b.len;
+    return b.data;
+}
 
-	if (got <= 0) {
-	    if (got == 0) {
-		rfbErr("httpd: premature connection close\n");
-	    } else {
-#ifdef WIN32
-	        errno=WSAGetLastError();
+
+/* FNV-1a, to fold the strings a page was made with into its ETag */
+static unsigned long
+httpHashString(unsigned long hash, const char *s)
+{
+    if (s == NULL)
+	return hash;
+    for (; *s != '\0'; s++)
+	hash = (hash ^ (unsigned char)*s) * 16777619UL;
+    /* so that "ab","c" and "a","bc" differ */
+    return (hash ^ 0xff) * 16777619UL;
+}
+
+/*
+ * httpPageETag makes the ETag of the page httpMakePage would make from
+ * template file f with params: the template's own, the screen size and
+ * port, and a hash of the strings substituted in.
+ */
+
+static void
+httpPageETag(rfbScreenInfoPtr rfbScreen, const rfbHttpFile *f,
+             const char *params, char *etag, size_t size)
+{
+    unsigned long hash = 2166136261UL;
+
+    hash = httpHashString(hash, rfbScreen->desktopName);
+    hash = httpHashString(hash, rfbScreen->thisHost);
+#ifndef WIN32
+    hash = httpHashString(hash, getenv("USER"));
 #endif
-		if (errno == EAGAIN) {
-		    return;
-		}
-		rfbLogPerror("httpProcessInput: read");
-	    }
-	    httpCloseSock(rfbScreen);
-	    return;
+    hash = httpHashString(hash, params);
+    snprintf(etag, size, "\"%lx-%llx-%dx%d-%d-%08lx\"",
+	     (unsigned long)f->mtime, (unsigned long long)f->size,
+	     rfbScreen->width, rfbScreen->height, rfbScreen->port,
+	     hash & 0xffffffffUL);
+}
+
+
+/*
+ * httpHeader returns the value of the header called name in a request,
+ * or NULL.
+ */
+
+static const char *
+httpHeader(const char *request, const char *name)
+{
+    size_t len = strlen(name);
+    const char *line = request;
+
+    while ((line = strchr(line, '\n')) != NULL) {
+	line++;
+	if (strncasecmp(line, name, len) == 0 && line[len] == ':') {
+	    for (line += len + 1; *line == ' ' || *line == '\t'; line++)
+		;
+	    return line;
 	}
+    }
+    return NULL;
+}
 
-	buf_filled += got;
-	buf[buf_filled] = '\0';
+/* whether the value of a header in a request contains str */
+static rfbBool
+httpHeaderHas(const char *request, const char *name, const char *str)
+{
+    const char *value = httpHeader(request, name);
+    size_t len = strlen(str);
+
+    if (value == NULL)
+	return FALSE;
+    for (; *value != '\0' && *value != '\r' && *value != '\n'; value++)
+	if (strncasecmp(value, str, len) == 0)
+	    return TRUE;
+    return FALSE;
+}
 
-	/* Is it complete yet (is there a blank line)? */
-	if (strstr (buf, "\r\r") || strstr (buf, "\n\n") ||
-	    strstr (buf, "\r\n\r\n") || strstr (buf, "\n\r\n\r"))
-	    break;
+static const char *
+httpContentType(const char *name)
+{
+    size_t i, len = strlen(name), suffix;
+
+    for (i = 0; i < sizeof(contentTypes) / sizeof(contentTypes[0]); i++) {
+	suffix = strlen(contentTypes[i].suffix);
+	if (len >= suffix && strcasecmp(name + len - suffix, contentTypes[i].suffix) == 0)
+	    return contentTypes[i].type;
     }
+    return NULL;
+}
 
+/* makes a response of only a head, after which the connection closes */
+static rfbBool
+httpRespondWith(rfbHttpConnection *c, const char *head)
+{
+    c->headLen = strlen(head);
+    memcpy(c->head, head, c->headLen);
+    c->keepAlive = FALSE;
+    c->sending = TRUE;
+    return TRUE;
+}
+
+static rfbClientRec cl;
+
+/*
+ * httpRespond makes the response to the request at the start of
+ * c->request for httpSend().  Returns FALSE if the connection is gone.
+ */
+
+static rfbBool
+httpRespond(rfbScreenInfoPtr rfbScreen, rfbHttpConnection *c)
+{
+    char fname[512];
+    char params[1024];
+    char etag[96];
+    char *buf = c->request;
+    char *ptr;
+    rfbHttpFile *f, *gz;
+    const char *type;
+    char ch;
+    rfbBool performSubstitutions = FALSE;
+    rfbBool http11;
+
+    cl.sock=c->sock;
+
+    if (strlen(rfbScreen->httpDir) > 255) {
+	rfbErr("-httpd directory too long\n");
+	httpCloseConnection(rfbScreen, c, TRUE);
+	return FALSE;
+    }
 
     /* Process the request. */
     if(rfbScreen->httpEnableProxyConnect) {
 	const static char* PROXY_OK_STR = "HTTP/1.0 200 OK\r\nContent-Type: octet-stream\r\nPragma: no-cache\r\n\r\n";
 	if(!strncmp(buf, "CONNECT ", 8)) {
-	    if(atoi(strchr(buf, ':')+1)!=rfbScreen->port) {
+	    if(strchr(buf, ':') == NULL || atoi(strchr(buf, ':')+1)!=rfbScreen->port) {
 		rfbErr("httpd: CONNECT format invalid.\n");
-		rfbWriteExact(&cl,INVALID_REQUEST_STR, strlen(INVALID_REQUEST_STR));
-		httpCloseSock(rfbScreen);
-		return;
+		return httpRespondWith(c, INVALID_REQUEST_STR);
 	    }
 	    /* proxy connection */
 	    rfbLog("httpd: client asked for CONNECT\n");
 	    rfbWriteExact(&cl,PROXY_OK_STR,strlen(PROXY_OK_STR));
-	    rfbNewClientConnection(rfbScreen,rfbScreen->httpSock);
-	    rfbScreen->httpSock = -1;
-	    return;
+	    rfbNewClientConnection(rfbScreen,c->sock);
+	    httpCloseConnection(rfbScreen, c, FALSE);
+	    return FALSE;
 	}
 	if (!strncmp(buf, "GET ",4) && !strncmp(strchr(buf,'/'),"/proxied.connection HTTP/1.", 27)) {
 	    /* proxy connection */
 	    rfbLog("httpd: client asked for /proxied.connection\n");
 	    rfbWriteExact(&cl,PROXY_OK_STR,strlen(PROXY_OK_STR));
-	    rfbNewClientConnection(rfbScreen,rfbScreen->httpSock);
-	    rfbScreen->httpSock = -1;
-	    return;
-	}	   
+	    rfbNewClientConnection(rfbScreen,c->sock);
+	    httpCloseConnection(rfbScreen, c, FALSE);
+	    return FALSE;
+	}
     }
 
     if (strncmp(buf, "GET ", 4)) {
 	rfbErr("httpd: no GET line\n");
-	httpCloseSock(rfbScreen);
-	return;
-    } else {
-	/* Only use the first line. */
-	buf[strcspn(buf, "\n\r")] = '\0';
+	httpCloseConnection(rfbScreen, c, TRUE);
+	return FALSE;
     }
 
-    if (strlen(buf) > maxFnameLen) {
+    if (strcspn(buf, "\n\r") >= sizeof(fname)) {
 	rfbErr("httpd: GET line too long\n");
-	httpCloseSock(rfbScreen);
-	return;
+	httpCloseConnection(rfbScreen, c, TRUE);
+	return FALSE;
     }
 
-    if (sscanf(buf, "GET %s HTTP/1.", fname) != 1) {
+    if (sscanf(buf, "GET %511s HTTP/1.%c", fname, &ch) != 2) {
 	rfbErr("httpd: couldn't parse GET line\n");
-	httpCloseSock(rfbScreen);
-	return;
+	httpCloseConnection(rfbScreen, c, TRUE);
+	return FALSE;
     }
 
+    /* HTTP/1.1 connections stay open unless asked not to */
+    http11 = ch != '0';
+    if (http11)
+	c->keepAlive = !httpHeaderHas(buf, "Connection", "close");
+    else
+	c->keepAlive = httpHeaderHas(buf, "Connection", "keep-alive");
+
     if (fname[0] != '/') {
 	rfbErr("httpd: filename didn't begin with '/'\n");
-	rfbWriteExact(&cl, NOT_FOUND_STR, strlen(NOT_FOUND_STR));
-	httpCloseSock(rfbScreen);
-	return;
+	return httpRespondWith(c, NOT_FOUND_STR);
     }
 
-
-    getpeername(rfbScreen->httpSock, (struct sockaddr *)&addr, &addrlen);
-#ifdef LIBVNCSERVER_IPv6
-    char host[1024];
-    if(getnameinfo((struct sockaddr*)&addr, addrlen, host, sizeof(host), NULL, 0, NI_NUMERICHOST) != 0) {
-      rfbLogPerror("httpProcessInput: error in getnameinfo");
+    if (strstr(fname, "/..") != NULL) {
+	rfbErr("httpd: filename outside the -httpd directory\n");
+	return httpRespondWith(c, NOT_FOUND_STR);
     }
-    rfbLog("httpd: get '%s' for %s\n", fname+1, host);
-#else
-    rfbLog("httpd: get '%s' for %s\n", fname+1,
-	   inet_ntoa(addr.sin_addr));
-#endif
+
+    rfbLog("httpd: get '%s' for %s\n", fname+1, c->host);
 
     /* Extract parameters from the URL string if necessary */
 
@@ -423,123 +884,281 @@ httpProcessInput(rfbScreenInfoPtr rfbScreen)
 	performSubstitutions = TRUE;
     }
 
-    /* Open the file */
+    /* Find the file */
 
-    if ((fd = fopen(fullFname, "r")) == 0) {
-        rfbLogPerror("httpProcessInput: open");
-        rfbWriteExact(&cl, NOT_FOUND_STR, strlen(NOT_FOUND_STR));
-        httpCloseSock(rfbScreen);
-        return;
+    if ((f = httpGetFile(rfbScreen, fname, performSubstitutions, FALSE)) == NULL) {
+	return httpRespondWith(c, NOT_FOUND_STR);
     }
+    type = httpContentType(fname);
 
-    if(performSubstitutions) /* is the 'index.vnc' file */
-      rfbWriteExact(&cl, OK_STR_HTML, strlen(OK_STR_HTML));
-    else
-      rfbWriteExact(&cl, OK_STR, strlen(OK_STR));
+    if (performSubstitutions) {
+	httpPageETag(rfbScreen, f, params, etag, sizeof(etag));
+    }
 
-    while (1) {
-	int n = fread(buf, 1, BUF_SIZE-1, fd);
-	if (n < 0) {
-	    rfbLogPerror("httpProcessInput: read");
-	    fclose(fd);
-	    httpCloseSock(rfbScreen);
-	    return;
+    if (performSubstitutions && httpHeaderHas(buf, "If-None-Match", etag)) {
+	/* nothing to make, the browser has this page already */
+	c->headLen = snprintf(c->head, sizeof(c->head),
+			      "HTTP/1.1 304 Not Modified\r\nETag: %s\r\n"
+			      CACHE_CONTROL_STR "Connection: %s\r\n\r\n",
+			      etag, c->keepAlive ? "keep-alive" : "close");
+	c->bodyLen = 0;
+    } else if (performSubstitutions) {
+	/* The page without parameters is made once for each screen size,
+	   unless the last one is still being sent; others for each request. */
+	if (params[0] == '\0' && (f->page == NULL || f->refs == 1) &&
+	    (f->page == NULL || f->pageWidth != rfbScreen->width ||
+	     f->pageHeight != rfbScreen->height)) {
+	    free(f->page);
+	    if ((f->page = httpMakePage(rfbScreen, f->data, "", &f->pageLen)) == NULL) {
+		httpCloseConnection(rfbScreen, c, TRUE);
+		return FALSE;
+	    }
+	    f->pageWidth = rfbScreen->width;
+	    f->pageHeight = rfbScreen->height;
+	}
+	if (params[0] == '\0' && f->pageWidth == rfbScreen->width &&
+	    f->pageHeight == rfbScreen->height) {
+	    c->body = f->page;
+	    c->bodyLen = f->pageLen;
+	} else {
+	    if ((c->ownBody = httpMakePage(rfbScreen, f->data, params, &c->bodyLen)) == NULL) {
+		httpCloseConnection(rfbScreen, c, TRUE);
+		return FALSE;
+	    }
+	    c->body = c->ownBody;
+	}
+	c->headLen = snprintf(c->head, sizeof(c->head),
+			      "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n"
+			      "Content-Length: %lu\r\nETag: %s\r\n"
+			      CACHE_CONTROL_STR "Connection: %s\r\n\r\n", type,
+			      (unsigned long)c->bodyLen, etag,
+			      c->keepAlive ? "keep-alive" : "close");
+    } else {
+	/* name.gz where there is one and it will do */
+	if (httpHeaderHas(buf, "Accept-Encoding", "gzip") &&
+	    strlen(fname) + 3 < sizeof(fname)) {
+	    strcat(fname, ".gz");
+	    gz = httpGetFile(rfbScreen, fname, FALSE, TRUE);
+	    fname[strlen(fname) - 3] = '\0';
+	    if (gz && gz->exists)
+		f = gz;
+	    else
+		gz = NULL;
+	} else {
+	    gz = NULL;
 	}
 
-	if (n == 0)
-	    break;
-
-	if (performSubstitutions) {
-
-	    /* Substitute $WIDTH, $HEIGHT, etc with the appropriate values.
-	       This won't quite work properly if the .vnc file is longer than
-	       BUF_SIZE, but it's reasonable to assume that .vnc files will
-	       always be short. */
-
-	    char *ptr = buf;
-	    char *dollar;
-	    buf[n] = 0; /* make sure it's null-terminated */
-
-	    while ((dollar = strchr(ptr, '$'))!=NULL) {
-		rfbWriteExact(&cl, ptr, (dollar - ptr));
+	if (httpHeaderHas(buf, "If-None-Match", f->etag)) {
+	    c->headLen = snprintf(c->head, sizeof(c->head),
+				  "HTTP/1.1 304 Not Modified\r\nETag: %s\r\n"
+				  CACHE_CONTROL_STR "%sConnection: %s\r\n\r\n",
+				  f->etag, gz ? "Vary: Accept-Encoding\r\n" : "",
+				  c->keepAlive ? "keep-alive" : "close");
+	    c->bodyLen = 0;
+	} else {
+	    c->headLen = snprintf(c->head, sizeof(c->head),
+				  "HTTP/1.1 200 OK\r\n%s%s%s%s"
+				  "Content-Length: %llu\r\nETag: %s\r\n"
+				  CACHE_CONTROL_STR "Connection: %s\r\n\r\n",
+				  type ? "Content-Type: " : "", type ? type : "",
+				  type ? "\r\n" : "",
+				  gz ? "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n" : "",
+				  (unsigned long long)f->size, f->etag,
+				  c->keepAlive ? "keep-alive" : "close");
+	    c->bodyLen = f->size;
+	    if (f->data) {
+		c->body = f->data;
+	    } else {
+		c->fd = f->fd;
+		c->offset = 0;
+	    }
+	}
+    }
 
-		ptr = dollar;
+    if (c->headLen >= sizeof(c->head)) {
+	rfbErr("httpd: response head too long\n");
+	httpCloseConnection(rfbScreen, c, TRUE);
+	return FALSE;
+    }
+    c->file = f;
+    f->refs++;
+    c->sending = TRUE;
+    return TRUE;
+}
 
-		if (compareAndSkip(&ptr, "$WIDTH")) {
 
-		    sprintf(str, "%d", rfbScreen->width);
-		    rfbWriteExact(&cl, str, strlen(str));
+/*
+ * httpProcessInput is called when input is received on an HTTP connection
+ * that is not sending a response, and answers the requests it completes.
+ * Returns FALSE if the connection is gone.
+ */
 
-		} else if (compareAndSkip(&ptr, "$HEIGHT")) {
+static rfbBool
+httpProcessInput(rfbScreenInfoPtr rfbScreen, rfbHttpConnection *c)
+{
+    ssize_t got;
 
-		    sprintf(str, "%d", rfbScreen->height);
-		    rfbWriteExact(&cl, str, strlen(str));
+    got = read(c->sock, c->request + c->requestLen,
+	       sizeof(c->request) - c->requestLen - 1);
 
-		} else if (compareAndSkip(&ptr, "$APPLETWIDTH")) {
+    if (got <= 0) {
+	if (got == 0) {
+	    /* browsers close the connections they kept alive */
+	    if (c->requestLen > 0)
+		rfbErr("httpd: premature connection close\n");
+	} else {
+#ifdef WIN32
+	    errno=WSAGetLastError();
+#endif
+	    if (errno == EAGAIN || errno == EINTR)
+		return TRUE;
+	    rfbLogPerror("httpProcessInput: read");
+	}
+	httpCloseConnection(rfbScreen, c, TRUE);
+	return FALSE;
+    }
 
-		    sprintf(str, "%d", rfbScreen->width);
-		    rfbWriteExact(&cl, str, strlen(str));
+    c->requestLen += got;
+    c->request[c->requestLen] = '\0';
+    c->lastActive = time(NULL);
+    return httpAnswer(rfbScreen, c);
+}
 
-		} else if (compareAndSkip(&ptr, "$APPLETHEIGHT")) {
 
-		    sprintf(str, "%d", rfbScreen->height + 32);
-		    rfbWriteExact(&cl, str, strlen(str));
+/*
+ * httpAnswer sends what it can of the response being sent on c, then
+ * answers the requests read after it in turn.  Returns FALSE if the
+ * connection is gone.
+ */
 
-		} else if (compareAndSkip(&ptr, "$PORT")) {
+static rfbBool
+httpAnswer(rfbScreenInfoPtr rfbScreen, rfbHttpConnection *c)
+{
+    char *end, *end2;
+    size_t len;
 
-		    sprintf(str, "%d", rfbScreen->port);
-		    rfbWriteExact(&cl, str, strlen(str));
+    while (1) {
+	if (c->sending) {
+	    if (!httpSend(rfbScreen, c))
+		return FALSE;
+	    if (c->sending)
+		return TRUE;
+	}
 
-		} else if (compareAndSkip(&ptr, "$DESKTOP")) {
+	/* Is a request complete yet (is there a blank line)? */
+	end = strstr(c->request, "\r\n\r\n");
+	end2 = strstr(c->request, "\n\n");
+	if (end2 && (end == NULL || end2 < end)) {
+	    end = end2 + 2;
+	} else if (end) {
+	    end += 4;
+	} else {
+	    if (c->requestLen < sizeof(c->request) - 1)
+		return TRUE;
+	    rfbErr("httpProcessInput: HTTP request is too long\n");
+	    httpCloseConnection(rfbScreen, c, TRUE);
+	    return FALSE;
+	}
 
-		    rfbWriteExact(&cl, rfbScreen->desktopName, strlen(rfbScreen->desktopName));
+	len = end - c->request;
+	end[-1] = '\0';
+	if (!httpRespond(rfbScreen, c))
+	    return FALSE;
+	c->requestLen -= len;
+	memmove(c->request, end, c->requestLen + 1);
+    }
+}
 
-		} else if (compareAndSkip(&ptr, "$DISPLAY")) {
 
-		    sprintf(str, "%s:%d", rfbScreen->thisHost, rfbScreen->port-5900);
-		    rfbWriteExact(&cl, str, strlen(str));
+/*
+ * httpSend sends what it can of the response of c, and when it is all
+ * sent, closes the connection unless it is kept alive.  Returns FALSE if
+ * the connection is gone.
+ */
 
-		} else if (compareAndSkip(&ptr, "$USER")) {
-#ifndef WIN32
-		    if (user) {
-			rfbWriteExact(&cl, user,
-				   strlen(user));
-		    } else
+static rfbBool
+httpSend(rfbScreenInfoPtr rfbScreen, rfbHttpConnection *c)
+{
+    struct iovec iov[2];
+    ssize_t n;
+    size_t part;
+#ifndef LIBVNCSERVER_HAVE_SYS_SENDFILE_H
+    char buf[16384];
 #endif
-			rfbWriteExact(&cl, "?", 1);
-		} else if (compareAndSkip(&ptr, "$PARAMS")) {
-		    if (params[0] != '\0')
-			rfbWriteExact(&cl, params, strlen(params));
-		} else {
-		    if (!compareAndSkip(&ptr, "$$"))
-			ptr++;
-
-		    if (rfbWriteExact(&cl, "$", 1) < 0) {
-			fclose(fd);
-			httpCloseSock(rfbScreen);
-			return;
-		    }
-		}
-	    }
-	    if (rfbWriteExact(&cl, ptr, (&buf[n] - ptr)) < 0)
-		break;
 
+    while (c->headSent < c->headLen || c->bodySent < c->bodyLen) {
+	if (c->fd < 0) {
+	    iov[0].iov_base = c->head + c->headSent;
+	    iov[0].iov_len = c->headLen - c->headSent;
+	    iov[1].iov_base = (char *)c->body + c->bodySent;
+	    iov[1].iov_len = c->bodyLen - c->bodySent;
+	    n = writev(c->sock, iov, 2);
+	} else if (c->headSent < c->headLen) {
+#ifdef MSG_MORE
+	    n = send(c->sock, c->head + c->headSent, c->headLen - c->headSent, MSG_MORE);
+#else
+	    n = send(c->sock, c->head + c->headSent, c->headLen - c->headSent, 0);
+#endif
 	} else {
+#ifdef LIBVNCSERVER_HAVE_SYS_SENDFILE_H
+	    n = sendfile(c->sock, c->fd, &c->offset, c->bodyLen - c->bodySent);
+#else
+	    part = c->bodyLen - c->bodySent;
+	    if (part > sizeof(buf))
+		part = sizeof(buf);
+	    n = pread(c->fd, buf, part, c->offset);
+	    if (n > 0 && (n = write(c->sock, buf, n)) > 0)
+		c->offset += n;
+#endif
+	    if (n == 0) {
+		rfbErr("httpd: file shrank while being sent\n");
+		httpCloseConnection(rfbScreen, c, TRUE);
+		return FALSE;
+	    }
+	}
 
-	    /* For files not ending .vnc, just write out the buffer */
-
-	    if (rfbWriteExact(&cl, buf, n) < 0)
-		break;
+	if (n < 0) {
+#ifdef WIN32
+	    errno=WSAGetLastError();
+#endif
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return TRUE;
+	    if (errno == EINTR)
+		continue;
+	    rfbLogPerror("httpSend: write");
+	    httpCloseConnection(rfbScreen, c, TRUE);
+	    return FALSE;
 	}
+
+	c->lastActive = time(NULL);
+	part = c->headLen - c->headSent;
+	if ((size_t)n < part)
+	    part = n;
+	c->headSent += part;
+	c->bodySent += n - part;
     }
 
-    fclose(fd);
-    httpCloseSock(rfbScreen);
+    c->sending = FALSE;
+    if (c->file) {
+	httpReleaseFile(c->file);
+	c->file = NULL;
+    }
+    free(c->ownBody);
+    c->ownBody = NULL;
+    c->body = NULL;
+    c->fd = -1;
+    c->headLen = c->headSent = c->bodyLen = c->bodySent = 0;
+
+    if (!c->keepAlive) {
+	httpCloseConnection(rfbScreen, c, TRUE);
+	return FALSE;
+    }
+    return TRUE;
 }
 
 
 static rfbBool
-compareAndSkip(char **ptr, const char *str)
+compareAndSkip(const char **ptr, const char *str)
 {
     if (strncmp(*ptr, str, strlen(str)) == 0) {
 	*ptr += strlen(str);
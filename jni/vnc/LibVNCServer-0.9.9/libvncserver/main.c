@@ -16,6 +16,9 @@
 #include <rfb/rfb.h>
 #include <rfb/rfbregion.h>
 #include "private.h"
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+#include "rfbssl.h"
+#endif
 
 #include <stdarg.h>
 #include <errno.h>
@@ -269,6 +272,9 @@ void rfbScheduleCopyRegion(rfbScreenInfoPtr rfbScreen,sraRegionPtr copyRegion,in
    rfbClientIteratorPtr iterator;
    rfbClientPtr cl;
 
+   /* encoded rectangles cached for this frame are stale now */
+   rfbScreen->frameSerial++;
+
    iterator=rfbGetClientIterator(rfbScreen);
    while((cl=rfbClientIteratorNext(iterator))) {
      LOCK(cl->updateMutex);
@@ -305,7 +311,7 @@ void rfbScheduleCopyRegion(rfbScreenInfoPtr rfbScreen,sraRegionPtr copyRegion,in
        sraRgnOr(cl->modifiedRegion,modifiedRegionBackup);
        sraRgnDestroy(modifiedRegionBackup);
 
-       if(!cl->enableCursorShapeUpdates) {
+       if(!cl->enableCursorShapeUpdates && cl->screen->cursor) {
           /*
            * n.b. (dx, dy) is the vector pointing in the direction the
            * copyrect displacement will take place.  copyRegion is the
@@ -401,6 +407,8 @@ void rfbMarkRegionAsModified(rfbScreenInfoPtr screen,sraRegionPtr modRegion)
    rfbClientIteratorPtr iterator;
    rfbClientPtr cl;
 
+   screen->frameSerial++;
+
    iterator=rfbGetClientIterator(screen);
    while((cl=rfbClientIteratorNext(iterator))) {
      LOCK(cl->updateMutex);
@@ -839,6 +847,7 @@ rfbScreenInfoPtr rfbGetScreen(int* argc,char** argv,
    screen->maxFd=0;
    screen->listenSock=-1;
    screen->listen6Sock=-1;
+   screen->epollFd=-1;
 
    screen->httpInitDone=FALSE;
    screen->httpEnableProxyConnect=FALSE;
@@ -1015,6 +1024,11 @@ void rfbScreenCleanup(rfbScreenInfoPtr screen)
     cl1=cl;
   }
   rfbReleaseClientIterator(i);
+  rfbEncodePoolShutdown(screen);
+  rfbEncodeCacheFree(screen);
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+  rfbssl_cleanup(screen);
+#endif
     
 #define FREE_IF(x) if(screen->x) free(screen->x)
   FREE_IF(colourMap.data.bytes);
@@ -1104,7 +1118,8 @@ rfbProcessEvents(rfbScreenInfoPtr screen,long usec)
   i = rfbGetClientIteratorWithClosed(screen);
   cl=rfbClientIteratorHead(i);
   while(cl) {
-    result = rfbUpdateClient(cl);
+    if (rfbUpdateClient(cl))
+      result = TRUE;
     clPrev=cl;
     cl=rfbClientIteratorNext(i);
     if(clPrev->sock==-1) {
@@ -1123,12 +1138,22 @@ rfbUpdateClient(rfbClientPtr cl)
   struct timeval tv;
   rfbBool result=FALSE;
   rfbScreenInfoPtr screen = cl->screen;
+  int due;
+
+  if (cl->outQueue != NULL && rfbOutputQueueStalled(cl))
+      rfbCloseClient(cl);
 
+  /* updates wait while the client's output queue is full */
   if (cl->sock >= 0 && !cl->onHold && FB_UPDATE_PENDING(cl) &&
-        !sraRgnEmpty(cl->requestedRegion)) {
+        !sraRgnEmpty(cl->requestedRegion) &&
+        cl->outQueueBytes <= screen->maxClientQueue) {
       result=TRUE;
       if(screen->deferUpdateTime == 0) {
           rfbSendFramebufferUpdate(cl,cl->modifiedRegion);
+      } else if((due = rfbDeferTimerDue(cl, &cl->deferTimer,
+                                        screen->deferUpdateTime)) >= 0) {
+          if(due)
+            rfbSendFramebufferUpdate(cl,cl->modifiedRegion);
       } else if(cl->startDeferring.tv_usec == 0) {
         gettimeofday(&cl->startDeferring,NULL);
         if(cl->startDeferring.tv_usec == 0)
@@ -1146,7 +1171,15 @@ rfbUpdateClient(rfbClientPtr cl)
     }
 
     if (!cl->viewOnly && cl->lastPtrX >= 0) {
-      if(cl->startPtrDeferring.tv_usec == 0) {
+      if((due = rfbDeferTimerDue(cl, &cl->ptrDeferTimer,
+                                 cl->screen->deferPtrUpdateTime)) >= 0) {
+        if(due) {
+          cl->screen->ptrAddEvent(cl->lastPtrButtons,
+                                  cl->lastPtrX,
+                                  cl->lastPtrY, cl);
+          cl->lastPtrX = -1;
+        }
+      } else if(cl->startPtrDeferring.tv_usec == 0) {
         gettimeofday(&cl->startPtrDeferring,NULL);
         if(cl->startPtrDeferring.tv_usec == 0)
           cl->startPtrDeferring.tv_usec++;
@@ -1166,6 +1199,12 @@ rfbUpdateClient(rfbClientPtr cl)
       }
     }
 
+    /* a file going out is sent on from rfbCheckFds() while the socket
+       takes it, so come back for it without waiting */
+    if (cl->sock >= 0 && cl->fileTransfer.fd != -1 &&
+        cl->fileTransfer.sending && cl->outQueue == NULL)
+      result = TRUE;
+
     return result;
 }
 
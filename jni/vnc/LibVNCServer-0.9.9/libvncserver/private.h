@@ -11,11 +11,192 @@ void rfbRedrawAfterHideCursor(rfbClientPtr cl,sraRegionPtr updateRegion);
 
 rfbClientPtr rfbClientIteratorHead(rfbClientIteratorPtr i);
 
+/* from sockets.c */
+
+#ifdef WIN32
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+#else
+#include <sys/uio.h>
+#endif
+
+int rfbWriteExactV(rfbClientPtr cl, struct iovec *iov, int iovcnt);
+void rfbCorkClient(rfbClientPtr cl, rfbBool cork);
+void rfbEpollAddClient(rfbClientPtr cl);
+void rfbEpollRemoveClient(rfbClientPtr cl);
+int rfbDeferTimerDue(rfbClientPtr cl, rfbDeferTimer *t, int ms);
+
+/* A stretch of output queued for a client, see rfbScreenInfo::maxClientQueue.
+   One holding a whole framebuffer update that may be dropped has the region
+   it covered, until it starts going out. */
+typedef struct _rfbQueuedOutput {
+    struct _rfbQueuedOutput *next;
+    char *data;
+    int len, sent, size;
+    rfbBool isUpdate;
+    sraRegionPtr region;
+    int encoding;
+    int flags;  /* rfbQueuedCursorShape, rfbQueuedCursorPos */
+} rfbQueuedOutput;
+
+#define rfbQueuedCursorShape 1
+#define rfbQueuedCursorPos 2
+
+rfbBool rfbFlushOutputQueue(rfbClientPtr cl);
+rfbBool rfbOutputQueueStalled(rfbClientPtr cl);
+void rfbBeginUpdateOutput(rfbClientPtr cl);
+rfbQueuedOutput *rfbEndUpdateOutput(rfbClientPtr cl);
+void rfbRemoveQueuedOutput(rfbClientPtr cl, rfbQueuedOutput **link);
+void rfbFreeOutputQueue(rfbClientPtr cl);
+
+/* from rfbserver.c */
+
+rfbBool rfbSendUpdateData(rfbClientPtr cl, const char *buf, int len);
+
+/* from encodepool.c */
+
+/* Output captured by rfbSendUpdateBuf() while cl->encodeSink is set: a
+   sequence of records, each an rfbEncodeRecord followed by len bytes. */
+
+#define rfbEncodeRecordRaw (-1)
+
+typedef struct {
+    int kind;   /* rfbEncodeRecordRaw, or an encoder-defined tag */
+    int len;
+} rfbEncodeRecord;
+
+typedef struct _rfbEncodeSink {
+    char *data;
+    int len, size;
+    int last;   /* offset of the last record, -1 if none */
+} rfbEncodeSink;
+
+typedef void (*rfbEncodeJobProcPtr)(void *job, int worker);
+
+rfbBool rfbEncodeSinkAppend(rfbEncodeSink *sink, int kind, const char *data, int len);
+void rfbEncodeSinkReset(rfbEncodeSink *sink);
+void rfbEncodeSinkFree(rfbEncodeSink *sink);
+int rfbEncodePoolSize(rfbScreenInfoPtr screen);
+void rfbEncodePoolRun(rfbScreenInfoPtr screen, rfbEncodeJobProcPtr proc,
+                      void *jobs, size_t jobSize, int nJobs);
+void rfbEncodePoolShutdown(rfbScreenInfoPtr screen);
+
+/* from encodecache.c */
+
+/* What an encoded rectangle depends on besides the pixels themselves. */
+typedef struct {
+    rfbPixelFormat format;
+    char *frameBuffer;
+    int encoding;
+    int settings[4];
+    int x, y, w, h;
+} rfbEncodeKey;
+
+typedef rfbBool (*rfbSendRectProcPtr)(rfbClientPtr cl, int x, int y, int w, int h);
+
+void rfbEncodeKeyInit(rfbEncodeKey *key, rfbClientPtr cl, int encoding,
+                      int x, int y, int w, int h);
+rfbBool rfbEncodeCacheUsable(rfbClientPtr cl);
+rfbBool rfbEncodeCacheLookup(rfbScreenInfoPtr screen, const rfbEncodeKey *key,
+                             rfbEncodeSink *out, int *flags);
+void rfbEncodeCacheStore(rfbScreenInfoPtr screen, const rfbEncodeKey *key,
+                         const rfbEncodeSink *sink, int flags);
+void rfbEncodeCacheFree(rfbScreenInfoPtr screen);
+rfbBool rfbEncodeSinkWrite(rfbClientPtr cl, const rfbEncodeSink *sink);
+rfbBool rfbSendRectEncodingShared(rfbClientPtr cl, int x, int y, int w, int h,
+                                  rfbSendRectProcPtr encode);
+
+/* from translateshift.c */
+
+/* Passed to the shift translators in place of a lookup table. Each of
+   red, green and blue converts as
+
+     v = (pixel >> inShift) & inMax
+     out |= (((v * outMax + bias) * mul) >> (16 + shift)) << outShift
+
+   which rfbInitShiftTranslate() has checked gives the same value as the
+   rounded division the tables are built with. */
+typedef struct {
+    uint32_t inShift[3], inMax[3];
+    uint32_t outMax[3], bias[3];
+    uint32_t mul[3], shift[3];
+    uint32_t outShift[3];
+} rfbShiftTranslateTable;
+
+static inline uint32_t
+rfbShiftTranslatePixel(const rfbShiftTranslateTable *t, uint32_t p)
+{
+    uint32_t out = 0, v;
+    int c;
+
+    for (c = 0; c < 3; c++) {
+        v = (p >> t->inShift[c]) & t->inMax[c];
+        v = ((v * t->outMax[c] + t->bias[c]) * t->mul[c]) >> (16 + t->shift[c]);
+        out |= v << t->outShift[c];
+    }
+    return out;
+}
+
+rfbTranslateFnType rfbInitShiftTranslate(char **table, rfbPixelFormat *in,
+                                         rfbPixelFormat *out,
+                                         const char **kernel);
+
+/* [16 or 32 bpp in][8, 16 or 32 bpp out], from translateshift_neon.c */
+#ifdef LIBVNCSERVER_HAVE_NEON
+extern const rfbTranslateFnType rfbTranslateWithShiftsNEON[2][3];
+rfbBool rfbCpuHasNeon(void);
+#endif
+
+/* from scalebox.c */
+
+/* Passed to the box-filter downscalers. Each of red, green and blue is
+   summed over an areaX by areaY box of source pixels and averaged as
+
+     v = (sum * mul) >> 24           (the C kernels)
+     v = (sum * mul16) >> 16         (the SIMD ones, on 16-bit sums)
+
+   which rfbInitScaleBox() has made sure truncates the same way as the
+   division by areaX * areaY that rfbScaledScreenUpdateRect() used to do. */
+typedef struct {
+    int areaX, areaY;
+    uint32_t shift[3], max[3];
+    uint32_t mul, mul16;
+    /* 32bpp with 8-bit channels: the bytes of a pixel red, green and blue
+       are in; the SIMD kernels average all four and clear the fourth */
+    uint32_t byteMask;
+} rfbScaleBoxTable;
+
+/* the kernels are written once for any box and bpp and instantiated for
+   the common ones, which needs them inlined whatever their size */
+#ifdef __GNUC__
+#define RFB_BOX_INLINE static inline __attribute__((always_inline))
+#else
+#define RFB_BOX_INLINE static inline
+#endif
+
+typedef void (*rfbScaleBoxFnType)(const rfbScaleBoxTable *t,
+                                  unsigned char *dst, int dstStride,
+                                  const unsigned char *src, int srcStride,
+                                  int w, int h);
+
+rfbScaleBoxFnType rfbInitScaleBox(rfbScaleBoxTable *t, rfbPixelFormat *pf,
+                                  int areaX, int areaY, const char **kernel);
+
+/* [16 or 32 bpp], from scalebox_neon.c */
+#ifdef LIBVNCSERVER_HAVE_NEON
+extern const rfbScaleBoxFnType rfbScaleBoxNEON[2];
+#endif
+
 /* from tight.c */
 
 #ifdef LIBVNCSERVER_HAVE_LIBZ
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
 extern void rfbTightCleanup(rfbScreenInfoPtr screen);
+extern rfbBool rfbSendRegionEncodingTight(rfbClientPtr cl, sraRegionPtr region,
+                                          rfbBool shared);
+extern void rfbTightResetStreams(rfbClientPtr cl);
 #endif
 
 /* from zlib.c */
@@ -3,786 +3,566 @@
  *
  * A general purpose region clipping library
  * Only deals with rectangular regions, though.
+ *
+ * A region is kept flat, as an array of bands sorted top to bottom, each
+ * a stretch of rows covered by the same x spans.  The spans of all bands
+ * are in one array of x1, x2 pairs, sorted left to right in each band.
+ * Bands do not overlap, no band is empty, and neighbouring bands with the
+ * same spans are joined, so that a region has one form whatever it was
+ * made from.  Regions and iterators done with are kept for reuse with
+ * their arrays, so that once the regions of a frame have grown to size,
+ * making and combining them again does not go to the allocator.
  */
 
 #include <rfb/rfb.h>
 #include <rfb/rfbregion.h>
-
-/* -=- Internal Span structure */
-
-struct sraRegion;
-
-typedef struct sraSpan {
-  struct sraSpan *_next;
-  struct sraSpan *_prev;
-  int start;
-  int end;
-  struct sraRegion *subspan;
-} sraSpan;
-
-typedef struct sraRegion {
-  sraSpan front;
-  sraSpan back;
-} sraSpanList;
-
-/* -=- Span routines */
-
-sraSpanList *sraSpanListDup(const sraSpanList *src);
-void sraSpanListDestroy(sraSpanList *list);
-
-static sraSpan *
-sraSpanCreate(int start, int end, const sraSpanList *subspan) {
-  sraSpan *item = (sraSpan*)malloc(sizeof(sraSpan));
-  item->_next = item->_prev = NULL;
-  item->start = start;
-  item->end = end;
-  item->subspan = sraSpanListDup(subspan);
-  return item;
-}
-
-static sraSpan *
-sraSpanDup(const sraSpan *src) {
-  sraSpan *span;
-  if (!src) return NULL;
-  span = sraSpanCreate(src->start, src->end, src->subspan);
-  return span;
-}
-
-static void
-sraSpanInsertAfter(sraSpan *newspan, sraSpan *after) {
-  newspan->_next = after->_next;
-  newspan->_prev = after;
-  after->_next->_prev = newspan;
-  after->_next = newspan;
-}
-
-static void
-sraSpanInsertBefore(sraSpan *newspan, sraSpan *before) {
-  newspan->_next = before;
-  newspan->_prev = before->_prev;
-  before->_prev->_next = newspan;
-  before->_prev = newspan;
-}
-
-static void
-sraSpanRemove(sraSpan *span) {
-  span->_prev->_next = span->_next;
-  span->_next->_prev = span->_prev;
-}
-
-static void
-sraSpanDestroy(sraSpan *span) {
-  if (span->subspan) sraSpanListDestroy(span->subspan);
-  free(span);
-}
-
-#ifdef DEBUG
-static void
-sraSpanCheck(const sraSpan *span, const char *text) {
-  /* Check the span is valid! */
-  if (span->start == span->end) {
-    printf(text); 
-    printf(":%d-%d\n", span->start, span->end);
-  }
-}
+#include <limits.h>
+
+/* -=- Internal band structure */
+
+typedef struct sraBand {
+  int y1;
+  int y2;
+  int first;			/* index of its first span in xs */
+  int count;			/* how many spans it has */
+} sraBand;
+
+struct sraRegion {
+  sraBand *bands;
+  int nBands, bandsSize;
+  int *xs;			/* x1 and x2 of each span */
+  int nSpans, spansSize;
+  struct sraRegion *nextFree;
+};
+
+#define SRA_OR 0
+#define SRA_AND 1
+#define SRA_SUBTRACT 2
+
+/* -=- Pool of regions and iterators done with */
+
+/* how many of each are kept, and the most spans one may keep room for */
+#define SRA_POOL_MAX 64
+#define SRA_POOL_MAX_SPANS 4096
+
+static sraRegion *freeRegions;
+static sraRectangleIterator *freeIterators;
+static int nFreeRegions, nFreeIterators;
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+static MUTEX(sraPoolMutex) = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
-/* -=- SpanList routines */
-
-static void sraSpanPrint(const sraSpan *s);
-
-static void
-sraSpanListPrint(const sraSpanList *l) {
-  sraSpan *curr;
-  if (!l) {
-	  printf("NULL");
-	  return;
-  }
-  curr = l->front._next;
-  printf("[");
-  while (curr != &(l->back)) {
-    sraSpanPrint(curr);
-    curr = curr->_next;
-  }
-  printf("]");
-}
-
-void
-sraSpanPrint(const sraSpan *s) {
-  printf("(%d-%d)", (s->start), (s->end));
-  if (s->subspan)
-    sraSpanListPrint(s->subspan);
-}
-
-static sraSpanList *
-sraSpanListCreate(void) {
-  sraSpanList *item = (sraSpanList*)malloc(sizeof(sraSpanList));
-  item->front._next = &(item->back);
-  item->front._prev = NULL;
-  item->back._prev = &(item->front);
-  item->back._next = NULL;
-  return item;
-}
-
-sraSpanList *
-sraSpanListDup(const sraSpanList *src) {
-  sraSpanList *newlist;
-  sraSpan *newspan, *curr;
-
-  if (!src) return NULL;
-  newlist = sraSpanListCreate();
-  curr = src->front._next;
-  while (curr != &(src->back)) {
-    newspan = sraSpanDup(curr);
-    sraSpanInsertBefore(newspan, &(newlist->back));
-    curr = curr->_next;
-  }
-
-  return newlist;
-}
+static sraRegion *
+sraRegionAlloc(void) {
+  sraRegion *rgn;
 
-void
-sraSpanListDestroy(sraSpanList *list) {
-  sraSpan *curr, *next;
-  while (list->front._next != &(list->back)) {
-    curr = list->front._next;
-    next = curr->_next;
-    sraSpanRemove(curr);
-    sraSpanDestroy(curr);
-    curr = next;
+  LOCK(sraPoolMutex);
+  if ((rgn = freeRegions) != NULL) {
+    freeRegions = rgn->nextFree;
+    nFreeRegions--;
   }
-  free(list);
+  UNLOCK(sraPoolMutex);
+  if (rgn == NULL)
+    rgn = (sraRegion*)calloc(1, sizeof(sraRegion));
+  else
+    rgn->nBands = rgn->nSpans = 0;
+  return rgn;
 }
 
 static void
-sraSpanListMakeEmpty(sraSpanList *list) {
-  sraSpan *curr, *next;
-  while (list->front._next != &(list->back)) {
-    curr = list->front._next;
-    next = curr->_next;
-    sraSpanRemove(curr);
-    sraSpanDestroy(curr);
-    curr = next;
+sraRegionFree(sraRegion *rgn) {
+  if (rgn->spansSize <= SRA_POOL_MAX_SPANS) {
+    LOCK(sraPoolMutex);
+    if (nFreeRegions < SRA_POOL_MAX) {
+      rgn->nextFree = freeRegions;
+      freeRegions = rgn;
+      nFreeRegions++;
+      rgn = NULL;
+    }
+    UNLOCK(sraPoolMutex);
+    if (rgn == NULL)
+      return;
   }
-  list->front._next = &(list->back);
-  list->front._prev = NULL;
-  list->back._prev = &(list->front);
-  list->back._next = NULL;
+  free(rgn->bands);
+  free(rgn->xs);
+  free(rgn);
 }
 
+/* Makes room for nBands bands and nSpans spans in all; FALSE if there is
+   not the memory for them. */
 static rfbBool
-sraSpanListEqual(const sraSpanList *s1, const sraSpanList *s2) {
-  sraSpan *sp1, *sp2;
-
-  if (!s1) {
-    if (!s2) {
-      return 1;
-    } else {
-      rfbErr("sraSpanListEqual:incompatible spans (only one NULL!)\n");
+sraRegionReserve(sraRegion *rgn, int nBands, int nSpans) {
+  int size;
+
+  if (nBands > rgn->bandsSize) {
+    sraBand *bands;
+    for (size = rgn->bandsSize ? rgn->bandsSize * 2 : 4; size < nBands; size *= 2)
+      ;
+    if ((bands = (sraBand*)realloc(rgn->bands, size * sizeof(sraBand))) == NULL) {
+      rfbErr("sraRegionReserve: no memory for %d bands\n", size);
       return FALSE;
     }
+    rgn->bands = bands;
+    rgn->bandsSize = size;
   }
-
-  sp1 = s1->front._next;
-  sp2 = s2->front._next;
-  while ((sp1 != &(s1->back)) &&
-	 (sp2 != &(s2->back))) {
-    if ((sp1->start != sp2->start) ||
-	(sp1->end != sp2->end) ||
-	(!sraSpanListEqual(sp1->subspan, sp2->subspan))) {
-      return 0;
+  if (nSpans > rgn->spansSize) {
+    int *xs;
+    for (size = rgn->spansSize ? rgn->spansSize * 2 : 8; size < nSpans; size *= 2)
+      ;
+    if ((xs = (int*)realloc(rgn->xs, size * 2 * sizeof(int))) == NULL) {
+      rfbErr("sraRegionReserve: no memory for %d spans\n", size);
+      return FALSE;
     }
-    sp1 = sp1->_next;
-    sp2 = sp2->_next;
+    rgn->xs = xs;
+    rgn->spansSize = size;
   }
-
-  if ((sp1 == &(s1->back)) && (sp2 == &(s2->back))) {
-    return 1;
-  } else {
-    return 0;
-  }    
+  return TRUE;
 }
 
-static rfbBool
-sraSpanListEmpty(const sraSpanList *list) {
-  return (list->front._next == &(list->back));
-}
+/* -=- Band routines */
 
-static unsigned long
-sraSpanListCount(const sraSpanList *list) {
-  sraSpan *curr = list->front._next;
-  unsigned long count = 0;
-  while (curr != &(list->back)) {
-    if (curr->subspan) {
-      count += sraSpanListCount(curr->subspan);
-    } else {
-      count += 1;
-    }
-    curr = curr->_next;
+/* Makes the count spans last added to rgn's xs a band from y1 to y2, or
+   adds the rows to the band before when that has the same spans. */
+static void
+sraBandAppend(sraRegion *rgn, int y1, int y2, int count) {
+  int first = rgn->nSpans - count;
+  sraBand *prev = rgn->nBands ? &rgn->bands[rgn->nBands - 1] : NULL;
+
+  if (count == 0)
+    return;
+  if (prev && prev->y2 == y1 && prev->count == count &&
+      memcmp(rgn->xs + 2 * prev->first, rgn->xs + 2 * first,
+	     2 * count * sizeof(int)) == 0) {
+    prev->y2 = y2;
+    rgn->nSpans = first;
+    return;
   }
-  return count;
+  rgn->bands[rgn->nBands].y1 = y1;
+  rgn->bands[rgn->nBands].y2 = y2;
+  rgn->bands[rgn->nBands].first = first;
+  rgn->bands[rgn->nBands].count = count;
+  rgn->nBands++;
 }
 
+/* Takes band b and its spans out of rgn. */
 static void
-sraSpanMergePrevious(sraSpan *dest) {
-  sraSpan *prev = dest->_prev;
- 
-  while ((prev->_prev) &&
-	 (prev->end == dest->start) &&
-	 (sraSpanListEqual(prev->subspan, dest->subspan))) {
-    /*
-    printf("merge_prev:");
-    sraSpanPrint(prev);
-    printf(" & ");
-    sraSpanPrint(dest);
-    printf("\n");
-    */
-    dest->start = prev->start;
-    sraSpanRemove(prev);
-    sraSpanDestroy(prev);
-    prev = dest->_prev;
-  }
-}    
+sraBandRemove(sraRegion *rgn, int b) {
+  sraBand *band = &rgn->bands[b];
+  int i, count = band->count;
 
-static void
-sraSpanMergeNext(sraSpan *dest) {
-  sraSpan *next = dest->_next;
-  while ((next->_next) &&
-	 (next->start == dest->end) &&
-	 (sraSpanListEqual(next->subspan, dest->subspan))) {
-/*
-	  printf("merge_next:");
-    sraSpanPrint(dest);
-    printf(" & ");
-    sraSpanPrint(next);
-    printf("\n");
-	*/
-    dest->end = next->end;
-    sraSpanRemove(next);
-    sraSpanDestroy(next);
-    next = dest->_next;
-  }
+  memmove(rgn->xs + 2 * band->first, rgn->xs + 2 * (band->first + count),
+	  2 * (rgn->nSpans - band->first - count) * sizeof(int));
+  rgn->nSpans -= count;
+  for (i = b + 1; i < rgn->nBands; i++)
+    rgn->bands[i].first -= count;
+  memmove(band, band + 1, (rgn->nBands - b - 1) * sizeof(sraBand));
+  rgn->nBands--;
 }
 
-static void
-sraSpanListOr(sraSpanList *dest, const sraSpanList *src) {
-  sraSpan *d_curr, *s_curr;
-  int s_start, s_end;
+/* Adds count bands of from, starting at band b, to the end of rgn. */
+static rfbBool
+sraBandsCopy(sraRegion *rgn, const sraRegion *from, int b, int count) {
+  const sraBand *f = from->bands + b;
+  int n = f[count - 1].first + f[count - 1].count - f[0].first, i, shift;
 
-  if (!dest) {
-    if (!src) {
-      return;
-    } else {
-      rfbErr("sraSpanListOr:incompatible spans (only one NULL!)\n");
-      return;
-    }
+  if (!sraRegionReserve(rgn, rgn->nBands + count, rgn->nSpans + n))
+    return FALSE;
+  /* - The first may go on the band before; the others are as in from */
+  memcpy(rgn->xs + 2 * rgn->nSpans, from->xs + 2 * f[0].first,
+	 2 * f[0].count * sizeof(int));
+  rgn->nSpans += f[0].count;
+  sraBandAppend(rgn, f[0].y1, f[0].y2, f[0].count);
+  if (count == 1)
+    return TRUE;
+  n -= f[0].count;
+  memcpy(rgn->xs + 2 * rgn->nSpans, from->xs + 2 * f[1].first,
+	 2 * n * sizeof(int));
+  shift = rgn->nSpans - f[1].first;
+  for (i = 1; i < count; i++) {
+    rgn->bands[rgn->nBands] = f[i];
+    rgn->bands[rgn->nBands++].first += shift;
+  }
+  rgn->nSpans += n;
+  return TRUE;
+}
+
+/* Adds to rgn's xs the spans that are in a or b (SRA_OR), in both
+   (SRA_AND), or in a but not b (SRA_SUBTRACT), going along the edges of
+   both.  Room must have been made for na + nb more spans.  Returns how many
+   spans were added. */
+static int
+sraSpansOp(sraRegion *rgn, const int *a, int na, const int *b, int nb, int op) {
+  int *out = rgn->xs + 2 * rgn->nSpans;
+  int ia = 0, ib = 0, inA = 0, inB = 0, in, was = 0, x, n = 0;
+
+  /* - Rows only one of them covers keep its spans as they are */
+  if (nb == 0 || na == 0) {
+    if (op == SRA_AND || (na == 0 && op == SRA_SUBTRACT))
+      return 0;
+    n = na ? na : nb;
+    memcpy(out, na ? a : b, 2 * n * sizeof(int));
+    rgn->nSpans += n;
+    return n;
   }
 
-  d_curr = dest->front._next;
-  s_curr = src->front._next;
-  s_start = s_curr->start;
-  s_end = s_curr->end;
-  while (s_curr != &(src->back)) {
-
-    /* - If we are at end of destination list OR
-       If the new span comes before the next destination one */
-    if ((d_curr == &(dest->back)) ||
-		(d_curr->start >= s_end)) {
-      /* - Add the span */
-      sraSpanInsertBefore(sraSpanCreate(s_start, s_end,
-					s_curr->subspan),
-			  d_curr);
-      if (d_curr != &(dest->back))
-	sraSpanMergePrevious(d_curr);
-      s_curr = s_curr->_next;
-      s_start = s_curr->start;
-      s_end = s_curr->end;
-    } else {
-
-      /* - If the new span overlaps the existing one */
-      if ((s_start < d_curr->end) &&
-	  (s_end > d_curr->start)) {
-
-	/* - Insert new span before the existing destination one? */
-	if (s_start < d_curr->start) {
-	  sraSpanInsertBefore(sraSpanCreate(s_start,
-					    d_curr->start,
-					    s_curr->subspan),
-			      d_curr);
-	  sraSpanMergePrevious(d_curr);
-	}
-
-	/* Split the existing span if necessary */
-	if (s_end < d_curr->end) {
-	  sraSpanInsertAfter(sraSpanCreate(s_end,
-					   d_curr->end,
-					   d_curr->subspan),
-			     d_curr);
-	  d_curr->end = s_end;
-	}
-	if (s_start > d_curr->start) {
-	  sraSpanInsertBefore(sraSpanCreate(d_curr->start,
-					    s_start,
-					    d_curr->subspan),
-			      d_curr);
-	  d_curr->start = s_start;
-	}
-
-	/* Recursively OR subspans */
-	sraSpanListOr(d_curr->subspan, s_curr->subspan);
-
-	/* Merge this span with previous or next? */
-	if (d_curr->_prev != &(dest->front))
-	  sraSpanMergePrevious(d_curr);
-	if (d_curr->_next != &(dest->back))
-	  sraSpanMergeNext(d_curr);
-
-	/* Move onto the next pair to compare */
-	if (s_end > d_curr->end) {
-	  s_start = d_curr->end;
-	  d_curr = d_curr->_next;
-	} else {
-	  s_curr = s_curr->_next;
-	  s_start = s_curr->start;
-	  s_end = s_curr->end;
-	}
-      } else {
-	/* - No overlap.  Move to the next destination span */
-	d_curr = d_curr->_next;
-      }
-    }
+  na *= 2;
+  nb *= 2;
+  while (ia < na || ib < nb) {
+    if (ib >= nb || (ia < na && a[ia] < b[ib]))
+      x = a[ia];
+    else
+      x = b[ib];
+    /* even edges start spans and odd ones end them */
+    while (ia < na && a[ia] == x)
+      inA = !(ia++ & 1);
+    while (ib < nb && b[ib] == x)
+      inB = !(ib++ & 1);
+
+    in = op == SRA_OR ? (inA || inB) :
+	 op == SRA_AND ? (inA && inB) : (inA && !inB);
+    if (in && !was)
+      out[2 * n] = x;
+    else if (!in && was)
+      out[2 * n++ + 1] = x;
+    was = in;
   }
+  rgn->nSpans += n;
+  return n;
 }
 
-static rfbBool
-sraSpanListAnd(sraSpanList *dest, const sraSpanList *src) {
-  sraSpan *d_curr, *s_curr, *d_next;
-
-  if (!dest) {
-    if (!src) {
-      return 1;
-    } else {
-      rfbErr("sraSpanListAnd:incompatible spans (only one NULL!)\n");
-      return FALSE;
-    }
+/* Replaces dst with the result of op on dst and src, going down the bands
+   of both. */
+static void
+sraRegionOp(sraRegion *dst, const sraRegion *src, int op) {
+  sraRegion *rgn, swap;
+  const sraBand *a = dst->bands, *b = src->bands;
+  int na = dst->nBands, nb = src->nBands, ia = 0, ib = 0;
+  int y, y2, inA, inB, n;
+
+  if ((rgn = sraRegionAlloc()) == NULL) {
+    rfbErr("sraRegionOp: no memory\n");
+    return;
   }
 
-  d_curr = dest->front._next;
-  s_curr = src->front._next;
-  while ((s_curr != &(src->back)) && (d_curr != &(dest->back))) {
-
-    /* - If we haven't reached a destination span yet then move on */
-    if (d_curr->start >= s_curr->end) {
-      s_curr = s_curr->_next;
-      continue;
-    }
-
-    /* - If we are beyond the current destination span then remove it */
-    if (d_curr->end <= s_curr->start) {
-      sraSpan *next = d_curr->_next;
-      sraSpanRemove(d_curr);
-      sraSpanDestroy(d_curr);
-      d_curr = next;
-      continue;
-    }
-
-    /* - If we partially overlap a span then split it up or remove bits */
-    if (s_curr->start > d_curr->start) {
-      /* - The top bit of the span does not match */
-      d_curr->start = s_curr->start;
-    }
-    if (s_curr->end < d_curr->end) {
-      /* - The end of the span does not match */
-      sraSpanInsertAfter(sraSpanCreate(s_curr->end,
-				       d_curr->end,
-				       d_curr->subspan),
-			 d_curr);
-      d_curr->end = s_curr->end;
+  y = na && (!nb || a[0].y1 < b[0].y1) ? a[0].y1 : nb ? b[0].y1 : 0;
+  while (ia < na || ib < nb) {
+    inA = ia < na && a[ia].y1 <= y;
+    inB = ib < nb && b[ib].y1 <= y;
+
+    /* - Whole bands only one of them has, down to where the other starts,
+         go in as they are */
+    if (inA != inB && (op == SRA_OR || (inA && op == SRA_SUBTRACT)) &&
+	y == (inA ? a[ia].y1 : b[ib].y1)) {
+      const sraBand *f = inA ? a + ia : b + ib;
+      int nf = inA ? na - ia : nb - ib, k;
+      int limit = inA ? (ib < nb ? b[ib].y1 : INT_MAX) :
+			(ia < na ? a[ia].y1 : INT_MAX);
+      for (k = 0; k < nf && f[k].y2 <= limit; k++)
+	;
+      if (k > 0) {
+	if (!sraBandsCopy(rgn, inA ? dst : src, inA ? ia : ib, k))
+	  break;
+	y = f[k - 1].y2;
+	if (inA)
+	  ia += k;
+	else
+	  ib += k;
+	if ((ia >= na || a[ia].y1 > y) && (ib >= nb || b[ib].y1 > y))
+	  y = ia < na && (ib >= nb || a[ia].y1 < b[ib].y1) ? a[ia].y1 :
+	      ib < nb ? b[ib].y1 : y;
+	continue;
+      }
     }
 
-    /* - Now recursively process the affected span */
-    if (!sraSpanListAnd(d_curr->subspan, s_curr->subspan)) {
-      /* - The destination subspan is now empty, so we should remove it */
-		sraSpan *next = d_curr->_next;
-      sraSpanRemove(d_curr);
-      sraSpanDestroy(d_curr);
-      d_curr = next;
-    } else {
-      /* Merge this span with previous or next? */
-      if (d_curr->_prev != &(dest->front))
-	sraSpanMergePrevious(d_curr);
-
-      /* - Move on to the next span */
-      d_next = d_curr;
-      if (s_curr->end >= d_curr->end) {
-	d_next = d_curr->_next;
-      }
-      if (s_curr->end <= d_curr->end) {
-	s_curr = s_curr->_next;
-      }
-      d_curr = d_next;
+    /* the rows down to where either region changes */
+    y2 = inA ? a[ia].y2 : ia < na ? a[ia].y1 : INT_MAX;
+    if (inB ? b[ib].y2 < y2 : (ib < nb && b[ib].y1 < y2))
+      y2 = inB ? b[ib].y2 : b[ib].y1;
+
+    if ((inA || (inB && op == SRA_OR)) && (inB || op != SRA_AND)) {
+      if (!sraRegionReserve(rgn, rgn->nBands + 1,
+			    rgn->nSpans + (inA ? a[ia].count : 0) +
+			    (inB ? b[ib].count : 0)))
+	break;
+      n = sraSpansOp(rgn,
+		     inA ? dst->xs + 2 * a[ia].first : NULL, inA ? a[ia].count : 0,
+		     inB ? src->xs + 2 * b[ib].first : NULL, inB ? b[ib].count : 0,
+		     op);
+      sraBandAppend(rgn, y, y2, n);
     }
-  }
 
-  while (d_curr != &(dest->back)) {
-    sraSpan *next = d_curr->_next;
-    sraSpanRemove(d_curr);
-    sraSpanDestroy(d_curr);
-    d_curr=next;
+    y = y2;
+    while (ia < na && a[ia].y2 <= y)
+      ia++;
+    while (ib < nb && b[ib].y2 <= y)
+      ib++;
+    /* skip rows neither covers */
+    if ((ia >= na || a[ia].y1 > y) && (ib >= nb || b[ib].y1 > y))
+      y = ia < na && (ib >= nb || a[ia].y1 < b[ib].y1) ? a[ia].y1 :
+	  ib < nb ? b[ib].y1 : y;
   }
 
-  return !sraSpanListEmpty(dest);
+  swap = *dst;
+  *dst = *rgn;
+  *rgn = swap;
+  dst->nextFree = rgn->nextFree = NULL;
+  sraRegionFree(rgn);
 }
 
-static rfbBool
-sraSpanListSubtract(sraSpanList *dest, const sraSpanList *src) {
-  sraSpan *d_curr, *s_curr;
-
-  if (!dest) {
-    if (!src) {
-      return 1;
-    } else {
-      rfbErr("sraSpanListSubtract:incompatible spans (only one NULL!)\n");
-      return FALSE;
-    }
-  }
-
-  d_curr = dest->front._next;
-  s_curr = src->front._next;
-  while ((s_curr != &(src->back)) && (d_curr != &(dest->back))) {
-
-    /* - If we haven't reached a destination span yet then move on */
-    if (d_curr->start >= s_curr->end) {
-      s_curr = s_curr->_next;
-      continue;
-    }
-
-    /* - If we are beyond the current destination span then skip it */
-    if (d_curr->end <= s_curr->start) {
-      d_curr = d_curr->_next;
-      continue;
-    }
-
-    /* - If we partially overlap the current span then split it up */
-    if (s_curr->start > d_curr->start) {
-      sraSpanInsertBefore(sraSpanCreate(d_curr->start,
-					s_curr->start,
-					d_curr->subspan),
-			  d_curr);
-      d_curr->start = s_curr->start;
-    }
-    if (s_curr->end < d_curr->end) {
-      sraSpanInsertAfter(sraSpanCreate(s_curr->end,
-				       d_curr->end,
-				       d_curr->subspan),
-			 d_curr);
-      d_curr->end = s_curr->end;
-    }
+static void
+sraSpanListPrint(const sraRegion *rgn) {
+  int i, j;
 
-    /* - Now recursively process the affected span */
-    if ((!d_curr->subspan) || !sraSpanListSubtract(d_curr->subspan, s_curr->subspan)) {
-      /* - The destination subspan is now empty, so we should remove it */
-      sraSpan *next = d_curr->_next;
-      sraSpanRemove(d_curr);
-      sraSpanDestroy(d_curr);
-      d_curr = next;
-    } else {
-      /* Merge this span with previous or next? */
-      if (d_curr->_prev != &(dest->front))
-	sraSpanMergePrevious(d_curr);
-      if (d_curr->_next != &(dest->back))
-	sraSpanMergeNext(d_curr);
-
-      /* - Move on to the next span */
-      if (s_curr->end > d_curr->end) {
-	d_curr = d_curr->_next;
-      } else {
-	s_curr = s_curr->_next;
-      }
-    }
+  if (!rgn) {
+    printf("NULL");
+    return;
   }
-
-  return !sraSpanListEmpty(dest);
+  printf("[");
+  for (i = 0; i < rgn->nBands; i++) {
+    printf("(%d-%d)[", rgn->bands[i].y1, rgn->bands[i].y2);
+    for (j = rgn->bands[i].first; j < rgn->bands[i].first + rgn->bands[i].count; j++)
+      printf("(%d-%d)", rgn->xs[2 * j], rgn->xs[2 * j + 1]);
+    printf("]");
+  }
+  printf("]");
 }
 
 /* -=- Region routines */
 
 sraRegion *
 sraRgnCreate(void) {
-  return (sraRegion*)sraSpanListCreate();
+  return sraRegionAlloc();
 }
 
 sraRegion *
 sraRgnCreateRect(int x1, int y1, int x2, int y2) {
-  sraSpanList *vlist, *hlist;
-  sraSpan *vspan, *hspan;
-
-  /* - Build the horizontal portion of the span */
-  hlist = sraSpanListCreate();
-  hspan = sraSpanCreate(x1, x2, NULL);
-  sraSpanInsertAfter(hspan, &(hlist->front));
+  sraRegion *rgn = sraRegionAlloc();
 
-  /* - Build the vertical portion of the span */
-  vlist = sraSpanListCreate();
-  vspan = sraSpanCreate(y1, y2, hlist);
-  sraSpanInsertAfter(vspan, &(vlist->front));
-
-  sraSpanListDestroy(hlist);
-
-  return (sraRegion*)vlist;
+  /* - A rectangle with no area makes an empty region */
+  if (rgn == NULL || x1 >= x2 || y1 >= y2 || !sraRegionReserve(rgn, 1, 1))
+    return rgn;
+  rgn->xs[0] = x1;
+  rgn->xs[1] = x2;
+  rgn->nSpans = 1;
+  sraBandAppend(rgn, y1, y2, 1);
+  return rgn;
 }
 
 sraRegion *
 sraRgnCreateRgn(const sraRegion *src) {
-  return (sraRegion*)sraSpanListDup((sraSpanList*)src);
+  sraRegion *rgn = sraRegionAlloc();
+
+  if (rgn == NULL || !src || !sraRegionReserve(rgn, src->nBands, src->nSpans))
+    return rgn;
+  memcpy(rgn->bands, src->bands, src->nBands * sizeof(sraBand));
+  memcpy(rgn->xs, src->xs, 2 * src->nSpans * sizeof(int));
+  rgn->nBands = src->nBands;
+  rgn->nSpans = src->nSpans;
+  return rgn;
 }
 
 void
 sraRgnDestroy(sraRegion *rgn) {
-  sraSpanListDestroy((sraSpanList*)rgn);
+  if (rgn)
+    sraRegionFree(rgn);
 }
 
 void
 sraRgnMakeEmpty(sraRegion *rgn) {
-  sraSpanListMakeEmpty((sraSpanList*)rgn);
+  rgn->nBands = rgn->nSpans = 0;
 }
 
 /* -=- Boolean Region ops */
 
 rfbBool
 sraRgnAnd(sraRegion *dst, const sraRegion *src) {
-  return sraSpanListAnd((sraSpanList*)dst, (sraSpanList*)src);
+  if (dst->nBands == 0 || src->nBands == 0) {
+    sraRgnMakeEmpty(dst);
+    return FALSE;
+  }
+  sraRegionOp(dst, src, SRA_AND);
+  return dst->nBands > 0;
 }
 
 void
 sraRgnOr(sraRegion *dst, const sraRegion *src) {
-  sraSpanListOr((sraSpanList*)dst, (sraSpanList*)src);
+  if (src->nBands == 0)
+    return;
+  sraRegionOp(dst, src, SRA_OR);
 }
 
 rfbBool
 sraRgnSubtract(sraRegion *dst, const sraRegion *src) {
-  return sraSpanListSubtract((sraSpanList*)dst, (sraSpanList*)src);
+  if (dst->nBands > 0 && src->nBands > 0)
+    sraRegionOp(dst, src, SRA_SUBTRACT);
+  return dst->nBands > 0;
 }
 
 void
 sraRgnOffset(sraRegion *dst, int dx, int dy) {
-  sraSpan *vcurr, *hcurr;
-
-  vcurr = ((sraSpanList*)dst)->front._next;
-  while (vcurr != &(((sraSpanList*)dst)->back)) {
-    vcurr->start += dy;
-    vcurr->end += dy;
-    
-    hcurr = vcurr->subspan->front._next;
-    while (hcurr != &(vcurr->subspan->back)) {
-      hcurr->start += dx;
-      hcurr->end += dx;
-      hcurr = hcurr->_next;
-    }
+  int i;
 
-    vcurr = vcurr->_next;
+  for (i = 0; i < dst->nBands; i++) {
+    dst->bands[i].y1 += dy;
+    dst->bands[i].y2 += dy;
   }
+  for (i = 0; i < 2 * dst->nSpans; i++)
+    dst->xs[i] += dx;
 }
 
 sraRegion *sraRgnBBox(const sraRegion *src) {
-  int xmin=((unsigned int)(int)-1)>>1,ymin=xmin,xmax=1-xmin,ymax=xmax;
-  sraSpan *vcurr, *hcurr;
+  int xmin, xmax, i;
+  const sraBand *band;
 
-  if(!src)
+  if(!src || src->nBands == 0)
     return sraRgnCreate();
 
-  vcurr = ((sraSpanList*)src)->front._next;
-  while (vcurr != &(((sraSpanList*)src)->back)) {
-    if(vcurr->start<ymin)
-      ymin=vcurr->start;
-    if(vcurr->end>ymax)
-      ymax=vcurr->end;
-    
-    hcurr = vcurr->subspan->front._next;
-    while (hcurr != &(vcurr->subspan->back)) {
-      if(hcurr->start<xmin)
-	xmin=hcurr->start;
-      if(hcurr->end>xmax)
-	xmax=hcurr->end;
-      hcurr = hcurr->_next;
-    }
-
-    vcurr = vcurr->_next;
+  xmin = src->xs[2 * src->bands[0].first];
+  xmax = src->xs[2 * (src->bands[0].first + src->bands[0].count) - 1];
+  for (i = 1; i < src->nBands; i++) {
+    band = &src->bands[i];
+    if (src->xs[2 * band->first] < xmin)
+      xmin = src->xs[2 * band->first];
+    if (src->xs[2 * (band->first + band->count) - 1] > xmax)
+      xmax = src->xs[2 * (band->first + band->count) - 1];
   }
 
-  if(xmax<xmin || ymax<ymin)
-    return sraRgnCreate();
-
-  return sraRgnCreateRect(xmin,ymin,xmax,ymax);
+  return sraRgnCreateRect(xmin, src->bands[0].y1,
+			  xmax, src->bands[src->nBands - 1].y2);
 }
 
 rfbBool
 sraRgnPopRect(sraRegion *rgn, sraRect *rect, unsigned long flags) {
-  sraSpan *vcurr, *hcurr;
-  sraSpan *vend, *hend;
   rfbBool right2left = (flags & 2) == 2;
   rfbBool bottom2top = (flags & 1) == 1;
+  sraBand *band;
+  int i, b, span;
+
+  if (rgn->nBands == 0)
+    return 0;
 
   /* - Pick correct order */
-  if (bottom2top) {
-    vcurr = ((sraSpanList*)rgn)->back._prev;
-    vend = &(((sraSpanList*)rgn)->front);
-  } else {
-    vcurr = ((sraSpanList*)rgn)->front._next;
-    vend = &(((sraSpanList*)rgn)->back);
+  band = &rgn->bands[bottom2top ? rgn->nBands - 1 : 0];
+  span = right2left ? band->first + band->count - 1 : band->first;
+
+  rect->y1 = band->y1;
+  rect->y2 = band->y2;
+  rect->x1 = rgn->xs[2 * span];
+  rect->x2 = rgn->xs[2 * span + 1];
+
+  /* - Take the span out, and the band when it was its last */
+  memmove(rgn->xs + 2 * span, rgn->xs + 2 * span + 2,
+	  2 * (rgn->nSpans - span - 1) * sizeof(int));
+  rgn->nSpans--;
+  band->count--;
+  for (i = band - rgn->bands + 1; i < rgn->nBands; i++)
+    rgn->bands[i].first--;
+  if (band->count == 0) {
+    sraBandRemove(rgn, band - rgn->bands);
+    return 1;
   }
 
-  if (vcurr != vend) {
-    rect->y1 = vcurr->start;
-    rect->y2 = vcurr->end;
-
-    /* - Pick correct order */
-    if (right2left) {
-      hcurr = vcurr->subspan->back._prev;
-      hend = &(vcurr->subspan->front);
-    } else {
-      hcurr = vcurr->subspan->front._next;
-      hend = &(vcurr->subspan->back);
-    }
-
-    if (hcurr != hend) {
-      rect->x1 = hcurr->start;
-      rect->x2 = hcurr->end;
-
-      sraSpanRemove(hcurr);
-      sraSpanDestroy(hcurr);
-      
-      if (sraSpanListEmpty(vcurr->subspan)) {
-	sraSpanRemove(vcurr);
-	sraSpanDestroy(vcurr);
-      }
-
-#if 0
-      printf("poprect:(%dx%d)-(%dx%d)\n",
-	     rect->x1, rect->y1, rect->x2, rect->y2);
-#endif
-      return 1;
+  /* - What is left of the band may now be the band next to it */
+  b = band - rgn->bands;
+  if (bottom2top ? b > 0 : b < rgn->nBands - 1) {
+    sraBand *upper = &rgn->bands[bottom2top ? b - 1 : b];
+    sraBand *lower = upper + 1;
+    if (upper->y2 == lower->y1 && upper->count == lower->count &&
+	memcmp(rgn->xs + 2 * upper->first, rgn->xs + 2 * lower->first,
+	       2 * upper->count * sizeof(int)) == 0) {
+      upper->y2 = lower->y2;
+      sraBandRemove(rgn, lower - rgn->bands);
     }
   }
-
-  return 0;
+  return 1;
 }
 
 unsigned long
 sraRgnCountRects(const sraRegion *rgn) {
-  unsigned long count = sraSpanListCount((sraSpanList*)rgn);
-  return count;
+  return rgn->nSpans;
 }
 
 rfbBool
 sraRgnEmpty(const sraRegion *rgn) {
-  return sraSpanListEmpty((sraSpanList*)rgn);
+  return rgn->nBands == 0;
 }
 
 /* iterator stuff */
 sraRectangleIterator *sraRgnGetIterator(sraRegion *s)
 {
-  /* these values have to be multiples of 4 */
-#define DEFSIZE 4
-#define DEFSTEP 8
-  sraRectangleIterator *i =
-    (sraRectangleIterator*)malloc(sizeof(sraRectangleIterator));
-  if(!i)
-    return NULL;
+  sraRectangleIterator *i;
 
-  /* we have to recurse eventually. So, the first sPtr is the pointer to
-     the sraSpan in the first level. the second sPtr is the pointer to
-     the sraRegion.back. The third and fourth sPtr are for the second
-     recursion level and so on. */
-  i->sPtrs = (sraSpan**)malloc(sizeof(sraSpan*)*DEFSIZE);
-  if(!i->sPtrs) {
-    free(i);
-    return NULL;
+  LOCK(sraPoolMutex);
+  if ((i = freeIterators) != NULL) {
+    freeIterators = i->nextFree;
+    nFreeIterators--;
   }
-  i->ptrSize = DEFSIZE;
-  i->sPtrs[0] = &(s->front);
-  i->sPtrs[1] = &(s->back);
-  i->ptrPos = 0;
+  UNLOCK(sraPoolMutex);
+  if (i == NULL &&
+      (i = (sraRectangleIterator*)malloc(sizeof(sraRectangleIterator))) == NULL)
+    return NULL;
+
+  i->region = s;
+  i->band = 0;
+  i->span = 0;
   i->reverseX = 0;
   i->reverseY = 0;
+  i->nextFree = NULL;
   return i;
 }
 
 sraRectangleIterator *sraRgnGetReverseIterator(sraRegion *s,rfbBool reverseX,rfbBool reverseY)
 {
   sraRectangleIterator *i = sraRgnGetIterator(s);
-  if(reverseY) {
-    i->sPtrs[1] = &(s->front);
-    i->sPtrs[0] = &(s->back);
-  }
+  if(!i)
+    return NULL;
   i->reverseX = reverseX;
   i->reverseY = reverseY;
   return(i);
 }
 
-static rfbBool sraReverse(sraRectangleIterator *i)
-{
-  return( ((i->ptrPos&2) && i->reverseX) ||
-     (!(i->ptrPos&2) && i->reverseY));
-}
-
-static sraSpan* sraNextSpan(sraRectangleIterator *i)
-{
-  if(sraReverse(i))
-    return(i->sPtrs[i->ptrPos]->_prev);
-  else
-    return(i->sPtrs[i->ptrPos]->_next);
-}
-
 rfbBool sraRgnIteratorNext(sraRectangleIterator* i,sraRect* r)
 {
-  /* is the subspan finished? */
-  while(sraNextSpan(i) == i->sPtrs[i->ptrPos+1]) {
-    i->ptrPos -= 2;
-    if(i->ptrPos < 0) /* the end */
-      return(0);
-  }
-
-  i->sPtrs[i->ptrPos] = sraNextSpan(i);
-
-  /* is this a new subspan? */
-  while(i->sPtrs[i->ptrPos]->subspan) {
-    if(i->ptrPos+2 > i->ptrSize) { /* array is too small */
-      i->ptrSize += DEFSTEP;
-      i->sPtrs = (sraSpan**)realloc(i->sPtrs, sizeof(sraSpan*)*i->ptrSize);
-    }
-    i->ptrPos =+ 2;
-    if(sraReverse(i)) {
-      i->sPtrs[i->ptrPos]   =   i->sPtrs[i->ptrPos-2]->subspan->back._prev;
-      i->sPtrs[i->ptrPos+1] = &(i->sPtrs[i->ptrPos-2]->subspan->front);
-    } else {
-      i->sPtrs[i->ptrPos]   =   i->sPtrs[i->ptrPos-2]->subspan->front._next;
-      i->sPtrs[i->ptrPos+1] = &(i->sPtrs[i->ptrPos-2]->subspan->back);
-    }
+  const sraRegion *s = i->region;
+  const sraBand *band;
+  int span;
+
+  /* is the region finished? */
+  if(i->band >= s->nBands)
+    return(0);
+
+  band = &s->bands[i->reverseY ? s->nBands - 1 - i->band : i->band];
+  span = band->first + (i->reverseX ? band->count - 1 - i->span : i->span);
+
+  r->y1 = band->y1;
+  r->y2 = band->y2;
+  r->x1 = s->xs[2 * span];
+  r->x2 = s->xs[2 * span + 1];
+
+  /* is the band finished? */
+  if(++i->span >= band->count) {
+    i->span = 0;
+    i->band++;
   }
-
-  if((i->ptrPos%4)!=2) {
-    rfbErr("sraRgnIteratorNext: offset is wrong (%d%%4!=2)\n",i->ptrPos);
-    return FALSE;
-  }
-
-  r->y1 = i->sPtrs[i->ptrPos-2]->start;
-  r->y2 = i->sPtrs[i->ptrPos-2]->end;
-  r->x1 = i->sPtrs[i->ptrPos]->start;
-  r->x2 = i->sPtrs[i->ptrPos]->end;
-
   return(-1);
 }
 
 void sraRgnReleaseIterator(sraRectangleIterator* i)
 {
-  free(i->sPtrs);
+  LOCK(sraPoolMutex);
+  if (nFreeIterators < SRA_POOL_MAX) {
+    i->nextFree = freeIterators;
+    freeIterators = i;
+    nFreeIterators++;
+    i = NULL;
+  }
+  UNLOCK(sraPoolMutex);
   free(i);
 }
 
 void
 sraRgnPrint(const sraRegion *rgn) {
-	sraSpanListPrint((sraSpanList*)rgn);
+	sraSpanListPrint(rgn);
 }
 
 rfbBool
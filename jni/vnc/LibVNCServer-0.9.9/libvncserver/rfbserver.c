@@ -102,9 +102,12 @@ static const int tight2turbo_subsamp[10] = {
 };
 #endif
 
+static rfbBool rfbSendProtocolVersion(rfbClientPtr cl);
 static void rfbProcessClientProtocolVersion(rfbClientPtr cl);
+static void rfbProcessClientTLSHandshake(rfbClientPtr cl);
 static void rfbProcessClientNormalMessage(rfbClientPtr cl);
 static void rfbProcessClientInitMessage(rfbClientPtr cl);
+static rfbBool rfbEndFileTransfer(rfbClientPtr cl);
 
 #ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
 void rfbIncrClientRef(rfbClientPtr cl)
@@ -282,7 +285,6 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
                      int sock,
                      rfbBool isUDP)
 {
-    rfbProtocolVersionMsg pv;
     rfbClientIteratorPtr iterator;
     rfbClientPtr cl,cl_;
 #ifdef LIBVNCSERVER_IPv6
@@ -298,6 +300,8 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
     cl->screen = rfbScreen;
     cl->sock = sock;
     cl->viewOnly = FALSE;
+    cl->deferTimer.fd = -1;
+    cl->ptrDeferTimer.fd = -1;
     /* setup pseudo scaling */
     cl->scaledScreen = rfbScreen;
     cl->scaledScreen->scaledScreenRefCount++;
@@ -344,8 +348,11 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
 	return NULL;
       }
 
-      FD_SET(sock,&(rfbScreen->allFds));
+      /* past FD_SETSIZE only epoll can wait for the socket */
+      if (sock < FD_SETSIZE) {
+        FD_SET(sock,&(rfbScreen->allFds));
 		rfbScreen->maxFd = max(sock,rfbScreen->maxFd);
+      }
 
       INIT_MUTEX(cl->outputMutex);
       INIT_MUTEX(cl->refCountMutex);
@@ -389,6 +396,7 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
         rfbScreen->clientHead->prev = cl;
 
       rfbScreen->clientHead = cl;
+      rfbEpollAddClient(cl);
       UNLOCK(rfbClientListMutex);
 
 #if defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG)
@@ -450,11 +458,8 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
       }
 #endif
 
-      sprintf(pv,rfbProtocolVersionFormat,rfbScreen->protocolMajorVersion, 
-              rfbScreen->protocolMinorVersion);
-
-      if (rfbWriteExact(cl, pv, sz_rfbProtocolVersionMsg) < 0) {
-        rfbLogPerror("rfbNewClient: write");
+      /* wss connections send it once TLS and WebSockets are set up */
+      if (cl->state == RFB_PROTOCOL_VERSION && !rfbSendProtocolVersion(cl)) {
         rfbCloseClient(cl);
 	rfbClientConnectionGone(cl);
         return NULL;
@@ -521,6 +526,7 @@ rfbClientConnectionGone(rfbClientPtr cl)
         cl->screen->clientHead = cl->next;
     if (cl->next)
         cl->next->prev = cl->prev;
+    rfbEpollRemoveClient(cl);
 
     UNLOCK(rfbClientListMutex);
 
@@ -553,7 +559,18 @@ rfbClientConnectionGone(rfbClientPtr cl)
     free(cl->beforeEncBuf);
     free(cl->afterEncBuf);
 
-    if(cl->sock>=0)
+    rfbFreeOutputQueue(cl);
+
+    rfbEndFileTransfer(cl);
+
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+    /* rfbScreenCleanup() drops clients without closing them */
+    if (cl->sslctx)
+	rfbssl_destroy(cl);
+    free(cl->wsctx);
+#endif
+
+    if(cl->sock>=0 && cl->sock<FD_SETSIZE)
        FD_CLR(cl->sock,&(cl->screen->allFds));
 
     cl->clientGoneHook(cl);
@@ -572,6 +589,7 @@ rfbClientConnectionGone(rfbClientPtr cl)
 	if (cl->zsActive[i])
 	    deflateEnd(&cl->zsStruct[i]);
     }
+    rfbFreeTightData(cl);
 #endif
 #endif
 
@@ -611,6 +629,9 @@ void
 rfbProcessClientMessage(rfbClientPtr cl)
 {
     switch (cl->state) {
+    case RFB_TLS_HANDSHAKE:
+        rfbProcessClientTLSHandshake(cl);
+        return;
     case RFB_PROTOCOL_VERSION:
         rfbProcessClientProtocolVersion(cl);
         return;
@@ -631,6 +652,50 @@ rfbProcessClientMessage(rfbClientPtr cl)
 }
 
 
+/*
+ * rfbSendProtocolVersion starts the RFB handshake.
+ */
+
+static rfbBool
+rfbSendProtocolVersion(rfbClientPtr cl)
+{
+    rfbProtocolVersionMsg pv;
+
+    sprintf(pv,rfbProtocolVersionFormat,cl->screen->protocolMajorVersion,
+            cl->screen->protocolMinorVersion);
+
+    if (rfbWriteExact(cl, pv, sz_rfbProtocolVersionMsg) < 0) {
+        rfbLogPerror("rfbSendProtocolVersion: write");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+/*
+ * rfbProcessClientTLSHandshake is called when a wss client sends more of
+ * its TLS handshake, so that a slow one holds up no one else. Once TLS is
+ * done, the WebSockets handshake is read and the RFB one starts.
+ */
+
+static void
+rfbProcessClientTLSHandshake(rfbClientPtr cl)
+{
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+    switch (rfbssl_handshake(cl)) {
+    case 0:
+        return;
+    case 1:
+        cl->state = RFB_PROTOCOL_VERSION;
+        if (webSocketsCheckTLS(cl) && rfbSendProtocolVersion(cl))
+            return;
+        break;
+    }
+#endif
+    rfbCloseClient(cl);
+}
+
+
 /*
  * rfbProcessClientProtocolVersion is called when the client sends its
  * protocol version.
@@ -1374,20 +1439,197 @@ char *rfbProcessFileTransferReadBuffer(rfbClientPtr cl, uint32_t length)
 }
 
 
+/*
+ * Files go out a window of blocks at a time: one read() fills the window,
+ * the blocks are compressed side by side on the encoding threads, and all
+ * the packets go out in one write.  Windows are sent while the socket takes
+ * them, at most FT_WINDOWS_PER_CALL per call so that the other clients and
+ * input get their turn.  When output queues up, the next window waits for
+ * the queue to go out.  Data that does not compress is sent as it is, and
+ * compression is only tried again after FT_SKIP_WINDOWS windows.
+ *
+ * Received packets are gathered into a window-sized buffer and written to
+ * the file in one write() when it is full or the file ends.
+ */
+
+#define FT_WINDOW_BLOCKS 32
+#define FT_WINDOW (FT_WINDOW_BLOCKS * sz_rfbBlockSize)
+#define FT_WINDOWS_PER_CALL 4
+#define FT_SKIP_WINDOWS 16
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+/* the most compress() may make of a block */
+#define FT_COMPRESSED_SIZE (sz_rfbBlockSize + sz_rfbBlockSize / 1000 + 64)
+#else
+#define FT_COMPRESSED_SIZE 0
+#endif
+
+/*
+ * Writes out the received data held for cl's file.  Returns FALSE if it
+ * could not be.
+ */
+static rfbBool
+rfbFlushFileTransfer(rfbClientPtr cl)
+{
+    char *p = cl->fileTransfer.buffer;
+    int n, len = cl->fileTransfer.bufferLen;
+
+    cl->fileTransfer.bufferLen = 0;
+    for (; len > 0; p += n, len -= n) {
+        if ((n = write(cl->fileTransfer.fd, p, len)) < 0) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            rfbLogPerror("rfbProcessFileTransfer: write");
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * Ends cl's file transfer, writing out what was received of the file
+ * first.  Returns FALSE if that could not be written.
+ */
+static rfbBool
+rfbEndFileTransfer(rfbClientPtr cl)
+{
+    rfbBool ok = TRUE;
+
+    if (cl->fileTransfer.fd != -1) {
+        if (cl->fileTransfer.receiving)
+            ok = rfbFlushFileTransfer(cl);
+        close(cl->fileTransfer.fd);
+    }
+    free(cl->fileTransfer.buffer);
+    cl->fileTransfer.buffer = NULL;
+    cl->fileTransfer.bufferLen = 0;
+    cl->fileTransfer.fd = -1;
+    cl->fileTransfer.sending   = 0;
+    cl->fileTransfer.receiving = 0;
+    return ok;
+}
+
+typedef struct {
+    const unsigned char *data;
+    int len;
+    unsigned char *out;
+    unsigned long outLen;       /* 0 if the block did not compress */
+} rfbFileBlockJob;
+
+static void
+CompressFileBlockJob(void *arg, int worker)
+{
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    rfbFileBlockJob *job = (rfbFileBlockJob *)arg;
+
+    job->outLen = FT_COMPRESSED_SIZE;
+    if (compress2(job->out, &job->outLen, job->data, job->len,
+                  Z_BEST_SPEED) != Z_OK ||
+        job->outLen >= (unsigned long)job->len)
+        job->outLen = 0;
+#endif
+}
+
+/*
+ * Sends one window of cl's file.  Returns 1 if there is more to send, 0 if
+ * the transfer has ended, or -1 if the client had to be closed.
+ */
+static int
+rfbSendFileTransferWindow(rfbClientPtr cl)
+{
+    rfbFileBlockJob jobs[FT_WINDOW_BLOCKS];
+    rfbFileTransferMsg ft[FT_WINDOW_BLOCKS];
+    struct iovec iov[2 * FT_WINDOW_BLOCKS];
+    unsigned char *window;
+    int len = 0, n, nBlocks, i, packed = 0, sent = 0;
+    rfbBool eof = FALSE;
+
+    if (cl->fileTransfer.buffer == NULL &&
+        (cl->fileTransfer.buffer = (char *)malloc(FT_WINDOW +
+                                                  FT_WINDOW_BLOCKS * FT_COMPRESSED_SIZE)) == NULL) {
+        rfbErr("rfbSendFileTransferWindow: no memory for the file window\n");
+        rfbEndFileTransfer(cl);
+        return rfbSendFileTransferMessage(cl, rfbAbortFileTransfer, 0, 0, 0, NULL) ? 0 : -1;
+    }
+    window = (unsigned char *)cl->fileTransfer.buffer;
+
+    while (len < FT_WINDOW && !eof) {
+        n = read(cl->fileTransfer.fd, window + len, FT_WINDOW - len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            rfbLog("rfbSendFileTransferWindow(): %s\n", strerror(errno));
+            rfbEndFileTransfer(cl);
+            return rfbSendFileTransferMessage(cl, rfbAbortFileTransfer, 0, 0, 0, NULL) ? 0 : -1;
+        }
+        eof = (n == 0);
+        len += n;
+    }
+
+    nBlocks = (len + sz_rfbBlockSize - 1) / sz_rfbBlockSize;
+    for (i = 0; i < nBlocks; i++) {
+        jobs[i].data = window + i * sz_rfbBlockSize;
+        jobs[i].len = i < nBlocks - 1 ? sz_rfbBlockSize : len - i * sz_rfbBlockSize;
+        jobs[i].out = window + FT_WINDOW + i * FT_COMPRESSED_SIZE;
+        jobs[i].outLen = 0;
+    }
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    if (cl->fileTransfer.compressionEnabled && nBlocks > 0) {
+        if (cl->fileTransfer.skipCompression > 0) {
+            cl->fileTransfer.skipCompression--;
+        } else {
+            rfbEncodePoolRun(cl->screen, CompressFileBlockJob, jobs,
+                             sizeof(rfbFileBlockJob), nBlocks);
+            for (i = 0; i < nBlocks; i++)
+                packed += jobs[i].outLen ? jobs[i].outLen : jobs[i].len;
+            /* saving less than a thirty-second is not worth the CPU */
+            if (packed > len - len / 32)
+                cl->fileTransfer.skipCompression = FT_SKIP_WINDOWS;
+        }
+    }
+#endif
+
+    for (i = 0; i < nBlocks; i++) {
+        n = jobs[i].outLen ? jobs[i].outLen : jobs[i].len;
+        ft[i].type = rfbFileTransfer;
+        ft[i].contentType = rfbFilePacket;
+        ft[i].contentParam = 0;
+        ft[i].pad = 0;
+        ft[i].size = Swap32IfLE((uint32_t)(jobs[i].outLen ? 1 : 0));
+        ft[i].length = Swap32IfLE((uint32_t)n);
+        iov[2 * i].iov_base = (char *)&ft[i];
+        iov[2 * i].iov_len = sz_rfbFileTransferMsg;
+        iov[2 * i + 1].iov_base = jobs[i].outLen ? (char *)jobs[i].out : (char *)jobs[i].data;
+        iov[2 * i + 1].iov_len = n;
+        sent += sz_rfbFileTransferMsg + n;
+    }
+
+    if (nBlocks > 0) {
+        LOCK(cl->sendMutex);
+        if (rfbWriteExactV(cl, iov, 2 * nBlocks) < 0) {
+            rfbLogPerror("rfbSendFileTransferWindow: write");
+            rfbCloseClient(cl);
+            UNLOCK(cl->sendMutex);
+            rfbEndFileTransfer(cl);
+            return -1;
+        }
+        UNLOCK(cl->sendMutex);
+        rfbStatRecordMessageSent(cl, rfbFileTransfer, sent, len + nBlocks * sz_rfbFileTransferMsg);
+    }
+
+    if (eof) {
+        rfbEndFileTransfer(cl);
+        return rfbSendFileTransferMessage(cl, rfbEndOfFile, 0, 0, 0, NULL) ? 0 : -1;
+    }
+    return 1;
+}
+
 rfbBool rfbSendFileTransferChunk(rfbClientPtr cl)
 {
-    /* Allocate buffer for compression */
-    unsigned char readBuf[sz_rfbBlockSize];
-    int bytesRead=0;
-    int retval=0;
     fd_set wfds;
     struct timeval tv;
-    int n;
-#ifdef LIBVNCSERVER_HAVE_LIBZ
-    unsigned char compBuf[sz_rfbBlockSize + 1024];
-    unsigned long nMaxCompSize = sizeof(compBuf);
-    int nRetC = 0;
-#endif
+    int n, windows;
 
     /*
      * Don't close the client if we get into this one because 
@@ -1401,8 +1643,16 @@ rfbBool rfbSendFileTransferChunk(rfbClientPtr cl)
     }
 
     /* If not sending, or no file open...   Return as if we sent something! */
-    if ((cl->fileTransfer.fd!=-1) && (cl->fileTransfer.sending==1))
+    for (windows = 0; windows < FT_WINDOWS_PER_CALL; windows++)
     {
+        if (cl->fileTransfer.fd == -1 || cl->fileTransfer.sending != 1 ||
+            cl->sock < 0)
+            break;
+
+        /* queued output goes first, the next window waits for it */
+        if (cl->outQueue != NULL)
+            break;
+
 	FD_ZERO(&wfds);
         FD_SET(cl->sock, &wfds);
 
@@ -1418,57 +1668,11 @@ rfbBool rfbSendFileTransferChunk(rfbClientPtr cl)
             rfbLog("rfbSendFileTransferChunk() select failed: %s\n", strerror(errno));
 	}
         /* We have space on the transmit queue */
-	if (n > 0)
-	{
-            bytesRead = read(cl->fileTransfer.fd, readBuf, sz_rfbBlockSize);
-            switch (bytesRead) {
-            case 0:
-                /*
-                rfbLog("rfbSendFileTransferChunk(): End-Of-File Encountered\n");
-                */
-                retval = rfbSendFileTransferMessage(cl, rfbEndOfFile, 0, 0, 0, NULL);
-                close(cl->fileTransfer.fd);
-                cl->fileTransfer.fd = -1;
-                cl->fileTransfer.sending   = 0;
-                cl->fileTransfer.receiving = 0;
-                return retval;
-            case -1:
-                /* TODO : send an error msg to the client... */
-#ifdef WIN32
-	        errno=WSAGetLastError();
-#endif
-                rfbLog("rfbSendFileTransferChunk(): %s\n",strerror(errno));
-                retval = rfbSendFileTransferMessage(cl, rfbAbortFileTransfer, 0, 0, 0, NULL);
-                close(cl->fileTransfer.fd);
-                cl->fileTransfer.fd = -1;
-                cl->fileTransfer.sending   = 0;
-                cl->fileTransfer.receiving = 0;
-                return retval;
-            default:
-                /*
-                rfbLog("rfbSendFileTransferChunk(): Read %d bytes\n", bytesRead);
-                */
-                if (!cl->fileTransfer.compressionEnabled)
-                    return  rfbSendFileTransferMessage(cl, rfbFilePacket, 0, 0, bytesRead, (char *)readBuf);
-                else
-                {
-#ifdef LIBVNCSERVER_HAVE_LIBZ
-                    nRetC = compress(compBuf, &nMaxCompSize, readBuf, bytesRead);
-                    /*
-                    rfbLog("Compressed the packet from %d -> %d bytes\n", nMaxCompSize, bytesRead);
-                    */
-                    
-                    if ((nRetC==0) && (nMaxCompSize<bytesRead))
-                        return  rfbSendFileTransferMessage(cl, rfbFilePacket, 0, 1, nMaxCompSize, (char *)compBuf);
-                    else
-                        return  rfbSendFileTransferMessage(cl, rfbFilePacket, 0, 0, bytesRead, (char *)readBuf);
-#else
-                    /* We do not support compression of the data stream */
-                    return  rfbSendFileTransferMessage(cl, rfbFilePacket, 0, 0, bytesRead, (char *)readBuf);
-#endif
-                }
-            }
-        }
+	if (n <= 0)
+	    break;
+
+        if ((n = rfbSendFileTransferWindow(cl)) <= 0)
+            return n == 0 ? TRUE : FALSE;
     }
     return TRUE;
 }
@@ -1484,10 +1688,15 @@ rfbBool rfbProcessFileTransfer(rfbClientPtr cl, uint8_t contentType, uint8_t con
     uint32_t sizeHtmp=0;
     int n=0;
     char timespec[64];
+    char *in;
 #ifdef LIBVNCSERVER_HAVE_LIBZ
     unsigned char compBuff[sz_rfbBlockSize];
     unsigned long nRawBytes = sz_rfbBlockSize;
     int nRet = 0;
+    rfbBool packed = (size != 0);
+#else
+    /* Write the file out as received... */
+    rfbBool packed = FALSE;
 #endif
 
     FILEXFER_ALLOWED_OR_CLOSE_AND_RETURN("", cl, FALSE);
@@ -1567,6 +1776,7 @@ rfbBool rfbProcessFileTransfer(rfbClientPtr cl, uint8_t contentType, uint8_t con
         if ((buffer = rfbProcessFileTransferReadBuffer(cl, length))==NULL) return FALSE;
         /* The client requests a File */
         rfbFilenameTranslate2UNIX(cl, buffer, filename1);
+        rfbEndFileTransfer(cl);
         cl->fileTransfer.fd=open(filename1, O_RDONLY, 0744);
 
         /*
@@ -1614,6 +1824,7 @@ rfbBool rfbProcessFileTransfer(rfbClientPtr cl, uint8_t contentType, uint8_t con
         cl->fileTransfer.numPackets = statbuf.st_size / sz_rfbBlockSize;
         cl->fileTransfer.receiving = 0;
         cl->fileTransfer.sending = 0; /* set when we receive a rfbFileHeader: */
+        cl->fileTransfer.skipCompression = 0;
 
         /* TODO: finish 64-bit file size support */
         sizeHtmp = 0;        
@@ -1632,8 +1843,7 @@ rfbBool rfbProcessFileTransfer(rfbClientPtr cl, uint8_t contentType, uint8_t con
         /* Destination file (viewer side) is ready for reception (size > 0) or not (size = -1) */
         if (size==-1) {
             rfbLog("rfbProcessFileTransfer() rfbFileHeader (error, aborting)\n");
-            close(cl->fileTransfer.fd);
-            cl->fileTransfer.fd=-1;
+            rfbEndFileTransfer(cl);
             return TRUE;
         }
 
@@ -1686,6 +1896,7 @@ rfbBool rfbProcessFileTransfer(rfbClientPtr cl, uint8_t contentType, uint8_t con
         /* If the file exists... We can send a rfbFileChecksums back to the client before we send an rfbFileAcceptHeader */
         /* TODO: Delta Transfer */
 
+        rfbEndFileTransfer(cl);
         cl->fileTransfer.fd=open(filename1, O_CREAT|O_WRONLY|O_TRUNC, 0744);
         if (DB) rfbLog("rfbProcessFileTransfer() rfbFileTransferOffer(\"%s\"->\"%s\") %s %s fd=%d\n", buffer, filename1, (cl->fileTransfer.fd==-1?"Failed":"Success"), (cl->fileTransfer.fd==-1?strerror(errno):""), cl->fileTransfer.fd);
         /*
@@ -1703,16 +1914,55 @@ rfbBool rfbProcessFileTransfer(rfbClientPtr cl, uint8_t contentType, uint8_t con
         cl->fileTransfer.numPackets = size / sz_rfbBlockSize;
         cl->fileTransfer.receiving = 1;
         cl->fileTransfer.sending = 0;
+        /* without it, packets are written one at a time */
+        cl->fileTransfer.buffer = (char *)malloc(FT_WINDOW + FT_COMPRESSED_SIZE);
         break;
 
     case rfbFilePacket:
         /*
         rfbLog("rfbProcessFileTransfer() rfbFilePacket:\n");
         */
+        if (cl->fileTransfer.fd!=-1 && cl->fileTransfer.buffer!=NULL &&
+            length <= (packed ? FT_COMPRESSED_SIZE : sz_rfbBlockSize)) {
+            /* the packet goes into the window, after what it holds is
+               written out if it could not take another block */
+            if (cl->fileTransfer.bufferLen > FT_WINDOW - sz_rfbBlockSize &&
+                !rfbFlushFileTransfer(cl))
+                retval = -1;
+            in = cl->fileTransfer.buffer + (packed ? FT_WINDOW : cl->fileTransfer.bufferLen);
+            if ((n = rfbReadExact(cl, in, length)) <= 0) {
+                if (n != 0)
+                    rfbLogPerror("rfbProcessFileTransfer: read");
+                rfbCloseClient(cl);
+                rfbEndFileTransfer(cl);
+                return FALSE;
+            }
+            if (!packed) {
+                cl->fileTransfer.bufferLen += length;
+            } else {
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+                /* compressed packet */
+                nRawBytes = sz_rfbBlockSize;
+                nRet = uncompress((unsigned char *)cl->fileTransfer.buffer + cl->fileTransfer.bufferLen,
+                                  &nRawBytes, (const unsigned char *)in, length);
+                if (nRet == Z_OK)
+                    cl->fileTransfer.bufferLen += nRawBytes;
+                else
+                    retval = -1;
+#endif
+            }
+            if (retval==-1)
+                rfbEndFileTransfer(cl);
+            break;
+        }
+
         if ((buffer = rfbProcessFileTransferReadBuffer(cl, length))==NULL) return FALSE;
         if (cl->fileTransfer.fd!=-1) {
+            /* what the window holds goes first */
+            if (!rfbFlushFileTransfer(cl))
+                retval=-1;
             /* buffer contains the contents of the file */
-            if (size==0)
+            else if (size==0)
                 retval=write(cl->fileTransfer.fd, buffer, length);
             else
             {
@@ -1729,12 +1979,7 @@ rfbBool rfbProcessFileTransfer(rfbClientPtr cl, uint8_t contentType, uint8_t con
 #endif
             }
             if (retval==-1)
-            {
-                close(cl->fileTransfer.fd);
-                cl->fileTransfer.fd=-1;
-                cl->fileTransfer.sending   = 0;
-                cl->fileTransfer.receiving = 0;
-            }
+                rfbEndFileTransfer(cl);
         }
         break;
 
@@ -1742,11 +1987,7 @@ rfbBool rfbProcessFileTransfer(rfbClientPtr cl, uint8_t contentType, uint8_t con
         if (DB) rfbLog("rfbProcessFileTransfer() rfbEndOfFile\n");
         /*
         */
-        if (cl->fileTransfer.fd!=-1)
-            close(cl->fileTransfer.fd);
-        cl->fileTransfer.fd=-1;
-        cl->fileTransfer.sending   = 0;
-        cl->fileTransfer.receiving = 0;
+        rfbEndFileTransfer(cl);
         break;
 
     case rfbAbortFileTransfer:
@@ -1755,10 +1996,7 @@ rfbBool rfbProcessFileTransfer(rfbClientPtr cl, uint8_t contentType, uint8_t con
         */
         if (cl->fileTransfer.fd!=-1)
         {
-            close(cl->fileTransfer.fd);
-            cl->fileTransfer.fd=-1;
-            cl->fileTransfer.sending   = 0;
-            cl->fileTransfer.receiving = 0;
+            rfbEndFileTransfer(cl);
         }
         else
         {
@@ -2553,15 +2791,130 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 
 
 
+static rfbBool SendFramebufferUpdate(rfbClientPtr cl,
+                                     sraRegionPtr givenUpdateRegion);
+
+/*
+ * Whether an update in this encoding can be dropped from the output queue
+ * unsent: the encoding keeps no state between updates that the client would
+ * miss, or, for Tight, can have the client reset it.
+ */
+
+static rfbBool
+DroppableEncoding(int encoding)
+{
+    switch (encoding) {
+    case -1:
+    case rfbEncodingRaw:
+    case rfbEncodingRRE:
+    case rfbEncodingCoRRE:
+    case rfbEncodingHextile:
+    case rfbEncodingUltra:
+#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && defined(LIBVNCSERVER_HAVE_LIBZ)
+    case rfbEncodingTight:
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+    case rfbEncodingTightPng:
+#endif
+#endif
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/*
+ * Latest frame wins: updates still queued whole for a client that is not
+ * keeping up, and partly stale given what is about to be sent in region,
+ * are dropped, last first, and what they covered goes back into
+ * modifiedRegion and requestedRegion to be sent afresh.  An update followed
+ * in the queue by one that cannot be dropped is kept, since that one was
+ * encoded against it.  Returns TRUE if anything was dropped.
+ */
+
+static rfbBool
+DropQueuedUpdates(rfbClientPtr cl, sraRegionPtr region)
+{
+    rfbQueuedOutput **link, **last;
+    rfbQueuedOutput *q;
+    sraRegionPtr stale;
+    rfbBool dropped = FALSE, overlaps;
+
+    for (;;) {
+        last = NULL;
+        for (link = &cl->outQueue; *link != NULL; link = &(*link)->next)
+            if ((*link)->isUpdate)
+                last = link;
+        if (last == NULL || (q = *last)->region == NULL || q->sent > 0)
+            break;
+
+        /* with nothing newer to send for it, it may as well go as it is */
+        stale = sraRgnCreateRgn(q->region);
+        sraRgnAnd(stale, region);
+        overlaps = !sraRgnEmpty(stale);
+        sraRgnDestroy(stale);
+        if (!overlaps)
+            break;
+
+        LOCK(cl->updateMutex);
+        sraRgnOr(cl->modifiedRegion, q->region);
+        sraRgnOr(cl->requestedRegion, q->region);
+        /* a copy pending now may have been meant to move what is dropped */
+        sraRgnOr(cl->modifiedRegion, cl->copyRegion);
+        sraRgnMakeEmpty(cl->copyRegion);
+        cl->copyDX = 0;
+        cl->copyDY = 0;
+        UNLOCK(cl->updateMutex);
+
+        if (q->flags & rfbQueuedCursorShape)
+            cl->cursorWasChanged = TRUE;
+        if (q->flags & rfbQueuedCursorPos)
+            cl->cursorWasMoved = TRUE;
+#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && defined(LIBVNCSERVER_HAVE_LIBZ)
+        if (q->encoding == rfbEncodingTight ||
+            q->encoding == rfbEncodingTightPng)
+            rfbTightResetStreams(cl);
+#endif
+        cl->updatesDropped++;
+        cl->updateBytesDropped += q->len;
+        rfbRemoveQueuedOutput(cl, last);
+        dropped = TRUE;
+    }
+    return dropped;
+}
+
 /*
  * rfbSendFramebufferUpdate - send the currently pending framebuffer update to
  * the RFB client.
  * givenUpdateRegion is not changed.
+ *
+ * The socket is corked meanwhile, so that however many writes the encoders
+ * make, the update leaves in full-sized packets.
  */
 
 rfbBool
 rfbSendFramebufferUpdate(rfbClientPtr cl,
                          sraRegionPtr givenUpdateRegion)
+{
+    sraRegionPtr region = givenUpdateRegion;
+    rfbBool result;
+
+    if (cl->outQueue != NULL && DropQueuedUpdates(cl, givenUpdateRegion) &&
+        givenUpdateRegion != cl->modifiedRegion) {
+        region = sraRgnCreateRgn(givenUpdateRegion);
+        sraRgnOr(region, cl->modifiedRegion);
+    }
+
+    rfbCorkClient(cl, TRUE);
+    result = SendFramebufferUpdate(cl, region);
+    rfbCorkClient(cl, FALSE);
+
+    if (region != givenUpdateRegion)
+        sraRgnDestroy(region);
+    return result;
+}
+
+static rfbBool
+SendFramebufferUpdate(rfbClientPtr cl,
+                      sraRegionPtr givenUpdateRegion)
 {
     sraRectangleIterator* i=NULL;
     sraRect rect;
@@ -2575,7 +2928,9 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
     rfbBool sendSupportedMessages = FALSE;
     rfbBool sendSupportedEncodings = FALSE;
     rfbBool sendServerIdentity = FALSE;
+    rfbBool shared = FALSE;
     rfbBool result = TRUE;
+    rfbQueuedOutput *queued;
     
 
     if(cl->screen->displayHook)
@@ -2591,6 +2946,7 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
       cl->newFBSizePending = FALSE;
       UNLOCK(cl->updateMutex);
       fu->type = rfbFramebufferUpdate;
+      fu->pad = 0;
       fu->nRects = Swap16IfLE(1);
       cl->ublen = sz_rfbFramebufferUpdateMsg;
       if (!rfbSendNewFBSize(cl, cl->scaledScreen->width, cl->scaledScreen->height)) {
@@ -2782,6 +3138,7 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
      * Now send the update.
      */
     
+    rfbBeginUpdateOutput(cl);
     rfbStatRecordMessageSent(cl, rfbFramebufferUpdate, 0, 0);
     if (cl->preferredEncoding == rfbEncodingCoRRE) {
         nUpdateRegionRects = 0;
@@ -2879,6 +3236,7 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
     }
 
     fu->type = rfbFramebufferUpdate;
+    fu->pad = 0;
     if (nUpdateRegionRects != 0xFFFF) {
 	if(cl->screen->maxRectsPerUpdate>0
 	   /* CoRRE splits the screen into smaller squares */
@@ -2947,6 +3305,19 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 	        goto updateFailed;
     }
 
+    /* other clients may want the same rectangles, see encodecache.c */
+    shared = rfbEncodeCacheUsable(cl);
+
+#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && defined(LIBVNCSERVER_HAVE_LIBZ)
+    /* Tight rectangles can be encoded side by side, see tight.c */
+    if (cl->preferredEncoding == rfbEncodingTight &&
+        (cl->screen->encodeThreads > 0 || shared)) {
+        if (!rfbSendRegionEncodingTight(cl, updateRegion, shared))
+            goto updateFailed;
+        goto rectsSent;
+    }
+#endif
+
     for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
         int x = rect.x1;
         int y = rect.y1;
@@ -2972,7 +3343,11 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 	        goto updateFailed;
 	    break;
         case rfbEncodingHextile:
-            if (!rfbSendRectEncodingHextile(cl, x, y, w, h))
+            if (shared) {
+                if (!rfbSendRectEncodingShared(cl, x, y, w, h,
+                                               rfbSendRectEncodingHextile))
+                    goto updateFailed;
+            } else if (!rfbSendRectEncodingHextile(cl, x, y, w, h))
 	        goto updateFailed;
             break;
         case rfbEncodingUltra:
@@ -3009,6 +3384,7 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
         i = NULL;
     }
 
+rectsSent:
     if ( nUpdateRegionRects == 0xFFFF &&
 	 !rfbSendLastRectMarker(cl) )
 	    goto updateFailed;
@@ -3018,6 +3394,18 @@ updateFailed:
 	result = FALSE;
     }
 
+    /* queued whole, the update may yet be dropped for a later one */
+    if ((queued = rfbEndUpdateOutput(cl)) != NULL && result &&
+        DroppableEncoding(cl->preferredEncoding) && !sendKeyboardLedState &&
+        !sendSupportedMessages && !sendSupportedEncodings &&
+        !sendServerIdentity) {
+      queued->region = sraRgnCreateRgn(updateRegion);
+      sraRgnOr(queued->region, updateCopyRegion);
+      queued->encoding = cl->preferredEncoding;
+      queued->flags = (sendCursorShape ? rfbQueuedCursorShape : 0) |
+                      (sendCursorPos ? rfbQueuedCursorPos : 0);
+    }
+
     if (!cl->enableCursorShapeUpdates) {
       rfbHideCursor(cl);
     }
@@ -3243,6 +3631,14 @@ rfbSendNewFBSize(rfbClientPtr cl,
 rfbBool
 rfbSendUpdateBuf(rfbClientPtr cl)
 {
+    if (cl->encodeSink != NULL) {
+        if (!rfbEncodeSinkAppend(cl->encodeSink, rfbEncodeRecordRaw,
+                                 cl->updateBuf, cl->ublen))
+            return FALSE;
+        cl->ublen = 0;
+        return TRUE;
+    }
+
     if(cl->sock<0)
       return FALSE;
 
@@ -3256,6 +3652,46 @@ rfbSendUpdateBuf(rfbClientPtr cl)
     return TRUE;
 }
 
+/*
+ * Adds len bytes at buf to what is queued in cl->updateBuf.  They are copied
+ * in if they fit; otherwise both go out together in a single writev(), and
+ * buf is not copied at all.  Returns FALSE on error, as rfbSendUpdateBuf().
+ */
+
+rfbBool
+rfbSendUpdateData(rfbClientPtr cl, const char *buf, int len)
+{
+    struct iovec iov[2];
+
+    if (cl->ublen + len <= UPDATE_BUF_SIZE) {
+        memcpy(&cl->updateBuf[cl->ublen], buf, len);
+        cl->ublen += len;
+        return TRUE;
+    }
+
+    if (cl->encodeSink != NULL) {
+        return rfbSendUpdateBuf(cl) &&
+               rfbEncodeSinkAppend(cl->encodeSink, rfbEncodeRecordRaw,
+                                   buf, len);
+    }
+
+    if(cl->sock<0)
+      return FALSE;
+
+    iov[0].iov_base = cl->updateBuf;
+    iov[0].iov_len = cl->ublen;
+    iov[1].iov_base = (char *)buf;
+    iov[1].iov_len = len;
+    if (rfbWriteExactV(cl, iov, 2) < 0) {
+        rfbLogPerror("rfbSendUpdateData: write");
+        rfbCloseClient(cl);
+        return FALSE;
+    }
+
+    cl->ublen = 0;
+    return TRUE;
+}
+
 /*
  * rfbSendSetColourMapEntries sends a SetColourMapEntries message to the
  * client, using values from the currently installed colormap.
@@ -5,11 +5,13 @@
 #include "rfb/rfbconfig.h"
 
 int rfbssl_init(rfbClientPtr cl);
+int rfbssl_handshake(rfbClientPtr cl);
 int rfbssl_pending(rfbClientPtr cl);
 int rfbssl_peek(rfbClientPtr cl, char *buf, int bufsize);
 int rfbssl_read(rfbClientPtr cl, char *buf, int bufsize);
 int rfbssl_write(rfbClientPtr cl, const char *buf, int bufsize);
 void rfbssl_destroy(rfbClientPtr cl);
+void rfbssl_cleanup(rfbScreenInfoPtr screen);
 
 
 #endif /* _VNCSSL_H */
@@ -33,6 +33,11 @@ int rfbssl_init(rfbClientPtr cl)
     return -1;
 }
 
+int rfbssl_handshake(rfbClientPtr cl)
+{
+    return -1;
+}
+
 int rfbssl_write(rfbClientPtr cl, const char *buf, int bufsize)
 {
     return -1;
@@ -56,3 +61,7 @@ int rfbssl_pending(rfbClientPtr cl)
 void rfbssl_destroy(rfbClientPtr cl)
 {
 }
+
+void rfbssl_cleanup(rfbScreenInfoPtr screen)
+{
+}
@@ -22,12 +22,28 @@
  */
 
 #include "rfbssl.h"
+#include <errno.h>
+#include <poll.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+/* Sessions kept for viewers to resume; wallboards reconnecting all at once
+   then skip the key exchange. Tickets come on top, keyed per SSL_CTX. */
+#define RFBSSL_SESSION_CACHE_SIZE 256
+#define RFBSSL_SESSION_TIMEOUT (60 * 60)
+
+/* Forward-secret AEAD suites first, then the CBC ones older viewers and
+   OpenSSL builds have; suites OpenSSL doesn't know are skipped. */
+#define RFBSSL_CIPHERS "ECDHE+AESGCM:ECDHE+CHACHA20:DHE+AESGCM:" \
+    "ECDHE+AES:DHE+AES:AES:!aNULL:!eNULL:!EXPORT:!DES:!RC4:!MD5:!PSK"
 
 struct rfbssl_ctx {
-    SSL_CTX *ssl_ctx;
     SSL     *ssl;
+    /* SSL_accept() is done */
+    int     accepted;
 };
 
 static void rfbssl_error(void)
@@ -37,62 +53,210 @@ static void rfbssl_error(void)
     rfbErr("%s (%ld)\n", ERR_error_string(e, buf), e);
 }
 
-int rfbssl_init(rfbClientPtr cl)
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) && OPENSSL_VERSION_NUMBER < 0x10100000L
+/* OpenSSL before 1.1 needs these to share an SSL_CTX between threads */
+
+static pthread_mutex_t *rfbssl_locks;
+
+static void rfbssl_lock(int mode, int n, const char *file, int line)
+{
+    if (mode & CRYPTO_LOCK)
+	pthread_mutex_lock(&rfbssl_locks[n]);
+    else
+	pthread_mutex_unlock(&rfbssl_locks[n]);
+}
+
+static void rfbssl_init_locks(void)
 {
+    int i;
+
+    if (CRYPTO_get_locking_callback() != NULL)
+	return;
+    rfbssl_locks = malloc(CRYPTO_num_locks() * sizeof(pthread_mutex_t));
+    if (rfbssl_locks == NULL)
+	return;
+    for (i = 0; i < CRYPTO_num_locks(); i++)
+	pthread_mutex_init(&rfbssl_locks[i], NULL);
+    CRYPTO_set_locking_callback(rfbssl_lock);
+}
+#else
+#define rfbssl_init_locks()
+#endif
+
+/*
+ * rfbssl_server_ctx returns the SSL_CTX of the screen, loading its key and
+ * certificate on the first wss connection; every later one shares it and
+ * its session cache.
+ */
+
+static SSL_CTX *rfbssl_server_ctx(rfbScreenInfoPtr screen)
+{
+    static const unsigned char sid_ctx[] = "libvncserver";
+    SSL_CTX *ssl_ctx;
     char *keyfile;
-    int r, ret = -1;
-    struct rfbssl_ctx *ctx;
+#if OPENSSL_VERSION_NUMBER < 0x10100000L && !defined(OPENSSL_NO_ECDH)
+    EC_KEY *ecdh;
+#endif
+
+    if (screen->sslServerCtx)
+	return (SSL_CTX *)screen->sslServerCtx;
 
     SSL_library_init();
     SSL_load_error_strings();
+    rfbssl_init_locks();
 
-    if (cl->screen->sslkeyfile && *cl->screen->sslkeyfile) {
-      keyfile = cl->screen->sslkeyfile;
+    if (screen->sslkeyfile && *screen->sslkeyfile) {
+      keyfile = screen->sslkeyfile;
     } else {
-      keyfile = cl->screen->sslcertfile;
+      keyfile = screen->sslcertfile;
     }
 
-    if (NULL == (ctx = malloc(sizeof(struct rfbssl_ctx)))) {
-	rfbErr("OOM\n");
-    } else if (!cl->screen->sslcertfile || !cl->screen->sslcertfile[0]) {
+    if (!screen->sslcertfile || !screen->sslcertfile[0]) {
 	rfbErr("SSL connection but no cert specified\n");
-    } else if (NULL == (ctx->ssl_ctx = SSL_CTX_new(TLSv1_server_method()))) {
+	return NULL;
+    }
+    /* the newest TLS both ends speak, where TLSv1_server_method() was
+       TLS 1.0 only */
+    if (NULL == (ssl_ctx = SSL_CTX_new(SSLv23_server_method()))) {
 	rfbssl_error();
-    } else if (SSL_CTX_use_PrivateKey_file(ctx->ssl_ctx, keyfile, SSL_FILETYPE_PEM) <= 0) {
+	return NULL;
+    }
+    if (SSL_CTX_use_PrivateKey_file(ssl_ctx, keyfile, SSL_FILETYPE_PEM) <= 0) {
 	rfbErr("Unable to load private key file %s\n", keyfile);
-    } else if (SSL_CTX_use_certificate_file(ctx->ssl_ctx, cl->screen->sslcertfile, SSL_FILETYPE_PEM) <= 0) {
-	rfbErr("Unable to load certificate file %s\n", cl->screen->sslcertfile);
-    } else if (NULL == (ctx->ssl = SSL_new(ctx->ssl_ctx))) {
+	SSL_CTX_free(ssl_ctx);
+	return NULL;
+    }
+    if (SSL_CTX_use_certificate_file(ssl_ctx, screen->sslcertfile, SSL_FILETYPE_PEM) <= 0) {
+	rfbErr("Unable to load certificate file %s\n", screen->sslcertfile);
+	SSL_CTX_free(ssl_ctx);
+	return NULL;
+    }
+
+    SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 |
+			SSL_OP_NO_COMPRESSION | SSL_OP_CIPHER_SERVER_PREFERENCE |
+			SSL_OP_SINGLE_ECDH_USE | SSL_OP_SINGLE_DH_USE);
+    if (!SSL_CTX_set_cipher_list(ssl_ctx, RFBSSL_CIPHERS))
+	rfbssl_error();
+#if OPENSSL_VERSION_NUMBER < 0x10100000L && !defined(OPENSSL_NO_ECDH)
+    /* later versions pick the curve themselves */
+    if ((ecdh = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1)) != NULL) {
+	SSL_CTX_set_tmp_ecdh(ssl_ctx, ecdh);
+	EC_KEY_free(ecdh);
+    }
+#endif
+
+    /* Output is queued like any other client's, see QueueOutput(): a write
+       may go out in part, and is retried from wherever the queue has it. */
+    SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+		     SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_session_id_context(ssl_ctx, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ssl_ctx, RFBSSL_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ssl_ctx, RFBSSL_SESSION_TIMEOUT);
+
+    screen->sslServerCtx = ssl_ctx;
+    return ssl_ctx;
+}
+
+/*
+ * rfbssl_init sets up TLS on a new wss connection. The handshake is left
+ * to rfbssl_handshake(), which the event loop calls as the viewer's data
+ * comes in.
+ */
+
+int rfbssl_init(rfbClientPtr cl)
+{
+    int ret = -1;
+    struct rfbssl_ctx *ctx;
+    SSL_CTX *ssl_ctx;
+
+    if (NULL == (ssl_ctx = rfbssl_server_ctx(cl->screen))) {
+	/* reported already */
+    } else if (NULL == (ctx = calloc(1, sizeof(struct rfbssl_ctx)))) {
+	rfbErr("OOM\n");
+    } else if (NULL == (ctx->ssl = SSL_new(ssl_ctx))) {
 	rfbErr("SSL_new failed\n");
 	rfbssl_error();
+	free(ctx);
     } else if (!(SSL_set_fd(ctx->ssl, cl->sock))) {
 	rfbErr("SSL_set_fd failed\n");
 	rfbssl_error();
+	SSL_free(ctx->ssl);
+	free(ctx);
     } else {
-	while ((r = SSL_accept(ctx->ssl)) < 0) {
-	    if (SSL_get_error(ctx->ssl, r) != SSL_ERROR_WANT_READ)
-		break;
-	}
-	if (r < 0) {
-	    rfbErr("SSL_accept failed %d\n", SSL_get_error(ctx->ssl, r));
-	} else {
-	    cl->sslctx = (rfbSslCtx *)ctx;
-	    ret = 0;
-	}
+	cl->sslctx = (rfbSslCtx *)ctx;
+	ret = 0;
     }
     return ret;
 }
 
-int rfbssl_write(rfbClientPtr cl, const char *buf, int bufsize)
+/* waits until the socket takes more, for as long as a write would */
+static int rfbssl_wait_writable(rfbClientPtr cl)
+{
+    struct pollfd pfd;
+
+    pfd.fd = cl->sock;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    return poll(&pfd, 1, cl->screen->maxClientWait ?
+		cl->screen->maxClientWait : rfbMaxClientWait) > 0;
+}
+
+/*
+ * rfbssl_handshake goes on with the handshake as far as the data in hand
+ * allows. It returns 1 once it is done and the viewer's first request has
+ * come, 0 while waiting for the viewer and -1 if it failed.
+ */
+
+int rfbssl_handshake(rfbClientPtr cl)
 {
-    int ret;
     struct rfbssl_ctx *ctx = (struct rfbssl_ctx *)cl->sslctx;
+    char c;
+    int r, err;
 
-    while ((ret = SSL_write(ctx->ssl, buf, bufsize)) <= 0) {
-	if (SSL_get_error(ctx->ssl, ret) != SSL_ERROR_WANT_WRITE)
-	    break;
+    while ((r = ctx->accepted ? SSL_peek(ctx->ssl, &c, 1)
+			      : SSL_accept(ctx->ssl)) <= 0) {
+	err = SSL_get_error(ctx->ssl, r);
+	if (err == SSL_ERROR_WANT_READ)
+	    return 0;
+	if (err != SSL_ERROR_WANT_WRITE || !rfbssl_wait_writable(cl)) {
+	    rfbErr("%s failed %d\n", ctx->accepted ? "SSL_peek" : "SSL_accept",
+		   err);
+	    return -1;
+	}
     }
-    return ret;
+    if (!ctx->accepted) {
+	ctx->accepted = 1;
+	rfbLog("%s handshake with %s, %s\n", SSL_get_version(ctx->ssl),
+	       SSL_get_cipher_name(ctx->ssl),
+	       SSL_session_reused(ctx->ssl) ? "resumed" : "new session");
+	/* A full handshake ends with the server's Finished, before the
+	   viewer has sent anything; peek for that without blocking. */
+	return rfbssl_handshake(cl);
+    }
+    return 1;
+}
+
+/*
+ * rfbssl_write writes what it can of buf without blocking. It returns how
+ * many bytes went out, or -1 with errno set to EAGAIN if the socket is
+ * full, in which case the same bytes, or more following on from them, have
+ * to be written next.
+ */
+
+int rfbssl_write(rfbClientPtr cl, const char *buf, int bufsize)
+{
+    int ret, err;
+    struct rfbssl_ctx *ctx = (struct rfbssl_ctx *)cl->sslctx;
+
+    if ((ret = SSL_write(ctx->ssl, buf, bufsize)) > 0)
+	return ret;
+    err = SSL_get_error(ctx->ssl, ret);
+    if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+	errno = EAGAIN;
+    else if (err != SSL_ERROR_SYSCALL)
+	errno = EPIPE;
+    return -1;
 }
 
 int rfbssl_peek(rfbClientPtr cl, char *buf, int bufsize)
@@ -128,8 +292,21 @@ int rfbssl_pending(rfbClientPtr cl)
 void rfbssl_destroy(rfbClientPtr cl)
 {
     struct rfbssl_ctx *ctx = (struct rfbssl_ctx *)cl->sslctx;
-    if (ctx->ssl)
+    if (ctx->ssl) {
+	/* SSL_free() drops the session from the cache unless the
+	   connection was shut down; keep it for the viewer to resume */
+	if (ctx->accepted)
+	    SSL_set_shutdown(ctx->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
 	SSL_free(ctx->ssl);
-    if (ctx->ssl_ctx)
-	SSL_CTX_free(ctx->ssl_ctx);
+    }
+    free(ctx);
+    cl->sslctx = NULL;
+}
+
+void rfbssl_cleanup(rfbScreenInfoPtr screen)
+{
+    if (screen->sslServerCtx) {
+	SSL_CTX_free((SSL_CTX *)screen->sslServerCtx);
+	screen->sslServerCtx = NULL;
+    }
 }
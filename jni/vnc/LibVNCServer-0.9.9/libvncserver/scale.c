@@ -32,6 +32,7 @@
 #include <rfb/rfb.h>
 #include <rfb/rfbregion.h>
 #include "private.h"
+#include "scale.h"
 
 #ifdef LIBVNCSERVER_HAVE_FCNTL_H
 #include <fcntl.h>
@@ -137,6 +138,9 @@ void rfbScaledScreenUpdateRect(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr, in
     int x1, y1, w1, h1;
     int bitsPerPixel, bytesPerPixel, bytesPerLine, areaX, areaY, area2;
     unsigned char *srcptr, *dstptr;
+    rfbScaleBoxFnType scaleBox = NULL;
+    rfbScaleBoxTable box;
+    const char *kernel;
 
     /* Nothing to do!!! */
     if (screen==ptr) return;
@@ -180,7 +184,13 @@ void rfbScaledScreenUpdateRect(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr, in
      *    screen->width, screen->height, ptr->width, ptr->height, ptr->frameBuffer);
      */
 
-    if (screen->serverFormat.trueColour) { /* Blend neighbouring pixels together */
+    if (rfbBoxScale)
+      scaleBox = rfbInitScaleBox(&box, &screen->serverFormat, areaX, areaY, &kernel);
+
+    if (scaleBox != NULL) { /* Average whole rows of boxes at a time */
+      scaleBox(&box, dstptr, ptr->paddedWidthInBytes,
+               srcptr, screen->paddedWidthInBytes, w1, h1);
+    } else if (screen->serverFormat.trueColour) { /* Blend neighbouring pixels together */
       unsigned char *srcptr2;
       unsigned long pixel_value, red, green, blue;
       unsigned int redShift = screen->serverFormat.redShift;
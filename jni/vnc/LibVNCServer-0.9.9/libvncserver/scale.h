@@ -8,3 +8,7 @@ rfbScreenInfoPtr rfbScaledScreenAllocate(rfbClientPtr cl, int width, int height)
 rfbScreenInfoPtr rfbScalingFind(rfbClientPtr cl, int width, int height);
 void rfbScalingSetup(rfbClientPtr cl, int width, int height);
 int rfbSendNewScaleSize(rfbClientPtr cl);
+
+/* scale true colour with the box-filter kernels in scalebox.c where
+   possible, not pixel by pixel */
+extern rfbBool rfbBoxScale;
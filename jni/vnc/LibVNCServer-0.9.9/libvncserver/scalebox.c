@@ -0,0 +1,406 @@
+/*
+ * scalebox.c - average boxes of server pixels into a scaled framebuffer a
+ * row of boxes at a time, where scale.c sums and divides the channels of
+ * each destination pixel on its own.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+#include "scale.h"
+
+rfbBool rfbBoxScale = TRUE;
+
+/* The SIMD kernels keep 16-bit sums and multiply them by a 16-bit mul16,
+   which is exact up to boxes of this many pixels; see rfbInitScaleBox(). */
+#define BOX_MAX_SIMD_AREA 16
+
+
+/*
+ * The C kernels: one pass per destination pixel like scale.c, but with the
+ * pixel size known and the division a multiply.
+ */
+
+RFB_BOX_INLINE void
+rfbScaleBoxRowsC(const rfbScaleBoxTable *t, unsigned char *dst, int dstStride,
+                 const unsigned char *src, int srcStride, int w, int h,
+                 int bytesPerPixel)
+{
+    const uint32_t rs = t->shift[0], gs = t->shift[1], bs = t->shift[2];
+    const uint32_t rm = t->max[0], gm = t->max[1], bm = t->max[2];
+    const uint32_t mul = t->mul;
+    uint32_t p, r, g, b;
+    int x, y, u, v;
+
+    for (y = 0; y < h; y++, dst += dstStride, src += t->areaY * srcStride) {
+        for (x = 0; x < w; x++) {
+            r = g = b = 0;
+            for (v = 0; v < t->areaY; v++) {
+                const unsigned char *in = src + v * srcStride +
+                    x * t->areaX * bytesPerPixel;
+                for (u = 0; u < t->areaX; u++, in += bytesPerPixel) {
+                    p = bytesPerPixel == 4 ? *(const uint32_t *)in
+                                           : *(const uint16_t *)in;
+                    r += (p >> rs) & rm;
+                    g += (p >> gs) & gm;
+                    b += (p >> bs) & bm;
+                }
+            }
+            p = ((r * mul) >> 24) << rs | ((g * mul) >> 24) << gs |
+                ((b * mul) >> 24) << bs;
+            if (bytesPerPixel == 4)
+                ((uint32_t *)dst)[x] = p;
+            else
+                ((uint16_t *)dst)[x] = (uint16_t)p;
+        }
+    }
+}
+
+static void
+rfbScaleBox16C(const rfbScaleBoxTable *t, unsigned char *dst, int dstStride,
+               const unsigned char *src, int srcStride, int w, int h)
+{
+    rfbScaleBoxRowsC(t, dst, dstStride, src, srcStride, w, h, 2);
+}
+
+static void
+rfbScaleBox32C(const rfbScaleBoxTable *t, unsigned char *dst, int dstStride,
+               const unsigned char *src, int srcStride, int w, int h)
+{
+    rfbScaleBoxRowsC(t, dst, dstStride, src, srcStride, w, h, 4);
+}
+
+static const rfbScaleBoxFnType rfbScaleBoxC[2] = {
+    rfbScaleBox16C, rfbScaleBox32C
+};
+
+
+#ifdef __SSE2__
+
+#include <emmintrin.h>
+
+/*
+ * A row of boxes is done in chunks: the areaY source rows under a chunk
+ * are added up column by column into sums, four 16-bit lanes per source
+ * pixel (its bytes at 32bpp, red, green, blue and 0 at 16bpp), then each
+ * run of areaX columns is added up, multiplied by mul16 and packed.
+ */
+
+/* destination pixels per chunk */
+#define BOX_CHUNK 64
+
+typedef struct {
+    __m128i shift[3], max[3];
+    __m128i mul, mask, place;
+} rfbBoxConstsSSE2;
+
+static void
+rfbBoxPrepareSSE2(rfbBoxConstsSSE2 *k, const rfbScaleBoxTable *t)
+{
+    int c;
+
+    for (c = 0; c < 3; c++) {
+        k->shift[c] = _mm_cvtsi32_si128(t->shift[c]);
+        k->max[c] = _mm_set1_epi16(t->max[c]);
+    }
+    k->mul = _mm_set1_epi16(t->mul16);
+    k->mask = _mm_set1_epi32(t->byteMask);
+    /* multipliers that move each channel lane of a 16bpp average into
+       its place in the pixel */
+    k->place = _mm_set_epi16(0, 1 << t->shift[2], 1 << t->shift[1],
+                             1 << t->shift[0], 0, 1 << t->shift[2],
+                             1 << t->shift[1], 1 << t->shift[0]);
+}
+
+RFB_BOX_INLINE void
+rfbBoxColumns32SSE2(uint16_t *sums, const unsigned char *src, int bytes,
+                    rfbBool first)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i v, lo, hi;
+    int i;
+
+    for (i = 0; i + 16 <= bytes; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)(src + i));
+        lo = _mm_unpacklo_epi8(v, zero);
+        hi = _mm_unpackhi_epi8(v, zero);
+        if (!first) {
+            lo = _mm_add_epi16(lo, _mm_loadu_si128((__m128i *)(sums + i)));
+            hi = _mm_add_epi16(hi, _mm_loadu_si128((__m128i *)(sums + i + 8)));
+        }
+        _mm_storeu_si128((__m128i *)(sums + i), lo);
+        _mm_storeu_si128((__m128i *)(sums + i + 8), hi);
+    }
+    for (; i < bytes; i++)
+        sums[i] = (first ? 0 : sums[i]) + src[i];
+}
+
+RFB_BOX_INLINE void
+rfbBoxColumns16SSE2(uint16_t *sums, const unsigned char *src, int pixels,
+                    rfbBool first, const rfbBoxConstsSSE2 *k,
+                    const rfbScaleBoxTable *t)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i p, r, g, b, rg, b0, px[4];
+    uint32_t q;
+    int i, j;
+
+    for (i = 0; i + 8 <= pixels; i += 8) {
+        p = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+        r = _mm_and_si128(_mm_srl_epi16(p, k->shift[0]), k->max[0]);
+        g = _mm_and_si128(_mm_srl_epi16(p, k->shift[1]), k->max[1]);
+        b = _mm_and_si128(_mm_srl_epi16(p, k->shift[2]), k->max[2]);
+        rg = _mm_unpacklo_epi16(r, g);
+        b0 = _mm_unpacklo_epi16(b, zero);
+        px[0] = _mm_unpacklo_epi32(rg, b0);
+        px[1] = _mm_unpackhi_epi32(rg, b0);
+        rg = _mm_unpackhi_epi16(r, g);
+        b0 = _mm_unpackhi_epi16(b, zero);
+        px[2] = _mm_unpacklo_epi32(rg, b0);
+        px[3] = _mm_unpackhi_epi32(rg, b0);
+        for (j = 0; j < 4; j++) {
+            if (!first)
+                px[j] = _mm_add_epi16(px[j],
+                    _mm_loadu_si128((__m128i *)(sums + 4 * i + 8 * j)));
+            _mm_storeu_si128((__m128i *)(sums + 4 * i + 8 * j), px[j]);
+        }
+    }
+    for (; i < pixels; i++) {
+        q = ((const uint16_t *)src)[i];
+        for (j = 0; j < 3; j++)
+            sums[4 * i + j] = (first ? 0 : sums[4 * i + j]) +
+                              ((q >> t->shift[j]) & t->max[j]);
+        sums[4 * i + 3] = 0;
+    }
+}
+
+/* the sums of box x in the low four lanes */
+RFB_BOX_INLINE __m128i
+rfbBoxSumSSE2(const uint16_t *sums, int x, int areaX)
+{
+    const uint16_t *p = sums + x * areaX * 4;
+    __m128i s = _mm_setzero_si128();
+    int u;
+
+    for (u = 0; u + 2 <= areaX; u += 2)
+        s = _mm_add_epi16(s, _mm_loadu_si128((const __m128i *)(p + 4 * u)));
+    s = _mm_add_epi16(s, _mm_srli_si128(s, 8));
+    if (u < areaX)
+        s = _mm_add_epi16(s, _mm_loadl_epi64((const __m128i *)(p + 4 * u)));
+    return s;
+}
+
+/* the averages of boxes x and x + 1, one in each half */
+RFB_BOX_INLINE __m128i
+rfbBoxAverage2SSE2(const uint16_t *sums, int x, int areaX, __m128i mul)
+{
+    return _mm_mulhi_epu16(_mm_unpacklo_epi64(rfbBoxSumSSE2(sums, x, areaX),
+                                              rfbBoxSumSSE2(sums, x + 1, areaX)),
+                           mul);
+}
+
+RFB_BOX_INLINE void
+rfbBoxStore32SSE2(unsigned char *dst, const uint16_t *sums, int n, int areaX,
+                  const rfbBoxConstsSSE2 *k)
+{
+    __m128i a, b;
+    uint32_t p;
+    int x;
+
+    for (x = 0; x + 4 <= n; x += 4) {
+        a = rfbBoxAverage2SSE2(sums, x, areaX, k->mul);
+        b = rfbBoxAverage2SSE2(sums, x + 2, areaX, k->mul);
+        _mm_storeu_si128((__m128i *)(dst + 4 * x),
+                         _mm_and_si128(_mm_packus_epi16(a, b), k->mask));
+    }
+    for (; x < n; x++) {
+        a = _mm_mulhi_epu16(rfbBoxSumSSE2(sums, x, areaX), k->mul);
+        p = _mm_cvtsi128_si32(_mm_and_si128(_mm_packus_epi16(a, a), k->mask));
+        memcpy(dst + 4 * x, &p, 4);
+    }
+}
+
+/* Moves the channels of the two averages in v into place and adds them up
+   in the low lane of each half; they don't overlap, so adding is or-ing. */
+RFB_BOX_INLINE __m128i
+rfbBoxPlace16SSE2(__m128i v, const rfbBoxConstsSSE2 *k)
+{
+    v = _mm_mullo_epi16(v, k->place);
+    v = _mm_add_epi16(v, _mm_srli_epi64(v, 16));
+    v = _mm_add_epi16(v, _mm_srli_epi64(v, 32));
+    /* the pixels are now in 32-bit lanes 0 and 2 */
+    return _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+RFB_BOX_INLINE void
+rfbBoxStore16SSE2(unsigned char *dst, const uint16_t *sums, int n, int areaX,
+                  const rfbBoxConstsSSE2 *k)
+{
+    __m128i a, b;
+    uint16_t p;
+    int x;
+
+    for (x = 0; x + 4 <= n; x += 4) {
+        a = rfbBoxPlace16SSE2(rfbBoxAverage2SSE2(sums, x, areaX, k->mul), k);
+        b = rfbBoxPlace16SSE2(rfbBoxAverage2SSE2(sums, x + 2, areaX, k->mul), k);
+        a = _mm_unpacklo_epi64(a, b);
+        /* as in translateshift.c, sign-extend so _mm_packs_epi32 keeps
+           the pixels whole */
+        a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+        _mm_storel_epi64((__m128i *)(dst + 2 * x), _mm_packs_epi32(a, a));
+    }
+    for (; x < n; x++) {
+        a = _mm_mulhi_epu16(rfbBoxSumSSE2(sums, x, areaX), k->mul);
+        p = _mm_extract_epi16(rfbBoxPlace16SSE2(a, k), 0);
+        memcpy(dst + 2 * x, &p, 2);
+    }
+}
+
+RFB_BOX_INLINE void
+rfbScaleBoxRowsSSE2(const rfbScaleBoxTable *t, unsigned char *dst,
+                    int dstStride, const unsigned char *src, int srcStride,
+                    int w, int h, int bytesPerPixel, int areaX, int areaY)
+{
+    uint16_t sums[BOX_CHUNK * BOX_MAX_SIMD_AREA * 4];
+    const unsigned char *in;
+    rfbBoxConstsSSE2 k;
+    int x, y, v, n;
+
+    rfbBoxPrepareSSE2(&k, t);
+    for (y = 0; y < h; y++, dst += dstStride, src += areaY * srcStride) {
+        for (x = 0; x < w; x += n) {
+            n = w - x < BOX_CHUNK ? w - x : BOX_CHUNK;
+            in = src + x * areaX * bytesPerPixel;
+            for (v = 0; v < areaY; v++, in += srcStride) {
+                if (bytesPerPixel == 4)
+                    rfbBoxColumns32SSE2(sums, in, n * areaX * 4, v == 0);
+                else
+                    rfbBoxColumns16SSE2(sums, in, n * areaX, v == 0, &k, t);
+            }
+            if (bytesPerPixel == 4)
+                rfbBoxStore32SSE2(dst + 4 * x, sums, n, areaX, &k);
+            else
+                rfbBoxStore16SSE2(dst + 2 * x, sums, n, areaX, &k);
+        }
+    }
+}
+
+/* 2:1, 3:1 and 4:1 get their box loops unrolled */
+#define BOX_KERNEL_SSE2(bpp)                                            \
+static void                                                             \
+rfbScaleBox##bpp##SSE2(const rfbScaleBoxTable *t, unsigned char *dst,   \
+                       int dstStride, const unsigned char *src,         \
+                       int srcStride, int w, int h)                     \
+{                                                                       \
+    if (t->areaX == 2 && t->areaY == 2)                                 \
+        rfbScaleBoxRowsSSE2(t, dst, dstStride, src, srcStride, w, h,    \
+                            bpp / 8, 2, 2);                             \
+    else if (t->areaX == 3 && t->areaY == 3)                            \
+        rfbScaleBoxRowsSSE2(t, dst, dstStride, src, srcStride, w, h,    \
+                            bpp / 8, 3, 3);                             \
+    else if (t->areaX == 4 && t->areaY == 4)                            \
+        rfbScaleBoxRowsSSE2(t, dst, dstStride, src, srcStride, w, h,    \
+                            bpp / 8, 4, 4);                             \
+    else                                                                \
+        rfbScaleBoxRowsSSE2(t, dst, dstStride, src, srcStride, w, h,    \
+                            bpp / 8, t->areaX, t->areaY);               \
+}
+
+BOX_KERNEL_SSE2(16)
+BOX_KERNEL_SSE2(32)
+
+static const rfbScaleBoxFnType rfbScaleBoxSSE2[2] = {
+    rfbScaleBox16SSE2, rfbScaleBox32SSE2
+};
+
+#endif /* __SSE2__ */
+
+
+/*
+ * rfbInitScaleBox returns the function to average areaX by areaY boxes of
+ * pixels in format pf, with *t filled in for it, or NULL if there is none
+ * and scale.c has to do it. kernel is set to the instruction set chosen.
+ */
+
+rfbScaleBoxFnType
+rfbInitScaleBox(rfbScaleBoxTable *t, rfbPixelFormat *pf, int areaX, int areaY,
+                const char **kernel)
+{
+    const rfbScaleBoxFnType *fns = NULL;
+    uint32_t shift[3], max[3];
+    int area = areaX * areaY, c;
+    rfbBool bytes = (pf->bitsPerPixel == 32);
+
+    if (!pf->trueColour || (pf->bitsPerPixel != 16 && pf->bitsPerPixel != 32))
+        return NULL;
+    /* (sum * mul) >> 24 with mul = ceil(2^24 / area) overshoots sum / area
+       by sum * (mul * area - 2^24) / (area * 2^24) < sum / 2^24, which stays
+       below the 1 / area that would change the result for every sum up to
+       area * 255 while area * area * 255 < 2^24, so up to 256 pixels */
+    if (areaX < 1 || areaY < 1 || areaX > 256 || area > 256)
+        return NULL;
+
+    shift[0] = pf->redShift;
+    shift[1] = pf->greenShift;
+    shift[2] = pf->blueShift;
+    max[0] = pf->redMax;
+    max[1] = pf->greenMax;
+    max[2] = pf->blueMax;
+    t->byteMask = 0;
+    for (c = 0; c < 3; c++) {
+        if (max[c] > 255 || shift[c] >= pf->bitsPerPixel ||
+            ((uint64_t)max[c] << shift[c]) >> pf->bitsPerPixel)
+            return NULL;
+        t->shift[c] = shift[c];
+        t->max[c] = max[c];
+        if (max[c] != 255 || shift[c] % 8 != 0)
+            bytes = FALSE;
+        t->byteMask |= 0xffu << shift[c];
+    }
+    if (!bytes)
+        t->byteMask = 0;
+
+    t->areaX = areaX;
+    t->areaY = areaY;
+    t->mul = ((1 << 24) + area - 1) / area;
+    /* likewise with 2^16 up to 16 pixels, which also keeps the sums and
+       mul16 within 16 bits; 1:1 has no 16-bit mul16 */
+    t->mul16 = ((1 << 16) + area - 1) / area;
+
+    if (area >= 2 && area <= BOX_MAX_SIMD_AREA &&
+        (pf->bitsPerPixel == 16 || bytes)) {
+#ifdef LIBVNCSERVER_HAVE_NEON
+        if (fns == NULL && rfbCpuHasNeon()) {
+            fns = rfbScaleBoxNEON;
+            *kernel = "neon";
+        }
+#endif
+#ifdef __SSE2__
+        if (fns == NULL) {
+            fns = rfbScaleBoxSSE2;
+            *kernel = "sse2";
+        }
+#endif
+    }
+    if (fns == NULL) {
+        fns = rfbScaleBoxC;
+        *kernel = "c";
+    }
+    return fns[pf->bitsPerPixel / 32];
+}
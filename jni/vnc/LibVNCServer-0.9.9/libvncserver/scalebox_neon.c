@@ -0,0 +1,240 @@
+/*
+ * scalebox_neon.c - NEON versions of the box-filter downscalers in
+ * scalebox.c. Built with -mfpu=neon for armeabi-v7a only; scalebox.c
+ * checks the CPU before using them.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+
+#include <arm_neon.h>
+
+/* as in scalebox.c */
+#define BOX_CHUNK 64
+#define BOX_MAX_SIMD_AREA 16
+
+/* NEON widens as it adds and has a multiply-long, so the column sums are
+   taken straight from the loads and mul16 is applied with vmull_u16.
+   16bpp pixels are split and interleaved into the sums by vld4/vst4. */
+
+typedef struct {
+    int16x8_t shift[3];
+    uint16x8_t max[3];
+    uint16x4_t mul;
+    int16x4_t place;
+    uint8x16_t mask;
+} rfbBoxConstsNEON;
+
+static void
+rfbBoxPrepareNEON(rfbBoxConstsNEON *k, const rfbScaleBoxTable *t)
+{
+    int16_t place[4];
+    int c;
+
+    for (c = 0; c < 3; c++) {
+        k->shift[c] = vdupq_n_s16(-(int)t->shift[c]);
+        k->max[c] = vdupq_n_u16(t->max[c]);
+        place[c] = t->shift[c];
+    }
+    place[3] = 0;
+    k->mul = vdup_n_u16(t->mul16);
+    k->place = vld1_s16(place);
+    k->mask = vreinterpretq_u8_u32(vdupq_n_u32(t->byteMask));
+}
+
+RFB_BOX_INLINE void
+rfbBoxColumns32NEON(uint16_t *sums, const unsigned char *src, int bytes,
+                    rfbBool first)
+{
+    uint8x16_t v;
+    int i;
+
+    for (i = 0; i + 16 <= bytes; i += 16) {
+        v = vld1q_u8(src + i);
+        if (first) {
+            vst1q_u16(sums + i, vmovl_u8(vget_low_u8(v)));
+            vst1q_u16(sums + i + 8, vmovl_u8(vget_high_u8(v)));
+        } else {
+            vst1q_u16(sums + i, vaddw_u8(vld1q_u16(sums + i), vget_low_u8(v)));
+            vst1q_u16(sums + i + 8,
+                      vaddw_u8(vld1q_u16(sums + i + 8), vget_high_u8(v)));
+        }
+    }
+    for (; i < bytes; i++)
+        sums[i] = (first ? 0 : sums[i]) + src[i];
+}
+
+RFB_BOX_INLINE void
+rfbBoxColumns16NEON(uint16_t *sums, const unsigned char *src, int pixels,
+                    rfbBool first, const rfbBoxConstsNEON *k,
+                    const rfbScaleBoxTable *t)
+{
+    uint16x8x4_t px;
+    uint16x8_t p, ch;
+    uint32_t q;
+    int i, c;
+
+    for (i = 0; i + 8 <= pixels; i += 8) {
+        p = vld1q_u16((const uint16_t *)src + i);
+        if (first)
+            px.val[3] = vdupq_n_u16(0);
+        else
+            px = vld4q_u16(sums + 4 * i);
+        for (c = 0; c < 3; c++) {
+            ch = vandq_u16(vshlq_u16(p, k->shift[c]), k->max[c]);
+            px.val[c] = first ? ch : vaddq_u16(px.val[c], ch);
+        }
+        vst4q_u16(sums + 4 * i, px);
+    }
+    for (; i < pixels; i++) {
+        q = ((const uint16_t *)src)[i];
+        for (c = 0; c < 3; c++)
+            sums[4 * i + c] = (first ? 0 : sums[4 * i + c]) +
+                              ((q >> t->shift[c]) & t->max[c]);
+        sums[4 * i + 3] = 0;
+    }
+}
+
+/* the average of box x */
+RFB_BOX_INLINE uint16x4_t
+rfbBoxAverageNEON(const uint16_t *sums, int x, int areaX, uint16x4_t mul)
+{
+    const uint16_t *p = sums + x * areaX * 4;
+    uint16x8_t s = vdupq_n_u16(0);
+    uint16x4_t r;
+    int u;
+
+    for (u = 0; u + 2 <= areaX; u += 2)
+        s = vaddq_u16(s, vld1q_u16(p + 4 * u));
+    r = vadd_u16(vget_low_u16(s), vget_high_u16(s));
+    if (u < areaX)
+        r = vadd_u16(r, vld1_u16(p + 4 * u));
+    return vshrn_n_u32(vmull_u16(r, mul), 16);
+}
+
+RFB_BOX_INLINE void
+rfbBoxStore32NEON(unsigned char *dst, const uint16_t *sums, int n, int areaX,
+                  const rfbBoxConstsNEON *k)
+{
+    uint16x8_t a, b;
+    uint8x8_t o;
+    uint32_t p;
+    int x;
+
+    for (x = 0; x + 4 <= n; x += 4) {
+        a = vcombine_u16(rfbBoxAverageNEON(sums, x, areaX, k->mul),
+                         rfbBoxAverageNEON(sums, x + 1, areaX, k->mul));
+        b = vcombine_u16(rfbBoxAverageNEON(sums, x + 2, areaX, k->mul),
+                         rfbBoxAverageNEON(sums, x + 3, areaX, k->mul));
+        vst1q_u8(dst + 4 * x,
+                 vandq_u8(vcombine_u8(vmovn_u16(a), vmovn_u16(b)), k->mask));
+    }
+    for (; x < n; x++) {
+        a = vcombine_u16(rfbBoxAverageNEON(sums, x, areaX, k->mul),
+                         vdup_n_u16(0));
+        o = vand_u8(vmovn_u16(a), vget_low_u8(k->mask));
+        p = vget_lane_u32(vreinterpret_u32_u8(o), 0);
+        memcpy(dst + 4 * x, &p, 4);
+    }
+}
+
+/* Moves the channels of each average into place with a shift per lane,
+   then adds lanes pairwise down to one pixel each; they don't overlap, so
+   adding is or-ing. */
+RFB_BOX_INLINE void
+rfbBoxStore16NEON(unsigned char *dst, const uint16_t *sums, int n, int areaX,
+                  const rfbBoxConstsNEON *k)
+{
+    uint16x4_t a, b, c, d;
+    uint16_t p;
+    int x;
+
+    for (x = 0; x + 4 <= n; x += 4) {
+        a = vshl_u16(rfbBoxAverageNEON(sums, x, areaX, k->mul), k->place);
+        b = vshl_u16(rfbBoxAverageNEON(sums, x + 1, areaX, k->mul), k->place);
+        c = vshl_u16(rfbBoxAverageNEON(sums, x + 2, areaX, k->mul), k->place);
+        d = vshl_u16(rfbBoxAverageNEON(sums, x + 3, areaX, k->mul), k->place);
+        vst1_u16((uint16_t *)(dst + 2 * x),
+                 vpadd_u16(vpadd_u16(a, b), vpadd_u16(c, d)));
+    }
+    for (; x < n; x++) {
+        a = vshl_u16(rfbBoxAverageNEON(sums, x, areaX, k->mul), k->place);
+        a = vpadd_u16(a, a);
+        p = vget_lane_u16(vpadd_u16(a, a), 0);
+        memcpy(dst + 2 * x, &p, 2);
+    }
+}
+
+RFB_BOX_INLINE void
+rfbScaleBoxRowsNEON(const rfbScaleBoxTable *t, unsigned char *dst,
+                    int dstStride, const unsigned char *src, int srcStride,
+                    int w, int h, int bytesPerPixel, int areaX, int areaY)
+{
+    uint16_t sums[BOX_CHUNK * BOX_MAX_SIMD_AREA * 4];
+    const unsigned char *in;
+    rfbBoxConstsNEON k;
+    int x, y, v, n;
+
+    rfbBoxPrepareNEON(&k, t);
+    for (y = 0; y < h; y++, dst += dstStride, src += areaY * srcStride) {
+        for (x = 0; x < w; x += n) {
+            n = w - x < BOX_CHUNK ? w - x : BOX_CHUNK;
+            in = src + x * areaX * bytesPerPixel;
+            for (v = 0; v < areaY; v++, in += srcStride) {
+                if (bytesPerPixel == 4)
+                    rfbBoxColumns32NEON(sums, in, n * areaX * 4, v == 0);
+                else
+                    rfbBoxColumns16NEON(sums, in, n * areaX, v == 0, &k, t);
+            }
+            if (bytesPerPixel == 4)
+                rfbBoxStore32NEON(dst + 4 * x, sums, n, areaX, &k);
+            else
+                rfbBoxStore16NEON(dst + 2 * x, sums, n, areaX, &k);
+        }
+    }
+}
+
+/* 2:1, 3:1 and 4:1 get their box loops unrolled */
+#define BOX_KERNEL_NEON(bpp)                                            \
+static void                                                             \
+rfbScaleBox##bpp##NEON(const rfbScaleBoxTable *t, unsigned char *dst,   \
+                       int dstStride, const unsigned char *src,         \
+                       int srcStride, int w, int h)                     \
+{                                                                       \
+    if (t->areaX == 2 && t->areaY == 2)                                 \
+        rfbScaleBoxRowsNEON(t, dst, dstStride, src, srcStride, w, h,    \
+                            bpp / 8, 2, 2);                             \
+    else if (t->areaX == 3 && t->areaY == 3)                            \
+        rfbScaleBoxRowsNEON(t, dst, dstStride, src, srcStride, w, h,    \
+                            bpp / 8, 3, 3);                             \
+    else if (t->areaX == 4 && t->areaY == 4)                            \
+        rfbScaleBoxRowsNEON(t, dst, dstStride, src, srcStride, w, h,    \
+                            bpp / 8, 4, 4);                             \
+    else                                                                \
+        rfbScaleBoxRowsNEON(t, dst, dstStride, src, srcStride, w, h,    \
+                            bpp / 8, t->areaX, t->areaY);               \
+}
+
+BOX_KERNEL_NEON(16)
+BOX_KERNEL_NEON(32)
+
+const rfbScaleBoxFnType rfbScaleBoxNEON[2] = {
+    rfbScaleBox16NEON, rfbScaleBox32NEON
+};
@@ -0,0 +1,88 @@
+/*
+ * shifttranstemplate.c - template for translation by shifting and masking.
+ *
+ * This file shouldn't be compiled.  It is included multiple times by
+ * translateshift.c and translateshift_neon.c, each time with different
+ * definitions of the macros IN and OUT, to define one function that
+ * translates a rectangle of IN bpp true colour pixels to OUT bpp ones
+ * eight pixels at a time (see rfbShiftTranslateTable in private.h).
+ *
+ * The includer supplies the vector code for one instruction set:
+ *
+ *   SHIFT_SUFFIX                 appended to the function name
+ *   SHIFT_VEC                    four 32-bit lanes
+ *   SHIFT_CONSTS                 one channel of the table, as SHIFT_CONVERT uses it
+ *   SHIFT_PREPARE(k, t)          set up SHIFT_CONSTS k[3] from table t
+ *   SHIFT_CONVERT(v, k)          translate the four pixels in v
+ *   SHIFT_LOAD16/32(p, lo, hi)   eight input pixels at p into two vectors
+ *   SHIFT_STORE8/16/32(p, lo, hi)  eight output pixels from two vectors
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#if !defined(IN) || !defined(OUT) || !defined(SHIFT_SUFFIX)
+#error "This file shouldn't be compiled."
+#error "It is included as part of translateshift.c"
+#endif
+
+#define IN_T CONCAT3E(uint,IN,_t)
+#define OUT_T CONCAT3E(uint,OUT,_t)
+#define SHIFT_LOADIN CONCAT2E(SHIFT_LOAD,IN)
+#define SHIFT_STOREOUT CONCAT2E(SHIFT_STORE,OUT)
+#define rfbTranslateWithShiftsINtoOUT \
+        CONCAT2E(CONCAT4E(rfbTranslateWithShifts,IN,to,OUT),SHIFT_SUFFIX)
+
+static void
+rfbTranslateWithShiftsINtoOUT (char *table, rfbPixelFormat *in,
+                               rfbPixelFormat *out,
+                               char *iptr, char *optr,
+                               int bytesBetweenInputLines,
+                               int width, int height)
+{
+    const rfbShiftTranslateTable *t = (const rfbShiftTranslateTable *)table;
+    IN_T *ip = (IN_T *)iptr;
+    OUT_T *op = (OUT_T *)optr;
+    int ipextra = bytesBetweenInputLines / sizeof(IN_T) - width;
+    SHIFT_CONSTS k[3];
+    SHIFT_VEC lo, hi;
+    int x;
+
+    SHIFT_PREPARE(k, t);
+
+    while (height > 0) {
+        for (x = 0; x + 8 <= width; x += 8) {
+            SHIFT_LOADIN(ip, lo, hi);
+            lo = SHIFT_CONVERT(lo, k);
+            hi = SHIFT_CONVERT(hi, k);
+            SHIFT_STOREOUT(op, lo, hi);
+            ip += 8;
+            op += 8;
+        }
+        for (; x < width; x++)
+            *(op++) = (OUT_T)rfbShiftTranslatePixel(t, *(ip++));
+
+        ip += ipextra;
+        height--;
+    }
+}
+
+#undef IN_T
+#undef OUT_T
+#undef SHIFT_LOADIN
+#undef SHIFT_STOREOUT
+#undef rfbTranslateWithShiftsINtoOUT
@@ -42,6 +42,8 @@
  */
 
 #include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "private.h"
 
 #ifdef LIBVNCSERVER_HAVE_SYS_TYPES_H
 #include <sys/types.h>
@@ -79,6 +81,20 @@ struct timeval
 #include <fcntl.h>
 #endif
 
+#ifdef LIBVNCSERVER_HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#ifdef LIBVNCSERVER_HAVE_SYS_TIMERFD_H
+#include <sys/timerfd.h>
+#else
+/* older C libraries have the system calls but not the wrappers */
+#include <sys/syscall.h>
+#define timerfd_create(clock, flags) syscall(__NR_timerfd_create, clock, flags)
+#define timerfd_settime(fd, flags, new, old) \
+    syscall(__NR_timerfd_settime, fd, flags, new, old)
+#define TFD_NONBLOCK O_NONBLOCK
+#endif
+#endif
+
 #include <errno.h>
 
 #ifdef USE_LIBWRAP
@@ -103,6 +119,12 @@ int deny_severity=LOG_WARNING;
 int rfbMaxClientWait = 20000;   /* time (ms) after which we decide client has
                                    gone away - needed to stop us hanging */
 
+static void EpollInit(rfbScreenInfoPtr rfbScreen);
+static void EpollShutdown(rfbScreenInfoPtr rfbScreen);
+static void EpollWatchOutput(rfbClientPtr cl, rfbBool on);
+
+static void InitSockets(rfbScreenInfoPtr rfbScreen);
+
 /*
  * rfbInitSockets sets up the TCP and UDP sockets to listen for RFB
  * connections.  It does nothing if called again.
@@ -111,11 +133,19 @@ int rfbMaxClientWait = 20000;   /* time (ms) after which we decide client has
 void
 rfbInitSockets(rfbScreenInfoPtr rfbScreen)
 {
-    in_addr_t iface = rfbScreen->listenInterface;
-
     if (rfbScreen->socketState!=RFB_SOCKET_INIT)
 	return;
 
+    InitSockets(rfbScreen);
+    if (rfbScreen->useEpoll)
+	EpollInit(rfbScreen);
+}
+
+static void
+InitSockets(rfbScreenInfoPtr rfbScreen)
+{
+    in_addr_t iface = rfbScreen->listenInterface;
+
     rfbScreen->socketState = RFB_SOCKET_READY;
 
     if (rfbScreen->inetdSock != -1) {
@@ -222,6 +252,8 @@ void rfbShutdownSockets(rfbScreenInfoPtr rfbScreen)
 
     rfbScreen->socketState = RFB_SOCKET_SHUTDOWN;
 
+    EpollShutdown(rfbScreen);
+
     if(rfbScreen->inetdSock>-1) {
 	closesocket(rfbScreen->inetdSock);
 	FD_CLR(rfbScreen->inetdSock,&rfbScreen->allFds);
@@ -247,6 +279,312 @@ void rfbShutdownSockets(rfbScreenInfoPtr rfbScreen)
     }
 }
 
+/*
+ * CheckUDPSocket reads what arrived on the UDP socket, taking its sender as
+ * the UDP client if it is a new one.  Returns FALSE if the socket failed.
+ */
+
+static rfbBool
+CheckUDPSocket(rfbScreenInfoPtr rfbScreen)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    char buf[6];
+
+    if(!rfbScreen->udpClient)
+	rfbNewUDPClient(rfbScreen);
+    if (recvfrom(rfbScreen->udpSock, buf, 1, MSG_PEEK,
+		(struct sockaddr *)&addr, &addrlen) < 0) {
+	rfbLogPerror("rfbCheckFds: UDP: recvfrom");
+	rfbDisconnectUDPSock(rfbScreen);
+	rfbScreen->udpSockConnected = FALSE;
+    } else {
+	if (!rfbScreen->udpSockConnected ||
+		(memcmp(&addr, &rfbScreen->udpRemoteAddr, addrlen) != 0))
+	{
+	    /* new remote end */
+	    rfbLog("rfbCheckFds: UDP: got connection\n");
+
+	    memcpy(&rfbScreen->udpRemoteAddr, &addr, addrlen);
+	    rfbScreen->udpSockConnected = TRUE;
+
+	    if (connect(rfbScreen->udpSock,
+			(struct sockaddr *)&addr, addrlen) < 0) {
+		rfbLogPerror("rfbCheckFds: UDP: connect");
+		rfbDisconnectUDPSock(rfbScreen);
+		return FALSE;
+	    }
+
+	    rfbNewUDPConnection(rfbScreen,rfbScreen->udpSock);
+	}
+
+	rfbProcessUDPInput(rfbScreen);
+    }
+    return TRUE;
+}
+
+#ifdef LIBVNCSERVER_HAVE_SYS_EPOLL_H
+
+/*
+ * With screen->useEpoll, rfbCheckFds() waits on an epoll set and looks only
+ * at the sockets that have something, instead of walking every client
+ * after select(), and there is no FD_SETSIZE limit.
+ *
+ * Client sockets are edge-triggered.  A client whose socket becomes
+ * readable goes on screen->readyClients, and stays there while more input
+ * is buffered, one message being handled per client and call as with
+ * select().  Listening and UDP sockets are level-triggered, since one
+ * connection or datagram is taken per call.  While a client has output
+ * queued, its socket is watched for EPOLLOUT too, to flush the queue.
+ *
+ * Each event's data is a pointer with the kind of descriptor in its low
+ * bits: the client, the socket field in the screen, or the client whose
+ * deferral timer expired; rfbUpdateClient() reads the timers.
+ */
+
+#define EPOLL_CLIENT 0
+#define EPOLL_SCREEN 1
+#define EPOLL_TIMER 2
+#define EPOLL_KIND 3
+
+#define EPOLL_MAX_EVENTS 64
+
+static void
+EpollAdd(rfbScreenInfoPtr rfbScreen, int fd, void *ptr, int kind,
+         uint32_t events)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = (uint64_t)(uintptr_t)ptr | kind;
+    if (epoll_ctl(rfbScreen->epollFd, EPOLL_CTL_ADD, fd, &ev) < 0)
+	rfbLogPerror("rfbCheckFds: epoll_ctl");
+}
+
+static void
+EpollInit(rfbScreenInfoPtr rfbScreen)
+{
+    rfbClientIteratorPtr i;
+    rfbClientPtr cl;
+
+    if ((rfbScreen->epollFd = epoll_create(EPOLL_MAX_EVENTS)) < 0) {
+	rfbLogPerror("rfbInitSockets: epoll_create, using select");
+	return;
+    }
+    fcntl(rfbScreen->epollFd, F_SETFD, FD_CLOEXEC);
+
+    if (rfbScreen->listenSock >= 0)
+	EpollAdd(rfbScreen, rfbScreen->listenSock, &rfbScreen->listenSock,
+		 EPOLL_SCREEN, EPOLLIN);
+    if (rfbScreen->listen6Sock >= 0)
+	EpollAdd(rfbScreen, rfbScreen->listen6Sock, &rfbScreen->listen6Sock,
+		 EPOLL_SCREEN, EPOLLIN);
+    if (rfbScreen->udpSock >= 0)
+	EpollAdd(rfbScreen, rfbScreen->udpSock, &rfbScreen->udpSock,
+		 EPOLL_SCREEN, EPOLLIN);
+
+    /* reverse connections made before rfbInitServer() */
+    i = rfbGetClientIterator(rfbScreen);
+    while ((cl = rfbClientIteratorNext(i)))
+	rfbEpollAddClient(cl);
+    rfbReleaseClientIterator(i);
+}
+
+static void
+EpollShutdown(rfbScreenInfoPtr rfbScreen)
+{
+    rfbClientPtr cl;
+
+    if (rfbScreen->epollFd < 0)
+	return;
+    close(rfbScreen->epollFd);
+    rfbScreen->epollFd = -1;
+    while ((cl = rfbScreen->readyClients) != NULL) {
+	rfbScreen->readyClients = cl->nextReady;
+	cl->isReady = FALSE;
+    }
+}
+
+/* called as a client is set up */
+void
+rfbEpollAddClient(rfbClientPtr cl)
+{
+    if (cl->screen->epollFd >= 0 && cl->sock >= 0 &&
+        cl->sock != cl->screen->udpSock)
+	EpollAdd(cl->screen, cl->sock, cl, EPOLL_CLIENT,
+		 EPOLLIN | EPOLLRDHUP | EPOLLET);
+}
+
+/* asks for EPOLLOUT while cl has output queued, see rfbFlushOutputQueue() */
+static void
+EpollWatchOutput(rfbClientPtr cl, rfbBool on)
+{
+    struct epoll_event ev;
+
+    if (cl->screen->epollFd < 0 || cl->sock < 0)
+	return;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (on ? EPOLLOUT : 0);
+    ev.data.u64 = (uint64_t)(uintptr_t)cl | EPOLL_CLIENT;
+    if (epoll_ctl(cl->screen->epollFd, EPOLL_CTL_MOD, cl->sock, &ev) < 0)
+	rfbLogPerror("rfbCheckFds: epoll_ctl");
+}
+
+/* called as a client goes, before it is freed */
+void
+rfbEpollRemoveClient(rfbClientPtr cl)
+{
+    rfbClientPtr *link;
+
+    for (link = &cl->screen->readyClients; *link; link = &(*link)->nextReady)
+	if (*link == cl) {
+	    *link = cl->nextReady;
+	    break;
+	}
+    cl->isReady = FALSE;
+    if (cl->deferTimer.fd >= 0)
+	close(cl->deferTimer.fd);
+    if (cl->ptrDeferTimer.fd >= 0)
+	close(cl->ptrDeferTimer.fd);
+    cl->deferTimer.fd = cl->ptrDeferTimer.fd = -1;
+}
+
+/*
+ * rfbDeferTimerDue times a deferral in rfbUpdateClient() when the screen
+ * waits with epoll: the first call arms a timerfd for ms milliseconds,
+ * whose expiry wakes epoll_wait(), and the first call after that returns 1
+ * and ends the deferral.  Returns 0 while the timer runs, or -1 if there is
+ * no timer and the caller should keep time itself.
+ */
+
+int
+rfbDeferTimerDue(rfbClientPtr cl, rfbDeferTimer *t, int ms)
+{
+    struct itimerspec its;
+    uint64_t expirations;
+
+    if (cl->screen->epollFd < 0)
+	return -1;
+    if (ms <= 0)
+	return 1;
+
+    if (t->fd < 0) {
+	if ((t->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0)
+	    return -1;
+	fcntl(t->fd, F_SETFD, FD_CLOEXEC);
+	EpollAdd(cl->screen, t->fd, cl, EPOLL_TIMER, EPOLLIN | EPOLLET);
+	t->armed = FALSE;
+    }
+
+    if (!t->armed) {
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000;
+	if (timerfd_settime(t->fd, 0, &its, NULL) < 0)
+	    return -1;
+	t->armed = TRUE;
+	return 0;
+    }
+
+    if (read(t->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+	return 0;
+    t->armed = FALSE;
+    return 1;
+}
+
+/* whether a client has more to read after a message, or has hung up */
+static rfbBool
+ClientInputPending(rfbClientPtr cl)
+{
+    char c;
+
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+    if (cl->sslctx && rfbssl_pending(cl))
+	return TRUE;
+#endif
+    return recv(cl->sock, &c, 1, MSG_PEEK | MSG_DONTWAIT) >= 0;
+}
+
+static int
+EpollCheckFds(rfbScreenInfoPtr rfbScreen, long usec)
+{
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    rfbClientIteratorPtr i;
+    rfbClientPtr cl, *link;
+    int nfds, n, result = 0;
+    void *ptr;
+
+    do {
+	nfds = epoll_wait(rfbScreen->epollFd, events, EPOLL_MAX_EVENTS,
+			  rfbScreen->readyClients ? 0 : (usec + 999) / 1000);
+	if (nfds < 0) {
+	    if (errno != EINTR)
+		rfbLogPerror("rfbCheckFds: epoll_wait");
+	    return -1;
+	}
+	result += nfds;
+
+	for (n = 0; n < nfds; n++) {
+	    ptr = (void *)(uintptr_t)(events[n].data.u64 & ~(uint64_t)EPOLL_KIND);
+	    switch (events[n].data.u64 & EPOLL_KIND) {
+	    case EPOLL_CLIENT:
+		cl = (rfbClientPtr)ptr;
+		if ((events[n].events & EPOLLOUT) && !rfbFlushOutputQueue(cl))
+		    break;
+		if (!(events[n].events & ~EPOLLOUT))
+		    break;
+		if (!cl->isReady) {
+		    cl->isReady = TRUE;
+		    cl->nextReady = rfbScreen->readyClients;
+		    rfbScreen->readyClients = cl;
+		}
+		break;
+	    case EPOLL_SCREEN:
+		if (ptr == &rfbScreen->udpSock) {
+		    if (!CheckUDPSocket(rfbScreen))
+			return -1;
+		} else if (!rfbProcessNewConnection(rfbScreen)) {
+		    return -1;
+		}
+		break;
+	    }
+	}
+
+	link = &rfbScreen->readyClients;
+	while ((cl = *link) != NULL) {
+	    if (cl->sock >= 0 && !cl->onHold)
+		rfbProcessClientMessage(cl);
+	    if (cl->sock >= 0 && !cl->onHold && ClientInputPending(cl)) {
+		link = &cl->nextReady;
+	    } else {
+		*link = cl->nextReady;
+		cl->isReady = FALSE;
+	    }
+	}
+
+	if (rfbScreen->permitFileTransfer) {
+	    i = rfbGetClientIterator(rfbScreen);
+	    while ((cl = rfbClientIteratorNext(i)))
+		if (cl->sock >= 0 && !cl->onHold && !cl->isReady)
+		    rfbSendFileTransferChunk(cl);
+	    rfbReleaseClientIterator(i);
+	}
+    } while(rfbScreen->handleEventsEagerly);
+    return result;
+}
+
+#else
+
+static void EpollInit(rfbScreenInfoPtr rfbScreen) {}
+static void EpollShutdown(rfbScreenInfoPtr rfbScreen) {}
+static void EpollWatchOutput(rfbClientPtr cl, rfbBool on) {}
+void rfbEpollAddClient(rfbClientPtr cl) {}
+void rfbEpollRemoveClient(rfbClientPtr cl) {}
+int rfbDeferTimerDue(rfbClientPtr cl, rfbDeferTimer *t, int ms) { return -1; }
+
+#endif /* LIBVNCSERVER_HAVE_SYS_EPOLL_H */
+
 /*
  * rfbCheckFds is called from ProcessInputEvents to check for input on the RFB
  * socket(s).  If there is input to process, the appropriate function in the
@@ -258,11 +596,9 @@ int
 rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec)
 {
     int nfds;
-    fd_set fds;
+    fd_set fds, wfds;
+    rfbBool queued;
     struct timeval tv;
-    struct sockaddr_in addr;
-    socklen_t addrlen = sizeof(addr);
-    char buf[6];
     rfbClientIteratorPtr i;
     rfbClientPtr cl;
     int result = 0;
@@ -272,11 +608,30 @@ rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec)
 	rfbScreen->inetdInitDone = TRUE;
     }
 
+#ifdef LIBVNCSERVER_HAVE_SYS_EPOLL_H
+    if (rfbScreen->epollFd >= 0)
+	return EpollCheckFds(rfbScreen, usec);
+#endif
+
     do {
 	memcpy((char *)&fds, (char *)&(rfbScreen->allFds), sizeof(fd_set));
+	/* clients with output queued or a file going out wait to be able to
+	   write too */
+	FD_ZERO(&wfds);
+	queued = FALSE;
+	i = rfbGetClientIterator(rfbScreen);
+	while((cl = rfbClientIteratorNext(i))) {
+	    if ((cl->outQueue != NULL ||
+	         (cl->fileTransfer.fd != -1 && cl->fileTransfer.sending)) &&
+	        cl->sock >= 0 && cl->sock < FD_SETSIZE) {
+		FD_SET(cl->sock, &wfds);
+		queued = TRUE;
+	    }
+	}
+	rfbReleaseClientIterator(i);
 	tv.tv_sec = 0;
 	tv.tv_usec = usec;
-	nfds = select(rfbScreen->maxFd + 1, &fds, NULL, NULL /* &fds */, &tv);
+	nfds = select(rfbScreen->maxFd + 1, &fds, queued ? &wfds : NULL, NULL, &tv);
 	if (nfds == 0) {
 	    /* timed out, check for async events */
             i = rfbGetClientIterator(rfbScreen);
@@ -301,6 +656,20 @@ rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec)
 
 	result += nfds;
 
+	if (queued) {
+	    i = rfbGetClientIterator(rfbScreen);
+	    while((cl = rfbClientIteratorNext(i))) {
+		if (cl->outQueue != NULL && cl->sock >= 0 &&
+		    cl->sock < FD_SETSIZE && FD_ISSET(cl->sock, &wfds)) {
+		    rfbFlushOutputQueue(cl);
+		    nfds--;
+		}
+	    }
+	    rfbReleaseClientIterator(i);
+	    if (nfds == 0)
+		return result;
+	}
+
 	if (rfbScreen->listenSock != -1 && FD_ISSET(rfbScreen->listenSock, &fds)) {
 
 	    if (!rfbProcessNewConnection(rfbScreen))
@@ -322,35 +691,8 @@ rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec)
 	}
 
 	if ((rfbScreen->udpSock != -1) && FD_ISSET(rfbScreen->udpSock, &fds)) {
-	    if(!rfbScreen->udpClient)
-		rfbNewUDPClient(rfbScreen);
-	    if (recvfrom(rfbScreen->udpSock, buf, 1, MSG_PEEK,
-			(struct sockaddr *)&addr, &addrlen) < 0) {
-		rfbLogPerror("rfbCheckFds: UDP: recvfrom");
-		rfbDisconnectUDPSock(rfbScreen);
-		rfbScreen->udpSockConnected = FALSE;
-	    } else {
-		if (!rfbScreen->udpSockConnected ||
-			(memcmp(&addr, &rfbScreen->udpRemoteAddr, addrlen) != 0))
-		{
-		    /* new remote end */
-		    rfbLog("rfbCheckFds: UDP: got connection\n");
-
-		    memcpy(&rfbScreen->udpRemoteAddr, &addr, addrlen);
-		    rfbScreen->udpSockConnected = TRUE;
-
-		    if (connect(rfbScreen->udpSock,
-				(struct sockaddr *)&addr, addrlen) < 0) {
-			rfbLogPerror("rfbCheckFds: UDP: connect");
-			rfbDisconnectUDPSock(rfbScreen);
-			return -1;
-		    }
-
-		    rfbNewUDPConnection(rfbScreen,rfbScreen->udpSock);
-		}
-
-		rfbProcessUDPInput(rfbScreen);
-	    }
+	    if (!CheckUDPSocket(rfbScreen))
+		return -1;
 
 	    FD_CLR(rfbScreen->udpSock, &fds);
 	    if (--nfds == 0)
@@ -360,7 +702,7 @@ rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec)
 	i = rfbGetClientIterator(rfbScreen);
 	while((cl = rfbClientIteratorNext(i))) {
 
-	    if (cl->onHold)
+	    if (cl->onHold || cl->sock < 0)
 		continue;
 
             if (FD_ISSET(cl->sock, &(rfbScreen->allFds)))
@@ -473,7 +815,8 @@ rfbCloseClient(rfbClientPtr cl)
     if (cl->sock != -1)
 #endif
       {
-	FD_CLR(cl->sock,&(cl->screen->allFds));
+	if (cl->sock < FD_SETSIZE)
+	    FD_CLR(cl->sock,&(cl->screen->allFds));
 	if(cl->sock==cl->screen->maxFd)
 	  while(cl->screen->maxFd>0
 		&& !FD_ISSET(cl->screen->maxFd,&(cl->screen->allFds)))
@@ -702,108 +1045,539 @@ rfbPeekExactTimeout(rfbClientPtr cl, char* buf, int len, int timeout)
 }
 
 /*
- * WriteExact writes an exact number of bytes to a client.  Returns 1 if
- * those bytes have been written, or -1 if an error occurred (errno is set to
- * ETIMEDOUT if it timed out).
+ * Waits for sock to take more output after a write would have blocked.
+ * Returns 1 to try the write again, or -1 if an error occurred or the
+ * client has not taken anything for timeout ms (errno is set).
  */
 
-int
-rfbWriteExact(rfbClientPtr cl,
-              const char *buf,
-              int len)
+static int
+WaitForWrite(int sock, int *totalTimeWaited, int timeout)
 {
-    int sock = cl->sock;
-    int n;
     fd_set fds;
     struct timeval tv;
-    int totalTimeWaited = 0;
-    const int timeout = (cl->screen && cl->screen->maxClientWait) ? cl->screen->maxClientWait : rfbMaxClientWait;
+    int n;
 
-#undef DEBUG_WRITE_EXACT
-#ifdef DEBUG_WRITE_EXACT
-    rfbLog("WriteExact %d bytes\n",len);
-    for(n=0;n<len;n++)
-	    fprintf(stderr,"%02x ",(unsigned char)buf[n]);
-    fprintf(stderr,"\n");
-#endif
+    /* Retry every 5 seconds until we exceed timeout.  We
+       need to do this because select doesn't necessarily return
+       immediately when the other end has gone away */
 
-#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
-    if (cl->wsctx) {
-        char *tmp = NULL;
-        if ((len = webSocketsEncode(cl, buf, len, &tmp)) < 0) {
-            rfbErr("WriteExact: WebSockets encode error\n");
+    FD_ZERO(&fds);
+    FD_SET(sock, &fds);
+    tv.tv_sec = 5;
+    tv.tv_usec = 0;
+    n = select(sock+1, NULL, &fds, NULL /* &fds */, &tv);
+    if (n < 0) {
+#ifdef WIN32
+        errno=WSAGetLastError();
+#endif
+        if(errno==EINTR)
+            return 1;
+        rfbLogPerror("WriteExact: select");
+        return -1;
+    }
+    if (n == 0) {
+        *totalTimeWaited += 5000;
+        if (*totalTimeWaited >= timeout) {
+            errno = ETIMEDOUT;
             return -1;
         }
-        buf = tmp;
+    } else {
+        *totalTimeWaited = 0;
+    }
+    return 1;
+}
+
+/*
+ * Output queues.  With screen->maxClientQueue set, what a client's socket
+ * would block on is kept in cl->outQueue instead of waited for, so that a
+ * viewer on a slow link does not stall the others, nor capture and input
+ * when all run in the one thread.  rfbCheckFds() writes the queue out as
+ * the socket takes it.  Framebuffer updates are written between
+ * rfbBeginUpdateOutput() and rfbEndUpdateOutput(), so that one queued whole
+ * can be found and dropped for a later one (see rfbserver.c).
+ */
+
+#ifndef WIN32
+
+static rfbBool
+QueueingOutput(rfbClientPtr cl)
+{
+    if (cl->outQueue != NULL)
+	return TRUE;
+    if (cl->screen == NULL || cl->screen->maxClientQueue <= 0 ||
+        cl->sock == cl->screen->udpSock)
+	return FALSE;
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    if (cl->screen->backgroundLoop)
+	return FALSE;
+#endif
+    return TRUE;
+}
+
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+
+/*
+ * SslWriteV writes iov with rfbssl_write(), which takes one buffer at a
+ * time, up to the first buffer that does not all go out.  Returns the
+ * bytes written, or -1 if none were (errno is set).
+ */
+
+static ssize_t
+SslWriteV(rfbClientPtr cl, struct iovec *iov, int iovcnt)
+{
+    ssize_t done = 0;
+    int i, n;
+
+    for (i = 0; i < iovcnt; i++) {
+	if (iov[i].iov_len == 0)
+	    continue;
+	if ((n = rfbssl_write(cl, iov[i].iov_base, iov[i].iov_len)) < 0)
+	    return done > 0 ? done : -1;
+	done += n;
+	if ((size_t)n < iov[i].iov_len)
+	    break;
     }
+    return done;
+}
+
+#endif
+
+/*
+ * QueueOutput writes what of iov the socket takes without blocking, if
+ * nothing is queued before it, and queues the rest.  Returns 1, or -1 if
+ * an error occurred (errno is set).
+ */
+
+static int
+QueueOutput(rfbClientPtr cl, struct iovec *iov, int iovcnt)
+{
+    rfbQueuedOutput *q;
+    ssize_t n = 0;
+    int i, len = 0;
+    char *data;
+
+    if (cl->outQueue == NULL) {
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+	if (cl->sslctx) {
+	    n = SslWriteV(cl, iov, iovcnt);
+	    /* SSL may have taken in what it could not send, which can then
+	       only be written again, not dropped for a later update */
+	    if (cl->writingUpdate)
+		cl->updateWritten = TRUE;
+	} else
 #endif
+	do
+	    n = writev(cl->sock, iov, iovcnt);
+	while (n < 0 && errno == EINTR);
+	if (n < 0) {
+	    if (errno != EWOULDBLOCK && errno != EAGAIN)
+		return -1;
+	    n = 0;
+	}
+	if (n > 0 && cl->writingUpdate)
+	    cl->updateWritten = TRUE;
+    }
+
+    for (i = 0; i < iovcnt; i++)
+	len += iov[i].iov_len;
+    len -= n;
+    if (len == 0)
+	return 1;
+
+    /* each update gets a stretch of its own, other output shares one */
+    q = cl->outQueueTail;
+    if (q == NULL || q->isUpdate != cl->writingUpdate ||
+        (cl->writingUpdate && q != cl->updateOutput)) {
+	if ((q = (rfbQueuedOutput *)calloc(1, sizeof(*q))) == NULL)
+	    return -1;
+	q->isUpdate = cl->writingUpdate;
+	if (cl->writingUpdate)
+	    cl->updateOutput = q;
+	if (cl->outQueueTail != NULL) {
+	    cl->outQueueTail->next = q;
+	} else {
+	    cl->outQueue = q;
+	    gettimeofday(&cl->outQueueProgress, NULL);
+	    EpollWatchOutput(cl, TRUE);
+	}
+	cl->outQueueTail = q;
+    }
+
+    if (q->len + len > q->size) {
+	int size = q->size > 0 ? q->size * 2 : 4096;
+
+	while (size < q->len + len)
+	    size *= 2;
+	if ((data = (char *)realloc(q->data, size)) == NULL)
+	    return -1;
+	q->data = data;
+	q->size = size;
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+	if ((size_t)n >= iov[i].iov_len) {
+	    n -= iov[i].iov_len;
+	    continue;
+	}
+	memcpy(q->data + q->len, (char *)iov[i].iov_base + n,
+	       iov[i].iov_len - n);
+	q->len += iov[i].iov_len - n;
+	n = 0;
+    }
+
+    cl->outQueueBytes += len;
+    if (cl->outQueueBytes > cl->outQueuePeak)
+	cl->outQueuePeak = cl->outQueueBytes;
+    return 1;
+}
+
+#define FLUSH_IOV 16
+
+/*
+ * rfbFlushOutputQueue writes as much of cl's output queue as the socket
+ * takes without blocking.  Returns FALSE if the client had to be closed.
+ */
+
+rfbBool
+rfbFlushOutputQueue(rfbClientPtr cl)
+{
+    struct iovec iov[FLUSH_IOV];
+    rfbQueuedOutput *q;
+    ssize_t n;
+    int cnt, len;
 
     LOCK(cl->outputMutex);
-    while (len > 0) {
+    while (cl->outQueue != NULL) {
+	for (q = cl->outQueue, cnt = 0; q != NULL && cnt < FLUSH_IOV;
+	     q = q->next, cnt++) {
+	    iov[cnt].iov_base = q->data + q->sent;
+	    iov[cnt].iov_len = q->len - q->sent;
+	}
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+	if (cl->sslctx) {
+	    q = cl->outQueue;
+	    n = rfbssl_write(cl, iov[0].iov_base, iov[0].iov_len);
+	    if (n < 0 && errno == EAGAIN && q->region != NULL) {
+		/* SSL has it now, see QueueOutput() */
+		sraRgnDestroy(q->region);
+		q->region = NULL;
+	    }
+	} else
+#endif
+	n = writev(cl->sock, iov, cnt);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EWOULDBLOCK || errno == EAGAIN)
+		break;
+	    UNLOCK(cl->outputMutex);
+	    rfbLogPerror("rfbFlushOutputQueue: write");
+	    rfbCloseClient(cl);
+	    return FALSE;
+	}
+	if (n == 0)
+	    break;
+
+	gettimeofday(&cl->outQueueProgress, NULL);
+	while (n > 0) {
+	    q = cl->outQueue;
+	    len = q->len - q->sent;
+	    if (n < len) {
+		q->sent += n;
+		cl->outQueueBytes -= n;
+		break;
+	    }
+	    n -= len;
+	    rfbRemoveQueuedOutput(cl, &cl->outQueue);
+	}
+    }
+    if (cl->outQueue == NULL)
+	EpollWatchOutput(cl, FALSE);
+    UNLOCK(cl->outputMutex);
+    return TRUE;
+}
+
+/*
+ * rfbOutputQueueStalled tells whether cl has had output queued that it has
+ * not taken any of for maxClientWait ms, when rfbWriteExact() would have
+ * given up on it.
+ */
+
+rfbBool
+rfbOutputQueueStalled(rfbClientPtr cl)
+{
+    const int timeout = cl->screen->maxClientWait ? cl->screen->maxClientWait : rfbMaxClientWait;
+    struct timeval now;
+
+    if (cl->outQueue == NULL)
+	return FALSE;
+    gettimeofday(&now, NULL);
+    if ((now.tv_sec - cl->outQueueProgress.tv_sec) * 1000 +
+        (now.tv_usec - cl->outQueueProgress.tv_usec) / 1000 < timeout)
+	return FALSE;
+    rfbLog("Client %s took no output for %d ms\n", cl->host, timeout);
+    return TRUE;
+}
+
+/* Unlinks the queued output at *link from cl's queue and frees it. */
+void
+rfbRemoveQueuedOutput(rfbClientPtr cl, rfbQueuedOutput **link)
+{
+    rfbQueuedOutput *q = *link, *prev;
+
+    *link = q->next;
+    if (cl->outQueueTail == q) {
+	for (prev = cl->outQueue; prev != NULL && prev->next != NULL;
+	     prev = prev->next)
+	    ;
+	cl->outQueueTail = prev;
+    }
+    if (cl->updateOutput == q)
+	cl->updateOutput = NULL;
+    cl->outQueueBytes -= q->len - q->sent;
+    if (q->region)
+	sraRgnDestroy(q->region);
+    free(q->data);
+    free(q);
+}
+
+void
+rfbFreeOutputQueue(rfbClientPtr cl)
+{
+    while (cl->outQueue != NULL)
+	rfbRemoveQueuedOutput(cl, &cl->outQueue);
+}
+
+#else
+
+static rfbBool QueueingOutput(rfbClientPtr cl) { return FALSE; }
+static int QueueOutput(rfbClientPtr cl, struct iovec *iov, int iovcnt) { return -1; }
+rfbBool rfbFlushOutputQueue(rfbClientPtr cl) { return TRUE; }
+rfbBool rfbOutputQueueStalled(rfbClientPtr cl) { return FALSE; }
+void rfbRemoveQueuedOutput(rfbClientPtr cl, rfbQueuedOutput **link) {}
+void rfbFreeOutputQueue(rfbClientPtr cl) {}
+
+#endif /* WIN32 */
+
+void
+rfbBeginUpdateOutput(rfbClientPtr cl)
+{
+    cl->writingUpdate = TRUE;
+    cl->updateWritten = FALSE;
+    cl->updateOutput = NULL;
+}
+
+/*
+ * Returns the queued output holding all the update written since
+ * rfbBeginUpdateOutput(), or NULL if any of it has gone out already or
+ * none of it was queued.
+ */
+
+rfbQueuedOutput *
+rfbEndUpdateOutput(rfbClientPtr cl)
+{
+    cl->writingUpdate = FALSE;
+    return cl->updateWritten ? NULL : cl->updateOutput;
+}
+
+/*
+ * WriteV writes iovcnt buffers to a client as they are, one after the other.
+ * Returns 1 if they have been written, or -1 if an error occurred (errno is
+ * set to ETIMEDOUT if it timed out).  With screen->maxClientQueue set, what
+ * the socket does not take at once is queued instead.  iov is updated as it
+ * is written.
+ */
+
+static int
+WriteV(rfbClientPtr cl, struct iovec *iov, int iovcnt)
+{
+    int sock = cl->sock;
+    ssize_t n;
+    int totalTimeWaited = 0;
+    const int timeout = (cl->screen && cl->screen->maxClientWait) ? cl->screen->maxClientWait : rfbMaxClientWait;
+
+    LOCK(cl->outputMutex);
+    if (QueueingOutput(cl)) {
+        n = QueueOutput(cl, iov, iovcnt);
+        UNLOCK(cl->outputMutex);
+        return n;
+    }
+    while (iovcnt > 0) {
+        if (iov->iov_len == 0) {
+            iov++;
+            iovcnt--;
+            continue;
+        }
 #ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+        /* SSL encrypts each buffer by itself */
         if (cl->sslctx)
-	    n = rfbssl_write(cl, buf, len);
-	else
+            n = rfbssl_write(cl, iov->iov_base, iov->iov_len);
+        else
+#endif
+#ifdef WIN32
+            n = write(sock, iov->iov_base, iov->iov_len);
+#else
+            n = writev(sock, iov, iovcnt);
 #endif
-	    n = write(sock, buf, len);
 
         if (n > 0) {
 
-            buf += n;
-            len -= n;
+            while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+                n -= iov->iov_len;
+                iov++;
+                iovcnt--;
+            }
+            if (n > 0) {
+                iov->iov_base = (char *)iov->iov_base + n;
+                iov->iov_len -= n;
+            }
 
         } else if (n == 0) {
 
             rfbErr("WriteExact: write returned 0?\n");
+            UNLOCK(cl->outputMutex);
             return 0;
 
         } else {
 #ifdef WIN32
-			errno = WSAGetLastError();
+            errno = WSAGetLastError();
 #endif
-	    if (errno == EINTR)
-		continue;
+            if (errno == EINTR)
+                continue;
 
-            if (errno != EWOULDBLOCK && errno != EAGAIN) {
-	        UNLOCK(cl->outputMutex);
-                return n;
+            if ((errno != EWOULDBLOCK && errno != EAGAIN) ||
+                WaitForWrite(sock, &totalTimeWaited, timeout) < 0) {
+                UNLOCK(cl->outputMutex);
+                return -1;
             }
+        }
+    }
+    UNLOCK(cl->outputMutex);
+    return 1;
+}
 
-            /* Retry every 5 seconds until we exceed timeout.  We
-               need to do this because select doesn't necessarily return
-               immediately when the other end has gone away */
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
 
-            FD_ZERO(&fds);
-            FD_SET(sock, &fds);
-            tv.tv_sec = 5;
-            tv.tv_usec = 0;
-            n = select(sock+1, NULL, &fds, NULL /* &fds */, &tv);
-	    if (n < 0) {
-#ifdef WIN32
-                errno=WSAGetLastError();
-#endif
-       	        if(errno==EINTR)
-		    continue;
-                rfbLogPerror("WriteExact: select");
-                UNLOCK(cl->outputMutex);
-                return n;
-            }
-            if (n == 0) {
-                totalTimeWaited += 5000;
-                if (totalTimeWaited >= timeout) {
-                    errno = ETIMEDOUT;
-                    UNLOCK(cl->outputMutex);
-                    return -1;
-                }
-            } else {
-                totalTimeWaited = 0;
+/* most buffers WriteWebSockets() sends behind one frame header */
+#define WS_FRAME_IOV 8
+
+/*
+ * WriteWebSockets sends iovcnt buffers to a WebSockets client as one binary
+ * frame, the buffers going out behind the frame header as they are.  Those
+ * to clients taking their frames base64 encoded, and to wss clients, where
+ * SSL has to copy anyway, are encoded instead, into frames of at most
+ * UPDATE_BUF_SIZE bytes of the buffers each.
+ */
+
+static int
+WriteWebSockets(rfbClientPtr cl, struct iovec *iov, int iovcnt)
+{
+    struct iovec frame[WS_FRAME_IOV + 1];
+    char header[WEBSOCKETS_MAX_FRAME_HEADER], *buf, *encoded;
+    int i, n, m, len = 0;
+
+    for (i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    if (len == 0)
+        return 1;
+
+    if (!cl->sslctx && iovcnt <= WS_FRAME_IOV &&
+        (n = webSocketsFrameHeader(cl, len, header)) > 0) {
+        frame[0].iov_base = header;
+        frame[0].iov_len = n;
+        memcpy(frame + 1, iov, iovcnt * sizeof(*iov));
+        return WriteV(cl, frame, iovcnt + 1);
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        buf = iov[i].iov_base;
+        for (len = iov[i].iov_len; len > 0; len -= n, buf += n) {
+            n = len < UPDATE_BUF_SIZE ? len : UPDATE_BUF_SIZE;
+            if ((m = webSocketsEncode(cl, buf, n, &encoded)) < 0) {
+                rfbErr("WriteExact: WebSockets encode error\n");
+                return -1;
             }
+            frame[0].iov_base = encoded;
+            frame[0].iov_len = m;
+            if (WriteV(cl, frame, 1) < 0)
+                return -1;
         }
     }
-    UNLOCK(cl->outputMutex);
     return 1;
 }
 
+#endif
+
+/*
+ * WriteExact writes an exact number of bytes to a client.  Returns 1 if
+ * those bytes have been written, or -1 if an error occurred (errno is set to
+ * ETIMEDOUT if it timed out).  With screen->maxClientQueue set, what the
+ * socket does not take at once is queued instead.
+ */
+
+int
+rfbWriteExact(rfbClientPtr cl,
+              const char *buf,
+              int len)
+{
+    struct iovec iov;
+
+#undef DEBUG_WRITE_EXACT
+#ifdef DEBUG_WRITE_EXACT
+    int n;
+    rfbLog("WriteExact %d bytes\n",len);
+    for(n=0;n<len;n++)
+	    fprintf(stderr,"%02x ",(unsigned char)buf[n]);
+    fprintf(stderr,"\n");
+#endif
+
+    iov.iov_base = (char *)buf;
+    iov.iov_len = len;
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+    if (cl->wsctx)
+        return WriteWebSockets(cl, &iov, 1);
+#endif
+    return WriteV(cl, &iov, 1);
+}
+
+/*
+ * WriteExactV writes iovcnt buffers to a client one after the other, as
+ * rfbWriteExact() would their concatenation, but with writev() so that they
+ * need not be copied together first.  iov is updated as it is written, and
+ * iovcnt must not be more than IOV_MAX.
+ */
+
+int
+rfbWriteExactV(rfbClientPtr cl,
+               struct iovec *iov,
+               int iovcnt)
+{
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+    if (cl->wsctx)
+        return WriteWebSockets(cl, iov, iovcnt);
+#endif
+    return WriteV(cl, iov, iovcnt);
+}
+
+/*
+ * CorkClient holds back partial packets to a client from when cork is TRUE
+ * until it is FALSE again, so that the pieces of a framebuffer update go out
+ * in full-sized segments despite TCP_NODELAY.  It does nothing where
+ * TCP_CORK is not available.
+ */
+
+void
+rfbCorkClient(rfbClientPtr cl, rfbBool cork)
+{
+#ifdef TCP_CORK
+    int one = cork ? 1 : 0;
+
+    if (cl->sock < 0)
+        return;
+    setsockopt(cl->sock, IPPROTO_TCP, TCP_CORK, (char *)&one, sizeof(one));
+#endif
+}
+
 /* currently private, called by rfbProcessArguments() */
 int
 rfbStringToAddr(char *str, in_addr_t *addr)  {
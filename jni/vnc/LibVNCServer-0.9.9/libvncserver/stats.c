@@ -474,6 +474,10 @@ void rfbPrintStats(rfbClientPtr cl)
         savings = 100.0 - ((totalBytes/totalBytesIfRaw)*100.0);
     rfbLog(" %-20.20s: %6d | %9.0f/%9.0f (%5.1f%%)\n",
             "TOTALS", totalRects, totalBytes,totalBytesIfRaw, savings);
+
+    if (cl->outQueuePeak > 0)
+        rfbLog("Output queue: peak %d bytes, %d updates of %d bytes dropped\n",
+               cl->outQueuePeak, cl->updatesDropped, cl->updateBytesDropped);
       
 } 
 
@@ -36,7 +36,9 @@
  */
 
 #include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
 #include "private.h"
+#include "scale.h"
 
 #ifdef LIBVNCSERVER_HAVE_LIBPNG
 #include <png.h>
@@ -52,21 +54,6 @@
 #define MIN_SOLID_SUBRECT_SIZE  2048
 #define MAX_SPLIT_TILE_SIZE       16
 
-/*
- * There is so much access of the Tight encoding static data buffers
- * that we resort to using thread local storage instead of having
- * per-client data.
- */
-#if LIBVNCSERVER_HAVE_LIBPTHREAD && LIBVNCSERVER_HAVE_TLS && !defined(TLS) && defined(__linux__)
-#define TLS __thread
-#endif
-#ifndef TLS
-#define TLS
-#endif
-
-/* This variable is set on every rfbSendRectEncodingTight() call. */
-static TLS rfbBool usePixelFormat24 = FALSE;
-
 
 /* Compression level stuff. The following array contains various
    encoder parameters for each of 10 compression levels (0..9).
@@ -106,10 +93,6 @@ static TIGHT_PNG_CONF tightPngConf[10] = {
 };
 #endif
 
-static TLS int compressLevel = 1;
-static TLS int qualityLevel = 95;
-static TLS int subsampLevel = TJ_444;
-
 static const int subsampLevel2tjsubsamp[4] = {
     TJ_444, TJ_420, TJ_422, TJ_GRAYSCALE
 };
@@ -134,41 +117,144 @@ typedef struct PALETTE_s {
     COLOR_LIST list[256];
 } PALETTE;
 
-/* TODO: move into rfbScreen struct */
-static TLS int paletteNumColors = 0;
-static TLS int paletteMaxColors = 0;
-static TLS uint32_t monoBackground = 0;
-static TLS uint32_t monoForeground = 0;
-static TLS PALETTE palette;
+/*
+ * Per-client encoder state, kept in cl->tightEncoder so that different
+ * clients can be encoded from different threads at the same time.
+ */
 
-/* Pointers to dynamically-allocated buffers. */
+typedef struct TIGHT_STATE_s {
+    /* These are set on every rfbSendRectEncodingTight() call. */
+    rfbBool usePixelFormat24;
+    int compressLevel;
+    int qualityLevel;
+    int subsampLevel;
+
+    int paletteNumColors;
+    int paletteMaxColors;
+    uint32_t monoBackground;
+    uint32_t monoForeground;
+    PALETTE palette;
+
+    /* Pointers to dynamically-allocated buffers. */
+    int tightBeforeBufSize;
+    char *tightBeforeBuf;
+    int tightAfterBufSize;
+    char *tightAfterBuf;
+    int jpegRgbBufSize;
+    unsigned char *jpegRgbBuf;
+
+    tjhandle j;
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+    int pngDstDataLen;
+#endif
 
-static TLS int tightBeforeBufSize = 0;
-static TLS char *tightBeforeBuf = NULL;
+    /* Parallel encoding, see rfbSendRegionEncodingTight(). */
+    int nWorkers;
+    struct TIGHT_WORKER_s *workers;
+    int nJobs;
+    struct TIGHT_JOB_s *jobs;
+
+    /* Zlib streams the client has reset that ours have not caught up with
+       yet, see SendStreamControl(). */
+    int streamsToReset;
+
+    /* Output shared between clients, see encodecache.c: every rectangle
+       resets the zlib streams it uses and is compressed afresh. */
+    rfbBool stateless;
+    int streamsUsed;
+    z_stream freshStream;
+    rfbBool freshActive;
+    int freshLevel, freshStrategy;
+} TIGHT_STATE;
+
+/* A stand-in for the client for each encode pool thread, output captured:
+   its updateBuf is the thread's own, emptied into the job's sink. */
+typedef struct TIGHT_WORKER_s {
+    rfbClientPtr cl;
+    TIGHT_STATE *ts;
+} TIGHT_WORKER;
+
+typedef struct TIGHT_JOB_s {
+    TIGHT_STATE *owner;
+    int x, y, w, h;
+    rfbEncodeSink sink;
+    rfbBool ok;
+    rfbBool cached;     /* sink filled from the encode cache */
+    int streams;        /* streams reset by stateless output */
+} TIGHT_JOB;
+
+/* rfbEncodeRecord kind for data still to go through a zlib stream */
+#define TIGHT_ZLIB_RECORD(streamId, level, strategy) \
+    ((streamId) | (level) << 4 | (strategy) << 8)
+/* rfbEncodeRecord kind for a control byte that may need reset bits added */
+#define TIGHT_CONTROL_RECORD(streamId) (0x10000 | (streamId))
+
+static TIGHT_STATE *
+GetTightState(rfbClientPtr cl)
+{
+    TIGHT_STATE *ts = (TIGHT_STATE *)cl->tightEncoder;
+
+    if (ts == NULL) {
+        ts = (TIGHT_STATE *)calloc(1, sizeof(TIGHT_STATE));
+        if (ts == NULL)
+            return NULL;
+        ts->compressLevel = 1;
+        ts->qualityLevel = 95;
+        ts->subsampLevel = TJ_444;
+        cl->tightEncoder = ts;
+    }
+    return ts;
+}
 
-static TLS int tightAfterBufSize = 0;
-static TLS char *tightAfterBuf = NULL;
+void rfbFreeTightData(rfbClientPtr cl)
+{
+    TIGHT_STATE *ts = (TIGHT_STATE *)cl->tightEncoder;
+    int i;
 
-static TLS tjhandle j = NULL;
+    if (ts == NULL)
+        return;
+    for (i = 0; i < ts->nWorkers; i++) {
+        if (ts->workers[i].cl == NULL)
+            continue;
+        rfbFreeTightData(ts->workers[i].cl);
+        rfbResetStats(ts->workers[i].cl);
+        free(ts->workers[i].cl);
+    }
+    free(ts->workers);
+    for (i = 0; i < ts->nJobs; i++)
+        rfbEncodeSinkFree(&ts->jobs[i].sink);
+    free(ts->jobs);
+    free(ts->tightBeforeBuf);
+    free(ts->tightAfterBuf);
+    free(ts->jpegRgbBuf);
+    if (ts->j) tjDestroy(ts->j);
+    if (ts->freshActive) deflateEnd(&ts->freshStream);
+    free(ts);
+    cl->tightEncoder = NULL;
+}
 
+/* The buffers are per client now, see rfbFreeTightData(). */
 void rfbTightCleanup (rfbScreenInfoPtr screen)
 {
-    if (tightBeforeBufSize) {
-        free (tightBeforeBuf);
-        tightBeforeBufSize = 0;
-        tightBeforeBuf = NULL;
-    }
-    if (tightAfterBufSize) {
-        free (tightAfterBuf);
-        tightAfterBufSize = 0;
-        tightAfterBuf = NULL;
-    }
-    if (j) tjDestroy(j);
+}
+
+/*
+ * Output encoded for cl was dropped without being sent, see
+ * rfbScreenInfo::maxClientQueue, so the client's zlib streams are behind
+ * ours: each stream starts over the next time it is used.
+ */
+void rfbTightResetStreams(rfbClientPtr cl)
+{
+    TIGHT_STATE *ts = (TIGHT_STATE *)cl->tightEncoder;
+
+    if (ts != NULL)
+        ts->streamsToReset = 0x0F;
 }
 
 
 /* Prototypes for static functions. */
 
+static void SetTightLevels(rfbClientPtr cl, TIGHT_STATE *ts);
 static rfbBool SendRectEncodingTight(rfbClientPtr cl, int x, int y,
                                      int w, int h);
 static void FindBestSolidArea (rfbClientPtr cl, int x, int y, int w, int h,
@@ -196,29 +282,37 @@ static rfbBool SendFullColorRect (rfbClientPtr cl, int x, int y, int w, int h);
 
 static rfbBool CompressData (rfbClientPtr cl, int streamId, int dataLen,
                              int zlibLevel, int zlibStrategy);
+static rfbBool SendStreamControl (rfbClientPtr cl, int control,
+                                   int streamId);
+static int StreamReset (rfbClientPtr cl, TIGHT_STATE *ts, int streamId);
+static rfbBool CompressFresh (rfbClientPtr cl, char *data, int dataLen,
+                              int zlibLevel, int zlibStrategy);
+static rfbBool DeflateRect (rfbClientPtr cl, z_streamp pz);
+static rfbBool CompressStream (rfbClientPtr cl, int streamId, char *data,
+                               int dataLen, int zlibLevel, int zlibStrategy);
 static rfbBool SendCompressedData (rfbClientPtr cl, char *buf,
                                    int compressedLen);
 
-static void FillPalette8 (int count);
-static void FillPalette16 (int count);
-static void FillPalette32 (int count);
+static void FillPalette8 (TIGHT_STATE *ts, int count);
+static void FillPalette16 (TIGHT_STATE *ts, int count);
+static void FillPalette32 (TIGHT_STATE *ts, int count);
 static void FastFillPalette16 (rfbClientPtr cl, uint16_t *data, int w,
                                int pitch, int h);
 static void FastFillPalette32 (rfbClientPtr cl, uint32_t *data, int w,
                                int pitch, int h);
 
-static void PaletteReset (void);
-static int PaletteInsert (uint32_t rgb, int numPixels, int bpp);
+static void PaletteReset (TIGHT_STATE *ts);
+static int PaletteInsert (TIGHT_STATE *ts, uint32_t rgb, int numPixels, int bpp);
 
 static void Pack24 (rfbClientPtr cl, char *buf, rfbPixelFormat *fmt,
                     int count);
 
-static void EncodeIndexedRect16 (uint8_t *buf, int count);
-static void EncodeIndexedRect32 (uint8_t *buf, int count);
+static void EncodeIndexedRect16 (TIGHT_STATE *ts, uint8_t *buf, int count);
+static void EncodeIndexedRect32 (TIGHT_STATE *ts, uint8_t *buf, int count);
 
-static void EncodeMonoRect8 (uint8_t *buf, int w, int h);
-static void EncodeMonoRect16 (uint8_t *buf, int w, int h);
-static void EncodeMonoRect32 (uint8_t *buf, int w, int h);
+static void EncodeMonoRect8 (TIGHT_STATE *ts, uint8_t *buf, int w, int h);
+static void EncodeMonoRect16 (TIGHT_STATE *ts, uint8_t *buf, int w, int h);
+static void EncodeMonoRect32 (TIGHT_STATE *ts, uint8_t *buf, int w, int h);
 
 static rfbBool SendJpegRect (rfbClientPtr cl, int x, int y, int w, int h,
                              int quality);
@@ -243,7 +337,8 @@ rfbNumCodedRectsTight(rfbClientPtr cl,
                       int w,
                       int h)
 {
-    int maxRectSize, maxRectWidth;
+    TIGHT_STATE *ts = GetTightState(cl);
+    int level, maxRectSize, maxRectWidth;
     int subrectMaxWidth, subrectMaxHeight;
 
     /* No matter how many rectangles we will send if LastRect markers
@@ -251,8 +346,9 @@ rfbNumCodedRectsTight(rfbClientPtr cl,
     if (cl->enableLastRectEncoding && w * h >= MIN_SPLIT_RECT_SIZE)
         return 0;
 
-    maxRectSize = tightConf[compressLevel].maxRectSize;
-    maxRectWidth = tightConf[compressLevel].maxRectWidth;
+    level = ts != NULL ? ts->compressLevel : 1;
+    maxRectSize = tightConf[level].maxRectSize;
+    maxRectWidth = tightConf[level].maxRectWidth;
 
     if (w > maxRectWidth || w * h > maxRectSize) {
         subrectMaxWidth = (w > maxRectWidth) ? maxRectWidth : w;
@@ -287,24 +383,262 @@ rfbSendRectEncodingTightPng(rfbClientPtr cl,
 }
 
 
+/*
+ * Parallel encoding. With screen->encodeThreads set, rfbSendFramebufferUpdate()
+ * hands the whole update region to rfbSendRegionEncodingTight(). Rectangles
+ * are cut into bands of whole subrectangle rows, so the count
+ * rfbNumCodedRectsTight() reported still holds, and the bands are encoded on
+ * the screen's encode pool by copies of the client whose output is captured
+ * instead of sent. JPEG, solid and uncompressed data come out the same on any
+ * thread; data for the zlib streams is compressed while the captured output
+ * is written out, band by band, so each stream sees it in order.
+ *
+ * With shared set, the bands are encoded statelessly instead, and looked up
+ * in and added to the screen's encode cache for other clients to reuse.
+ */
+
+static void
+EncodeTightJob(void *arg, int worker)
+{
+    TIGHT_JOB *job = (TIGHT_JOB *)arg;
+    rfbClientPtr cl = job->owner->workers[worker].cl;
+    TIGHT_STATE *ts = job->owner->workers[worker].ts;
+
+    if (job->cached) {
+        job->ok = TRUE;
+        return;
+    }
+    rfbEncodeSinkReset(&job->sink);
+    ts->streamsUsed = 0;
+    cl->encodeSink = &job->sink;
+    job->ok = SendRectEncodingTight(cl, job->x, job->y, job->w, job->h) &&
+              rfbSendUpdateBuf(cl);
+    cl->encodeSink = NULL;
+    job->streams = ts->streamsUsed;
+}
+
+static rfbBool
+WriteTightJob(rfbClientPtr cl, TIGHT_JOB *job)
+{
+    rfbEncodeRecord rec;
+    char *p = job->sink.data, *end = p + job->sink.len;
+
+    while (p < end) {
+        memcpy(&rec, p, sizeof(rec));
+        p += sizeof(rec);
+        if (rec.kind == rfbEncodeRecordRaw) {
+            if (!rfbSendUpdateData(cl, p, rec.len))
+                return FALSE;
+        } else if (rec.kind & TIGHT_CONTROL_RECORD(0)) {
+            if (cl->ublen == UPDATE_BUF_SIZE && !rfbSendUpdateBuf(cl))
+                return FALSE;
+            cl->updateBuf[cl->ublen++] =
+                (char)(p[0] | StreamReset(cl, job->owner, rec.kind & 0x0F));
+        } else {
+            /* room for the compact length SendCompressedData() writes */
+            if (cl->ublen + 3 > UPDATE_BUF_SIZE && !rfbSendUpdateBuf(cl))
+                return FALSE;
+            if (!CompressStream(cl, rec.kind & 0x0F, p, rec.len,
+                                rec.kind >> 4 & 0x0F, rec.kind >> 8))
+                return FALSE;
+        }
+        p += rec.len;
+    }
+    return TRUE;
+}
+
+static void
+MergeTightStats(rfbClientPtr cl, rfbClientPtr worker)
+{
+    rfbStatList *ptr, *to;
+
+    for (ptr = worker->statEncList; ptr != NULL; ptr = ptr->Next) {
+        to = rfbStatLookupEncoding(cl, ptr->type);
+        if (to != NULL) {
+            to->sentCount += ptr->sentCount;
+            to->bytesSent += ptr->bytesSent;
+            to->bytesSentIfRaw += ptr->bytesSentIfRaw;
+        }
+    }
+    rfbResetStats(worker);
+}
+
+/* Sets up a worker's client, once; it never has a socket to write to. */
+static rfbBool
+NewTightWorker(TIGHT_WORKER *worker)
+{
+    if ((worker->cl = (rfbClientPtr)calloc(1, sizeof(rfbClientRec))) == NULL)
+        return FALSE;
+    worker->cl->sock = -1;
+    if ((worker->ts = GetTightState(worker->cl)) == NULL) {
+        free(worker->cl);
+        worker->cl = NULL;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Brings a worker's client up to date with cl, in the fields that encoding
+   a rectangle reads. */
+static void
+RefreshTightWorker(rfbClientPtr cl, TIGHT_STATE *ts, TIGHT_WORKER *worker,
+                   rfbBool shared)
+{
+    rfbClientPtr wcl = worker->cl;
+
+    wcl->screen = cl->screen;
+    wcl->scaledScreen = cl->scaledScreen;
+    wcl->format = cl->format;
+    wcl->translateFn = cl->translateFn;
+    wcl->translateLookupTable = cl->translateLookupTable;
+    wcl->enableLastRectEncoding = cl->enableLastRectEncoding;
+    wcl->tightEncoding = cl->tightEncoding;
+    wcl->tightCompressLevel = cl->tightCompressLevel;
+    wcl->turboQualityLevel = cl->turboQualityLevel;
+    wcl->turboSubsampLevel = cl->turboSubsampLevel;
+    worker->ts->stateless = shared;
+    worker->ts->streamsToReset = ts->streamsToReset;
+}
+
+/* Cuts the region into bands, in the order they go out. Returns how many
+   there are; fills in jobs unless it is NULL. */
+static int
+TightBands(rfbClientPtr cl, TIGHT_STATE *ts, sraRegionPtr region,
+           TIGHT_JOB *jobs)
+{
+    int maxRectSize = tightConf[ts->compressLevel].maxRectSize;
+    int maxRectWidth = tightConf[ts->compressLevel].maxRectWidth;
+    sraRectangleIterator *i;
+    sraRect rect;
+    int n = 0;
+
+    for (i = sraRgnGetIterator(region); sraRgnIteratorNext(i, &rect);) {
+        int x = rect.x1, y = rect.y1, w = rect.x2 - x, h = rect.y2 - y;
+        int dy, bandHeight = h;
+
+        if (cl->screen != cl->scaledScreen)
+            rfbScaledCorrection(cl->screen, cl->scaledScreen,
+                                &x, &y, &w, &h, "TightBands");
+
+        /* whole rows of the subrectangles SendRectSimple() would send */
+        if (w > maxRectWidth || w * h > maxRectSize)
+            bandHeight = maxRectSize / ((w > maxRectWidth) ? maxRectWidth : w);
+
+        for (dy = 0; dy < h; dy += bandHeight, n++) {
+            if (jobs != NULL) {
+                jobs[n].owner = ts;
+                jobs[n].x = x;
+                jobs[n].y = y + dy;
+                jobs[n].w = w;
+                jobs[n].h = (dy + bandHeight < h) ? bandHeight : h - dy;
+            }
+        }
+    }
+    sraRgnReleaseIterator(i);
+    return n;
+}
+
 rfbBool
-SendRectEncodingTight(rfbClientPtr cl,
-                         int x,
-                         int y,
-                         int w,
-                         int h)
+rfbSendRegionEncodingTight(rfbClientPtr cl, sraRegionPtr region,
+                           rfbBool shared)
 {
-    int nMaxRows;
-    uint32_t colorValue;
-    int dx, dy, dw, dh;
-    int x_best, y_best, w_best, h_best;
-    char *fbptr;
+    TIGHT_STATE *ts = GetTightState(cl);
+    rfbEncodeKey key;
+    int nWorkers, nJobs, n, maxAfterSize;
 
-    rfbSendUpdateBuf(cl);
+    if (ts == NULL)
+        return FALSE;
+
+    cl->tightEncoding = rfbEncodingTight;
+    SetTightLevels(cl, ts);
+
+    /* The zlib data is compressed here, from the bands' before buffers. */
+    maxAfterSize = tightConf[ts->compressLevel].maxRectSize *
+                   (cl->format.bitsPerPixel / 8);
+    maxAfterSize += (maxAfterSize + 99) / 100 + 12;
+    if (ts->tightAfterBufSize < maxAfterSize) {
+        char *buf = (char *)realloc(ts->tightAfterBuf, maxAfterSize);
+        if (buf == NULL)
+            return FALSE;
+        ts->tightAfterBuf = buf;
+        ts->tightAfterBufSize = maxAfterSize;
+    }
 
-    compressLevel = cl->tightCompressLevel;
-    qualityLevel = cl->turboQualityLevel;
-    subsampLevel = cl->turboSubsampLevel;
+    nWorkers = rfbEncodePoolSize(cl->screen);
+    if (nWorkers > ts->nWorkers) {
+        TIGHT_WORKER *workers = (TIGHT_WORKER *)realloc(ts->workers,
+                                         nWorkers * sizeof(TIGHT_WORKER));
+        if (workers == NULL)
+            return FALSE;
+        memset(&workers[ts->nWorkers], 0,
+               (nWorkers - ts->nWorkers) * sizeof(TIGHT_WORKER));
+        ts->workers = workers;
+        for (; ts->nWorkers < nWorkers; ts->nWorkers++)
+            if (!NewTightWorker(&workers[ts->nWorkers]))
+                return FALSE;
+    }
+    for (n = 0; n < nWorkers; n++)
+        RefreshTightWorker(cl, ts, &ts->workers[n], shared);
+
+    nJobs = TightBands(cl, ts, region, NULL);
+    if (nJobs > ts->nJobs) {
+        TIGHT_JOB *jobs = (TIGHT_JOB *)realloc(ts->jobs,
+                                               nJobs * sizeof(TIGHT_JOB));
+        if (jobs == NULL)
+            return FALSE;
+        memset(&jobs[ts->nJobs], 0, (nJobs - ts->nJobs) * sizeof(TIGHT_JOB));
+        ts->jobs = jobs;
+        ts->nJobs = nJobs;
+    }
+    TightBands(cl, ts, region, ts->jobs);
+
+    for (n = 0; n < nJobs; n++) {
+        TIGHT_JOB *job = &ts->jobs[n];
+
+        job->cached = FALSE;
+        job->streams = 0;
+        if (shared) {
+            rfbEncodeKeyInit(&key, cl, rfbEncodingTight,
+                             job->x, job->y, job->w, job->h);
+            job->cached = rfbEncodeCacheLookup(cl->screen, &key, &job->sink,
+                                               &job->streams);
+        }
+    }
+
+    rfbEncodePoolRun(cl->screen, EncodeTightJob, ts->jobs,
+                     sizeof(TIGHT_JOB), nJobs);
+
+    for (n = 0; n < nWorkers; n++)
+        MergeTightStats(cl, ts->workers[n].cl);
+
+    for (n = 0; n < nJobs; n++) {
+        TIGHT_JOB *job = &ts->jobs[n];
+
+        if (!job->ok)
+            return FALSE;
+        if (shared && !job->cached) {
+            rfbEncodeKeyInit(&key, cl, rfbEncodingTight,
+                             job->x, job->y, job->w, job->h);
+            rfbEncodeCacheStore(cl->screen, &key, &job->sink, job->streams);
+        } else if (job->cached) {
+            rfbStatRecordEncodingSent(cl, rfbEncodingTight, job->sink.len,
+                sz_rfbFramebufferUpdateRectHeader +
+                job->w * job->h * (cl->format.bitsPerPixel / 8));
+        }
+        if (!WriteTightJob(cl, job))
+            return FALSE;
+        /* The client has reset these streams, ours must follow suit. */
+        ts->streamsToReset |= job->streams;
+    }
+    return TRUE;
+}
+
+static void
+SetTightLevels(rfbClientPtr cl, TIGHT_STATE *ts)
+{
+    ts->compressLevel = cl->tightCompressLevel;
+    ts->qualityLevel = cl->turboQualityLevel;
+    ts->subsampLevel = cl->turboSubsampLevel;
 
     /* We only allow compression levels that have a demonstrable performance
        benefit.  CL 0 with JPEG reduces CPU usage for workloads that have low
@@ -315,14 +649,14 @@ SendRectEncodingTight(rfbClientPtr cl,
        high-color workloads, CL 1 should always be used, as higher compression
        levels increase CPU usage for these workloads without providing any
        significant reduction in bandwidth. */
-    if (qualityLevel != -1) {
-        if (compressLevel < 1) compressLevel = 1;
-        if (compressLevel > 2) compressLevel = 2;
+    if (ts->qualityLevel != -1) {
+        if (ts->compressLevel < 1) ts->compressLevel = 1;
+        if (ts->compressLevel > 2) ts->compressLevel = 2;
     }
 
     /* With JPEG disabled, CL 2 offers no significant bandwidth savings over
        CL 1, so we don't include it. */
-    else if (compressLevel > 1) compressLevel = 1;
+    else if (ts->compressLevel > 1) ts->compressLevel = 1;
 
     /* CL 9 (which maps internally to CL 3) is included mainly for backward
        compatibility with TightVNC Compression Levels 5-9.  It should be used
@@ -330,27 +664,49 @@ SendRectEncodingTight(rfbClientPtr cl,
        benefit.  For low-color workloads, it provides typically only 10-20%
        better compression than CL 2 with JPEG and CL 1 without JPEG, and it
        uses, on average, twice as much CPU time. */
-    if (cl->tightCompressLevel == 9) compressLevel = 3;
+    if (cl->tightCompressLevel == 9) ts->compressLevel = 3;
 
     if ( cl->format.depth == 24 && cl->format.redMax == 0xFF &&
          cl->format.greenMax == 0xFF && cl->format.blueMax == 0xFF ) {
-        usePixelFormat24 = TRUE;
+        ts->usePixelFormat24 = TRUE;
     } else {
-        usePixelFormat24 = FALSE;
+        ts->usePixelFormat24 = FALSE;
     }
+}
+
+rfbBool
+SendRectEncodingTight(rfbClientPtr cl,
+                         int x,
+                         int y,
+                         int w,
+                         int h)
+{
+    TIGHT_STATE *ts = GetTightState(cl);
+    int nMaxRows;
+    uint32_t colorValue;
+    int dx, dy, dw, dh;
+    int x_best, y_best, w_best, h_best;
+    char *fbptr;
+
+    if (ts == NULL)
+        return FALSE;
+
+    rfbSendUpdateBuf(cl);
+
+    SetTightLevels(cl, ts);
 
     if (!cl->enableLastRectEncoding || w * h < MIN_SPLIT_RECT_SIZE)
         return SendRectSimple(cl, x, y, w, h);
 
     /* Make sure we can write at least one pixel into tightBeforeBuf. */
 
-    if (tightBeforeBufSize < 4) {
-        tightBeforeBufSize = 4;
-        if (tightBeforeBuf == NULL)
-            tightBeforeBuf = (char *)malloc(tightBeforeBufSize);
+    if (ts->tightBeforeBufSize < 4) {
+        ts->tightBeforeBufSize = 4;
+        if (ts->tightBeforeBuf == NULL)
+            ts->tightBeforeBuf = (char *)malloc(ts->tightBeforeBufSize);
         else
-            tightBeforeBuf = (char *)realloc(tightBeforeBuf,
-                                             tightBeforeBufSize);
+            ts->tightBeforeBuf = (char *)realloc(ts->tightBeforeBuf,
+                                             ts->tightBeforeBufSize);
     }
 
     /* Calculate maximum number of rows in one non-solid rectangle. */
@@ -358,8 +714,8 @@ SendRectEncodingTight(rfbClientPtr cl,
     {
         int maxRectSize, maxRectWidth, nMaxWidth;
 
-        maxRectSize = tightConf[compressLevel].maxRectSize;
-        maxRectWidth = tightConf[compressLevel].maxRectWidth;
+        maxRectSize = tightConf[ts->compressLevel].maxRectSize;
+        maxRectWidth = tightConf[ts->compressLevel].maxRectWidth;
         nMaxWidth = (w > maxRectWidth) ? maxRectWidth : w;
         nMaxRows = maxRectSize / nMaxWidth;
     }
@@ -387,7 +743,7 @@ SendRectEncodingTight(rfbClientPtr cl,
 
             if (CheckSolidTile(cl, dx, dy, dw, dh, &colorValue, FALSE)) {
 
-                if (subsampLevel == TJ_GRAYSCALE && qualityLevel != -1) {
+                if (ts->subsampLevel == TJ_GRAYSCALE && ts->qualityLevel != -1) {
                     uint32_t r = (colorValue >> 16) & 0xFF;
                     uint32_t g = (colorValue >> 8) & 0xFF;
                     uint32_t b = (colorValue) & 0xFF;
@@ -434,7 +790,7 @@ SendRectEncodingTight(rfbClientPtr cl,
                          (x_best * (cl->scaledScreen->bitsPerPixel / 8)));
 
                 (*cl->translateFn)(cl->translateLookupTable, &cl->screen->serverFormat,
-                                   &cl->format, fbptr, tightBeforeBuf,
+                                   &cl->format, fbptr, ts->tightBeforeBuf,
                                    cl->scaledScreen->paddedWidthInBytes, 1, 1);
 
                 if (!SendSolidRect(cl))
@@ -613,34 +969,35 @@ DEFINE_CHECK_SOLID_FUNCTION(32)
 static rfbBool
 SendRectSimple(rfbClientPtr cl, int x, int y, int w, int h)
 {
+    TIGHT_STATE *ts = cl->tightEncoder;
     int maxBeforeSize, maxAfterSize;
     int maxRectSize, maxRectWidth;
     int subrectMaxWidth, subrectMaxHeight;
     int dx, dy;
     int rw, rh;
 
-    maxRectSize = tightConf[compressLevel].maxRectSize;
-    maxRectWidth = tightConf[compressLevel].maxRectWidth;
+    maxRectSize = tightConf[ts->compressLevel].maxRectSize;
+    maxRectWidth = tightConf[ts->compressLevel].maxRectWidth;
 
     maxBeforeSize = maxRectSize * (cl->format.bitsPerPixel / 8);
     maxAfterSize = maxBeforeSize + (maxBeforeSize + 99) / 100 + 12;
 
-    if (tightBeforeBufSize < maxBeforeSize) {
-        tightBeforeBufSize = maxBeforeSize;
-        if (tightBeforeBuf == NULL)
-            tightBeforeBuf = (char *)malloc(tightBeforeBufSize);
+    if (ts->tightBeforeBufSize < maxBeforeSize) {
+        ts->tightBeforeBufSize = maxBeforeSize;
+        if (ts->tightBeforeBuf == NULL)
+            ts->tightBeforeBuf = (char *)malloc(ts->tightBeforeBufSize);
         else
-            tightBeforeBuf = (char *)realloc(tightBeforeBuf,
-                                             tightBeforeBufSize);
+            ts->tightBeforeBuf = (char *)realloc(ts->tightBeforeBuf,
+                                             ts->tightBeforeBufSize);
     }
 
-    if (tightAfterBufSize < maxAfterSize) {
-        tightAfterBufSize = maxAfterSize;
-        if (tightAfterBuf == NULL)
-            tightAfterBuf = (char *)malloc(tightAfterBufSize);
+    if (ts->tightAfterBufSize < maxAfterSize) {
+        ts->tightAfterBufSize = maxAfterSize;
+        if (ts->tightAfterBuf == NULL)
+            ts->tightAfterBuf = (char *)malloc(ts->tightAfterBufSize);
         else
-            tightAfterBuf = (char *)realloc(tightAfterBuf,
-                                            tightAfterBufSize);
+            ts->tightAfterBuf = (char *)realloc(ts->tightAfterBuf,
+                                            ts->tightAfterBufSize);
     }
 
     if (w > maxRectWidth || w * h > maxRectSize) {
@@ -670,6 +1027,7 @@ SendSubrect(rfbClientPtr cl,
             int w,
             int h)
 {
+    TIGHT_STATE *ts = cl->tightEncoder;
     char *fbptr;
     rfbBool success = FALSE;
 
@@ -686,15 +1044,15 @@ SendSubrect(rfbClientPtr cl,
              + (cl->scaledScreen->paddedWidthInBytes * y)
              + (x * (cl->scaledScreen->bitsPerPixel / 8)));
 
-    if (subsampLevel == TJ_GRAYSCALE && qualityLevel != -1)
-        return SendJpegRect(cl, x, y, w, h, qualityLevel);
+    if (ts->subsampLevel == TJ_GRAYSCALE && ts->qualityLevel != -1)
+        return SendJpegRect(cl, x, y, w, h, ts->qualityLevel);
 
-    paletteMaxColors = w * h / tightConf[compressLevel].idxMaxColorsDivisor;
-    if(qualityLevel != -1)
-        paletteMaxColors = tightConf[compressLevel].palMaxColorsWithJPEG;
-    if ( paletteMaxColors < 2 &&
-         w * h >= tightConf[compressLevel].monoMinRectSize ) {
-        paletteMaxColors = 2;
+    ts->paletteMaxColors = w * h / tightConf[ts->compressLevel].idxMaxColorsDivisor;
+    if(ts->qualityLevel != -1)
+        ts->paletteMaxColors = tightConf[ts->compressLevel].palMaxColorsWithJPEG;
+    if ( ts->paletteMaxColors < 2 &&
+         w * h >= tightConf[ts->compressLevel].monoMinRectSize ) {
+        ts->paletteMaxColors = 2;
     }
 
     if (cl->format.bitsPerPixel == cl->screen->serverFormat.bitsPerPixel &&
@@ -715,35 +1073,35 @@ SendSubrect(rfbClientPtr cl,
                               cl->scaledScreen->paddedWidthInBytes / 4, h);
         }
 
-        if(paletteNumColors != 0 || qualityLevel == -1) {
+        if(ts->paletteNumColors != 0 || ts->qualityLevel == -1) {
             (*cl->translateFn)(cl->translateLookupTable,
                                &cl->screen->serverFormat, &cl->format, fbptr,
-                               tightBeforeBuf,
+                               ts->tightBeforeBuf,
                                cl->scaledScreen->paddedWidthInBytes, w, h);
         }
     }
     else {
         (*cl->translateFn)(cl->translateLookupTable, &cl->screen->serverFormat,
-                           &cl->format, fbptr, tightBeforeBuf,
+                           &cl->format, fbptr, ts->tightBeforeBuf,
                            cl->scaledScreen->paddedWidthInBytes, w, h);
 
         switch (cl->format.bitsPerPixel) {
         case 8:
-            FillPalette8(w * h);
+            FillPalette8(ts, w * h);
             break;
         case 16:
-            FillPalette16(w * h);
+            FillPalette16(ts, w * h);
             break;
         default:
-            FillPalette32(w * h);
+            FillPalette32(ts, w * h);
         }
     }
 
-    switch (paletteNumColors) {
+    switch (ts->paletteNumColors) {
     case 0:
         /* Truecolor image */
-        if (qualityLevel != -1) {
-            success = SendJpegRect(cl, x, y, w, h, qualityLevel);
+        if (ts->qualityLevel != -1) {
+            success = SendJpegRect(cl, x, y, w, h, ts->qualityLevel);
         } else {
             success = SendFullColorRect(cl, x, y, w, h);
         }
@@ -802,10 +1160,11 @@ SendTightHeader(rfbClientPtr cl,
 static rfbBool
 SendSolidRect(rfbClientPtr cl)
 {
+    TIGHT_STATE *ts = cl->tightEncoder;
     int len;
 
-    if (usePixelFormat24) {
-        Pack24(cl, tightBeforeBuf, &cl->format, 1);
+    if (ts->usePixelFormat24) {
+        Pack24(cl, ts->tightBeforeBuf, &cl->format, 1);
         len = 3;
     } else
         len = cl->format.bitsPerPixel / 8;
@@ -816,7 +1175,7 @@ SendSolidRect(rfbClientPtr cl)
     }
 
     cl->updateBuf[cl->ublen++] = (char)(rfbTightFill << 4);
-    memcpy (&cl->updateBuf[cl->ublen], tightBeforeBuf, len);
+    memcpy (&cl->updateBuf[cl->ublen], ts->tightBeforeBuf, len);
     cl->ublen += len;
 
     rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, len + 1);
@@ -831,6 +1190,7 @@ SendMonoRect(rfbClientPtr cl,
              int w,
              int h)
 {
+    TIGHT_STATE *ts = cl->tightEncoder;
     int streamId = 1;
     int paletteLen, dataLen;
 
@@ -852,12 +1212,13 @@ SendMonoRect(rfbClientPtr cl,
     dataLen = (w + 7) / 8;
     dataLen *= h;
 
-    if (tightConf[compressLevel].monoZlibLevel == 0 &&
+    if (tightConf[ts->compressLevel].monoZlibLevel == 0 &&
         cl->tightEncoding != rfbEncodingTightPng)
         cl->updateBuf[cl->ublen++] =
             (char)((rfbTightNoZlib | rfbTightExplicitFilter) << 4);
-    else
-        cl->updateBuf[cl->ublen++] = (streamId | rfbTightExplicitFilter) << 4;
+    else if (!SendStreamControl(cl, (streamId | rfbTightExplicitFilter) << 4,
+                                streamId))
+        return FALSE;
     cl->updateBuf[cl->ublen++] = rfbTightFilterPalette;
     cl->updateBuf[cl->ublen++] = 1;
 
@@ -865,42 +1226,42 @@ SendMonoRect(rfbClientPtr cl,
     switch (cl->format.bitsPerPixel) {
 
     case 32:
-        EncodeMonoRect32((uint8_t *)tightBeforeBuf, w, h);
+        EncodeMonoRect32(ts, (uint8_t *)ts->tightBeforeBuf, w, h);
 
-        ((uint32_t *)tightAfterBuf)[0] = monoBackground;
-        ((uint32_t *)tightAfterBuf)[1] = monoForeground;
-        if (usePixelFormat24) {
-            Pack24(cl, tightAfterBuf, &cl->format, 2);
+        ((uint32_t *)ts->tightAfterBuf)[0] = ts->monoBackground;
+        ((uint32_t *)ts->tightAfterBuf)[1] = ts->monoForeground;
+        if (ts->usePixelFormat24) {
+            Pack24(cl, ts->tightAfterBuf, &cl->format, 2);
             paletteLen = 6;
         } else
             paletteLen = 8;
 
-        memcpy(&cl->updateBuf[cl->ublen], tightAfterBuf, paletteLen);
+        memcpy(&cl->updateBuf[cl->ublen], ts->tightAfterBuf, paletteLen);
         cl->ublen += paletteLen;
         rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 3 + paletteLen);
         break;
 
     case 16:
-        EncodeMonoRect16((uint8_t *)tightBeforeBuf, w, h);
+        EncodeMonoRect16(ts, (uint8_t *)ts->tightBeforeBuf, w, h);
 
-        ((uint16_t *)tightAfterBuf)[0] = (uint16_t)monoBackground;
-        ((uint16_t *)tightAfterBuf)[1] = (uint16_t)monoForeground;
+        ((uint16_t *)ts->tightAfterBuf)[0] = (uint16_t)ts->monoBackground;
+        ((uint16_t *)ts->tightAfterBuf)[1] = (uint16_t)ts->monoForeground;
 
-        memcpy(&cl->updateBuf[cl->ublen], tightAfterBuf, 4);
+        memcpy(&cl->updateBuf[cl->ublen], ts->tightAfterBuf, 4);
         cl->ublen += 4;
         rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 7);
         break;
 
     default:
-        EncodeMonoRect8((uint8_t *)tightBeforeBuf, w, h);
+        EncodeMonoRect8(ts, (uint8_t *)ts->tightBeforeBuf, w, h);
 
-        cl->updateBuf[cl->ublen++] = (char)monoBackground;
-        cl->updateBuf[cl->ublen++] = (char)monoForeground;
+        cl->updateBuf[cl->ublen++] = (char)ts->monoBackground;
+        cl->updateBuf[cl->ublen++] = (char)ts->monoForeground;
         rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 5);
     }
 
     return CompressData(cl, streamId, dataLen,
-                        tightConf[compressLevel].monoZlibLevel,
+                        tightConf[ts->compressLevel].monoZlibLevel,
                         Z_DEFAULT_STRATEGY);
 }
 
@@ -911,6 +1272,7 @@ SendIndexedRect(rfbClientPtr cl,
                 int w,
                 int h)
 {
+    TIGHT_STATE *ts = cl->tightEncoder;
     int streamId = 2;
     int i, entryLen;
 
@@ -921,57 +1283,58 @@ SendIndexedRect(rfbClientPtr cl,
 #endif
 
     if ( cl->ublen + TIGHT_MIN_TO_COMPRESS + 6 +
-	 paletteNumColors * cl->format.bitsPerPixel / 8 >
+	 ts->paletteNumColors * cl->format.bitsPerPixel / 8 >
          UPDATE_BUF_SIZE ) {
         if (!rfbSendUpdateBuf(cl))
             return FALSE;
     }
 
     /* Prepare tight encoding header. */
-    if (tightConf[compressLevel].idxZlibLevel == 0 &&
+    if (tightConf[ts->compressLevel].idxZlibLevel == 0 &&
         cl->tightEncoding != rfbEncodingTightPng)
         cl->updateBuf[cl->ublen++] =
             (char)((rfbTightNoZlib | rfbTightExplicitFilter) << 4);
-    else
-        cl->updateBuf[cl->ublen++] = (streamId | rfbTightExplicitFilter) << 4;
+    else if (!SendStreamControl(cl, (streamId | rfbTightExplicitFilter) << 4,
+                                streamId))
+        return FALSE;
     cl->updateBuf[cl->ublen++] = rfbTightFilterPalette;
-    cl->updateBuf[cl->ublen++] = (char)(paletteNumColors - 1);
+    cl->updateBuf[cl->ublen++] = (char)(ts->paletteNumColors - 1);
 
     /* Prepare palette, convert image. */
     switch (cl->format.bitsPerPixel) {
 
     case 32:
-        EncodeIndexedRect32((uint8_t *)tightBeforeBuf, w * h);
+        EncodeIndexedRect32(ts, (uint8_t *)ts->tightBeforeBuf, w * h);
 
-        for (i = 0; i < paletteNumColors; i++) {
-            ((uint32_t *)tightAfterBuf)[i] =
-                palette.entry[i].listNode->rgb;
+        for (i = 0; i < ts->paletteNumColors; i++) {
+            ((uint32_t *)ts->tightAfterBuf)[i] =
+                ts->palette.entry[i].listNode->rgb;
         }
-        if (usePixelFormat24) {
-            Pack24(cl, tightAfterBuf, &cl->format, paletteNumColors);
+        if (ts->usePixelFormat24) {
+            Pack24(cl, ts->tightAfterBuf, &cl->format, ts->paletteNumColors);
             entryLen = 3;
         } else
             entryLen = 4;
 
-        memcpy(&cl->updateBuf[cl->ublen], tightAfterBuf,
-               paletteNumColors * entryLen);
-        cl->ublen += paletteNumColors * entryLen;
+        memcpy(&cl->updateBuf[cl->ublen], ts->tightAfterBuf,
+               ts->paletteNumColors * entryLen);
+        cl->ublen += ts->paletteNumColors * entryLen;
         rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding,
-                                     3 + paletteNumColors * entryLen);
+                                     3 + ts->paletteNumColors * entryLen);
         break;
 
     case 16:
-        EncodeIndexedRect16((uint8_t *)tightBeforeBuf, w * h);
+        EncodeIndexedRect16(ts, (uint8_t *)ts->tightBeforeBuf, w * h);
 
-        for (i = 0; i < paletteNumColors; i++) {
-            ((uint16_t *)tightAfterBuf)[i] =
-                (uint16_t)palette.entry[i].listNode->rgb;
+        for (i = 0; i < ts->paletteNumColors; i++) {
+            ((uint16_t *)ts->tightAfterBuf)[i] =
+                (uint16_t)ts->palette.entry[i].listNode->rgb;
         }
 
-        memcpy(&cl->updateBuf[cl->ublen], tightAfterBuf, paletteNumColors * 2);
-        cl->ublen += paletteNumColors * 2;
+        memcpy(&cl->updateBuf[cl->ublen], ts->tightAfterBuf, ts->paletteNumColors * 2);
+        cl->ublen += ts->paletteNumColors * 2;
         rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding,
-                                     3 + paletteNumColors * 2);
+                                     3 + ts->paletteNumColors * 2);
         break;
 
     default:
@@ -979,7 +1342,7 @@ SendIndexedRect(rfbClientPtr cl,
     }
 
     return CompressData(cl, streamId, w * h,
-                        tightConf[compressLevel].idxZlibLevel,
+                        tightConf[ts->compressLevel].idxZlibLevel,
                         Z_DEFAULT_STRATEGY);
 }
 
@@ -990,6 +1353,7 @@ SendFullColorRect(rfbClientPtr cl,
                   int w,
                   int h)
 {
+    TIGHT_STATE *ts = cl->tightEncoder;
     int streamId = 0;
     int len;
 
@@ -1004,21 +1368,21 @@ SendFullColorRect(rfbClientPtr cl,
             return FALSE;
     }
 
-    if (tightConf[compressLevel].rawZlibLevel == 0 &&
+    if (tightConf[ts->compressLevel].rawZlibLevel == 0 &&
         cl->tightEncoding != rfbEncodingTightPng)
         cl->updateBuf[cl->ublen++] = (char)(rfbTightNoZlib << 4);
-    else
-        cl->updateBuf[cl->ublen++] = 0x00;  /* stream id = 0, no flushing, no filter */
+    else if (!SendStreamControl(cl, 0x00, streamId))  /* stream id = 0, no filter */
+        return FALSE;
     rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 1);
 
-    if (usePixelFormat24) {
-        Pack24(cl, tightBeforeBuf, &cl->format, w * h);
+    if (ts->usePixelFormat24) {
+        Pack24(cl, ts->tightBeforeBuf, &cl->format, w * h);
         len = 3;
     } else
         len = cl->format.bitsPerPixel / 8;
 
     return CompressData(cl, streamId, w * h * len,
-                        tightConf[compressLevel].rawZlibLevel,
+                        tightConf[ts->compressLevel].rawZlibLevel,
                         Z_DEFAULT_STRATEGY);
 }
 
@@ -1029,18 +1393,137 @@ CompressData(rfbClientPtr cl,
              int zlibLevel,
              int zlibStrategy)
 {
-    z_streamp pz;
-    int err;
+    TIGHT_STATE *ts = cl->tightEncoder;
 
     if (dataLen < TIGHT_MIN_TO_COMPRESS) {
-        memcpy(&cl->updateBuf[cl->ublen], tightBeforeBuf, dataLen);
+        memcpy(&cl->updateBuf[cl->ublen], ts->tightBeforeBuf, dataLen);
         cl->ublen += dataLen;
         rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, dataLen);
         return TRUE;
     }
 
     if (zlibLevel == 0)
-        return SendCompressedData (cl, tightBeforeBuf, dataLen);
+        return SendCompressedData (cl, ts->tightBeforeBuf, dataLen);
+
+    if (ts->stateless)
+        return CompressFresh(cl, ts->tightBeforeBuf, dataLen,
+                             zlibLevel, zlibStrategy);
+
+    /* The zlib streams carry over from one rectangle to the next, so on an
+       encode pool thread only record the data here. It is compressed when
+       the rectangles are written out in order. */
+    if (cl->encodeSink != NULL) {
+        if (!rfbSendUpdateBuf(cl))
+            return FALSE;
+        return rfbEncodeSinkAppend(cl->encodeSink,
+                                   TIGHT_ZLIB_RECORD(streamId, zlibLevel,
+                                                     zlibStrategy),
+                                   ts->tightBeforeBuf, dataLen);
+    }
+
+    return CompressStream(cl, streamId, ts->tightBeforeBuf, dataLen,
+                          zlibLevel, zlibStrategy);
+}
+
+/*
+ * Writes the compression control byte of a rectangle whose data goes
+ * through zlib stream streamId, with the bit asking the client to reset
+ * that stream first if the stream has to start over.
+ */
+
+static rfbBool
+SendStreamControl(rfbClientPtr cl,
+                  int control,
+                  int streamId)
+{
+    TIGHT_STATE *ts = cl->tightEncoder;
+    char c;
+
+    if (ts->stateless) {
+        control |= 1 << streamId;
+        ts->streamsUsed |= 1 << streamId;
+    } else if (cl->encodeSink != NULL && (ts->streamsToReset & 1 << streamId)) {
+        /* on an encode pool thread, WriteTightJob() resets the stream */
+        c = (char)control;
+        if (!rfbSendUpdateBuf(cl))
+            return FALSE;
+        return rfbEncodeSinkAppend(cl->encodeSink,
+                                   TIGHT_CONTROL_RECORD(streamId), &c, 1);
+    } else if (cl->encodeSink == NULL) {
+        control |= StreamReset(cl, ts, streamId);
+    }
+
+    cl->updateBuf[cl->ublen++] = (char)control;
+    return TRUE;
+}
+
+/* Returns the reset bit to send for streamId, if the stream is due one. */
+static int
+StreamReset(rfbClientPtr cl,
+            TIGHT_STATE *ts,
+            int streamId)
+{
+    int bit = 1 << streamId;
+
+    if (!(ts->streamsToReset & bit))
+        return 0;
+    ts->streamsToReset &= ~bit;
+    if (cl->zsActive[streamId])
+        deflateReset(&cl->zsStruct[streamId]);
+    return bit;
+}
+
+static rfbBool
+CompressFresh(rfbClientPtr cl,
+              char *data,
+              int dataLen,
+              int zlibLevel,
+              int zlibStrategy)
+{
+    TIGHT_STATE *ts = cl->tightEncoder;
+    z_streamp pz = &ts->freshStream;
+
+    if (ts->freshActive && (zlibLevel != ts->freshLevel ||
+                            zlibStrategy != ts->freshStrategy)) {
+        deflateEnd(pz);
+        ts->freshActive = FALSE;
+    }
+
+    if (!ts->freshActive) {
+        pz->zalloc = Z_NULL;
+        pz->zfree = Z_NULL;
+        pz->opaque = Z_NULL;
+
+        if (deflateInit2 (pz, zlibLevel, Z_DEFLATED, MAX_WBITS,
+                          MAX_MEM_LEVEL, zlibStrategy) != Z_OK)
+            return FALSE;
+
+        ts->freshActive = TRUE;
+        ts->freshLevel = zlibLevel;
+        ts->freshStrategy = zlibStrategy;
+    } else if (deflateReset(pz) != Z_OK) {
+        return FALSE;
+    }
+
+    pz->next_in = (Bytef *)data;
+    pz->avail_in = dataLen;
+    pz->next_out = (Bytef *)ts->tightAfterBuf;
+    pz->avail_out = ts->tightAfterBufSize;
+
+    return DeflateRect(cl, pz);
+}
+
+static rfbBool
+CompressStream(rfbClientPtr cl,
+               int streamId,
+               char *data,
+               int dataLen,
+               int zlibLevel,
+               int zlibStrategy)
+{
+    TIGHT_STATE *ts = cl->tightEncoder;
+    z_streamp pz;
+    int err;
 
     pz = &cl->zsStruct[streamId];
 
@@ -1060,10 +1543,10 @@ CompressData(rfbClientPtr cl,
     }
 
     /* Prepare buffer pointers. */
-    pz->next_in = (Bytef *)tightBeforeBuf;
+    pz->next_in = (Bytef *)data;
     pz->avail_in = dataLen;
-    pz->next_out = (Bytef *)tightAfterBuf;
-    pz->avail_out = tightAfterBufSize;
+    pz->next_out = (Bytef *)ts->tightAfterBuf;
+    pz->avail_out = ts->tightAfterBufSize;
 
     /* Change compression parameters if needed. */
     if (zlibLevel != cl->zsLevel[streamId]) {
@@ -1073,21 +1556,29 @@ CompressData(rfbClientPtr cl,
         cl->zsLevel[streamId] = zlibLevel;
     }
 
+    return DeflateRect(cl, pz);
+}
+
+/* Compresses what pz has been set up with and sends it. */
+static rfbBool
+DeflateRect(rfbClientPtr cl,
+            z_streamp pz)
+{
+    TIGHT_STATE *ts = cl->tightEncoder;
+
     /* Actual compression. */
     if (deflate(pz, Z_SYNC_FLUSH) != Z_OK ||
         pz->avail_in != 0 || pz->avail_out == 0) {
         return FALSE;
     }
 
-    return SendCompressedData(cl, tightAfterBuf,
-                              tightAfterBufSize - pz->avail_out);
+    return SendCompressedData(cl, ts->tightAfterBuf,
+                              ts->tightAfterBufSize - pz->avail_out);
 }
 
 static rfbBool SendCompressedData(rfbClientPtr cl, char *buf,
                                   int compressedLen)
 {
-    int i, portionLen;
-
     cl->updateBuf[cl->ublen++] = compressedLen & 0x7F;
     rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 1);
     if (compressedLen > 0x7F) {
@@ -1101,21 +1592,10 @@ static rfbBool SendCompressedData(rfbClientPtr cl, char *buf,
         }
     }
 
-    portionLen = UPDATE_BUF_SIZE;
-    for (i = 0; i < compressedLen; i += portionLen) {
-        if (i + portionLen > compressedLen) {
-            portionLen = compressedLen - i;
-        }
-        if (cl->ublen + portionLen > UPDATE_BUF_SIZE) {
-            if (!rfbSendUpdateBuf(cl))
-                return FALSE;
-        }
-        memcpy(&cl->updateBuf[cl->ublen], &buf[i], portionLen);
-        cl->ublen += portionLen;
-    }
     rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, compressedLen);
 
-    return TRUE;
+    /* sent straight from buf, after what is queued, unless it fits */
+    return rfbSendUpdateData(cl, buf, compressedLen);
 }
 
 
@@ -1124,22 +1604,22 @@ static rfbBool SendCompressedData(rfbClientPtr cl, char *buf,
  */
 
 static void
-FillPalette8(int count)
+FillPalette8(TIGHT_STATE *ts, int count)
 {
-    uint8_t *data = (uint8_t *)tightBeforeBuf;
+    uint8_t *data = (uint8_t *)ts->tightBeforeBuf;
     uint8_t c0, c1;
     int i, n0, n1;
 
-    paletteNumColors = 0;
+    ts->paletteNumColors = 0;
 
     c0 = data[0];
     for (i = 1; i < count && data[i] == c0; i++);
     if (i == count) {
-        paletteNumColors = 1;
+        ts->paletteNumColors = 1;
         return;                 /* Solid rectangle */
     }
 
-    if (paletteMaxColors < 2)
+    if (ts->paletteMaxColors < 2)
         return;
 
     n0 = i;
@@ -1155,13 +1635,13 @@ FillPalette8(int count)
     }
     if (i == count) {
         if (n0 > n1) {
-            monoBackground = (uint32_t)c0;
-            monoForeground = (uint32_t)c1;
+            ts->monoBackground = (uint32_t)c0;
+            ts->monoForeground = (uint32_t)c1;
         } else {
-            monoBackground = (uint32_t)c1;
-            monoForeground = (uint32_t)c0;
+            ts->monoBackground = (uint32_t)c1;
+            ts->monoForeground = (uint32_t)c0;
         }
-        paletteNumColors = 2;   /* Two colors */
+        ts->paletteNumColors = 2;   /* Two colors */
     }
 }
 
@@ -1169,20 +1649,20 @@ FillPalette8(int count)
 #define DEFINE_FILL_PALETTE_FUNCTION(bpp)                               \
                                                                         \
 static void                                                             \
-FillPalette##bpp(int count) {                                           \
-    uint##bpp##_t *data = (uint##bpp##_t *)tightBeforeBuf;              \
+FillPalette##bpp(TIGHT_STATE *ts, int count) {                          \
+    uint##bpp##_t *data = (uint##bpp##_t *)ts->tightBeforeBuf;          \
     uint##bpp##_t c0, c1, ci;                                           \
     int i, n0, n1, ni;                                                  \
                                                                         \
     c0 = data[0];                                                       \
     for (i = 1; i < count && data[i] == c0; i++);                       \
     if (i >= count) {                                                   \
-        paletteNumColors = 1;   /* Solid rectangle */                   \
+        ts->paletteNumColors = 1;   /* Solid rectangle */               \
         return;                                                         \
     }                                                                   \
                                                                         \
-    if (paletteMaxColors < 2) {                                         \
-        paletteNumColors = 0;   /* Full-color encoding preferred */     \
+    if (ts->paletteMaxColors < 2) {                                     \
+        ts->paletteNumColors = 0;   /* Full-color encoding preferred */ \
         return;                                                         \
     }                                                                   \
                                                                         \
@@ -1200,32 +1680,32 @@ FillPalette##bpp(int count) {                                           \
     }                                                                   \
     if (i >= count) {                                                   \
         if (n0 > n1) {                                                  \
-            monoBackground = (uint32_t)c0;                              \
-            monoForeground = (uint32_t)c1;                              \
+            ts->monoBackground = (uint32_t)c0;                          \
+            ts->monoForeground = (uint32_t)c1;                          \
         } else {                                                        \
-            monoBackground = (uint32_t)c1;                              \
-            monoForeground = (uint32_t)c0;                              \
+            ts->monoBackground = (uint32_t)c1;                          \
+            ts->monoForeground = (uint32_t)c0;                          \
         }                                                               \
-        paletteNumColors = 2;   /* Two colors */                        \
+        ts->paletteNumColors = 2;   /* Two colors */                    \
         return;                                                         \
     }                                                                   \
                                                                         \
-    PaletteReset();                                                     \
-    PaletteInsert (c0, (uint32_t)n0, bpp);                              \
-    PaletteInsert (c1, (uint32_t)n1, bpp);                              \
+    PaletteReset(ts);                                                   \
+    PaletteInsert (ts, c0, (uint32_t)n0, bpp);                          \
+    PaletteInsert (ts, c1, (uint32_t)n1, bpp);                          \
                                                                         \
     ni = 1;                                                             \
     for (i++; i < count; i++) {                                         \
         if (data[i] == ci) {                                            \
             ni++;                                                       \
         } else {                                                        \
-            if (!PaletteInsert (ci, (uint32_t)ni, bpp))                 \
+            if (!PaletteInsert (ts, ci, (uint32_t)ni, bpp))             \
                 return;                                                 \
             ci = data[i];                                               \
             ni = 1;                                                     \
         }                                                               \
     }                                                                   \
-    PaletteInsert (ci, (uint32_t)ni, bpp);                              \
+    PaletteInsert (ts, ci, (uint32_t)ni, bpp);                          \
 }
 
 DEFINE_FILL_PALETTE_FUNCTION(16)
@@ -1237,6 +1717,7 @@ static void                                                             \
 FastFillPalette##bpp(rfbClientPtr cl, uint##bpp##_t *data, int w,       \
                      int pitch, int h)                                  \
 {                                                                       \
+    TIGHT_STATE *ts = cl->tightEncoder;                                 \
     uint##bpp##_t c0, c1, ci, mask, c0t, c1t, cit;                      \
     int i, j, i2 = 0, j2, n0, n1, ni;                                   \
                                                                         \
@@ -1258,11 +1739,11 @@ FastFillPalette##bpp(rfbClientPtr cl, uint##bpp##_t *data, int w,       \
     }                                                                   \
     done:                                                               \
     if (j >= h) {                                                       \
-        paletteNumColors = 1;   /* Solid rectangle */                   \
+        ts->paletteNumColors = 1;   /* Solid rectangle */               \
         return;                                                         \
     }                                                                   \
-    if (paletteMaxColors < 2) {                                         \
-        paletteNumColors = 0;   /* Full-color encoding preferred */     \
+    if (ts->paletteMaxColors < 2) {                                     \
+        ts->paletteNumColors = 0;   /* Full-color encoding preferred */ \
         return;                                                         \
     }                                                                   \
                                                                         \
@@ -1291,19 +1772,19 @@ FastFillPalette##bpp(rfbClientPtr cl, uint##bpp##_t *data, int w,       \
                        (char *)&c1, (char *)&c1t, bpp/8, 1, 1);         \
     if (j2 >= h) {                                                      \
         if (n0 > n1) {                                                  \
-            monoBackground = (uint32_t)c0t;                             \
-            monoForeground = (uint32_t)c1t;                             \
+            ts->monoBackground = (uint32_t)c0t;                         \
+            ts->monoForeground = (uint32_t)c1t;                         \
         } else {                                                        \
-            monoBackground = (uint32_t)c1t;                             \
-            monoForeground = (uint32_t)c0t;                             \
+            ts->monoBackground = (uint32_t)c1t;                         \
+            ts->monoForeground = (uint32_t)c0t;                         \
         }                                                               \
-        paletteNumColors = 2;   /* Two colors */                        \
+        ts->paletteNumColors = 2;   /* Two colors */                    \
         return;                                                         \
     }                                                                   \
                                                                         \
-    PaletteReset();                                                     \
-    PaletteInsert (c0t, (uint32_t)n0, bpp);                             \
-    PaletteInsert (c1t, (uint32_t)n1, bpp);                             \
+    PaletteReset(ts);                                                   \
+    PaletteInsert (ts, c0t, (uint32_t)n0, bpp);                         \
+    PaletteInsert (ts, c1t, (uint32_t)n1, bpp);                         \
                                                                         \
     ni = 1;                                                             \
     i2++;  if (i2 >= w) {i2 = 0;  j2++;}                                \
@@ -1316,7 +1797,7 @@ FastFillPalette##bpp(rfbClientPtr cl, uint##bpp##_t *data, int w,       \
                                    &cl->screen->serverFormat,           \
                                    &cl->format, (char *)&ci,            \
                                    (char *)&cit, bpp/8, 1, 1);          \
-                if (!PaletteInsert (cit, (uint32_t)ni, bpp))            \
+                if (!PaletteInsert (ts, cit, (uint32_t)ni, bpp))        \
                     return;                                             \
                 ci = data[j * pitch + i] & mask;                        \
                 ni = 1;                                                 \
@@ -1328,7 +1809,7 @@ FastFillPalette##bpp(rfbClientPtr cl, uint##bpp##_t *data, int w,       \
     (*cl->translateFn)(cl->translateLookupTable,                        \
                        &cl->screen->serverFormat, &cl->format,          \
                        (char *)&ci, (char *)&cit, bpp/8, 1, 1);         \
-    PaletteInsert (cit, (uint32_t)ni, bpp);                             \
+    PaletteInsert (ts, cit, (uint32_t)ni, bpp);                         \
 }
 
 DEFINE_FAST_FILL_PALETTE_FUNCTION(16)
@@ -1344,15 +1825,16 @@ DEFINE_FAST_FILL_PALETTE_FUNCTION(32)
 
 
 static void
-PaletteReset(void)
+PaletteReset(TIGHT_STATE *ts)
 {
-    paletteNumColors = 0;
-    memset(palette.hash, 0, 256 * sizeof(COLOR_LIST *));
+    ts->paletteNumColors = 0;
+    memset(ts->palette.hash, 0, 256 * sizeof(COLOR_LIST *));
 }
 
 
 static int
-PaletteInsert(uint32_t rgb,
+PaletteInsert(TIGHT_STATE *ts,
+              uint32_t rgb,
               int numPixels,
               int bpp)
 {
@@ -1362,58 +1844,58 @@ PaletteInsert(uint32_t rgb,
 
     hash_key = (bpp == 16) ? HASH_FUNC16(rgb) : HASH_FUNC32(rgb);
 
-    pnode = palette.hash[hash_key];
+    pnode = ts->palette.hash[hash_key];
 
     while (pnode != NULL) {
         if (pnode->rgb == rgb) {
             /* Such palette entry already exists. */
             new_idx = idx = pnode->idx;
-            count = palette.entry[idx].numPixels + numPixels;
-            if (new_idx && palette.entry[new_idx-1].numPixels < count) {
+            count = ts->palette.entry[idx].numPixels + numPixels;
+            if (new_idx && ts->palette.entry[new_idx-1].numPixels < count) {
                 do {
-                    palette.entry[new_idx] = palette.entry[new_idx-1];
-                    palette.entry[new_idx].listNode->idx = new_idx;
+                    ts->palette.entry[new_idx] = ts->palette.entry[new_idx-1];
+                    ts->palette.entry[new_idx].listNode->idx = new_idx;
                     new_idx--;
                 }
-                while (new_idx && palette.entry[new_idx-1].numPixels < count);
-                palette.entry[new_idx].listNode = pnode;
+                while (new_idx && ts->palette.entry[new_idx-1].numPixels < count);
+                ts->palette.entry[new_idx].listNode = pnode;
                 pnode->idx = new_idx;
             }
-            palette.entry[new_idx].numPixels = count;
-            return paletteNumColors;
+            ts->palette.entry[new_idx].numPixels = count;
+            return ts->paletteNumColors;
         }
         prev_pnode = pnode;
         pnode = pnode->next;
     }
 
     /* Check if palette is full. */
-    if (paletteNumColors == 256 || paletteNumColors == paletteMaxColors) {
-        paletteNumColors = 0;
+    if (ts->paletteNumColors == 256 || ts->paletteNumColors == ts->paletteMaxColors) {
+        ts->paletteNumColors = 0;
         return 0;
     }
 
     /* Move palette entries with lesser pixel counts. */
-    for ( idx = paletteNumColors;
-          idx > 0 && palette.entry[idx-1].numPixels < numPixels;
+    for ( idx = ts->paletteNumColors;
+          idx > 0 && ts->palette.entry[idx-1].numPixels < numPixels;
           idx-- ) {
-        palette.entry[idx] = palette.entry[idx-1];
-        palette.entry[idx].listNode->idx = idx;
+        ts->palette.entry[idx] = ts->palette.entry[idx-1];
+        ts->palette.entry[idx].listNode->idx = idx;
     }
 
     /* Add new palette entry into the freed slot. */
-    pnode = &palette.list[paletteNumColors];
+    pnode = &ts->palette.list[ts->paletteNumColors];
     if (prev_pnode != NULL) {
         prev_pnode->next = pnode;
     } else {
-        palette.hash[hash_key] = pnode;
+        ts->palette.hash[hash_key] = pnode;
     }
     pnode->next = NULL;
     pnode->idx = idx;
     pnode->rgb = rgb;
-    palette.entry[idx].listNode = pnode;
-    palette.entry[idx].numPixels = numPixels;
+    ts->palette.entry[idx].listNode = pnode;
+    ts->palette.entry[idx].numPixels = numPixels;
 
-    return (++paletteNumColors);
+    return (++ts->paletteNumColors);
 }
 
 
@@ -1460,7 +1942,7 @@ static void Pack24(rfbClientPtr cl,
 #define DEFINE_IDX_ENCODE_FUNCTION(bpp)                                 \
                                                                         \
 static void                                                             \
-EncodeIndexedRect##bpp(uint8_t *buf, int count) {                       \
+EncodeIndexedRect##bpp(TIGHT_STATE *ts, uint8_t *buf, int count) {      \
     COLOR_LIST *pnode;                                                  \
     uint##bpp##_t *src;                                                 \
     uint##bpp##_t rgb;                                                  \
@@ -1473,7 +1955,7 @@ EncodeIndexedRect##bpp(uint8_t *buf, int count) {                       \
         while (count && *src == rgb) {                                  \
             rep++, src++, count--;                                      \
         }                                                               \
-        pnode = palette.hash[HASH_FUNC##bpp(rgb)];                      \
+        pnode = ts->palette.hash[HASH_FUNC##bpp(rgb)];                  \
         while (pnode != NULL) {                                         \
             if ((uint##bpp##_t)pnode->rgb == rgb) {                     \
                 *buf++ = (uint8_t)pnode->idx;                           \
@@ -1495,7 +1977,7 @@ DEFINE_IDX_ENCODE_FUNCTION(32)
 #define DEFINE_MONO_ENCODE_FUNCTION(bpp)                                \
                                                                         \
 static void                                                             \
-EncodeMonoRect##bpp(uint8_t *buf, int w, int h) {                       \
+EncodeMonoRect##bpp(TIGHT_STATE *ts, uint8_t *buf, int w, int h) {      \
     uint##bpp##_t *ptr;                                                 \
     uint##bpp##_t bg;                                                   \
     unsigned int value, mask;                                           \
@@ -1503,7 +1985,7 @@ EncodeMonoRect##bpp(uint8_t *buf, int w, int h) {                       \
     int x, y, bg_bits;                                                  \
                                                                         \
     ptr = (uint##bpp##_t *) buf;                                        \
-    bg = (uint##bpp##_t) monoBackground;                                \
+    bg = (uint##bpp##_t) ts->monoBackground;                            \
     aligned_width = w - w % 8;                                          \
                                                                         \
     for (y = 0; y < h; y++) {                                           \
@@ -1551,15 +2033,70 @@ DEFINE_MONO_ENCODE_FUNCTION(32)
  * JPEG compression stuff.
  */
 
+/* 16-bit pixels are read as native shorts, as PrepareRowForImg16() does. */
+static rfbBool
+IsNativeRGB565(const rfbPixelFormat *fmt)
+{
+    return fmt->redShift == 11 && fmt->greenShift == 5 && fmt->blueShift == 0
+        && fmt->redMax == 31 && fmt->greenMax == 63 && fmt->blueMax == 31;
+}
+
+/* Any other 16-bit format is expanded to RGB in ts->jpegRgbBuf. */
+static rfbBool
+ConvertRGB16(rfbClientPtr cl, unsigned char *src, int pitch, int w, int h)
+{
+    TIGHT_STATE *ts = cl->tightEncoder;
+    rfbPixelFormat *fmt = &cl->screen->serverFormat;
+    uint8_t redTab[256], greenTab[256], blueTab[256];
+    unsigned char *dst;
+    int i, j;
+
+    if (fmt->redMax > 255 || fmt->greenMax > 255 || fmt->blueMax > 255 ||
+        fmt->redMax == 0 || fmt->greenMax == 0 || fmt->blueMax == 0)
+        return FALSE;
+
+    if (ts->jpegRgbBufSize < w * h * 3) {
+        free(ts->jpegRgbBuf);
+        ts->jpegRgbBuf = (unsigned char *)malloc(w * h * 3);
+        if (ts->jpegRgbBuf == NULL) {
+            ts->jpegRgbBufSize = 0;
+            rfbLog("Memory allocation failure!\n");
+            return FALSE;
+        }
+        ts->jpegRgbBufSize = w * h * 3;
+    }
+
+    /* scale each component to 0..255 once per call, not once per pixel */
+    for (i = 0; i <= fmt->redMax; i++)
+        redTab[i] = (uint8_t)((i * 255 + fmt->redMax / 2) / fmt->redMax);
+    for (i = 0; i <= fmt->greenMax; i++)
+        greenTab[i] = (uint8_t)((i * 255 + fmt->greenMax / 2) / fmt->greenMax);
+    for (i = 0; i <= fmt->blueMax; i++)
+        blueTab[i] = (uint8_t)((i * 255 + fmt->blueMax / 2) / fmt->blueMax);
+
+    dst = ts->jpegRgbBuf;
+    for (j = 0; j < h; j++) {
+        uint16_t *srcptr = (uint16_t *)(src + j * pitch);
+        for (i = 0; i < w; i++) {
+            uint16_t pix = srcptr[i];
+            *dst++ = redTab[pix >> fmt->redShift & fmt->redMax];
+            *dst++ = greenTab[pix >> fmt->greenShift & fmt->greenMax];
+            *dst++ = blueTab[pix >> fmt->blueShift & fmt->blueMax];
+        }
+    }
+    return TRUE;
+}
+
 static rfbBool
 SendJpegRect(rfbClientPtr cl, int x, int y, int w, int h, int quality)
 {
+    TIGHT_STATE *ts = cl->tightEncoder;
     unsigned char *srcbuf;
     int ps = cl->screen->serverFormat.bitsPerPixel / 8;
-    int subsamp = subsampLevel2tjsubsamp[subsampLevel];
-    unsigned long size = 0;
-    int flags = 0, pitch;
-    unsigned char *tmpbuf = NULL;
+    int subsamp = subsampLevel2tjsubsamp[ts->subsampLevel];
+    unsigned long size;
+    unsigned char *jpegBuf;
+    int pitch, pixelFormat;
 
     if (cl->screen->serverFormat.bitsPerPixel == 8)
         return SendFullColorRect(cl, x, y, w, h);
@@ -1568,91 +2105,59 @@ SendJpegRect(rfbClientPtr cl, int x, int y, int w, int h, int quality)
         rfbLog("Error: JPEG requires 16-bit, 24-bit, or 32-bit pixel format.\n");
         return 0;
     }
-    if (!j) {
-        if ((j = tjInitCompress()) == NULL) {
+    if (!ts->j) {
+        if ((ts->j = tjInitCompress()) == NULL) {
             rfbLog("JPEG Error: %s\n", tjGetErrorStr());
             return 0;
         }
     }
 
-    if (tightAfterBufSize < TJBUFSIZE(w, h)) {
-        if (tightAfterBuf == NULL)
-            tightAfterBuf = (char *)malloc(TJBUFSIZE(w, h));
+    if (ts->tightAfterBufSize < TJBUFSIZE(w, h)) {
+        if (ts->tightAfterBuf == NULL)
+            ts->tightAfterBuf = (char *)malloc(TJBUFSIZE(w, h));
         else
-            tightAfterBuf = (char *)realloc(tightAfterBuf,
+            ts->tightAfterBuf = (char *)realloc(ts->tightAfterBuf,
                                             TJBUFSIZE(w, h));
-        if (!tightAfterBuf) {
+        if (!ts->tightAfterBuf) {
             rfbLog("Memory allocation failure!\n");
             return 0;
         }
-        tightAfterBufSize = TJBUFSIZE(w, h);
+        ts->tightAfterBufSize = TJBUFSIZE(w, h);
     }
 
-    if (ps == 2) {
-        uint16_t *srcptr, pix;
-        unsigned char *dst;
-        int inRed, inGreen, inBlue, i, j;
+    pitch = cl->scaledScreen->paddedWidthInBytes;
+    srcbuf = (unsigned char *)&cl->scaledScreen->frameBuffer[y * pitch + x * ps];
 
-        if((tmpbuf = (unsigned char *)malloc(w * h * 3)) == NULL)
-            rfbLog("Memory allocation failure!\n");
-        srcptr = (uint16_t *)&cl->scaledScreen->frameBuffer
-            [y * cl->scaledScreen->paddedWidthInBytes + x * ps];
-        dst = tmpbuf;
-        for(j = 0; j < h; j++) {
-            uint16_t *srcptr2 = srcptr;
-            unsigned char *dst2 = dst;
-            for (i = 0; i < w; i++) {
-                pix = *srcptr2++;
-                inRed = (int) (pix >> cl->screen->serverFormat.redShift
-                               & cl->screen->serverFormat.redMax);
-                inGreen = (int) (pix >> cl->screen->serverFormat.greenShift
-                                 & cl->screen->serverFormat.greenMax);
-                inBlue  = (int) (pix >> cl->screen->serverFormat.blueShift
-                                 & cl->screen->serverFormat.blueMax);
-                *dst2++ = (uint8_t)((inRed * 255
-                                     + cl->screen->serverFormat.redMax / 2)
-                                    / cl->screen->serverFormat.redMax);
-               	*dst2++ = (uint8_t)((inGreen * 255
-                                     + cl->screen->serverFormat.greenMax / 2)
-                                    / cl->screen->serverFormat.greenMax);
-                *dst2++ = (uint8_t)((inBlue * 255
-                                     + cl->screen->serverFormat.blueMax / 2)
-                                    / cl->screen->serverFormat.blueMax);
-            }
-            srcptr += cl->scaledScreen->paddedWidthInBytes / ps;
-            dst += w * 3;
-        }
-        srcbuf = tmpbuf;
+    if (ps == 2 && IsNativeRGB565(&cl->screen->serverFormat)) {
+        /* libjpeg reads these straight from the framebuffer */
+        pixelFormat = TJPF_RGB565;
+    } else if (ps == 2) {
+        if (!ConvertRGB16(cl, srcbuf, pitch, w, h))
+            return SendFullColorRect(cl, x, y, w, h);
+        srcbuf = ts->jpegRgbBuf;
         pitch = w * 3;
-        ps = 3;
+        pixelFormat = TJPF_RGB;
     } else {
-        if (cl->screen->serverFormat.bigEndian && ps == 4)
-            flags |= TJ_ALPHAFIRST;
-        if (cl->screen->serverFormat.redShift == 16
-            && cl->screen->serverFormat.blueShift == 0)
-            flags |= TJ_BGR;
+        rfbBool bgr = cl->screen->serverFormat.redShift == 16
+            && cl->screen->serverFormat.blueShift == 0;
         if (cl->screen->serverFormat.bigEndian)
-            flags ^= TJ_BGR;
-        pitch = cl->scaledScreen->paddedWidthInBytes;
-        srcbuf = (unsigned char *)&cl->scaledScreen->frameBuffer
-            [y * pitch + x * ps];
+            bgr = !bgr;
+        if (ps == 3)
+            pixelFormat = bgr ? TJPF_BGR : TJPF_RGB;
+        else if (cl->screen->serverFormat.bigEndian)
+            pixelFormat = bgr ? TJPF_XBGR : TJPF_XRGB;
+        else
+            pixelFormat = bgr ? TJPF_BGRX : TJPF_RGBX;
     }
 
-    if (tjCompress(j, srcbuf, w, pitch, h, ps, (unsigned char *)tightAfterBuf,
-                   &size, subsamp, quality, flags) == -1) {
+    jpegBuf = (unsigned char *)ts->tightAfterBuf;
+    size = ts->tightAfterBufSize;
+    if (tjCompress2(ts->j, srcbuf, w, pitch, h, pixelFormat, &jpegBuf, &size,
+                    subsamp, quality, 0) == -1) {
         rfbLog("JPEG Error: %s\n", tjGetErrorStr());
-        if (tmpbuf) {
-            free(tmpbuf);
-            tmpbuf = NULL;
-        }
         return 0;
     }
 
-    if (tmpbuf) {
-        free(tmpbuf);
-        tmpbuf = NULL;
-    }
-
     if (cl->ublen + TIGHT_MIN_TO_COMPRESS + 1 > UPDATE_BUF_SIZE) {
         if (!rfbSendUpdateBuf(cl))
             return FALSE;
@@ -1661,7 +2166,7 @@ SendJpegRect(rfbClientPtr cl, int x, int y, int w, int h, int quality)
     cl->updateBuf[cl->ublen++] = (char)(rfbTightJpeg << 4);
     rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 1);
 
-    return SendCompressedData(cl, tightAfterBuf, (int)size);
+    return SendCompressedData(cl, ts->tightAfterBuf, (int)size);
 }
 
 static void
@@ -1746,8 +2251,6 @@ DEFINE_JPEG_GET_ROW_FUNCTION(32)
 
 #ifdef LIBVNCSERVER_HAVE_LIBPNG
 
-static TLS int pngDstDataLen = 0;
-
 static rfbBool CanSendPngRect(rfbClientPtr cl, int w, int h) {
     if (cl->tightEncoding != rfbEncodingTightPng) {
         return FALSE;
@@ -1764,15 +2267,17 @@ static rfbBool CanSendPngRect(rfbClientPtr cl, int w, int h) {
 static void pngWriteData(png_structp png_ptr, png_bytep data,
                            png_size_t length)
 {
+    TIGHT_STATE *ts = ((rfbClientPtr)png_get_io_ptr(png_ptr))->tightEncoder;
+
 #if 0
     rfbClientPtr cl = png_get_io_ptr(png_ptr);
 
     buffer_reserve(&vs->tight.png, vs->tight.png.offset + length);
     memcpy(vs->tight.png.buffer + vs->tight.png.offset, data, length);
 #endif
-    memcpy(tightAfterBuf + pngDstDataLen, data, length);
+    memcpy(ts->tightAfterBuf + ts->pngDstDataLen, data, length);
 
-    pngDstDataLen += length;
+    ts->pngDstDataLen += length;
 }
 
 static void pngFlushData(png_structp png_ptr)
@@ -1793,6 +2298,7 @@ static void pngFree(png_structp png_ptr, png_voidp ptr)
 static rfbBool SendPngRect(rfbClientPtr cl, int x, int y, int w, int h) {
     /* rfbLog(">> SendPngRect x:%d, y:%d, w:%d, h:%d\n", x, y, w, h); */
 
+    TIGHT_STATE *ts = cl->tightEncoder;
     png_byte color_type;
     png_structp png_ptr;
     png_infop info_ptr;
@@ -1802,7 +2308,7 @@ static rfbBool SendPngRect(rfbClientPtr cl, int x, int y, int w, int h) {
     uint8_t *buf;
     int dy;
 
-    pngDstDataLen = 0;
+    ts->pngDstDataLen = 0;
 
     png_ptr = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL,
                                         NULL, pngMalloc, pngFree);
@@ -1895,6 +2401,6 @@ static rfbBool SendPngRect(rfbClientPtr cl, int x, int y, int w, int h) {
     rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 1);
 
     /* rfbLog("<< SendPngRect\n"); */
-    return SendCompressedData(cl, tightAfterBuf, pngDstDataLen);
+    return SendCompressedData(cl, ts->tightAfterBuf, ts->pngDstDataLen);
 }
 #endif
@@ -25,11 +25,13 @@
 
 #include <rfb/rfb.h>
 #include <rfb/rfbregion.h>
+#include "private.h"
 
 static void PrintPixelFormat(rfbPixelFormat *pf);
 static rfbBool rfbSetClientColourMapBGR233(rfbClientPtr cl);
 
 rfbBool rfbEconomicTranslate = FALSE;
+rfbBool rfbShiftTranslate = TRUE;
 
 /*
  * Some standard pixel formats.
@@ -244,6 +246,8 @@ rfbTranslateNone(char *table, rfbPixelFormat *in, rfbPixelFormat *out,
 rfbBool
 rfbSetTranslateFunction(rfbClientPtr cl)
 {
+    const char *kernel = NULL;
+
     rfbLog("Pixel format for client %s:\n",cl->host);
     PrintPixelFormat(&cl->format);
 
@@ -334,6 +338,16 @@ rfbSetTranslateFunction(rfbClientPtr cl)
 	   [BPP2OFFSET(cl->format.bitsPerPixel)]) (&cl->translateLookupTable,
 						   &(cl->screen->serverFormat), &cl->format,&cl->screen->colourMap);
 
+    } else if (rfbShiftTranslate &&
+               (cl->translateFn = rfbInitShiftTranslate(&cl->translateLookupTable,
+                                                        &cl->screen->serverFormat,
+                                                        &cl->format, &kernel))) {
+
+        /* where the CPU can, shift and mask whole vectors of pixels
+           instead of looking up each one in three tables */
+
+        rfbLog("translating with %s shifts\n", kernel);
+
     } else {
 
         /* otherwise we use three separate tables for red, green and blue */
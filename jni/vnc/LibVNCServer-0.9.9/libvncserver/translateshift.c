@@ -0,0 +1,272 @@
+/*
+ * translateshift.c - translate between true colour formats by shifting and
+ * masking whole vectors of pixels, where translate.c would look each pixel
+ * up in a table.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+
+#define CONCAT2(a,b) a##b
+#define CONCAT2E(a,b) CONCAT2(a,b)
+#define CONCAT3(a,b,c) a##b##c
+#define CONCAT3E(a,b,c) CONCAT3(a,b,c)
+#define CONCAT4(a,b,c,d) a##b##c##d
+#define CONCAT4E(a,b,c,d) CONCAT4(a,b,c,d)
+
+#ifdef __SSE2__
+
+#include <emmintrin.h>
+
+/*
+ * Every channel value stays below 2^16, so the arithmetic is done on the
+ * low 16 bits of each 32-bit lane with the high halves of all constants
+ * zero; SSE2 has a 16-bit multiply-high but no 32-bit multiply.
+ */
+
+typedef struct {
+    __m128i inShift, inMax, outMax, bias, mul, shift, outShift;
+} rfbShiftConstsSSE2;
+
+static void
+rfbShiftPrepareSSE2(rfbShiftConstsSSE2 *k, const rfbShiftTranslateTable *t)
+{
+    int c;
+
+    for (c = 0; c < 3; c++) {
+        k[c].inShift = _mm_cvtsi32_si128(t->inShift[c]);
+        k[c].inMax = _mm_set1_epi32(t->inMax[c]);
+        k[c].outMax = _mm_set1_epi32(t->outMax[c]);
+        k[c].bias = _mm_set1_epi32(t->bias[c]);
+        k[c].mul = _mm_set1_epi32(t->mul[c]);
+        k[c].shift = _mm_cvtsi32_si128(t->shift[c]);
+        k[c].outShift = _mm_cvtsi32_si128(t->outShift[c]);
+    }
+}
+
+static inline __m128i
+rfbShiftChannelSSE2(__m128i p, const rfbShiftConstsSSE2 *k)
+{
+    __m128i v = _mm_and_si128(_mm_srl_epi32(p, k->inShift), k->inMax);
+
+    v = _mm_add_epi16(_mm_mullo_epi16(v, k->outMax), k->bias);
+    v = _mm_srl_epi32(_mm_mulhi_epu16(v, k->mul), k->shift);
+    return _mm_sll_epi32(v, k->outShift);
+}
+
+static inline __m128i
+rfbShiftConvertSSE2(__m128i p, const rfbShiftConstsSSE2 *k)
+{
+    return _mm_or_si128(_mm_or_si128(rfbShiftChannelSSE2(p, &k[0]),
+                                     rfbShiftChannelSSE2(p, &k[1])),
+                        rfbShiftChannelSSE2(p, &k[2]));
+}
+
+#define SHIFT_SUFFIX SSE2
+#define SHIFT_VEC __m128i
+#define SHIFT_CONSTS rfbShiftConstsSSE2
+#define SHIFT_PREPARE(k, t) rfbShiftPrepareSSE2(k, t)
+#define SHIFT_CONVERT(v, k) rfbShiftConvertSSE2(v, k)
+
+#define SHIFT_LOAD16(p, lo, hi) {                                       \
+        __m128i v = _mm_loadu_si128((const __m128i *)(p));              \
+        lo = _mm_unpacklo_epi16(v, _mm_setzero_si128());                \
+        hi = _mm_unpackhi_epi16(v, _mm_setzero_si128());                \
+    }
+#define SHIFT_LOAD32(p, lo, hi) {                                       \
+        lo = _mm_loadu_si128((const __m128i *)(p));                     \
+        hi = _mm_loadu_si128((const __m128i *)(p) + 1);                 \
+    }
+
+/* _mm_packs_epi32 saturates signed values, so sign-extend 16-bit pixels
+   first to have them come through unchanged. */
+#define SHIFT_STORE8(p, lo, hi) {                                       \
+        __m128i v = _mm_packs_epi32(lo, hi);                            \
+        _mm_storel_epi64((__m128i *)(p), _mm_packus_epi16(v, v));       \
+    }
+#define SHIFT_STORE16(p, lo, hi)                                        \
+    _mm_storeu_si128((__m128i *)(p),                                    \
+                     _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(lo, 16), 16), \
+                                     _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16)))
+#define SHIFT_STORE32(p, lo, hi) {                                      \
+        _mm_storeu_si128((__m128i *)(p), lo);                           \
+        _mm_storeu_si128((__m128i *)(p) + 1, hi);                       \
+    }
+
+#define IN 16
+#define OUT 8
+#include "shifttranstemplate.c"
+#undef OUT
+#define OUT 16
+#include "shifttranstemplate.c"
+#undef OUT
+#define OUT 32
+#include "shifttranstemplate.c"
+#undef OUT
+#undef IN
+#define IN 32
+#define OUT 8
+#include "shifttranstemplate.c"
+#undef OUT
+#define OUT 16
+#include "shifttranstemplate.c"
+#undef OUT
+#define OUT 32
+#include "shifttranstemplate.c"
+#undef OUT
+#undef IN
+
+static const rfbTranslateFnType rfbTranslateWithShiftsSSE2[2][3] = {
+    { rfbTranslateWithShifts16to8SSE2,
+      rfbTranslateWithShifts16to16SSE2,
+      rfbTranslateWithShifts16to32SSE2 },
+    { rfbTranslateWithShifts32to8SSE2,
+      rfbTranslateWithShifts32to16SSE2,
+      rfbTranslateWithShifts32to32SSE2 }
+};
+
+#endif /* __SSE2__ */
+
+
+#ifdef LIBVNCSERVER_HAVE_NEON
+
+/* armeabi-v7a does not promise NEON, so ask the kernel. */
+
+rfbBool
+rfbCpuHasNeon(void)
+{
+    static int hasNeon = -1;
+    char line[512];
+    FILE *f;
+
+    if (hasNeon < 0) {
+        hasNeon = 0;
+        if ((f = fopen("/proc/cpuinfo", "r")) != NULL) {
+            while (!hasNeon && fgets(line, sizeof(line), f) != NULL)
+                if (strncmp(line, "Features", 8) == 0 &&
+                    strstr(line, " neon") != NULL)
+                    hasNeon = 1;
+            fclose(f);
+        }
+    }
+    return hasNeon;
+}
+
+#endif
+
+
+/*
+ * rfbInitShiftChannel works out the multiply and shift that stand in for
+ * the division by inMax, and checks them against every channel value.
+ */
+
+static rfbBool
+rfbInitShiftChannel(rfbShiftTranslateTable *t, int c, int inMax, int inShift,
+                    int outMax, int outShift, int outBits)
+{
+    uint32_t v, x, shift = 0;
+
+    if (inMax < 1 || inMax > 255 || outMax > 255 || inShift > 31 ||
+        outShift > 31 || ((uint64_t)outMax << outShift) >> outBits)
+        return FALSE;
+    while ((2 << shift) <= inMax)
+        shift++;
+
+    t->inShift[c] = inShift;
+    t->inMax[c] = inMax;
+    t->outMax[c] = outMax;
+    t->bias[c] = inMax / 2;
+    t->mul[c] = ((1 << (16 + shift)) + inMax - 1) / inMax;
+    t->shift[c] = shift;
+    t->outShift[c] = outShift;
+    if (t->mul[c] > 0xffff)
+        return FALSE;
+
+    for (v = 0; v <= (uint32_t)inMax; v++) {
+        x = v * outMax + inMax / 2;
+        if (((x * t->mul[c]) >> (16 + shift)) != x / inMax)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+
+/*
+ * rfbInitShiftTranslate returns the function to translate from in to out
+ * by shifting, with its table in *table, or NULL if there is none for this
+ * pair of formats or this CPU; then *table is left alone and the lookup
+ * tables must be used. kernel is set to the instruction set chosen.
+ */
+
+rfbTranslateFnType
+rfbInitShiftTranslate(char **table, rfbPixelFormat *in, rfbPixelFormat *out,
+                      const char **kernel)
+{
+    const rfbTranslateFnType (*fns)[3] = NULL;
+    rfbShiftTranslateTable t;
+    char *newTable;
+    int inIndex, outIndex;
+
+    if (!in->trueColour || !out->trueColour)
+        return NULL;
+    if (in->bitsPerPixel != 16 && in->bitsPerPixel != 32)
+        return NULL;
+    if (out->bitsPerPixel != 8 && out->bitsPerPixel != 16 &&
+        out->bitsPerPixel != 32)
+        return NULL;
+    /* the tables byte-swap for the client; these don't */
+    if (out->bitsPerPixel != 8 && out->bigEndian != in->bigEndian)
+        return NULL;
+
+    if (!rfbInitShiftChannel(&t, 0, in->redMax, in->redShift,
+                             out->redMax, out->redShift, out->bitsPerPixel) ||
+        !rfbInitShiftChannel(&t, 1, in->greenMax, in->greenShift,
+                             out->greenMax, out->greenShift, out->bitsPerPixel) ||
+        !rfbInitShiftChannel(&t, 2, in->blueMax, in->blueShift,
+                             out->blueMax, out->blueShift, out->bitsPerPixel))
+        return NULL;
+
+#ifdef LIBVNCSERVER_HAVE_NEON
+    if (fns == NULL && rfbCpuHasNeon()) {
+        fns = rfbTranslateWithShiftsNEON;
+        *kernel = "neon";
+    }
+#endif
+#ifdef __SSE2__
+    if (fns == NULL) {
+        fns = rfbTranslateWithShiftsSSE2;
+        *kernel = "sse2";
+    }
+#endif
+    if (fns == NULL)
+        return NULL;
+
+    inIndex = in->bitsPerPixel / 32;
+    outIndex = (out->bitsPerPixel == 8) ? 0 : out->bitsPerPixel / 16;
+
+    newTable = (char *)malloc(sizeof(rfbShiftTranslateTable));
+    if (newTable == NULL)
+        return NULL;
+    memcpy(newTable, &t, sizeof(t));
+    if (*table) free(*table);
+    *table = newTable;
+
+    return fns[inIndex][outIndex];
+}
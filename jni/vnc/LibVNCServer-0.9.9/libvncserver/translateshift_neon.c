@@ -0,0 +1,133 @@
+/*
+ * translateshift_neon.c - NEON versions of the shift translators in
+ * translateshift.c. Built with -mfpu=neon for armeabi-v7a only;
+ * translateshift.c checks the CPU before using them.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+
+#include <arm_neon.h>
+
+#define CONCAT2(a,b) a##b
+#define CONCAT2E(a,b) CONCAT2(a,b)
+#define CONCAT3(a,b,c) a##b##c
+#define CONCAT3E(a,b,c) CONCAT3(a,b,c)
+#define CONCAT4(a,b,c,d) a##b##c##d
+#define CONCAT4E(a,b,c,d) CONCAT4(a,b,c,d)
+
+/* NEON shifts by a register count, negative to the right, and has a full
+   32-bit multiply, so the product is taken whole. */
+
+typedef struct {
+    int32x4_t inShift, mulShift, outShift;
+    uint32x4_t inMax, outMax, bias, mul;
+} rfbShiftConstsNEON;
+
+static void
+rfbShiftPrepareNEON(rfbShiftConstsNEON *k, const rfbShiftTranslateTable *t)
+{
+    int c;
+
+    for (c = 0; c < 3; c++) {
+        k[c].inShift = vdupq_n_s32(-(int)t->inShift[c]);
+        k[c].mulShift = vdupq_n_s32(-(int)(16 + t->shift[c]));
+        k[c].outShift = vdupq_n_s32(t->outShift[c]);
+        k[c].inMax = vdupq_n_u32(t->inMax[c]);
+        k[c].outMax = vdupq_n_u32(t->outMax[c]);
+        k[c].bias = vdupq_n_u32(t->bias[c]);
+        k[c].mul = vdupq_n_u32(t->mul[c]);
+    }
+}
+
+static inline uint32x4_t
+rfbShiftChannelNEON(uint32x4_t p, const rfbShiftConstsNEON *k)
+{
+    uint32x4_t v = vandq_u32(vshlq_u32(p, k->inShift), k->inMax);
+
+    v = vmlaq_u32(k->bias, v, k->outMax);
+    v = vshlq_u32(vmulq_u32(v, k->mul), k->mulShift);
+    return vshlq_u32(v, k->outShift);
+}
+
+static inline uint32x4_t
+rfbShiftConvertNEON(uint32x4_t p, const rfbShiftConstsNEON *k)
+{
+    return vorrq_u32(vorrq_u32(rfbShiftChannelNEON(p, &k[0]),
+                               rfbShiftChannelNEON(p, &k[1])),
+                     rfbShiftChannelNEON(p, &k[2]));
+}
+
+#define SHIFT_SUFFIX NEON
+#define SHIFT_VEC uint32x4_t
+#define SHIFT_CONSTS rfbShiftConstsNEON
+#define SHIFT_PREPARE(k, t) rfbShiftPrepareNEON(k, t)
+#define SHIFT_CONVERT(v, k) rfbShiftConvertNEON(v, k)
+
+#define SHIFT_LOAD16(p, lo, hi) {                                       \
+        uint16x8_t v = vld1q_u16(p);                                    \
+        lo = vmovl_u16(vget_low_u16(v));                                \
+        hi = vmovl_u16(vget_high_u16(v));                               \
+    }
+#define SHIFT_LOAD32(p, lo, hi) {                                       \
+        lo = vld1q_u32(p);                                              \
+        hi = vld1q_u32((p) + 4);                                        \
+    }
+
+#define SHIFT_STORE8(p, lo, hi)                                         \
+    vst1_u8(p, vmovn_u16(vcombine_u16(vmovn_u32(lo), vmovn_u32(hi))))
+#define SHIFT_STORE16(p, lo, hi)                                        \
+    vst1q_u16(p, vcombine_u16(vmovn_u32(lo), vmovn_u32(hi)))
+#define SHIFT_STORE32(p, lo, hi) {                                      \
+        vst1q_u32(p, lo);                                               \
+        vst1q_u32((p) + 4, hi);                                         \
+    }
+
+#define IN 16
+#define OUT 8
+#include "shifttranstemplate.c"
+#undef OUT
+#define OUT 16
+#include "shifttranstemplate.c"
+#undef OUT
+#define OUT 32
+#include "shifttranstemplate.c"
+#undef OUT
+#undef IN
+#define IN 32
+#define OUT 8
+#include "shifttranstemplate.c"
+#undef OUT
+#define OUT 16
+#include "shifttranstemplate.c"
+#undef OUT
+#define OUT 32
+#include "shifttranstemplate.c"
+#undef OUT
+#undef IN
+
+const rfbTranslateFnType rfbTranslateWithShiftsNEON[2][3] = {
+    { rfbTranslateWithShifts16to8NEON,
+      rfbTranslateWithShifts16to16NEON,
+      rfbTranslateWithShifts16to32NEON },
+    { rfbTranslateWithShifts32to8NEON,
+      rfbTranslateWithShifts32to16NEON,
+      rfbTranslateWithShifts32to32NEON }
+};
@@ -135,7 +135,7 @@ Connection: Upgrade\r\n\
 Upgrade: websocket\r\n\
 Connection: Upgrade\r\n\
 Sec-WebSocket-Accept: %s\r\n\
-Sec-WebSocket-Protocol: %s\r\n\
+%s%s%s\
 \r\n"
 
 
@@ -151,6 +151,7 @@ struct timeval
 ;
 #endif
 
+static rfbBool webSocketsStart(rfbClientPtr cl, const char *bbuf, char *scheme);
 static rfbBool webSocketsHandshake(rfbClientPtr cl, char *scheme);
 void webSocketsGenMd5(char * target, char *key1, char *key2, char *key3);
 
@@ -185,7 +186,7 @@ static void webSocketsGenSha1Key(char *target, int size, char *key)
 rfbBool
 webSocketsCheck (rfbClientPtr cl)
 {
-    char bbuf[4], *scheme;
+    char bbuf[4];
     int ret;
 
     ret = rfbPeekExactTimeout(cl, bbuf, 4,
@@ -211,12 +212,34 @@ webSocketsCheck (rfbClientPtr cl)
 	  rfbErr("webSocketsHandshake: rfbssl_init failed\n");
 	  return FALSE;
 	}
-	ret = rfbPeekExactTimeout(cl, bbuf, 4, WEBSOCKETS_CLIENT_CONNECT_WAIT_MS);
-        scheme = "wss";
-    } else {
-        scheme = "ws";
+	/* rfbProcessClientMessage() takes it on from here */
+	cl->state = RFB_TLS_HANDSHAKE;
+	return TRUE;
+    }
+
+    return webSocketsStart(cl, bbuf, "ws");
+}
+
+/*
+ * webSocketsCheckTLS goes on with a wss connection once its TLS handshake
+ * is done and the first request has come
+ */
+
+rfbBool
+webSocketsCheckTLS(rfbClientPtr cl)
+{
+    char bbuf[4];
+
+    if (rfbPeekExactTimeout(cl, bbuf, 4, WEBSOCKETS_CLIENT_CONNECT_WAIT_MS) <= 0) {
+      rfbErr("webSocketsHandshake: unknown connection error\n");
+      return FALSE;
     }
+    return webSocketsStart(cl, bbuf, "wss");
+}
 
+static rfbBool
+webSocketsStart(rfbClientPtr cl, const char *bbuf, char *scheme)
+{
     if (strncmp(bbuf, "GET ", 4) != 0) {
       rfbErr("webSocketsHandshake: invalid client header\n");
       return FALSE;
@@ -346,16 +369,19 @@ webSocketsHandshake(rfbClientPtr cl, char *scheme)
         return FALSE;
     }
 
-    if ((protocol) && (strstr(protocol, "binary"))) {
-        if (! sec_ws_version) {
-            rfbErr("webSocketsHandshake: 'binary' protocol not supported with Hixie\n");
-            free(response);
-            free(buf);
-            return FALSE;
-        }
+    /* base64 is left to Hixie clients and HyBi ones that only know it;
+     * HyBi clients asking for no protocol at all get binary frames too */
+    if (sec_ws_version && ((protocol && strstr(protocol, "binary")) ||
+                           !(protocol && strstr(protocol, "base64")))) {
         rfbLog("  - webSocketsHandshake: using binary/raw encoding\n");
         base64 = FALSE;
-        protocol = "binary";
+        protocol = (protocol && strstr(protocol, "binary")) ? "binary" : NULL;
+    } else if (!sec_ws_version && (protocol) && (strstr(protocol, "binary")) &&
+               !strstr(protocol, "base64")) {
+        rfbErr("webSocketsHandshake: 'binary' protocol not supported with Hixie\n");
+        free(response);
+        free(buf);
+        return FALSE;
     } else {
         rfbLog("  - webSocketsHandshake: using base64 encoding\n");
         base64 = TRUE;
@@ -376,7 +402,9 @@ webSocketsHandshake(rfbClientPtr cl, char *scheme)
 	rfbLog("  - WebSockets client version hybi-%02d\n", sec_ws_version);
 	webSocketsGenSha1Key(accept, sizeof(accept), sec_ws_key);
 	len = snprintf(response, WEBSOCKETS_MAX_HANDSHAKE_LEN,
-		 SERVER_HANDSHAKE_HYBI, accept, protocol);
+		 SERVER_HANDSHAKE_HYBI, accept,
+		 protocol ? "Sec-WebSocket-Protocol: " : "",
+		 protocol ? protocol : "", protocol ? "\r\n" : "");
     } else {
 	/* older hixie handshake, this could be removed if
 	 * a final standard is established */
@@ -754,12 +782,32 @@ spor:
     return result;
 }
 
+/* Writes the header of a server frame of len payload bytes to header and
+ * returns its length */
+static int
+webSocketsHybiHeader(char *header, unsigned char opcode, int len)
+{
+    ws_header_t *h = (ws_header_t *)header;
+
+    h->b0 = 0x80 | (opcode & 0x0f);
+    if (len <= 125) {
+      h->b1 = (uint8_t)len;
+      return 2;
+    } else if (len <= 65535) {
+      h->b1 = 0x7e;
+      h->l16 = WS_HTON16((uint16_t)len);
+      return 4;
+    }
+    h->b1 = 0x7f;
+    h->l64 = WS_HTON64((uint64_t)len);
+    return 10;
+}
+
 static int
 webSocketsEncodeHybi(rfbClientPtr cl, const char *src, int len, char **dst)
 {
     int blen, ret = -1, sz = 0;
-    unsigned char opcode = '\0'; /* TODO: option! */
-    ws_header_t *header;
+    unsigned char opcode = WS_OPCODE_BINARY_FRAME;
     ws_ctx_t *wsctx = (ws_ctx_t *)cl->wsctx;
 
 
@@ -775,8 +823,10 @@ webSocketsEncodeHybi(rfbClientPtr cl, const char *src, int len, char **dst)
 	  /* nothing to encode */
 	  return 0;
     }
-
-    header = (ws_header_t *)wsctx->codeBuf;
+    if (len > UPDATE_BUF_SIZE) {
+	  rfbErr("%s: %d bytes do not fit a frame\n", __func__, len);
+	  return -1;
+    }
 
     if (wsctx->base64) {
 	opcode = WS_OPCODE_TEXT_FRAME;
@@ -786,19 +836,7 @@ webSocketsEncodeHybi(rfbClientPtr cl, const char *src, int len, char **dst)
 	blen = len;
     }
 
-    header->b0 = 0x80 | (opcode & 0x0f);
-    if (blen <= 125) {
-      header->b1 = (uint8_t)blen;
-      sz = 2;
-    } else if (blen <= 65536) {
-      header->b1 = 0x7e;
-      header->l16 = WS_HTON16((uint16_t)blen);
-      sz = 4;
-    } else {
-      header->b1 = 0x7f;
-      header->l64 = WS_HTON64(blen);
-      sz = 10;
-    }
+    sz = webSocketsHybiHeader(wsctx->codeBuf, opcode, blen);
 
     if (wsctx->base64) {
         if (-1 == (ret = __b64_ntop((unsigned char *)src, len, wsctx->codeBuf + sz, sizeof(wsctx->codeBuf) - sz))) {
@@ -817,6 +855,23 @@ webSocketsEncodeHybi(rfbClientPtr cl, const char *src, int len, char **dst)
     return ret;
 }
 
+/*
+ * webSocketsFrameHeader writes the header of a binary frame carrying len
+ * bytes to header (WEBSOCKETS_MAX_FRAME_HEADER long), for the payload to
+ * be sent as it is right behind it.  Returns the header length, or 0 if
+ * cl takes its frames encoded and webSocketsEncode() has to be used.
+ */
+
+int
+webSocketsFrameHeader(rfbClientPtr cl, int len, char *header)
+{
+    ws_ctx_t *wsctx = (ws_ctx_t *)cl->wsctx;
+
+    if (wsctx->version != WEBSOCKETS_VERSION_HYBI || wsctx->base64)
+	return 0;
+    return webSocketsHybiHeader(header, WS_OPCODE_BINARY_FRAME, len);
+}
+
 int
 webSocketsEncode(rfbClientPtr cl, const char *src, int len, char **dst)
 {
@@ -291,7 +291,10 @@ typedef struct _rfbScreenInfo
     int httpPort;
     char* httpDir;
     SOCKET httpListenSock;
-    SOCKET httpSock;
+    SOCKET httpSock; /**< unused since there are httpConns */
+    /** HTTP connections, and the files served from httpDir (see httpd.c) */
+    struct _rfbHttpConnection *httpConns;
+    struct _rfbHttpFile *httpCache;
 
     rfbPasswordCheckProcPtr passwordCheck;
     void* authPasswdData;
@@ -380,6 +383,9 @@ typedef struct _rfbScreenInfo
 #ifdef LIBVNCSERVER_WITH_WEBSOCKETS
     char *sslkeyfile;
     char *sslcertfile;
+    /** what the TLS library keeps for all wss connections, e.g. the
+        OpenSSL SSL_CTX with the key, certificate and session cache */
+    void *sslServerCtx;
 #endif
     int ipv6port; /**< The port to listen on when using IPv6.  */
     char* listen6Interface;
@@ -389,6 +395,31 @@ typedef struct _rfbScreenInfo
     SOCKET listen6Sock;
     int http6Port;
     SOCKET httpListen6Sock;
+    /** if not zero, Tight updates are encoded by this many threads,
+     * counting the one sending the update (see encodepool.c) */
+    int encodeThreads;
+    struct _rfbEncodePool *encodePool;
+    /** if TRUE, clients with the same pixel format and encoding settings
+     * share encoded Tight and Hextile rectangles (see encodecache.c) */
+    rfbBool shareEncodedRects;
+    struct _rfbEncodeCache *encodeCache;
+    /** bumped whenever the framebuffer is marked as modified */
+    unsigned int frameSerial;
+    /** if TRUE when rfbInitServer() is called, rfbCheckFds() waits on an
+     * epoll set in epollFd, where there is epoll, instead of select()ing
+     * allFds (see sockets.c). epollFd is -1 otherwise. */
+    rfbBool useEpoll;
+    int epollFd;
+    /** clients with input left after their last epoll wakeup; while there
+     * are any, waiting on epollFd would not return for them */
+    struct _rfbClientRec *readyClients;
+    /** if not zero, output a client's socket would block on is queued
+     * instead of waited for, framebuffer updates being held back while
+     * more than this many bytes are queued. An update still queued whole
+     * when the next one is sent is dropped and its region sent again with
+     * that one (see sockets.c). Not used with SSL or rfbRunEventLoop() in
+     * the background. */
+    int maxClientQueue;
 } rfbScreenInfo, *rfbScreenInfoPtr;
 
 
@@ -414,6 +445,12 @@ typedef struct sraRegion* sraRegionPtr;
 
 typedef void (*ClientGoneHookPtr)(struct _rfbClientRec* cl);
 
+/** a one-shot timerfd, created when first armed; fd is -1 until then */
+typedef struct _rfbDeferTimer {
+  int fd;
+  rfbBool armed;
+} rfbDeferTimer;
+
 typedef struct _rfbFileTransferData {
   int fd;
   int compressionEnabled;
@@ -421,6 +458,9 @@ typedef struct _rfbFileTransferData {
   int numPackets;
   int receiving;
   int sending;
+  char *buffer;          /**< blocks read ahead to send, or received and not yet written */
+  int bufferLen;         /**< bytes received into buffer */
+  int skipCompression;   /**< windows to send before trying to compress again */
 } rfbFileTransferData;
 
 
@@ -505,7 +545,8 @@ typedef struct _rfbClientRec {
         /* Ephemeral internal-use states that will never be seen by software
          * using LibVNCServer to provide services: */
 
-        RFB_INITIALISATION_SHARED /**< sending initialisation messages with implicit shared-flag already true */
+        RFB_INITIALISATION_SHARED, /**< sending initialisation messages with implicit shared-flag already true */
+        RFB_TLS_HANDSHAKE /**< TLS handshake of a wss connection, before the WebSockets one and RFB_PROTOCOL_VERSION */
     } state;
 
     rfbBool reverseConnection;
@@ -567,6 +608,13 @@ typedef struct _rfbClientRec {
       int lastPtrY;
       int lastPtrButtons;
 
+    /** timerfds used instead of startDeferring and startPtrDeferring when
+       the screen waits with epoll, and the epoll ready list */
+      rfbDeferTimer deferTimer;
+      rfbDeferTimer ptrDeferTimer;
+      struct _rfbClientRec *nextReady;
+      rfbBool isReady;
+
     /** translateFn points to the translation function which is used to copy
        and translate a rectangle from the framebuffer to an output buffer. */
 
@@ -584,6 +632,22 @@ typedef struct _rfbClientRec {
 
     char updateBuf[UPDATE_BUF_SIZE];
     int ublen;
+    /** if set, rfbSendUpdateBuf() appends to this instead of writing to
+     * the socket; used while encoding on an encode pool thread */
+    struct _rfbEncodeSink *encodeSink;
+
+    /** output queued because the socket would not take it, see
+     * rfbScreenInfo::maxClientQueue. outQueueBytes is its depth and
+     * outQueuePeak the most it has held; updatesDropped updates of
+     * updateBytesDropped bytes in all were dropped from it */
+    struct _rfbQueuedOutput *outQueue, *outQueueTail;
+    struct _rfbQueuedOutput *updateOutput;
+    rfbBool writingUpdate, updateWritten;
+    struct timeval outQueueProgress;
+    int outQueueBytes;
+    int outQueuePeak;
+    int updatesDropped;
+    int updateBytesDropped;
 
     /* statistics */
     struct _rfbStatList *statEncList;
@@ -687,6 +751,8 @@ typedef struct _rfbClientRec {
     /* TurboVNC Encoding support (extends TightVNC) */
     int turboSubsampLevel;
     int turboQualityLevel;  // 1-100 scale
+    /** Tight encoder state, per-client so clients can be encoded in parallel */
+    void *tightEncoder;
 #endif
 #endif
 
@@ -762,8 +828,12 @@ extern rfbBool rfbSetNonBlocking(int sock);
 /* websockets.c */
 
 extern rfbBool webSocketsCheck(rfbClientPtr cl);
+extern rfbBool webSocketsCheckTLS(rfbClientPtr cl);
 extern rfbBool webSocketCheckDisconnect(rfbClientPtr cl);
 extern int webSocketsEncode(rfbClientPtr cl, const char *src, int len, char **dst);
+/** longest header webSocketsFrameHeader() writes */
+#define WEBSOCKETS_MAX_FRAME_HEADER 10
+extern int webSocketsFrameHeader(rfbClientPtr cl, int len, char *header);
 extern int webSocketsDecode(rfbClientPtr cl, char *dst, int len);
 #endif
 
@@ -811,6 +881,8 @@ void rfbGotXCutText(rfbScreenInfoPtr rfbScreen, char *str, int len);
 /* translate.c */
 
 extern rfbBool rfbEconomicTranslate;
+/* translate true colour with SIMD shifts where possible, not tables */
+extern rfbBool rfbShiftTranslate;
 
 extern void rfbTranslateNone(char *table, rfbPixelFormat *in,
                              rfbPixelFormat *out,
@@ -823,9 +895,14 @@ extern void rfbSetClientColourMaps(rfbScreenInfoPtr rfbScreen, int firstColour,
 
 /* httpd.c */
 
+/** how many HTTP connections are served at a time */
+#define RFB_HTTP_MAX_CONNECTIONS 32
+
+struct pollfd;
 extern void rfbHttpInitSockets(rfbScreenInfoPtr rfbScreen);
 extern void rfbHttpShutdownSockets(rfbScreenInfoPtr rfbScreen);
 extern void rfbHttpCheckFds(rfbScreenInfoPtr rfbScreen);
+extern int rfbHttpPollFds(rfbScreenInfoPtr rfbScreen, struct pollfd *fds, int max);
 
 
 
@@ -893,6 +970,7 @@ extern rfbBool rfbTightDisableGradient;
 extern int rfbNumCodedRectsTight(rfbClientPtr cl, int x,int y,int w,int h);
 
 extern rfbBool rfbSendRectEncodingTight(rfbClientPtr cl, int x,int y,int w,int h);
+extern void rfbFreeTightData(rfbClientPtr cl);
 
 #if defined(LIBVNCSERVER_HAVE_LIBPNG)
 extern rfbBool rfbSendRectEncodingTightPng(rfbClientPtr cl, int x,int y,int w,int h);
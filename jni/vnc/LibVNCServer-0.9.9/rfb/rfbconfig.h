@@ -335,9 +335,19 @@
 /* Use the system libvncserver build environment for x11vnc. */
 /* #undef LIBVNCSERVER_HAVE_SYSTEM_LIBVNCSERVER */
 
+/* Define to 1 if you have the <sys/epoll.h> header file. */
+#ifndef LIBVNCSERVER_HAVE_SYS_EPOLL_H 
+#define LIBVNCSERVER_HAVE_SYS_EPOLL_H  1 
+#endif
+
 /* Define to 1 if you have the <sys/ioctl.h> header file. */
 /* #undef LIBVNCSERVER_HAVE_SYS_IOCTL_H */
 
+/* Define to 1 if you have the <sys/sendfile.h> header file. */
+#ifndef LIBVNCSERVER_HAVE_SYS_SENDFILE_H 
+#define LIBVNCSERVER_HAVE_SYS_SENDFILE_H  1 
+#endif
+
 /* Define to 1 if you have the <sys/socket.h> header file. */
 #ifndef LIBVNCSERVER_HAVE_SYS_SOCKET_H 
 #define LIBVNCSERVER_HAVE_SYS_SOCKET_H  1 
@@ -356,6 +366,9 @@
 #define LIBVNCSERVER_HAVE_SYS_TIMEB_H  1 
 #endif
 
+/* Define to 1 if you have the <sys/timerfd.h> header file. */
+/* #undef LIBVNCSERVER_HAVE_SYS_TIMERFD_H */
+
 /* Define to 1 if you have the <sys/time.h> header file. */
 #ifndef LIBVNCSERVER_HAVE_SYS_TIME_H 
 #define LIBVNCSERVER_HAVE_SYS_TIME_H  1 
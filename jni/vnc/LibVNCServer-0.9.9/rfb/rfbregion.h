@@ -43,8 +43,9 @@ extern sraRegion *sraRgnBBox(const sraRegion *src);
 
 typedef struct sraRectangleIterator {
   rfbBool reverseX,reverseY;
-  int ptrSize,ptrPos;
-  struct sraSpan** sPtrs;
+  struct sraRegion *region;
+  int band,span;
+  struct sraRectangleIterator *nextFree;
 } sraRectangleIterator;
 
 extern sraRectangleIterator *sraRgnGetIterator(sraRegion *s);
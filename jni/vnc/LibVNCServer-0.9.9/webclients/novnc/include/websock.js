@@ -5,8 +5,9 @@
  *
  * Websock is similar to the standard WebSocket object but Websock
  * enables communication with raw TCP sockets (i.e. the binary stream)
- * via websockify. This is accomplished by base64 encoding the data
- * stream between Websock and websockify.
+ * via websockify. This is accomplished by sending the data stream in
+ * binary frames, or base64 encoding it where binary frames are not
+ * available.
  *
  * Websock has built-in receive queue buffering; the message event
  * does not contain actual data but is simply a notification that
@@ -63,6 +64,7 @@ var api = {},         // Public API
     rQi = 0,          // Receive queue index
     rQmax = 10000,    // Max receive queue size before compacting
     sQ = [],          // Send queue
+    mode = 'base64',  // Current WebSocket mode: 'binary', 'base64'
 
     eventHandlers = {
         'message' : function() {},
@@ -167,14 +169,27 @@ function rQwait(msg, num, goback) {
 //
 
 function encode_message() {
+    if (mode === 'binary') {
+        /* raw bytes */
+        return (new Uint8Array(sQ)).buffer;
+    }
     /* base64 encode */
     return Base64.encode(sQ);
 }
 
 function decode_message(data) {
+    var u8, i;
     //Util.Debug(">> decode_message: " + data);
-    /* base64 decode */
-    rQ = rQ.concat(Base64.decode(data, 0));
+    if (typeof data !== 'string') {
+        /* binary frame */
+        u8 = new Uint8Array(data);
+        for (i = 0; i < u8.length; i++) {
+            rQ.push(u8[i]);
+        }
+    } else {
+        /* base64 decode */
+        rQ = rQ.concat(Base64.decode(data, 0));
+    }
     //Util.Debug(">> decode_message, rQ: " + rQ);
 }
 
@@ -261,6 +276,7 @@ function init() {
     rQ         = [];
     rQi        = 0;
     sQ         = [];
+    mode       = 'base64';
     websocket  = null;
 }
 
@@ -269,10 +285,11 @@ function open(uri) {
 
     if (test_mode) {
         websocket = {};
+    } else if (Websock_native && typeof Uint8Array !== 'undefined') {
+        websocket = new WebSocket(uri, ['binary', 'base64']);
+        websocket.binaryType = 'arraybuffer';
     } else {
         websocket = new WebSocket(uri, 'base64');
-        // TODO: future native binary support
-        //websocket = new WebSocket(uri, ['binary', 'base64']);
     }
 
     websocket.onmessage = recv_message;
@@ -281,6 +298,7 @@ function open(uri) {
         if (websocket.protocol) {
             Util.Info("Server chose sub-protocol: " + websocket.protocol);
         }
+        mode = (websocket.protocol === 'binary') ? 'binary' : 'base64';
         eventHandlers.open();
         Util.Debug("<< WebSock.onopen");
     };
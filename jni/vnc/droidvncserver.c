@@ -25,12 +25,19 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include "input.h"
 #include "flinger.h"
 #include "gralloc.h"
+#include "tileDiff.h"
+#include "governor.h"
 
 #include "libvncserver/scale.h"
 #include "rfb/rfb.h"
 #include "rfb/keysym.h"
+#include "rfb/rfbregion.h"
 #include "suinput.h"
 
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 
 #define CONCAT2(a,b) a##b
 #define CONCAT2E(a,b) CONCAT2(a,b)
@@ -43,14 +50,39 @@ int VNC_PORT=5901;
 
 unsigned int *cmpbuf;
 unsigned int *vncbuf;
+uint32_t *dirtyTiles;
+/* per-tile signature of the source, kept instead of cmpbuf with -H or -Z */
+uint64_t *tileHashes;
 
 static rfbScreenInfoPtr vncscr;
 
 uint32_t idle = 0;
-uint32_t standby = 1;
 uint16_t rotation = 0;
 uint16_t scaling = 100;
 uint8_t display_rotate_180 = 0;
+uint8_t print_stats = 0;
+uint8_t fb_wait_flips = 0;
+uint8_t zero_copy = 0;
+uint8_t hash_tiles = 0;
+uint8_t scroll_detect = 1;
+int target_fps = GOVERNOR_DEFAULT_FPS;
+int cpu_budget = GOVERNOR_DEFAULT_CPU;
+/* threads encoding Tight updates, -1 = one per online core */
+int encode_threads = -1;
+#define MAX_ENCODE_THREADS 8
+
+/* framebuffer copy accounting for -S */
+static struct {
+  time_t since;
+  unsigned long long copied;
+  unsigned long long fullFrame;
+  unsigned long scrolls;
+  unsigned long long scrolledRows;
+} copyStats;
+
+/* rows of the new frame that moved by scrollOffset, from findScroll */
+static uint8_t *movedRows;
+static int scrollOffset;
 
 //reverse connection
 char *rhost = NULL;
@@ -61,8 +93,208 @@ void (*update_screen)(void)=NULL;
 enum method_type {AUTO,FRAMEBUFFER,ADB,GRALLOC,FLINGER};
 enum method_type method=AUTO;
 
-#define PIXEL_TO_VIRTUALPIXEL_FB(i,j) ((j+scrinfo.yoffset)*scrinfo.xres_virtual+i+scrinfo.xoffset)
-#define PIXEL_TO_VIRTUALPIXEL(i,j) ((j*screenformat.width)+i)
+/*
+ * Capture runs on its own thread so a slow grab can't hold up input or
+ * socket I/O. The capture thread owns cmpbuf; vncbuf, the client regions and
+ * the rotation state are only touched under frameLock, which the network
+ * thread holds while libvncserver reads the framebuffer and sends. Frames
+ * are handed over through the clients' modifiedRegion, which coalesces, so
+ * at most one published frame is ever waiting to be sent.
+ */
+static pthread_mutex_t frameLock = PTHREAD_MUTEX_INITIALIZER;
+static int wakeFds[2] = { -1, -1 };
+
+static pthread_mutex_t captureMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t captureCond = PTHREAD_COND_INITIALIZER;
+/* all three under captureMutex */
+static int captureWake = 0;
+/* set when the next grab must diff even if the front buffer didn't move */
+static int captureForced = 1;
+/* viewers connected, kept by clientHook and clientGone */
+static int captureClients = 0;
+/* set under frameLock when vncbuf no longer matches tileHashes */
+static int hashesStale = 0;
+
+/* longest the network thread sleeps when nothing is pending, in us */
+#define NETWORK_IDLE_WAIT 50000
+
+/* output queued for a viewer past which its updates wait, in bytes */
+#define MAX_CLIENT_QUEUE (1 << 20)
+
+/* A scroll is only looked for once this many tile rows' worth of tiles
+   changed, and only moves of at least SCROLL_MIN_ROWS rows are sent. */
+#define SCROLL_MIN_DIRTY_ROWS 2
+#define SCROLL_MIN_ROWS TILE_SIZE
+
+/* with -v, diff anyway this often in case the driver draws in place, in ms */
+#define FLIP_RESCAN_MS 2000
+
+/* A 64-bit tile hash can still collide. This often -H compares the source
+   against vncbuf for real, and -Z resends the whole screen. */
+#define HASH_REFRESH_SECONDS 30
+static time_t nextHashRefresh;
+
+/* Tells the network thread a new frame is waiting in vncbuf. */
+static void wakeNetworkLoop(void)
+{
+  char c = 0;
+  if (write(wakeFds[1], &c, 1) < 0 && errno != EAGAIN)
+    L("wakeNetworkLoop: %s\n", strerror(errno));
+}
+
+static void countCopiedBytes(size_t copied, size_t frameSize)
+{
+  copyStats.copied += copied;
+  copyStats.fullFrame += frameSize;
+}
+
+/* Called from the capture thread, prints once a second when -S is given. */
+static void printStats(void)
+{
+  time_t now = time(NULL);
+  char buf[256];
+
+  if (now == copyStats.since)
+    return;
+
+  if (copyStats.since != 0) {
+    L("framebuffer copy: %llu KB/s (full-frame copy would be %llu KB/s)\n",
+      copyStats.copied / 1024 / (now - copyStats.since),
+      copyStats.fullFrame / 1024 / (now - copyStats.since));
+    if (copyStats.scrolls > 0)
+      L("scrolls: %lu, %llu rows sent as CopyRect\n",
+        copyStats.scrolls, copyStats.scrolledRows);
+    governorStats(buf, sizeof(buf));
+    L("governor: %s\n", buf);
+  }
+  copyStats.since = now;
+  copyStats.copied = 0;
+  copyStats.fullFrame = 0;
+  copyStats.scrolls = 0;
+  copyStats.scrolledRows = 0;
+}
+
+/*
+ * Turns the dirty tile bitmap into a region and hands it to libvncserver.
+ * Runs of dirty tiles on a tile row become one rectangle and sraRgnOr merges
+ * identical runs on neighbouring rows, so a clock in one corner and a
+ * spinner in the other stay two small rectangles instead of one huge box.
+ */
+static void markDirtyTiles(void)
+{
+  int tx,ty,t,run,tilesX,tilesY,x2,y2;
+  sraRegionPtr region,rect;
+  sraRectangleIterator *iter;
+  sraRect r;
+
+  tilesX = TILES_X(vncscr->width);
+  tilesY = TILES_Y(vncscr->height);
+  region = sraRgnCreate();
+
+  for (ty = 0, t = 0; ty < tilesY; ty++) {
+    for (tx = 0; tx < tilesX; tx++, t++) {
+      if (!TILE_IS_DIRTY(dirtyTiles, t))
+        continue;
+      for (run = 1; tx + run < tilesX && TILE_IS_DIRTY(dirtyTiles, t + run); run++)
+        ;
+      x2 = (tx + run) * TILE_SIZE;
+      y2 = (ty + 1) * TILE_SIZE;
+      if (x2 > vncscr->width)
+        x2 = vncscr->width;
+      if (y2 > vncscr->height)
+        y2 = vncscr->height;
+      rect = sraRgnCreateRect(tx * TILE_SIZE, ty * TILE_SIZE, x2, y2);
+      sraRgnOr(region, rect);
+      sraRgnDestroy(rect);
+      tx += run - 1;
+      t += run - 1;
+    }
+  }
+
+  /* rfbMarkRegionAsModified doesn't refresh the scaled copies by itself */
+  if (vncscr->scaledScreenNext != NULL) {
+    iter = sraRgnGetIterator(region);
+    while (sraRgnIteratorNext(iter, &r))
+      rfbScaledScreenUpdate(vncscr, r.x1, r.y1, r.x2, r.y2);
+    sraRgnReleaseIterator(iter);
+  }
+
+  rfbMarkRegionAsModified(vncscr, region);
+  sraRgnDestroy(region);
+}
+
+/*
+ * Once a frame changed too much to be a few widgets, looks for a scroll
+ * between vncbuf, which still holds the last frame, and the new one, and
+ * unflags the dirty tiles the move accounts for. Needs frameLock, held
+ * through applyScroll, so the network thread can't draw the cursor into
+ * vncbuf or send from it between the search and the move.
+ */
+static void detectScroll(const uint8_t *src, int dx, int dy, int w, int h,
+                         int bytesPerPixel, int dirty)
+{
+  scrollOffset = 0;
+  if (!scroll_detect || dirty < SCROLL_MIN_DIRTY_ROWS * TILES_X(w))
+    return;
+
+  scrollOffset = findScroll((const uint8_t *)vncbuf, src, dx, dy, w, h,
+                            bytesPerPixel, h, SCROLL_MIN_ROWS, movedRows);
+  if (scrollOffset != 0)
+    clearScrolledTiles((const uint8_t *)vncbuf, src, dx, dy, w, h,
+                       bytesPerPixel, movedRows, dirtyTiles);
+}
+
+/*
+ * Moves the rows detectScroll found in vncbuf and has libvncserver send
+ * the move as CopyRect. Needs frameLock, and must run before the dirty
+ * tiles are marked so they aren't taken for part of the copy's source.
+ * Returns the bytes moved.
+ */
+static size_t applyScroll(int w, int h, int bytesPerPixel)
+{
+  sraRegionPtr region, rect;
+  sraRectangleIterator *iter;
+  sraRect r;
+  int y, run, rows = 0;
+
+  if (scrollOffset == 0)
+    return 0;
+
+  scrollRows((uint8_t *)vncbuf, w, h, bytesPerPixel, scrollOffset, movedRows);
+
+  region = sraRgnCreate();
+  for (y = 0; y < h; y += run) {
+    for (run = 0; y + run < h && movedRows[y + run]; run++)
+      ;
+    if (run == 0) {
+      run = 1;
+      continue;
+    }
+    rect = sraRgnCreateRect(0, y, w, y + run);
+    sraRgnOr(region, rect);
+    sraRgnDestroy(rect);
+    rows += run;
+  }
+
+  /* a rotation that slipped in has marked the whole screen already */
+  if (w == vncscr->width && h == vncscr->height) {
+    if (vncscr->scaledScreenNext != NULL) {
+      /* the scaled copies can't follow a CopyRect, send the rows again */
+      iter = sraRgnGetIterator(region);
+      while (sraRgnIteratorNext(iter, &r))
+        rfbScaledScreenUpdate(vncscr, r.x1, r.y1, r.x2, r.y2);
+      sraRgnReleaseIterator(iter);
+      rfbMarkRegionAsModified(vncscr, region);
+    } else {
+      rfbScheduleCopyRegion(vncscr, region, 0, scrollOffset);
+    }
+  }
+  sraRgnDestroy(region);
+
+  copyStats.scrolls++;
+  copyStats.scrolledRows += rows;
+  return (size_t)rows * w * bytesPerPixel;
+}
 
 #define OUT 8 
 #include "updateScreen.c" 
@@ -84,10 +316,41 @@ inline int getCurrentRotation()
 void setIdle(int i)
 {
   idle=i; 
+
+  if (!idle) {
+    pthread_mutex_lock(&captureMutex);
+    captureWake = 1;
+    pthread_cond_signal(&captureCond);
+    pthread_mutex_unlock(&captureMutex);
+  }
+}
+
+/* Makes the capture thread grab and diff right away, flip or no flip. */
+static void forceCapture(void)
+{
+  pthread_mutex_lock(&captureMutex);
+  captureForced = 1;
+  captureWake = 1;
+  pthread_cond_signal(&captureCond);
+  pthread_mutex_unlock(&captureMutex);
+}
+
+int isCaptureForced(void)
+{
+  int forced;
+
+  pthread_mutex_lock(&captureMutex);
+  forced = captureForced;
+  pthread_mutex_unlock(&captureMutex);
+  return forced;
 }
 
 ClientGoneHookPtr clientGone(rfbClientPtr cl)
 {
+  pthread_mutex_lock(&captureMutex);
+  captureClients--;
+  pthread_mutex_unlock(&captureMutex);
+
   sendMsgToGui("~DISCONNECTED|\n");
   return 0;
 }
@@ -102,6 +365,11 @@ rfbNewClientHookPtr clientHook(rfbClientPtr cl)
   }
 
   cl->clientGoneHook=(ClientGoneHookPtr)clientGone;
+  pthread_mutex_lock(&captureMutex);
+  captureClients++;
+  pthread_mutex_unlock(&captureMutex);
+  /* the screen may have changed while nobody was watching */
+  forceCapture();
 
   char *header="~CONNECTED|";
   char *msg=malloc(sizeof(char)*((strlen(cl->host)) + strlen(header)+2));
@@ -138,14 +406,78 @@ void sendServerStopped()
   sendMsgToGui("~SERVERSTOPPED|\n");
 }
 
+/* The copies are needed again once the picture no longer matches the
+   source, e.g. after a rotation. Called under frameLock. */
+static void leaveZeroCopy(void)
+{
+  size_t bpp = screenformat.bitsPerPixel/CHAR_BIT;
+
+  L("Leaving zero-copy mode\n");
+  vncbuf = calloc(screenformat.width * screenformat.height, bpp);
+  assert(vncbuf != NULL);
+  if (hash_tiles) {
+    hashesStale = 1;
+  } else {
+    cmpbuf = calloc(screenformat.width * screenformat.height, bpp);
+    assert(cmpbuf != NULL);
+  }
+
+  vncscr->frameBuffer = (char *)vncbuf;
+  vncscr->paddedWidthInBytes = vncscr->width * bpp;
+  zero_copy = 0;
+}
+
 void initVncServer(int argc, char **argv)
 { 
+  unsigned int *src = NULL;
+  int stride = screenformat.width;
+
+  /* libvncserver can only read the source in place if nothing has to be
+     rotated and the grabber hands back a buffer that stays mapped */
+  if (zero_copy && (rotation != 0 || display_rotate_180 || scaling != 100 ||
+                    (method != FRAMEBUFFER && method != GRALLOC))) {
+    L("Zero-copy needs -m fb or gralloc without rotation or scaling, ignoring it\n");
+    zero_copy = 0;
+  }
 
-  vncbuf = calloc(screenformat.width * screenformat.height, screenformat.bitsPerPixel/CHAR_BIT);
-  cmpbuf = calloc(screenformat.width * screenformat.height, screenformat.bitsPerPixel/CHAR_BIT);
+  if (zero_copy) {
+    if (method == FRAMEBUFFER) {
+      struct fb_var_screeninfo scrinfo = FB_getscrinfo();
+      src = readBufferFB();
+      stride = scrinfo.xres_virtual;
+      src = (unsigned int *)((char *)src + (scrinfo.yoffset * stride + scrinfo.xoffset) *
+                             (screenformat.bitsPerPixel/CHAR_BIT));
+    } else {
+      src = (unsigned int *)readBufferGralloc();
+    }
+    if (src == NULL)
+      zero_copy = 0;
+  }
 
-  assert(vncbuf != NULL);
-  assert(cmpbuf != NULL);
+  if (zero_copy || hash_tiles) {
+    tileHashes = calloc(TILES_X(screenformat.width) * TILES_Y(screenformat.height), sizeof(uint64_t));
+    assert(tileHashes != NULL);
+  }
+  if (!zero_copy) {
+    vncbuf = calloc(screenformat.width * screenformat.height, screenformat.bitsPerPixel/CHAR_BIT);
+    assert(vncbuf != NULL);
+  }
+  if (!zero_copy && !hash_tiles) {
+    cmpbuf = calloc(screenformat.width * screenformat.height, screenformat.bitsPerPixel/CHAR_BIT);
+    assert(cmpbuf != NULL);
+  }
+  /* one flag per row in either orientation */
+  movedRows = calloc(screenformat.width > screenformat.height ?
+                     screenformat.width : screenformat.height, 1);
+  assert(movedRows != NULL);
+  /* same tile count in both orientations, so rotate() needn't realloc */
+  dirtyTiles = calloc(TILE_BITMAP_WORDS(screenformat.width, screenformat.height), sizeof(uint32_t));
+  assert(dirtyTiles != NULL);
+
+  L("Tile diff kernel: %s\n", initTileDiff());
+  if (tileHashes != NULL)
+    L("Tile hash kernel: %s\n", tileHashKernelName());
+  nextHashRefresh = time(NULL) + HASH_REFRESH_SECONDS;
 
   if (rotation==0 || rotation==180) 
   vncscr = rfbGetScreen(&argc, argv, screenformat.width , screenformat.height, 0 /* not used */ , 3,  screenformat.bitsPerPixel/CHAR_BIT);
@@ -155,7 +487,14 @@ void initVncServer(int argc, char **argv)
   assert(vncscr != NULL);
 
   vncscr->desktopName = "Android";
-  vncscr->frameBuffer =(char *)vncbuf;
+  if (zero_copy) {
+    L("Zero-copy: serving pixels straight from the grabbed buffer\n");
+    vncscr->frameBuffer = (char *)src;
+    vncscr->paddedWidthInBytes = stride * screenformat.bitsPerPixel/CHAR_BIT;
+    /* the cursor would be drawn into the device's own buffer */
+    vncscr->cursor = NULL;
+  } else
+    vncscr->frameBuffer =(char *)vncbuf;
   vncscr->port = VNC_PORT;
   vncscr->kbdAddEvent = keyEvent;
   vncscr->ptrAddEvent = ptrEvent;
@@ -188,7 +527,21 @@ void initVncServer(int argc, char **argv)
 
   vncscr->alwaysShared = TRUE;
   vncscr->handleEventsEagerly = TRUE;
-  vncscr->deferUpdateTime = 5;
+  /* the capture governor paces updates, don't hold them back on top of it */
+  vncscr->deferUpdateTime = 0;
+
+  if (encode_threads < 0)
+    encode_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (encode_threads > MAX_ENCODE_THREADS)
+    encode_threads = MAX_ENCODE_THREADS;
+  vncscr->encodeThreads = encode_threads > 1 ? encode_threads : 0;
+  /* viewers with the same settings get each rectangle encoded once */
+  vncscr->shareEncodedRects = TRUE;
+  /* only look at the viewers that sent something, however many are idle */
+  vncscr->useEpoll = TRUE;
+  /* a viewer on a slow link gets its output queued instead of stalling
+     input, the other viewers and hand-over from the capture thread */
+  vncscr->maxClientQueue = MAX_CLIENT_QUEUE;
 
   rfbInitServer(vncscr);
 
@@ -219,6 +572,10 @@ void rotate(int value)
 
   L("rotate()\n");
 
+  if (zero_copy)
+    leaveZeroCopy();
+  hashesStale = 1;
+
   if (value == -1 || 
       ((value == 90 || value == 270) && (rotation == 0 || rotation == 180)) ||
       ((value == 0 || value == 180) && (rotation == 90 || rotation == 270))) {
@@ -244,8 +601,183 @@ void rotate(int value)
   }
  
   rfbMarkRectAsModified(vncscr, 0, 0, vncscr->width, vncscr->height);
+  /* vncbuf still holds the old layout, don't let viewers wait for a flip */
+  forceCapture();
+}
+
+
+/* waitForEvents() for when the library waits with epoll: its descriptor
+   is readable when any viewer is, so there is no need for allFds. */
+static void waitForEpoll(long usec)
+{
+  struct pollfd fds[4 + RFB_HTTP_MAX_CONNECTIONS];
+  int n = 0;
+  char buf[64];
+
+  //viewers with input left over get no new epoll event
+  if (vncscr->readyClients != NULL)
+    return;
+
+  fds[n].fd = wakeFds[0];
+  fds[n++].events = POLLIN;
+  fds[n].fd = vncscr->epollFd;
+  fds[n++].events = POLLIN;
+  n += rfbHttpPollFds(vncscr, fds + n, sizeof(fds) / sizeof(fds[0]) - n);
+
+  if (poll(fds, n, (usec + 999) / 1000) > 0 && (fds[0].revents & POLLIN))
+    while (read(wakeFds[0], buf, sizeof(buf)) > 0)
+      ;
+}
+
+/* Sleeps until a client or the http server needs attention, the capture
+   thread publishes a frame or usec microseconds pass. */
+static void waitForEvents(long usec)
+{
+  fd_set fds, wfds;
+  struct timeval tv;
+  struct pollfd httpFds[2 + RFB_HTTP_MAX_CONNECTIONS];
+  int maxFd = vncscr->maxFd;
+  int i, n;
+  char buf[64];
+  rfbClientIteratorPtr iterator;
+  rfbClientPtr cl;
+
+  if (vncscr->epollFd >= 0) {
+    waitForEpoll(usec);
+    return;
+  }
+
+  memcpy(&fds, &vncscr->allFds, sizeof(fds));
+  FD_SET(wakeFds[0], &fds);
+  if (wakeFds[0] > maxFd)
+    maxFd = wakeFds[0];
+
+  //viewers with output queued or a file going out are waited on to take it
+  FD_ZERO(&wfds);
+  iterator = rfbGetClientIterator(vncscr);
+  while ((cl = rfbClientIteratorNext(iterator)) != NULL)
+    if ((cl->outQueue != NULL ||
+         (cl->fileTransfer.fd != -1 && cl->fileTransfer.sending)) &&
+        cl->sock >= 0 && cl->sock < FD_SETSIZE)
+      FD_SET(cl->sock, &wfds);
+  rfbReleaseClientIterator(iterator);
+
+  //and so are browsers with a response to take
+  n = rfbHttpPollFds(vncscr, httpFds, sizeof(httpFds) / sizeof(httpFds[0]));
+  for (i = 0; i < n; i++) {
+    if (httpFds[i].fd >= FD_SETSIZE)
+      continue;
+    FD_SET(httpFds[i].fd, (httpFds[i].events & POLLOUT) ? &wfds : &fds);
+    if (httpFds[i].fd > maxFd)
+      maxFd = httpFds[i].fd;
+  }
+
+  tv.tv_sec = usec / 1000000;
+  tv.tv_usec = usec % 1000000;
+  if (select(maxFd + 1, &fds, &wfds, NULL, &tv) > 0 && FD_ISSET(wakeFds[0], &fds))
+    while (read(wakeFds[0], buf, sizeof(buf)) > 0)
+      ;
+}
+
+/* Sleeps the capture thread for ms milliseconds, or until input wakes it. */
+static void captureSleep(long ms)
+{
+  struct timeval now;
+  struct timespec until;
+
+  gettimeofday(&now, NULL);
+  until.tv_sec = now.tv_sec + ms / 1000;
+  until.tv_nsec = now.tv_usec * 1000 + (ms % 1000) * 1000000;
+  if (until.tv_nsec >= 1000000000) {
+    until.tv_sec++;
+    until.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&captureMutex);
+  while (!captureWake)
+    if (pthread_cond_timedwait(&captureCond, &captureMutex, &until) == ETIMEDOUT)
+      break;
+  captureWake = 0;
+  pthread_mutex_unlock(&captureMutex);
+}
+
+static long elapsedUs(struct timeval *since)
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - since->tv_sec) * 1000000 + (now.tv_usec - since->tv_usec);
+}
+
+static void *captureLoop(void *arg)
+{
+  struct timeval start;
+  long delay;
+  int clients;
+
+  while (1) {
+    if (print_stats)
+      printStats();
+
+    pthread_mutex_lock(&captureMutex);
+    clients = captureClients;
+    pthread_mutex_unlock(&captureMutex);
+    if (clients == 0) {
+      idle=1;
+      captureSleep(governorNoClients());
+      continue;
+    }
+
+    /* Nothing new can be on screen until the front buffer is panned, so
+       wait for that instead of diffing a buffer nobody flipped. The wait
+       gives up as soon as a capture is forced. */
+    if (fb_wait_flips && !isCaptureForced())
+      FB_waitForFlip(FLIP_RESCAN_MS);
+    pthread_mutex_lock(&captureMutex);
+    captureForced = 0;
+    pthread_mutex_unlock(&captureMutex);
+
+    gettimeofday(&start, NULL);
+    update_screen();
+    delay = governorCaptured(!idle, elapsedUs(&start));
+    /* flips already pace an idle screen, backing off would only add latency */
+    if (!fb_wait_flips || !idle)
+      captureSleep(delay);
+  }
+  return NULL;
+}
+
+/* Feeds the governor with what the last rfbProcessEvents round cost and
+   how many updates went out. Needs frameLock. */
+static void sampleClients(long encodeUs)
+{
+  static int lastSent = 0;
+  int sent = 0;
+  rfbClientIteratorPtr iterator;
+  rfbClientPtr cl;
+
+  iterator = rfbGetClientIterator(vncscr);
+  while ((cl = rfbClientIteratorNext(iterator)) != NULL)
+    sent += rfbStatGetMessageCountSent(cl, rfbFramebufferUpdate);
+  rfbReleaseClientIterator(iterator);
+
+  /* totals drop when a viewer leaves, don't count that as negative work */
+  governorSent(encodeUs, sent > lastSent ? sent - lastSent : 0);
+  lastSent = sent;
 }
 
+void startCaptureThread()
+{
+  pthread_t thread;
+
+  if (pipe(wakeFds) != 0) {
+    L("Couldn't create capture wake pipe: %s\n", strerror(errno));
+    close_app();
+  }
+  fcntl(wakeFds[0], F_SETFL, O_NONBLOCK);
+  fcntl(wakeFds[1], F_SETFL, O_NONBLOCK);
+
+  pthread_create(&thread, NULL, captureLoop, NULL);
+}
 
 void close_app()
 { 	
@@ -332,12 +864,18 @@ void printUsage(char **argv)
     "-r <rotation>\t- Screen rotation (degrees) (0,90,180,270)\n"
     "-R <host:port>\t- Host for reverse connection\n" 
     "-s <scale>\t- Scale percentage (20,30,50,100,150)\n"
+    "-S\t\t- Print capture statistics every second\n"
+    "-v\t\t- Only grab when the front buffer is flipped (only with -m fb)\n"
+    "-H\t\t- Detect changes with per-tile hashes instead of a shadow framebuffer\n"
+    "-Z\t\t- Zero-copy, serve pixels straight from the grabbed buffer (fb or gralloc, no rotation or scaling)\n"
+    "-C\t\t- Don't look for scrolled content to send as CopyRect\n"
+    "-F <fps>\t- Target capture frame rate (default 30)\n"
+    "-B <percent>\t- CPU budget for capture and encoding, percent of one core (default 50)\n"
+    "-j <threads>\t- Threads encoding Tight updates (default one per core, 1 to disable)\n"
     "-z\t- Rotate display 180º (for zte compatibility)\n\n");
 }
 
 
-#include <time.h>
-
 int main(int argc, char **argv)
 {
   //pipe signals
@@ -345,6 +883,8 @@ int main(int argc, char **argv)
   signal(SIGKILL, close_app);
   signal(SIGILL, close_app);
   long usec;
+  rfbBool pending;
+  struct timeval start;
 
   if(argc > 1) {
     int i=1;
@@ -388,6 +928,33 @@ int main(int argc, char **argv)
           scaling = 100;
           L("scaling to %d%%\n",scaling);
           break;
+          case 'S':
+          print_stats=1;
+          break;
+          case 'v':
+          fb_wait_flips=1;
+          break;
+          case 'Z':
+          zero_copy=1;
+          break;
+          case 'H':
+          hash_tiles=1;
+          break;
+          case 'C':
+          scroll_detect=0;
+          break;
+          case 'F':
+          i++;
+          target_fps=atoi(argv[i]);
+          break;
+          case 'B':
+          i++;
+          cpu_budget=atoi(argv[i]);
+          break;
+          case 'j':
+          i++;
+          encode_threads=atoi(argv[i]);
+          break;
           case 'R':
           i++;
           extractReverseHostPort(argv[i]);
@@ -418,6 +985,10 @@ int main(int argc, char **argv)
 
     L("Initializing grabber method...\n");
     initGrabberMethod();
+    if (fb_wait_flips && method != FRAMEBUFFER) {
+      L("-v only works with the framebuffer method, ignoring it\n");
+      fb_wait_flips = 0;
+    }
 
     L("Initializing virtual keyboard and touch device...\n");
     initInput(); 
@@ -454,25 +1025,22 @@ int main(int argc, char **argv)
     }
 
 
+    initGovernor(target_fps, cpu_budget);
+    startCaptureThread();
+
+    //the network loop only reads input and sends what the capture thread published
+    usec = NETWORK_IDLE_WAIT;
     while (1) {
-        usec=(vncscr->deferUpdateTime+standby)*1000;
-        //clock_t start = clock();
-        rfbProcessEvents(vncscr,usec);
-      
-      if (idle)
-        standby+=2;
-      else
-        standby=2;
-      
-      if (vncscr->clientHead == NULL)
-      {
-        idle=1;
-        standby=50;
-        continue;
-      }
+      waitForEvents(usec);
+
+      pthread_mutex_lock(&frameLock);
+      gettimeofday(&start, NULL);
+      pending = rfbProcessEvents(vncscr,0);
+      sampleClients(elapsedUs(&start));
+      pthread_mutex_unlock(&frameLock);
 
-      update_screen(); 
-      //printf ( "%f\n", ( (double)clock() - start )*1000 / CLOCKS_PER_SEC );
+      //come back in time for deferred updates, otherwise wait to be woken
+      usec = pending ? (vncscr->deferUpdateTime > 0 ? vncscr->deferUpdateTime*1000 : 1000) : NETWORK_IDLE_WAIT;
     }
     close_app();
 }
@@ -0,0 +1,139 @@
+/*
+droid VNC server  - a vnc server for android
+Copyright (C) 2011 Jose Pereira <onaips@gmail.com>
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+//this file implements the capture rate governor
+//
+//The interval between two grabs is the largest of:
+//  - the target frame time (-F)
+//  - what keeps grab+diff+encode inside the cpu budget (-B)
+//and it backs off geometrically while the screen doesn't change. Input
+//wakes the capture thread directly, so backing off costs no latency.
+//
+//Viewers aren't a term of their own: they ask for the next update as soon
+//as one arrives, so the time between their requests is only the pace we
+//send at. A viewer on a slow link is held back by its output queue.
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "governor.h"
+
+#define IDLE_BACKOFF_MAX_MS 500
+#define NO_CLIENTS_MS 50
+
+/* weight of a new sample in the moving averages, 1/8 */
+#define EWMA(avg, sample) ((avg) += ((sample) - (avg)) / 8)
+
+static pthread_mutex_t governorMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+  int targetFps;
+  int cpuBudget;
+
+  /* measurements */
+  double changeRatio;   /* share of grabs that found a change */
+  double captureUs;     /* grab + diff + publish */
+  double encodeUs;      /* per FramebufferUpdate sent */
+
+  /* decision */
+  long intervalMs;
+  const char *reason;
+  unsigned long grabs;
+  unsigned long changedGrabs;
+} gov;
+
+void initGovernor(int targetFps, int cpuBudget)
+{
+  pthread_mutex_lock(&governorMutex);
+  gov.targetFps = targetFps > 0 ? targetFps : GOVERNOR_DEFAULT_FPS;
+  gov.cpuBudget = cpuBudget > 0 && cpuBudget <= 100 ? cpuBudget : GOVERNOR_DEFAULT_CPU;
+  gov.changeRatio = 0;
+  gov.captureUs = 0;
+  gov.encodeUs = 0;
+  gov.intervalMs = 1000 / gov.targetFps;
+  gov.reason = "start";
+  pthread_mutex_unlock(&governorMutex);
+}
+
+long governorCaptured(int changed, long captureUs)
+{
+  long frameMs, cpuMs, ms;
+
+  pthread_mutex_lock(&governorMutex);
+  gov.grabs++;
+  if (changed)
+    gov.changedGrabs++;
+  EWMA(gov.changeRatio, changed ? 1.0 : 0.0);
+  EWMA(gov.captureUs, (double)captureUs);
+
+  frameMs = 1000 / gov.targetFps;
+  cpuMs = (long)((gov.captureUs + gov.changeRatio * gov.encodeUs) * 100
+                 / gov.cpuBudget / 1000);
+
+  if (changed) {
+    ms = frameMs;
+    gov.reason = "target fps";
+    if (cpuMs > ms) {
+      ms = cpuMs;
+      gov.reason = "cpu budget";
+    }
+  } else {
+    ms = gov.intervalMs + gov.intervalMs / 2 + 1;
+    if (ms > IDLE_BACKOFF_MAX_MS)
+      ms = IDLE_BACKOFF_MAX_MS;
+    gov.reason = "idle backoff";
+  }
+
+  gov.intervalMs = ms;
+  pthread_mutex_unlock(&governorMutex);
+  return ms;
+}
+
+long governorNoClients(void)
+{
+  pthread_mutex_lock(&governorMutex);
+  gov.intervalMs = NO_CLIENTS_MS;
+  gov.reason = "no clients";
+  pthread_mutex_unlock(&governorMutex);
+  return NO_CLIENTS_MS;
+}
+
+void governorSent(long encodeUs, int updates)
+{
+  pthread_mutex_lock(&governorMutex);
+  if (updates > 0)
+    EWMA(gov.encodeUs, (double)encodeUs / updates);
+  pthread_mutex_unlock(&governorMutex);
+}
+
+int governorStats(char *buf, size_t len)
+{
+  int n;
+
+  pthread_mutex_lock(&governorMutex);
+  n = snprintf(buf, len,
+               "interval=%ldms reason=%s target_fps=%d cpu_budget=%d%% "
+               "change_ratio=%.2f capture_us=%.0f encode_us=%.0f "
+               "grabs=%lu changed=%lu",
+               gov.intervalMs, gov.reason, gov.targetFps, gov.cpuBudget,
+               gov.changeRatio, gov.captureUs, gov.encodeUs,
+               gov.grabs, gov.changedGrabs);
+  pthread_mutex_unlock(&governorMutex);
+  return n;
+}
@@ -0,0 +1,44 @@
+/*
+droid VNC server  - a vnc server for android
+Copyright (C) 2011 Jose Pereira <onaips@gmail.com>
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef CAPTURE_GOVERNOR_H
+#define CAPTURE_GOVERNOR_H
+
+#include <stddef.h>
+
+#define GOVERNOR_DEFAULT_FPS 30
+#define GOVERNOR_DEFAULT_CPU 50   /* percent of one core */
+
+void initGovernor(int targetFps, int cpuBudget);
+
+/* Capture thread: one grab+diff took captureUs, `changed` says whether it
+   found anything. Returns how long to sleep before the next grab, in ms. */
+long governorCaptured(int changed, long captureUs);
+
+/* Capture thread, no client connected. Returns the sleep in ms. */
+long governorNoClients(void);
+
+/* Network thread: one rfbProcessEvents round took encodeUs and sent
+   `updates` FramebufferUpdates. */
+void governorSent(long encodeUs, int updates);
+
+/* One line describing the current measurements and decision. */
+int governorStats(char *buf, size_t len);
+
+#endif
@@ -21,6 +21,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include "gui.h"
 #include "common.h"
+#include "governor.h"
 
 #define SOCKET_ERROR        -1
 #define BUFFER_SIZE         1024
@@ -114,6 +115,15 @@ void *handle_connections()
                  0,(struct sockaddr *)&from,fromlen);
       if (n  < 0) perror("sendto");
     }
+    else if (strstr(pBuffer,"~STATS|")!=NULL)
+    {
+      char resp[BUFFER_SIZE];
+      int len = snprintf(resp, sizeof(resp), "~STATS|");
+      governorStats(resp + len, sizeof(resp) - len);
+      n = sendto(hServerSocket,resp,strlen(resp),
+                 0,(struct sockaddr *)&from,fromlen);
+      if (n  < 0) perror("sendto");
+    }
     else if (strstr(pBuffer,"~KILL|")!=NULL)
     close_app();
   }
@@ -0,0 +1,46 @@
+/*
+droid VNC server  - a vnc server for android
+Copyright (C) 2011 Jose Pereira <onaips@gmail.com>
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef FB_STANDIN_H
+#define FB_STANDIN_H
+
+#include <stdint.h>
+#include <linux/fb.h>
+
+/*
+ * A regular file given to -f stands in for the fb device, so the
+ * framebuffer method can run without one; test/fakefb.c writes such
+ * files. The header below sits at the start of the file and the pixels
+ * start at FB_STANDIN_DATA_OFFSET.
+ * Whoever writes the file pans by storing a new xoffset/yoffset.
+ */
+#define FB_STANDIN_MAGIC 0x62664e44 /* "DNfb" */
+#define FB_STANDIN_DATA_OFFSET 4096
+
+struct fb_standin_header {
+  uint32_t magic;
+  uint32_t xres, yres;
+  uint32_t xres_virtual, yres_virtual;
+  volatile uint32_t xoffset, yoffset;
+  uint32_t bits_per_pixel;
+  uint32_t line_length;
+  struct fb_bitfield red, green, blue, transp;
+};
+
+#endif
@@ -23,9 +23,23 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include "framebuffer.h"
 #include "gui.h"
 
+#include <sys/stat.h>
+
+#ifndef FBIO_WAITFORVSYNC
+#define FBIO_WAITFORVSYNC _IOW('F', 0x20, __u32)
+#endif
+
+/* how often to look at the pan offsets when the driver can't wait for vsync */
+#define FLIP_POLL_MS 16
+
 int fbfd = -1;
 unsigned int *fbmmap;
 
+static struct fb_standin_header *standin = NULL;
+static int canWaitForVsync = 1;
+static int infoFresh = 0;
+static uint32_t lastXoffset, lastYoffset;
+
 char framebuffer_device[256] = "/dev/graphics/fb0";
 
 struct fb_var_screeninfo scrinfo;
@@ -38,6 +52,21 @@ void FB_setDevice(char *s)
 
 void update_fb_info(void)
 {  
+  if (standin) {
+    scrinfo.xres = standin->xres;
+    scrinfo.yres = standin->yres;
+    scrinfo.xres_virtual = standin->xres_virtual;
+    scrinfo.yres_virtual = standin->yres_virtual;
+    scrinfo.xoffset = standin->xoffset;
+    scrinfo.yoffset = standin->yoffset;
+    scrinfo.bits_per_pixel = standin->bits_per_pixel;
+    scrinfo.red = standin->red;
+    scrinfo.green = standin->green;
+    scrinfo.blue = standin->blue;
+    scrinfo.transp = standin->transp;
+    return;
+  }
+
   if (ioctl(fbfd, FBIOGET_VSCREENINFO, &scrinfo) != 0) {
     L("ioctl error\n");
     sendMsgToGui("~SHOW|Framebuffer ioctl error, please try out other display grab method\n");
@@ -45,6 +74,26 @@ void update_fb_info(void)
   }
 }
 
+/* Maps the header if the device is really a stand-in file. */
+static int openStandin(void)
+{
+  struct stat st;
+
+  if (fstat(fbfd, &st) != 0 || !S_ISREG(st.st_mode))
+    return 0;
+
+  standin = mmap(NULL, sizeof(*standin), PROT_READ, MAP_SHARED, fbfd, 0);
+  if (standin == MAP_FAILED || standin->magic != FB_STANDIN_MAGIC) {
+    L("%s is neither an fb device nor a stand-in file\n", framebuffer_device);
+    standin = NULL;
+    return -1;
+  }
+
+  L("Using stand-in framebuffer file %s\n", framebuffer_device);
+  canWaitForVsync = 0;
+  return 1;
+}
+
 inline int roundUpToPageSize(int x) {
   return (x + (PAGE_SIZE-1)) & ~(PAGE_SIZE-1);
 }
@@ -61,10 +110,14 @@ int initFB(void)
     return -1;
   }
 
-  update_fb_info();
+  if (openStandin() < 0)
+    return -1;
 
+  update_fb_info();
 
-  if (ioctl(fbfd, FBIOGET_FSCREENINFO, &fscrinfo) != 0) {
+  if (standin) {
+    fscrinfo.line_length = standin->line_length;
+  } else if (ioctl(fbfd, FBIOGET_FSCREENINFO, &fscrinfo) != 0) {
     L("ioctl error\n");
     return -1;
   }
@@ -88,7 +141,8 @@ int initFB(void)
 
   size_t fbSize = roundUpToPageSize(fscrinfo.line_length * size);
 
-  fbmmap = mmap(NULL, fbSize , PROT_READ|PROT_WRITE ,  MAP_SHARED , fbfd, 0);
+  fbmmap = mmap(NULL, fbSize , PROT_READ|PROT_WRITE ,  MAP_SHARED , fbfd,
+                standin ? FB_STANDIN_DATA_OFFSET : 0);
 
   if (fbmmap == MAP_FAILED) { 
     L("mmap failed\n");
@@ -109,11 +163,16 @@ int initFB(void)
   screenformat.alphaShift = scrinfo.transp.offset;
   screenformat.alphaMax = scrinfo.transp.length;
 
+  lastXoffset = scrinfo.xoffset;
+  lastYoffset = scrinfo.yoffset;
+
   return 1;
 } 
 
 void closeFB(void) 
 {
+  if (standin)
+    munmap(standin, sizeof(*standin));
   if(fbfd != -1)
   close(fbfd);
 } 
@@ -125,6 +184,42 @@ struct fb_var_screeninfo FB_getscrinfo(void)
 
 unsigned int *readBufferFB(void)
 {
-  update_fb_info();
+  /* FB_waitForFlip has just read the offsets, no need to ask again */
+  if (!infoFresh)
+    update_fb_info();
+  infoFresh = 0;
   return fbmmap;
 }
+
+/*
+ * Blocks until the front buffer is panned to a new offset, timeoutMs runs
+ * out or a capture is forced. Sleeps on vsync when the driver supports it,
+ * otherwise looks at the offsets every FLIP_POLL_MS. Returns 1 if the
+ * buffer moved.
+ */
+int FB_waitForFlip(long timeoutMs)
+{
+  __u32 crtc = 0;
+  long waited = 0;
+
+  do {
+    if (canWaitForVsync && ioctl(fbfd, FBIO_WAITFORVSYNC, &crtc) != 0) {
+      L("FBIO_WAITFORVSYNC not supported, polling pan offsets\n");
+      canWaitForVsync = 0;
+    }
+    if (!canWaitForVsync)
+      usleep(FLIP_POLL_MS * 1000);
+    waited += FLIP_POLL_MS;
+
+    update_fb_info();
+    if (scrinfo.xoffset != lastXoffset || scrinfo.yoffset != lastYoffset) {
+      lastXoffset = scrinfo.xoffset;
+      lastYoffset = scrinfo.yoffset;
+      infoFresh = 1;
+      return 1;
+    }
+  } while (waited < timeoutMs && !isCaptureForced());
+
+  infoFresh = 1;
+  return 0;
+}
@@ -21,11 +21,13 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #define ADB_FRAMEBUFFER_METHOD
 
 #include "common.h"
+#include "fbstandin.h"
 
 int initFB(void);
 void closeFB(void);
 unsigned int *readBufferFB(void);
 void FB_setDevice(char *);
 struct fb_var_screeninfo FB_getscrinfo(void);
+int FB_waitForFlip(long timeoutMs);
 
 #endif
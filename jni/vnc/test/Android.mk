@@ -0,0 +1,39 @@
+# Included from ../Android.mk with ndk-build DVNC_TESTS=1, so LOCAL_PATH is
+# still jni/vnc and libvncserver_static and libtilediff_static are defined.
+
+# the tests that run libvncserver, linked with the shared harness.c
+DVNC_LIBVNCSERVER_TESTS:= \
+	tightstress \
+	tjbench \
+	translatebench \
+	scalebench \
+	eventbench \
+	slowviewer \
+	tlsbench \
+	httpbench \
+	wsbench \
+	regionstress \
+	ftbench
+
+# $(1) is the test, $(2) other sources, $(3) the static libraries it needs
+define dvnc-test
+include $$(CLEAR_VARS)
+
+LOCAL_SRC_FILES := test/$(1).c $(2)
+
+LOCAL_CFLAGS += -Wall -O2
+LOCAL_C_INCLUDES += $$(LOCAL_PATH)
+
+LOCAL_STATIC_LIBRARIES := $(3)
+
+LOCAL_MODULE := $(1)
+
+include $$(BUILD_EXECUTABLE)
+endef
+
+$(eval $(call dvnc-test,tilebench,,libtilediff_static))
+$(eval $(call dvnc-test,fakefb))
+$(eval $(call dvnc-test,governortest,governor.c))
+$(eval $(call dvnc-test,scrollbench,test/harness.c,libvncserver_static libtilediff_static))
+$(foreach t,$(DVNC_LIBVNCSERVER_TESTS),\
+	$(eval $(call dvnc-test,$(t),test/harness.c,libvncserver_static)))
@@ -0,0 +1,148 @@
+/*
+droid VNC server  - a vnc server for android
+Copyright (C) 2011 Jose Pereira <onaips@gmail.com>
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Event loop benchmark: connects [idle] viewers that never send anything
+ * and [active] ones that send a burst of pointer events every round, then
+ * runs rfbProcessEvents() until every event has reached the screen's
+ * pointer hook. This is done once with select() and once with epoll
+ * (rfbScreenInfo.useEpoll); both must deliver every event, and the time
+ * per round is printed for each.
+ *
+ *   eventbench [idle] [active] [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <rfb/rfb.h>
+
+#include "harness.h"
+
+#define WIDTH 64
+#define HEIGHT 64
+/* pointer events per active viewer and round */
+#define BURST 3
+/* rfbProcessEvents() calls a round may take before it counts as lost */
+#define MAX_CALLS 1000
+
+static int delivered;
+
+static void countPointer(int buttonMask, int x, int y, rfbClientPtr cl)
+{
+  delivered++;
+}
+
+static int run(char **argv, char *fb, rfbBool epoll, int idle, int active,
+               int rounds)
+{
+  rfbScreenInfoPtr screen;
+  rfbClientPtr *clients;
+  struct sockaddr_in addr;
+  rfbPointerEventMsg pe[BURST];
+  int *viewerFds, listener, total = idle + active;
+  int fakeArgc = 1, lost = 0, i, r, calls;
+  double start, elapsed;
+
+  screen = rfbGetScreen(&fakeArgc, argv, WIDTH, HEIGHT, 8, 3, 4);
+  screen->frameBuffer = fb;
+  screen->port = 0;
+  screen->ipv6port = 0;
+  screen->ptrAddEvent = countPointer;
+  screen->useEpoll = epoll;
+  rfbInitServer(screen);
+  if (epoll && screen->epollFd < 0) {
+    printf("epoll    not available\n");
+    rfbScreenCleanup(screen);
+    return 0;
+  }
+
+  listener = listenLoopback(&addr, 64);
+
+  clients = malloc(total * sizeof(*clients));
+  viewerFds = malloc(total * sizeof(*viewerFds));
+  /* the active viewers come last, behind all the idle ones */
+  for (i = 0; i < total; i++)
+    clients[i] = connectViewer(screen, listener, &addr, 0, &viewerFds[i]);
+  close(listener);
+
+  /* take the protocol version messages out of the way */
+  rfbProcessEvents(screen, 0);
+
+  delivered = 0;
+  start = now();
+  for (r = 0; r < rounds; r++) {
+    for (i = idle; i < total; i++) {
+      int j;
+
+      for (j = 0; j < BURST; j++) {
+        pe[j].type = rfbPointerEvent;
+        /* no buttons, or the first viewer would grab the pointer */
+        pe[j].buttonMask = 0;
+        pe[j].x = Swap16IfLE((r + j) % WIDTH);
+        pe[j].y = Swap16IfLE(i % HEIGHT);
+      }
+      if (write(viewerFds[i], pe, sizeof(pe)) != sizeof(pe)) {
+        perror("write");
+        exit(1);
+      }
+    }
+    for (calls = 0; delivered < (r + 1) * active * BURST; calls++) {
+      if (calls == MAX_CALLS) {
+        lost = 1;
+        break;
+      }
+      rfbProcessEvents(screen, calls > 0 ? 1000 : 0);
+    }
+    if (lost)
+      break;
+  }
+  elapsed = now() - start;
+
+  printf("%-8s %4d idle  %2d active  %8.1f us/round  %s\n",
+         epoll ? "epoll" : "select", idle, active, elapsed * 1e3 / rounds,
+         lost ? "LOST EVENTS" : "ok");
+
+  for (i = 0; i < total; i++) {
+    rfbCloseClient(clients[i]);
+    rfbClientConnectionGone(clients[i]);
+    close(viewerFds[i]);
+  }
+  free(clients);
+  free(viewerFds);
+  rfbScreenCleanup(screen);
+  return lost;
+}
+
+int main(int argc, char **argv)
+{
+  int idle = argc > 1 ? atoi(argv[1]) : 300;
+  int active = argc > 2 ? atoi(argv[2]) : 4;
+  int rounds = argc > 3 ? atoi(argv[3]) : 2000;
+  char *fb = calloc(WIDTH * HEIGHT, 4);
+  int failed = 0;
+
+  rfbLogEnable(0);
+  failed |= run(argv, fb, FALSE, idle, active, rounds);
+  failed |= run(argv, fb, TRUE, idle, active, rounds);
+  free(fb);
+  printf("%s\n", failed ? "FAILED" : "ok");
+  return failed;
+}
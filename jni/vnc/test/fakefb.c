@@ -0,0 +1,107 @@
+/*
+droid VNC server  - a vnc server for android
+Copyright (C) 2011 Jose Pereira <onaips@gmail.com>
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Stand-in framebuffer device for the -m fb -f <file> path. Creates a
+ * double-buffered 32bpp file and, like a page-flipping display, draws a
+ * moving bar into the back buffer and pans to it `fps` times a second.
+ * With fps 0 the file is left static, which is what idle CPU is measured
+ * against with -v.
+ *
+ *   fakefb <file> [fps] [width] [height]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "screenMethods/fbstandin.h"
+
+static void draw(uint32_t *buf, int w, int h, int frame)
+{
+  int x, y, bar = frame % w;
+
+  for (y = 0; y < h; y++)
+    for (x = 0; x < w; x++)
+      buf[y * w + x] = (x >= bar && x < bar + 16) ? 0x00ffffff : 0x00203040;
+}
+
+int main(int argc, char **argv)
+{
+  int fps = argc > 2 ? atoi(argv[2]) : 0;
+  int w = argc > 3 ? atoi(argv[3]) : 480;
+  int h = argc > 4 ? atoi(argv[4]) : 800;
+  size_t size = FB_STANDIN_DATA_OFFSET + (size_t)w * h * 4 * 2;
+  struct fb_standin_header *hdr;
+  uint8_t *map;
+  uint32_t *pixels;
+  int fd, frame, back;
+
+  if (argc < 2 || w <= 0 || h <= 0) {
+    fprintf(stderr, "usage: %s <file> [fps] [width] [height]\n", argv[0]);
+    return 1;
+  }
+
+  fd = open(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, size) != 0) {
+    perror(argv[1]);
+    return 1;
+  }
+  map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+
+  hdr = (struct fb_standin_header *)map;
+  pixels = (uint32_t *)(map + FB_STANDIN_DATA_OFFSET);
+
+  memset(hdr, 0, sizeof(*hdr));
+  hdr->xres = hdr->xres_virtual = w;
+  hdr->yres = h;
+  hdr->yres_virtual = h * 2;
+  hdr->bits_per_pixel = 32;
+  hdr->line_length = w * 4;
+  hdr->red.offset = 16;
+  hdr->red.length = 8;
+  hdr->green.offset = 8;
+  hdr->green.length = 8;
+  hdr->blue.offset = 0;
+  hdr->blue.length = 8;
+  draw(pixels, w, h, 0);
+  __sync_synchronize();
+  hdr->magic = FB_STANDIN_MAGIC;
+
+  printf("%s: %dx%d, %s\n", argv[1], w, h, fps > 0 ? "flipping" : "static");
+  if (fps <= 0)
+    return 0;
+
+  for (frame = 1; ; frame++) {
+    back = frame & 1;
+    draw(pixels + (size_t)back * w * h, w, h, frame);
+    __sync_synchronize();
+    hdr->yoffset = back * h;
+    usleep(1000000 / fps);
+  }
+  return 0;
+}
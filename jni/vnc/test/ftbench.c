@@ -0,0 +1,358 @@
+/*
+droid VNC server  - a vnc server for android
+Copyright (C) 2011 Jose Pereira <onaips@gmail.com>
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * File transfer benchmark: a viewer in a child process downloads a log-like
+ * file and an incompressible one as UltraVNC viewers do, with and without
+ * compression, then uploads both, compressing the blocks that shrink. The
+ * viewer checks what it downloads against the file, and the server's copy
+ * of what was uploaded is checked against what was sent. Prints megabytes
+ * per second, the bytes on the wire per byte of the file and the CPU time
+ * the server spent per megabyte. Blocks are compressed on the given number
+ * of encoding threads.
+ *
+ *   ftbench [megabytes] [threads]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <rfb/rfb.h>
+
+#include "harness.h"
+
+enum { LOG, RANDOM, KINDS };
+static const char *kinds[] = { "log", "random" };
+
+static char dir[64], path[KINDS][512];
+static char *contents[KINDS];
+static long fileSize;
+
+/* Makes fileSize bytes of logcat-like lines, or of noise as an APK is. */
+static char *makeContents(int kind)
+{
+  char *data = malloc(fileSize), line[160];
+  unsigned int x = 2463534242u;
+  long i = 0;
+  int n, k = 0;
+
+  while (i < fileSize) {
+    if (kind == LOG) {
+      n = snprintf(line, sizeof(line),
+                   "10-16 08:%02d:%02d.%03d  %4d  %4d I ActivityManager: "
+                   "Start proc %d:com.example.app%d/u0a%d for activity\n",
+                   k / 60 % 60, k % 60, k % 1000, 500 + k % 7, 900 + k % 13,
+                   4000 + k, k % 17, 100 + k % 31);
+      k++;
+    } else {
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      memcpy(line, &x, sizeof(x));
+      n = sizeof(x);
+    }
+    if (n > fileSize - i)
+      n = fileSize - i;
+    memcpy(data + i, line, n);
+    i += n;
+  }
+  return data;
+}
+
+/* Reads a file transfer message header, and what follows it into buf. */
+static rfbFileTransferMsg readMessage(int fd, char *buf, long *wire)
+{
+  rfbFileTransferMsg ft;
+
+  readExact(fd, &ft, sz_rfbFileTransferMsg);
+  ft.size = ntohl(ft.size);
+  ft.length = ntohl(ft.length);
+  if (ft.type != rfbFileTransfer || ft.length > sz_rfbBlockSize + 1024)
+    _exit(1);
+  readExact(fd, buf, ft.length);
+  *wire += sz_rfbFileTransferMsg + ft.length;
+  return ft;
+}
+
+static void writeMessage(int fd, int contentType, uint32_t size,
+                         const char *data, uint32_t length, long *wire)
+{
+  rfbFileTransferMsg ft;
+
+  memset(&ft, 0, sizeof(ft));
+  ft.type = rfbFileTransfer;
+  ft.contentType = contentType;
+  ft.size = htonl(size);
+  ft.length = htonl(length);
+  writeExact(fd, &ft, sz_rfbFileTransferMsg);
+  writeExact(fd, data, length);
+  *wire += sz_rfbFileTransferMsg + length;
+}
+
+/* Downloads the file of kind and checks it; exits 1 if it differs, or
+   writes how many bytes it read off the socket to out. */
+static void downloader(struct sockaddr_in *addr, int kind, int out)
+{
+  static char buf[sz_rfbBlockSize + 1024], raw[sz_rfbBlockSize];
+  const char *data = contents[kind];
+  rfbFileTransferMsg ft;
+  unsigned long n;
+  long got = 0, wire = 0;
+  int fd = connectTo(addr);
+
+  readExact(fd, buf, sz_rfbProtocolVersionMsg);
+  writeExact(fd, path[kind], strlen(path[kind]));
+  ft = readMessage(fd, buf, &wire);
+  if (ft.contentType != rfbFileHeader || ft.size != (uint32_t)fileSize)
+    _exit(1);
+  /* the high 32 bits of the size */
+  readExact(fd, buf, 4);
+  for (;;) {
+    ft = readMessage(fd, buf, &wire);
+    if (ft.contentType == rfbEndOfFile)
+      break;
+    if (ft.contentType != rfbFilePacket)
+      _exit(1);
+    n = ft.length;
+    if (ft.size == 1) {
+      n = sizeof(raw);
+      if (uncompress((unsigned char *)raw, &n, (unsigned char *)buf,
+                     ft.length) != Z_OK)
+        _exit(1);
+      memcpy(buf, raw, n);
+    }
+    if (got + (long)n > fileSize || memcmp(buf, data + got, n) != 0)
+      _exit(1);
+    got += n;
+  }
+  if (got != fileSize)
+    _exit(1);
+  close(fd);
+  if (write(out, &wire, sizeof(wire)) != sizeof(wire))
+    _exit(1);
+  _exit(0);
+}
+
+/* Uploads the file of kind to name in blocks, compressing those that shrink,
+   and writes how many bytes it wrote to the socket to out. */
+static void uploader(struct sockaddr_in *addr, int kind, const char *name,
+                     int out)
+{
+  static char buf[sz_rfbBlockSize + 1024];
+  const char *data = contents[kind];
+  unsigned long n;
+  uint32_t sizeH = 0;
+  long sent, len, wire = 0;
+  int fd = connectTo(addr);
+
+  readExact(fd, buf, sz_rfbProtocolVersionMsg);
+  writeExact(fd, name, strlen(name));
+  writeExact(fd, &sizeH, 4);
+  if (readMessage(fd, buf, &wire).contentType != rfbFileAcceptHeader)
+    _exit(1);
+  wire = 0;
+  for (sent = 0; sent < fileSize; sent += len) {
+    len = fileSize - sent < sz_rfbBlockSize ? fileSize - sent : sz_rfbBlockSize;
+    n = sizeof(buf);
+    if (compress((unsigned char *)buf, &n, (const unsigned char *)data + sent,
+                 len) == Z_OK && (long)n < len)
+      writeMessage(fd, rfbFilePacket, 1, buf, n, &wire);
+    else
+      writeMessage(fd, rfbFilePacket, 0, data + sent, len, &wire);
+  }
+  writeMessage(fd, rfbEndOfFile, 0, NULL, 0, &wire);
+  /* the server closes when it is done */
+  while (read(fd, buf, sizeof(buf)) > 0)
+    ;
+  if (write(out, &wire, sizeof(wire)) != sizeof(wire))
+    _exit(1);
+  _exit(0);
+}
+
+/* TRUE if the file at name holds what the file of kind does. */
+static rfbBool sameFile(const char *name, int kind)
+{
+  char *buf = malloc(fileSize + 1);
+  int fd = open(name, O_RDONLY);
+  long len = 0, n = 1;
+
+  while (fd >= 0 && n > 0 && len <= fileSize)
+    if ((n = read(fd, buf + len, fileSize + 1 - len)) > 0)
+      len += n;
+  if (fd >= 0)
+    close(fd);
+  n = len == fileSize && memcmp(buf, contents[kind], len) == 0;
+  free(buf);
+  return n ? TRUE : FALSE;
+}
+
+/* Transfers the file of kind one way; FALSE if it failed. */
+static rfbBool run(rfbScreenInfoPtr screen, int listener,
+                   struct sockaddr_in *addr, int kind, rfbBool upload,
+                   rfbBool compressed)
+{
+  char name[600], header[sz_rfbFileTransferMsg];
+  rfbFileTransferMsg *ft = (rfbFileTransferMsg *)header;
+  int pipes[2], fd, status, failed = 0;
+  long wire = 0;
+  double start, t, cpu;
+  rfbClientPtr cl;
+  pid_t pid;
+  socklen_t len;
+  struct sockaddr_in peer;
+
+  snprintf(name, sizeof(name), "%s.up", path[kind]);
+  if (pipe(pipes) < 0) {
+    perror("pipe");
+    exit(1);
+  }
+  fflush(stdout);
+  if ((pid = fork()) == 0) {
+    close(listener);
+    if (upload)
+      uploader(addr, kind, name, pipes[1]);
+    downloader(addr, kind, pipes[1]);
+  }
+  close(pipes[1]);
+  len = sizeof(peer);
+  if ((fd = accept(listener, (struct sockaddr *)&peer, &len)) < 0 ||
+      (cl = rfbNewClient(screen, fd)) == NULL) {
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(pipes[0]);
+    return FALSE;
+  }
+
+  start = now();
+  cpu = cpuTime();
+  if (upload) {
+    rfbProcessFileTransfer(cl, rfbFileTransferOffer, 0, fileSize, strlen(name));
+    /* what rfbProcessClientNormalMessage() does with the viewer's */
+    do {
+      if (rfbReadExact(cl, header, sz_rfbFileTransferMsg) <= 0) {
+        failed = 1;
+        break;
+      }
+      rfbProcessFileTransfer(cl, ft->contentType, ft->contentParam,
+                             Swap32IfLE(ft->size), Swap32IfLE(ft->length));
+    } while (ft->contentType != rfbEndOfFile && cl->sock >= 0);
+  } else {
+    rfbProcessFileTransfer(cl, rfbFileTransferRequest, 0, compressed ? 1 : 0,
+                           strlen(path[kind]));
+    rfbProcessFileTransfer(cl, rfbFileHeader, 0, fileSize, 0);
+    /* the event loop sends the file on */
+    while ((cl->fileTransfer.fd != -1 || cl->outQueue != NULL) &&
+           cl->sock >= 0)
+      rfbCheckFds(screen, 1000);
+  }
+  cpu = cpuTime() - cpu;
+  if (cl->sock < 0)
+    failed = 1;
+  rfbCloseClient(cl);
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0)
+    failed = 1;
+  t = now() - start;
+  if (read(pipes[0], &wire, sizeof(wire)) != sizeof(wire))
+    failed = 1;
+  close(pipes[0]);
+  if (upload) {
+    if (!sameFile(name + 2, kind))
+      failed = 1;
+    unlink(name + 2);
+  }
+
+  printf("%-8s %-6s %-10s %6.1f MB/s  %4.2f wire bytes/byte  %5.2f ms CPU/MB",
+         upload ? "upload" : "download", kinds[kind],
+         compressed ? "compressed" : "raw", fileSize / 1048576.0 * 1e3 / t,
+         (double)wire / fileSize, cpu / (fileSize / 1048576.0));
+  if (failed)
+    printf("  FAILED");
+  printf("\n");
+
+  rfbClientConnectionGone(cl);
+  return !failed;
+}
+
+int main(int argc, char **argv)
+{
+  int megabytes = argc > 1 ? atoi(argv[1]) : 32;
+  int threads = argc > 2 ? atoi(argv[2]) : 0;
+  rfbScreenInfoPtr screen;
+  struct sockaddr_in addr;
+  char cwd[400];
+  int listener, kind, fd, fakeArgc = 1, failed = 0;
+
+  fileSize = megabytes * 1024L * 1024;
+  strcpy(dir, "ftbenchXXXXXX");
+  if (mkdtemp(dir) == NULL || getcwd(cwd, sizeof(cwd)) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  /* viewers name files the Windows way */
+  for (kind = 0; kind < KINDS; kind++) {
+    snprintf(path[kind], sizeof(path[kind]), "C:%s/%s/%s", cwd, dir,
+             kinds[kind]);
+    contents[kind] = makeContents(kind);
+    if ((fd = open(path[kind] + 2, O_CREAT | O_WRONLY | O_TRUNC, 0644)) < 0 ||
+        write(fd, contents[kind], fileSize) != fileSize) {
+      perror("write");
+      return 1;
+    }
+    close(fd);
+  }
+
+  rfbLogEnable(0);
+  screen = rfbGetScreen(&fakeArgc, argv, 64, 64, 8, 3, 4);
+  screen->frameBuffer = calloc(64 * 64, 4);
+  screen->port = 0;
+  screen->ipv6port = 0;
+  screen->permitFileTransfer = TRUE;
+  screen->maxClientQueue = 4 * 1024 * 1024;
+  screen->encodeThreads = threads;
+  rfbInitServer(screen);
+
+  listener = listenLoopback(&addr, 4);
+
+  printf("%d MB each, %d encoding threads\n", megabytes, threads);
+  for (kind = 0; kind < KINDS; kind++) {
+    failed |= !run(screen, listener, &addr, kind, FALSE, FALSE);
+    failed |= !run(screen, listener, &addr, kind, FALSE, TRUE);
+    failed |= !run(screen, listener, &addr, kind, TRUE, TRUE);
+  }
+
+  close(listener);
+  for (kind = 0; kind < KINDS; kind++) {
+    unlink(path[kind] + 2);
+    free(contents[kind]);
+  }
+  rmdir(dir);
+  free(screen->frameBuffer);
+  rfbScreenCleanup(screen);
+  printf("%s\n", failed ? "FAILED" : "ok");
+  return failed;
+}
@@ -0,0 +1,89 @@
+/*
+droid VNC server  - a vnc server for android
+Copyright (C) 2011 Jose Pereira <onaips@gmail.com>
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Capture governor test: feeds governorCaptured and governorSent what the
+ * capture and network threads would over a minute of a blinking cursor,
+ * then over a burst of scrolling, and checks the interval between grabs is
+ * back at the -F target from the first changed grab on. Also checks the
+ * idle back-off stops at its cap and a slow grab is held to the -B budget.
+ *
+ *   governortest
+ */
+
+#include <stdio.h>
+
+#include "governor.h"
+
+#define FPS 30
+#define CPU 50
+
+static int failed = 0;
+
+static void check(const char *what, long got, long lo, long hi)
+{
+  if (got < lo || got > hi) {
+    printf("%s: %ld ms, wanted %ld..%ld\n", what, got, lo, hi);
+    failed = 1;
+  }
+}
+
+int main(void)
+{
+  char stats[256];
+  long ms, t, blink = 0;
+  int i;
+
+  initGovernor(FPS, CPU);
+
+  /* a cursor blinking every 500 ms: one changed grab, one update sent and
+     asked for again, then nothing until the next blink */
+  for (t = 0; t < 60000; t += ms) {
+    if (t >= blink) {
+      ms = governorCaptured(1, 3000);
+      governorSent(2000, 1);
+      blink = t + 500;
+    } else {
+      ms = governorCaptured(0, 3000);
+    }
+  }
+
+  /* input woke the capture thread and the screen scrolls */
+  for (i = 0; i < 200; i++) {
+    ms = governorCaptured(1, 3000);
+    governorSent(2000, 1);
+    check("busy after idle", ms, 1000 / FPS, 1000 / FPS);
+  }
+
+  /* the screen stays still */
+  for (i = 0; i < 20; i++)
+    ms = governorCaptured(0, 3000);
+  check("idle back-off", ms, 500, 500);
+
+  /* grabs costing 30 ms can only run every 60 ms in half a core */
+  for (i = 0; i < 100; i++) {
+    ms = governorCaptured(1, 30000);
+    governorSent(2000, 1);
+  }
+  check("cpu budget", ms, 55, 75);
+
+  governorStats(stats, sizeof(stats));
+  printf("%s\n%s\n", stats, failed ? "FAILED" : "ok");
+  return failed;
+}
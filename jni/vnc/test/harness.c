@@ -0,0 +1,133 @@
+/*
+droid VNC server  - a vnc server for android
+Copyright (C) 2011 Jose Pereira <onaips@gmail.com>
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "harness.h"
+
+double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+double cpuTime(void)
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e3 +
+         (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e3;
+}
+
+int listenLoopback(struct sockaddr_in *addr, int backlog)
+{
+  socklen_t len = sizeof(*addr);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(fd, (struct sockaddr *)addr, sizeof(*addr)) < 0 ||
+      listen(fd, backlog) < 0 ||
+      getsockname(fd, (struct sockaddr *)addr, &len) < 0) {
+    perror("listen");
+    exit(1);
+  }
+  return fd;
+}
+
+rfbClientPtr connectViewer(rfbScreenInfoPtr screen, int listener,
+                           struct sockaddr_in *addr, int bufSize,
+                           int *viewerFd)
+{
+  rfbClientPtr cl;
+  int fd;
+
+  *viewerFd = socket(AF_INET, SOCK_STREAM, 0);
+  if (bufSize != 0)
+    setsockopt(*viewerFd, SOL_SOCKET, SO_RCVBUF, &bufSize, sizeof(bufSize));
+  if (connect(*viewerFd, (struct sockaddr *)addr, sizeof(*addr)) < 0 ||
+      (fd = accept(listener, NULL, NULL)) < 0) {
+    perror("connect");
+    exit(1);
+  }
+  if (bufSize != 0)
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufSize, sizeof(bufSize));
+  cl = rfbNewClient(screen, fd);
+  if (cl == NULL) {
+    fprintf(stderr, "rfbNewClient failed\n");
+    exit(1);
+  }
+  cl->state = RFB_NORMAL;
+  return cl;
+}
+
+void requestUpdate(int fd, rfbBool incremental, int w, int h)
+{
+  rfbFramebufferUpdateRequestMsg ur;
+
+  ur.type = rfbFramebufferUpdateRequest;
+  ur.incremental = incremental ? 1 : 0;
+  ur.x = 0;
+  ur.y = 0;
+  ur.w = Swap16IfLE(w);
+  ur.h = Swap16IfLE(h);
+  if (write(fd, &ur, sz_rfbFramebufferUpdateRequestMsg) !=
+      sz_rfbFramebufferUpdateRequestMsg) {
+    perror("write");
+    exit(1);
+  }
+}
+
+int connectTo(struct sockaddr_in *addr)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  if (connect(fd, (struct sockaddr *)addr, sizeof(*addr)) < 0) {
+    perror("connect");
+    _exit(1);
+  }
+  return fd;
+}
+
+void readExact(int fd, void *buf, long len)
+{
+  long n;
+
+  for (; len > 0; buf = (char *)buf + n, len -= n)
+    if ((n = read(fd, buf, len)) <= 0)
+      _exit(1);
+}
+
+void writeExact(int fd, const void *buf, long len)
+{
+  long n;
+
+  for (; len > 0; buf = (const char *)buf + n, len -= n)
+    if ((n = write(fd, buf, len)) <= 0)
+      _exit(1);
+}
@@ -0,0 +1,57 @@
+/*
+droid VNC server  - a vnc server for android
+Copyright (C) 2011 Jose Pereira <onaips@gmail.com>
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * What the libvncserver tests and benchmarks share: clocks, a loopback
+ * listener, and the two kinds of viewer they run, one in-process that is
+ * handed to the screen past the handshake, and one in a forked child that
+ * connects like a real viewer and gives up with _exit(1) on any error.
+ */
+
+#ifndef DVNC_TEST_HARNESS_H
+#define DVNC_TEST_HARNESS_H
+
+#include <netinet/in.h>
+
+#include <rfb/rfb.h>
+
+/* Monotonic wall clock time, and the CPU time of this process, in ms. */
+double now(void);
+double cpuTime(void);
+
+/* Listens on a free loopback port, whose address goes to addr. */
+int listenLoopback(struct sockaddr_in *addr, int backlog);
+
+/* Connects a viewer socket to addr, accepts it on listener and hands the
+   server end to screen as a client in RFB_NORMAL state. A bufSize other
+   than 0 shrinks the viewer's receive and the server's send buffer to it.
+   The viewer end goes to *viewerFd. */
+rfbClientPtr connectViewer(rfbScreenInfoPtr screen, int listener,
+                           struct sockaddr_in *addr, int bufSize,
+                           int *viewerFd);
+
+/* Asks for an update of the top left w x h of the screen on a viewer's fd. */
+void requestUpdate(int fd, rfbBool incremental, int w, int h);
+
+/* For viewers in a child process. */
+int connectTo(struct sockaddr_in *addr);
+void readExact(int fd, void *buf, long len);
+void writeExact(int fd, const void *buf, long len);
+
+#endif
@@ -0,0 +1,370 @@
+/*
+droid VNC server  - a vnc server for android
+Copyright (C) 2011 Jose Pereira <onaips@gmail.com>
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Web client loading benchmark: browsers in child processes load a web
+ * client from the HTTP server over loopback, each over a connection it
+ * keeps alive, first from scratch and then again revalidating with
+ * If-None-Match as browsers do. Meanwhile another browser asks for the
+ * biggest file and never reads it, which must not hold up the others.
+ * Every response is checked: the bodies against the files (the .gz one
+ * where there is one), the 304s, and the .vnc page substitutions. Prints
+ * requests per second and the slowest rfbProcessEvents() call of each
+ * round.
+ *
+ *   httpbench [loads per browser] [browsers]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <rfb/rfb.h>
+
+#include "harness.h"
+
+#define WIDTH 64
+#define HEIGHT 48
+/* longest an rfbProcessEvents() call may take, in ms */
+#define MAX_CALL_MS 500
+
+/* like the noVNC files: mostly small, one too big to be kept in memory */
+static const struct {
+  const char *name;
+  int size;
+} files[] = {
+  { "/vnc.html", 5023 },
+  { "/include/base.css", 9461 },
+  { "/include/util.js", 11200 },
+  { "/include/webutil.js", 6800 },
+  { "/include/base64.js", 4092 },
+  { "/include/websock.js", 14300 },
+  { "/include/des.js", 9800 },
+  { "/include/input.js", 70110 },
+  { "/include/display.js", 25600 },
+  { "/include/rfb.js", 62000 },
+  { "/include/ui.js", 27900 },
+  { "/images/favicon.ico", 1150 },
+  { "/include/web-socket-js/WebSocketMain.swf", 175746 },
+};
+#define FILES (int)(sizeof(files) / sizeof(files[0]))
+/* this one also comes precompressed */
+#define GZ_FILE 2
+
+static const char template[] =
+  "w=$WIDTH h=$HEIGHT aw=$APPLETWIDTH ah=$APPLETHEIGHT port=$PORT d=$$ p=$PARAMS.";
+static const char page[] = "w=64 h=48 aw=64 ah=80 port=0 d=$ p=.";
+static const char pageWithParams[] =
+  "w=64 h=48 aw=64 ah=80 port=0 d=$ p=<PARAM NAME=\"x\" VALUE=\"1\">\n.";
+
+static char dir[64];
+
+static char *contents(int f, rfbBool gz, int *size)
+{
+  char *data;
+  int i;
+
+  *size = gz ? files[f].size / 4 : files[f].size;
+  data = malloc(*size);
+  srand(f * 2 + gz);
+  for (i = 0; i < *size; i++)
+    data[i] = gz ? rand() : 'a' + rand() % 26;
+  return data;
+}
+
+static void writeFile(const char *name, const char *data, int size)
+{
+  char path[256], *p;
+  FILE *f;
+
+  snprintf(path, sizeof(path), "%s%s", dir, name);
+  for (p = strchr(path + strlen(dir) + 1, '/'); p; p = strchr(p + 1, '/')) {
+    *p = 0;
+    mkdir(path, 0700);
+    *p = '/';
+  }
+  if ((f = fopen(path, "w")) == NULL || fwrite(data, 1, size, f) != (size_t)size) {
+    perror(path);
+    exit(1);
+  }
+  fclose(f);
+}
+
+static void removeDir(void)
+{
+  char cmd[128];
+
+  snprintf(cmd, sizeof(cmd), "rm -r %s", dir);
+  if (system(cmd) != 0)
+    fprintf(stderr, "could not remove %s\n", dir);
+}
+
+/* a keep-alive connection and what has been read on it */
+typedef struct {
+  struct sockaddr_in *addr;
+  int fd;
+  char buf[256 * 1024];
+  int len;
+  int reconnects;
+} conn;
+
+static int fill(conn *c)
+{
+  int n = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len - 1);
+
+  if (n > 0) {
+    c->len += n;
+    c->buf[c->len] = 0;
+  }
+  return n;
+}
+
+/* Sends a request and reads the response; FALSE if it is not status with
+   body, of size bytes (or any if size is -1). Keeps the etag in lastEtag. */
+static rfbBool get(conn *c, const char *path, const char *etag, int status,
+                   const char *body, int size, rfbBool gz, char *lastEtag)
+{
+  char req[512], *end, *h;
+  int n, len, got;
+  rfbBool ok = TRUE;
+
+  n = snprintf(req, sizeof(req),
+               "GET %s HTTP/1.1\r\nHost: localhost\r\n"
+               "Accept-Encoding: gzip, deflate\r\n%s%s%s\r\n",
+               path, etag ? "If-None-Match: " : "", etag ? etag : "",
+               etag ? "\r\n" : "");
+  if (c->fd < 0) {
+    c->fd = connectTo(c->addr);
+    c->reconnects++;
+  }
+  if (write(c->fd, req, n) != n)
+    return FALSE;
+
+  while ((end = strstr(c->buf, "\r\n\r\n")) == NULL)
+    if (fill(c) <= 0)
+      return FALSE;
+  end += 4;
+  *(end - 2) = 0;
+  if (atoi(c->buf + 9) != status)
+    ok = FALSE;
+  if (!gz != !strstr(c->buf, "Content-Encoding: gzip"))
+    ok = FALSE;
+  if ((h = strstr(c->buf, "ETag: ")) != NULL && lastEtag)
+    sscanf(h + 6, "%63s", lastEtag);
+  len = (h = strstr(c->buf, "Content-Length: ")) ? atoi(h + 16) : -1;
+  if (status == 304)
+    len = 0;
+  if (len < 0 || strstr(c->buf, "Connection: close")) {
+    /* the old server: read up to the end */
+    while (fill(c) > 0)
+      ;
+    len = c->len - (end - c->buf);
+    close(c->fd);
+    c->fd = -1;
+  }
+  while (c->len - (end - c->buf) < len)
+    if ((got = fill(c)) <= 0)
+      return FALSE;
+  if (size >= 0 && (len != size || (body && memcmp(end, body, size) != 0)))
+    ok = FALSE;
+  n = end - c->buf + len;
+  memmove(c->buf, c->buf + n, c->len - n + 1);
+  c->len -= n;
+  return ok;
+}
+
+/* Loads the web client n times; writes requests failed and reconnections. */
+static void browser(struct sockaddr_in *addr, int n, rfbBool revalidate,
+                    int out)
+{
+  static conn c;
+  char *data[FILES], *gzData, etags[FILES][64], pageEtags[2][64] = { "", "" };
+  int sizes[FILES], gzSize, f, i, results[2] = { 0, 0 };
+  int loads = revalidate ? n + 1 : n;
+
+  for (f = 0; f < FILES; f++)
+    data[f] = contents(f, FALSE, &sizes[f]);
+  gzData = contents(GZ_FILE, TRUE, &gzSize);
+  c.addr = addr;
+  c.fd = -1;
+  c.reconnects = -1;
+
+  /* the first load gets the etags to revalidate with */
+  for (i = 0; i < loads; i++) {
+    if (revalidate && i > 0) {
+      if (!get(&c, "/", pageEtags[0], 304, NULL, 0, FALSE, NULL) ||
+          !get(&c, "/index.vnc?x=1", pageEtags[1], 304, NULL, 0, FALSE, NULL))
+        results[0]++;
+    } else if (!get(&c, "/", NULL, 200, page, strlen(page), FALSE,
+                    pageEtags[0]) ||
+               !get(&c, "/index.vnc?x=1", NULL, 200, pageWithParams,
+                    strlen(pageWithParams), FALSE, pageEtags[1]) ||
+               strcmp(pageEtags[0], pageEtags[1]) == 0) {
+      /* the parameters are part of the page, so of its etag */
+      results[0]++;
+    }
+    for (f = 0; f < FILES; f++) {
+      if (revalidate && i > 0) {
+        if (!get(&c, files[f].name, etags[f], 304, NULL, 0, FALSE, NULL))
+          results[0]++;
+      } else if (!get(&c, files[f].name, NULL, 200,
+                      f == GZ_FILE ? gzData : data[f],
+                      f == GZ_FILE ? gzSize : sizes[f], f == GZ_FILE, etags[f])) {
+        results[0]++;
+      }
+    }
+  }
+  /* and a 404 closes the connection */
+  if (!get(&c, "/nothere.js", NULL, 404, NULL, -1, FALSE, NULL) || c.fd >= 0)
+    results[0]++;
+  results[1] = c.reconnects;
+  if (write(out, results, sizeof(results)) != sizeof(results))
+    _exit(1);
+  _exit(0);
+}
+
+/* Runs browsers browsers of n loads each; FALSE if one failed. */
+static rfbBool run(rfbScreenInfoPtr screen, struct sockaddr_in *addr,
+                   int browsers, int n, rfbBool revalidate)
+{
+  struct pollfd fds[2 + RFB_HTTP_MAX_CONNECTIONS];
+  int pipes[2], running = browsers, failed = 0, errors = 0, reconnects = 0;
+  int results[2], i, status;
+  double start = now(), t, slowest = 0;
+
+  if (pipe(pipes) < 0) {
+    perror("pipe");
+    exit(1);
+  }
+  fflush(stdout);
+  for (i = 0; i < browsers; i++)
+    if (fork() == 0)
+      browser(addr, n, revalidate, pipes[1]);
+  close(pipes[1]);
+
+  while (running > 0) {
+    poll(fds, rfbHttpPollFds(screen, fds, 2 + RFB_HTTP_MAX_CONNECTIONS), 10);
+    t = now();
+    rfbProcessEvents(screen, 0);
+    t = now() - t;
+    if (t > slowest)
+      slowest = t;
+    while (running > 0 && waitpid(-1, &status, WNOHANG) > 0) {
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        failed = 1;
+      running--;
+    }
+  }
+  t = now() - start;
+  while (read(pipes[0], results, sizeof(results)) == sizeof(results)) {
+    errors += results[0];
+    reconnects += results[1];
+  }
+  close(pipes[0]);
+
+  i = browsers * (revalidate ? n + 1 : n) * (FILES + 2) + browsers;
+  printf("%-9s %5d requests  %8.1f/s  %3d reconnects  slowest call %6.1f ms",
+         revalidate ? "revalidate" : "first", i, i * 1e3 / t, reconnects,
+         slowest);
+  if (failed || errors) {
+    printf("  FAILED (%d)", errors);
+    failed = 1;
+  }
+  if (slowest > MAX_CALL_MS) {
+    printf("  BLOCKED");
+    failed = 1;
+  }
+  printf("\n");
+  return !failed;
+}
+
+int main(int argc, char **argv)
+{
+  int n = argc > 1 ? atoi(argv[1]) : 20;
+  int browsers = argc > 2 ? atoi(argv[2]) : 8;
+  rfbScreenInfoPtr screen;
+  struct sockaddr_in addr;
+  char *data, req[128], buf[4096];
+  int listener, f, size, slow, fakeArgc = 1, failed = 0;
+  pid_t slowBrowser;
+
+  strcpy(dir, "httpbenchXXXXXX");
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  writeFile("/index.vnc", template, strlen(template));
+  for (f = 0; f < FILES; f++) {
+    data = contents(f, FALSE, &size);
+    writeFile(files[f].name, data, size);
+    free(data);
+  }
+  data = contents(GZ_FILE, TRUE, &size);
+  snprintf(buf, sizeof(buf), "%s.gz", files[GZ_FILE].name);
+  writeFile(buf, data, size);
+  free(data);
+
+  listener = listenLoopback(&addr, 64);
+
+  rfbLogEnable(0);
+  screen = rfbGetScreen(&fakeArgc, argv, WIDTH, HEIGHT, 8, 3, 4);
+  screen->frameBuffer = calloc(WIDTH * HEIGHT, 4);
+  screen->port = 0;
+  screen->ipv6port = 0;
+  screen->desktopName = "bench";
+  snprintf(buf, sizeof(buf), "%s/", dir);
+  screen->httpDir = buf;
+  screen->httpListenSock = listener;
+  screen->httpInitDone = TRUE;
+  rfbInitServer(screen);
+
+  /* the slow browser asks for the biggest file and reads none of it */
+  fflush(stdout);
+  if ((slowBrowser = fork()) == 0) {
+    slow = connectTo(&addr);
+    size = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\n\r\n",
+                    files[FILES - 1].name);
+    if (write(slow, req, size) != size)
+      _exit(1);
+    pause();
+    _exit(0);
+  }
+
+  printf("%d browsers, %d loads each\n", browsers, n);
+  failed |= !run(screen, &addr, browsers, n, FALSE);
+  failed |= !run(screen, &addr, browsers, n, TRUE);
+
+  kill(slowBrowser, SIGTERM);
+  waitpid(slowBrowser, NULL, 0);
+  rfbShutdownServer(screen, TRUE);
+  free(screen->frameBuffer);
+  rfbScreenCleanup(screen);
+  removeDir();
+  printf("%s\n", failed ? "FAILED" : "ok");
+  return failed;
+}
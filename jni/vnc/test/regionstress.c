@@ -0,0 +1,458 @@
+/*
+droid VNC server  - a vnc server for android
+Copyright (C) 2011 Jose Pereira <onaips@gmail.com>
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Region stress test: runs the same random region operations on the flat
+ * regions of rfbregion.c and on the span list ones it had before (kept in
+ * test/sraspan.c), starting from the regions of examples/regiontest.c. After
+ * every operation both must cover the same pixels and agree on what the
+ * operation returned, and the flat region must be in its one form: no
+ * more rectangles than the span list one, none overlapping, and iterated
+ * in the order asked for. Each popped rectangle is taken out of the span
+ * list region too, as the two may pop different ones.
+ *
+ * Then both go through the region work of a framebuffer update many times
+ * over, and the time per update is printed for each.
+ *
+ *   regionstress [operations] [seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+
+#include "harness.h"
+
+/* the span list regions, under other names */
+typedef struct refRegion refRegion;
+typedef struct {
+  rfbBool reverseX, reverseY;
+  int ptrSize, ptrPos;
+  struct sraSpan **sPtrs;
+} refIterator;
+
+#define sraRegion refRegion
+#define sraRectangleIterator refIterator
+#define sraSpanListDup refSpanListDup
+#define sraSpanListDestroy refSpanListDestroy
+#define sraRgnCreate refRgnCreate
+#define sraRgnCreateRect refRgnCreateRect
+#define sraRgnCreateRgn refRgnCreateRgn
+#define sraRgnDestroy refRgnDestroy
+#define sraRgnMakeEmpty refRgnMakeEmpty
+#define sraRgnAnd refRgnAnd
+#define sraRgnOr refRgnOr
+#define sraRgnSubtract refRgnSubtract
+#define sraRgnOffset refRgnOffset
+#define sraRgnBBox refRgnBBox
+#define sraRgnPopRect refRgnPopRect
+#define sraRgnCountRects refRgnCountRects
+#define sraRgnEmpty refRgnEmpty
+#define sraRgnGetIterator refRgnGetIterator
+#define sraRgnGetReverseIterator refRgnGetReverseIterator
+#define sraRgnIteratorNext refRgnIteratorNext
+#define sraRgnReleaseIterator refRgnReleaseIterator
+#define sraRgnPrint refRgnPrint
+#define sraClipRect refClipRect
+#define sraClipRect2 refClipRect2
+#include "sraspan.c"
+#undef sraRegion
+#undef sraRectangleIterator
+#undef sraRgnCreate
+#undef sraRgnCreateRect
+#undef sraRgnCreateRgn
+#undef sraRgnDestroy
+#undef sraRgnMakeEmpty
+#undef sraRgnAnd
+#undef sraRgnOr
+#undef sraRgnSubtract
+#undef sraRgnOffset
+#undef sraRgnBBox
+#undef sraRgnPopRect
+#undef sraRgnCountRects
+#undef sraRgnEmpty
+#undef sraRgnGetIterator
+#undef sraRgnGetReverseIterator
+#undef sraRgnIteratorNext
+#undef sraRgnReleaseIterator
+#undef sraRgnPrint
+
+/* where the random rectangles go, and how far offsets may take them */
+#define AREA 96
+#define MARGIN 48
+#define SIZE (AREA + 2 * MARGIN)
+#define REGIONS 4
+
+static sraRegionPtr flat[REGIONS];
+static refRegion *ref[REGIONS];
+
+static void randomRect(sraRect *r)
+{
+  /* mostly small ones, some spanning most of the area */
+  int w = rand() % 4 ? 1 + rand() % 24 : 1 + rand() % AREA;
+  int h = rand() % 4 ? 1 + rand() % 24 : 1 + rand() % AREA;
+
+  r->x1 = rand() % AREA;
+  r->y1 = rand() % AREA;
+  r->x2 = r->x1 + w < AREA ? r->x1 + w : AREA;
+  r->y2 = r->y1 + h < AREA ? r->y1 + h : AREA;
+}
+
+/* Paints the rectangles of a region into map; FALSE if one is out of the
+   map, has no area, or overlaps another. */
+static rfbBool paintFlat(sraRegionPtr rgn, unsigned char *map, int *rects)
+{
+  sraRectangleIterator *i = sraRgnGetIterator(rgn);
+  sraRect r;
+  int x, y;
+  rfbBool ok = TRUE;
+
+  memset(map, 0, SIZE * SIZE);
+  *rects = 0;
+  while (sraRgnIteratorNext(i, &r)) {
+    (*rects)++;
+    if (r.x1 >= r.x2 || r.y1 >= r.y2 || r.x1 < -MARGIN || r.y1 < -MARGIN ||
+        r.x2 > AREA + MARGIN || r.y2 > AREA + MARGIN) {
+      ok = FALSE;
+      continue;
+    }
+    for (y = r.y1; y < r.y2; y++)
+      for (x = r.x1; x < r.x2; x++)
+        if (map[(y + MARGIN) * SIZE + x + MARGIN]++)
+          ok = FALSE;
+  }
+  sraRgnReleaseIterator(i);
+  return ok;
+}
+
+static void paintRef(refRegion *rgn, unsigned char *map, int *rects)
+{
+  refIterator *i = refRgnGetIterator(rgn);
+  sraRect r;
+  int x, y;
+
+  memset(map, 0, SIZE * SIZE);
+  *rects = 0;
+  while (refRgnIteratorNext(i, &r)) {
+    (*rects)++;
+    for (y = r.y1; y < r.y2; y++)
+      for (x = r.x1; x < r.x2; x++)
+        if (y >= -MARGIN && y < AREA + MARGIN && x >= -MARGIN && x < AREA + MARGIN)
+          map[(y + MARGIN) * SIZE + x + MARGIN] = 1;
+  }
+  refRgnReleaseIterator(i);
+}
+
+/* FALSE if the reverse iterator does not go bottom to top and right to left
+   as asked, or gives other rectangles than the forward one. */
+static rfbBool checkOrder(sraRegionPtr rgn, rfbBool reverseX, rfbBool reverseY)
+{
+  sraRectangleIterator *i = sraRgnGetReverseIterator(rgn, reverseX, reverseY);
+  sraRect r, prev;
+  int n = 0;
+  rfbBool ok = TRUE;
+
+  while (sraRgnIteratorNext(i, &r)) {
+    if (n++ > 0) {
+      if (r.y1 == prev.y1)
+        ok &= r.y2 == prev.y2 && (reverseX ? r.x2 <= prev.x1 : r.x1 >= prev.x2);
+      else
+        ok &= reverseY ? r.y2 <= prev.y1 : r.y1 >= prev.y2;
+    }
+    prev = r;
+  }
+  sraRgnReleaseIterator(i);
+  return ok && (unsigned long)n == sraRgnCountRects(rgn);
+}
+
+/* Compares region k of both kinds; prints what is wrong and returns FALSE if
+   anything is. */
+static rfbBool compare(int k, const char *op, int step)
+{
+  static unsigned char flatMap[SIZE * SIZE], refMap[SIZE * SIZE];
+  int flatRects, refRects;
+  rfbBool ok = TRUE;
+
+  if (!paintFlat(flat[k], flatMap, &flatRects)) {
+    printf("step %d %s: bad or overlapping rectangles\n", step, op);
+    ok = FALSE;
+  }
+  paintRef(ref[k], refMap, &refRects);
+  if (memcmp(flatMap, refMap, SIZE * SIZE) != 0) {
+    printf("step %d %s: regions differ\n", step, op);
+    ok = FALSE;
+  }
+  if (flatRects > refRects || (unsigned long)flatRects != sraRgnCountRects(flat[k])) {
+    printf("step %d %s: %d rectangles (counted %lu) for %d\n", step, op,
+           flatRects, sraRgnCountRects(flat[k]), refRects);
+    ok = FALSE;
+  }
+  if (!sraRgnEmpty(flat[k]) != !refRgnEmpty(ref[k])) {
+    printf("step %d %s: one is empty\n", step, op);
+    ok = FALSE;
+  }
+  if (!checkOrder(flat[k], FALSE, TRUE) || !checkOrder(flat[k], TRUE, FALSE) ||
+      !checkOrder(flat[k], TRUE, TRUE)) {
+    printf("step %d %s: iterated out of order\n", step, op);
+    ok = FALSE;
+  }
+  if (!ok) {
+    sraRgnPrint(flat[k]);
+    printf("\n");
+    refRgnPrint(ref[k]);
+    printf("\n");
+  }
+  return ok;
+}
+
+/* Does one random operation on region k of both kinds. */
+static const char *randomOp(int k)
+{
+  int j = rand() % REGIONS, op = rand() % 10, dx, dy;
+  unsigned long flags;
+  rfbBool a, b;
+  sraRegionPtr f;
+  refRegion *r;
+  refIterator *i;
+  sraRect rect, refRect;
+
+  switch (op) {
+  case 0:
+    randomRect(&rect);
+    sraRgnDestroy(flat[k]);
+    refRgnDestroy(ref[k]);
+    flat[k] = sraRgnCreateRect(rect.x1, rect.y1, rect.x2, rect.y2);
+    ref[k] = refRgnCreateRect(rect.x1, rect.y1, rect.x2, rect.y2);
+    return "create";
+  case 1:
+  case 2:
+    randomRect(&rect);
+    f = sraRgnCreateRect(rect.x1, rect.y1, rect.x2, rect.y2);
+    r = refRgnCreateRect(rect.x1, rect.y1, rect.x2, rect.y2);
+    sraRgnOr(flat[k], f);
+    refRgnOr(ref[k], r);
+    sraRgnDestroy(f);
+    refRgnDestroy(r);
+    return "or rect";
+  case 3:
+  case 4:
+  case 5:
+    /* j may be k: the flat regions must take that, the span list ones get
+       a copy as they cannot */
+    r = refRgnCreateRgn(ref[j]);
+    if (op == 3) {
+      sraRgnOr(flat[k], flat[j]);
+      refRgnOr(ref[k], r);
+      a = b = TRUE;
+    } else if (op == 4) {
+      a = sraRgnAnd(flat[k], flat[j]);
+      b = refRgnAnd(ref[k], r);
+    } else {
+      a = sraRgnSubtract(flat[k], flat[j]);
+      b = refRgnSubtract(ref[k], r);
+    }
+    refRgnDestroy(r);
+    if (!a != !b)
+      return "or, and or subtract (returned differently)";
+    return op == 3 ? "or" : op == 4 ? "and" : "subtract";
+  case 6:
+    randomRect(&rect);
+    f = sraRgnCreateRect(rect.x1, rect.y1, rect.x2, rect.y2);
+    r = refRgnCreateRect(rect.x1, rect.y1, rect.x2, rect.y2);
+    a = sraRgnSubtract(flat[k], f);
+    b = refRgnSubtract(ref[k], r);
+    sraRgnDestroy(f);
+    refRgnDestroy(r);
+    return !a == !b ? "subtract rect" : "subtract rect (returned differently)";
+  case 7:
+    /* offsets that keep what was in the area within the margins */
+    dx = rand() % 17 - 8;
+    dy = rand() % 17 - 8;
+    f = sraRgnCreateRgn(flat[k]);
+    r = refRgnCreateRgn(ref[k]);
+    sraRgnOffset(f, dx, dy);
+    refRgnOffset(r, dx, dy);
+    sraRgnAnd(f, flat[j]);
+    refRgnAnd(r, ref[j]);
+    sraRgnOr(flat[k], f);
+    refRgnOr(ref[k], r);
+    sraRgnDestroy(f);
+    refRgnDestroy(r);
+    return "offset";
+  case 8:
+    f = sraRgnBBox(flat[k]);
+    r = refRgnBBox(ref[k]);
+    sraRgnDestroy(flat[j]);
+    refRgnDestroy(ref[j]);
+    flat[j] = f;
+    ref[j] = r;
+    return "bbox";
+  default:
+    flags = rand() % 4;
+    a = sraRgnPopRect(flat[k], &rect, flags);
+    if (!a)
+      return refRgnEmpty(ref[k]) ? "pop" : "pop (returned differently)";
+    /* the span list region must have had it, and nothing beyond it */
+    r = refRgnCreateRect(rect.x1, rect.y1, rect.x2, rect.y2);
+    refRgnSubtract(r, ref[k]);
+    b = refRgnEmpty(r);
+    refRgnDestroy(r);
+    r = refRgnBBox(ref[k]);
+    i = refRgnGetIterator(r);
+    refRgnIteratorNext(i, &refRect);
+    refRgnReleaseIterator(i);
+    refRgnDestroy(r);
+    if ((flags & 1) ? rect.y2 != refRect.y2 : rect.y1 != refRect.y1)
+      b = FALSE;
+    r = refRgnCreateRect(rect.x1, rect.y1, rect.x2, rect.y2);
+    refRgnSubtract(ref[k], r);
+    refRgnDestroy(r);
+    return b ? "pop" : "pop (not an outermost rectangle)";
+  }
+}
+
+/* The region work of a framebuffer update: what was modified and copied,
+   clipped to what was asked for. */
+#define UPDATE(rgn, Create, CreateRect, CreateRgn, Or, And, Subtract, Offset, \
+               Count, GetIterator, Next, Release, Destroy)                  \
+  {                                                                         \
+    rgn *modified = Create(), *copy = CreateRect(0, 0, 8, 8);               \
+    rgn *requested = CreateRect(0, 0, AREA, AREA), *update, *updateCopy;    \
+    rgn *tmp;                                                               \
+    void *i;                                                                \
+    sraRect r;                                                              \
+    int n;                                                                  \
+                                                                            \
+    for (n = 0; n < 16; n++) {                                              \
+      tmp = CreateRect(rects[n].x1, rects[n].y1, rects[n].x2, rects[n].y2); \
+      Or(modified, tmp);                                                    \
+      Destroy(tmp);                                                         \
+    }                                                                       \
+    Subtract(copy, modified);                                               \
+    update = CreateRgn(modified);                                           \
+    Or(update, copy);                                                       \
+    And(update, requested);                                                 \
+    updateCopy = CreateRgn(copy);                                           \
+    And(updateCopy, requested);                                             \
+    tmp = CreateRgn(requested);                                             \
+    Offset(tmp, 1, 1);                                                      \
+    And(updateCopy, tmp);                                                   \
+    Destroy(tmp);                                                           \
+    Subtract(update, updateCopy);                                           \
+    total += Count(update) + Count(updateCopy);                             \
+    for (i = GetIterator(update); Next(i, &r);)                             \
+      total += r.x2 - r.x1;                                                 \
+    Release(i);                                                             \
+    Destroy(update);                                                        \
+    Destroy(updateCopy);                                                    \
+    Destroy(modified);                                                      \
+    Destroy(copy);                                                          \
+    Destroy(requested);                                                     \
+  }
+
+/* Returns a sum of what came out, for the work not to be optimized away. */
+static long bench(int updates)
+{
+  sraRect rects[16];
+  long total = 0;
+  double t;
+  int u, n;
+
+  for (n = 0; n < 16; n++)
+    randomRect(&rects[n]);
+
+  t = now();
+  for (u = 0; u < updates; u++)
+    UPDATE(refRegion, refRgnCreate, refRgnCreateRect, refRgnCreateRgn,
+           refRgnOr, refRgnAnd, refRgnSubtract, refRgnOffset,
+           refRgnCountRects, refRgnGetIterator, refRgnIteratorNext,
+           refRgnReleaseIterator, refRgnDestroy);
+  printf("span lists  %7.2f us per update\n", (now() - t) * 1e3 / updates);
+
+  t = now();
+  for (u = 0; u < updates; u++)
+    UPDATE(sraRegion, sraRgnCreate, sraRgnCreateRect, sraRgnCreateRgn,
+           sraRgnOr, sraRgnAnd, sraRgnSubtract, sraRgnOffset,
+           sraRgnCountRects, sraRgnGetIterator, sraRgnIteratorNext,
+           sraRgnReleaseIterator, sraRgnDestroy);
+  printf("flat        %7.2f us per update\n", (now() - t) * 1e3 / updates);
+  return total;
+}
+
+int main(int argc, char **argv)
+{
+  int ops = argc > 1 ? atoi(argv[1]) : 200000;
+  unsigned int seed = argc > 2 ? atoi(argv[2]) : 1;
+  const char *op;
+  int step, k, failed = 0;
+
+  /* the regions of examples/regiontest.c */
+  flat[0] = sraRgnCreateRect(10, 10, 600, 300);
+  ref[0] = refRgnCreateRect(10, 10, 600, 300);
+  flat[1] = sraRgnCreateRect(40, 50, 350, 200);
+  ref[1] = refRgnCreateRect(40, 50, 350, 200);
+  flat[2] = sraRgnCreateRect(0, 0, 20, 40);
+  ref[2] = refRgnCreateRect(0, 0, 20, 40);
+  sraRgnSubtract(flat[0], flat[1]);
+  refRgnSubtract(ref[0], ref[1]);
+  sraRgnOr(flat[0], flat[2]);
+  refRgnOr(ref[0], ref[2]);
+  flat[3] = sraRgnCreate();
+  ref[3] = refRgnCreate();
+  /* kept within the area */
+  for (k = 0; k < REGIONS; k++) {
+    sraRegionPtr area = sraRgnCreateRect(0, 0, AREA, AREA);
+    refRegion *refArea = refRgnCreateRect(0, 0, AREA, AREA);
+    sraRgnAnd(flat[k], area);
+    refRgnAnd(ref[k], refArea);
+    sraRgnDestroy(area);
+    refRgnDestroy(refArea);
+    failed |= !compare(k, "start", 0);
+  }
+
+  srand(seed);
+  for (step = 1; step <= ops && !failed; step++) {
+    k = rand() % REGIONS;
+    op = randomOp(k);
+    if (strchr(op, '(')) {
+      printf("step %d: %s\n", step, op);
+      failed = 1;
+    }
+    failed |= !compare(k, op, step);
+    /* start afresh now and then, for regions do not grow forever */
+    if (rand() % 200 == 0) {
+      sraRgnMakeEmpty(flat[k]);
+      refRgnMakeEmpty(ref[k]);
+    }
+  }
+  printf("%d operations, seed %u: %s\n", step - 1, seed,
+         failed ? "FAILED" : "ok");
+
+  for (k = 0; k < REGIONS; k++) {
+    sraRgnDestroy(flat[k]);
+    refRgnDestroy(ref[k]);
+  }
+
+  if (!failed)
+    bench(100000);
+  return failed;
+}
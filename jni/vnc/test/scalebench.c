@@ -0,0 +1,169 @@
+/*
+droid VNC server  - a vnc server for android
+Copyright (C) 2011 Jose Pereira <onaips@gmail.com>
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Server-side scaling benchmark: for each server format and scale, scales
+ * a random frame with the per-pixel loop in scale.c and with the box
+ * filters in scalebox.c that rfbScaledScreenUpdateRect() uses instead
+ * when rfbBoxScale is set, then updates random tiles of it with both.
+ * Both must give the same pixels; ms/frame is printed for each along with
+ * the box each destination pixel averages and the kernel chosen.
+ *
+ *   scalebench [frames]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rfb/rfb.h>
+#include "private.h"
+#include "scale.h"
+
+#include "harness.h"
+
+#define WIDTH 720
+#define HEIGHT 1280
+/* padded, so that rows don't follow each other */
+#define STRIDE 736
+#define TILE 32
+#define TILES 200
+
+typedef struct {
+  const char *name;
+  rfbPixelFormat pf;
+} format;
+
+/* bitsPerPixel, depth, bigEndian, trueColour, max r g b, shift r g b */
+static const format formats[] = {
+  { "RGBA8888", { 32, 24, 0, 1, 255, 255, 255,  0, 8, 16, 0, 0 } },
+  { "BGRA8888", { 32, 24, 0, 1, 255, 255, 255, 16, 8,  0, 0, 0 } },
+  { "RGB565",   { 16, 16, 0, 1,  31,  63,  31, 11, 5,  0, 0, 0 } },
+  { "RGB555",   { 16, 15, 0, 1,  31,  31,  31, 10, 5,  0, 0, 0 } },
+  /* channels off byte boundaries: the C kernel */
+  { "RGB888x4", { 32, 24, 0, 1, 255, 255, 255,  4, 12, 20, 0, 0 } },
+};
+
+/* scaled sizes in percent, as droidvncserver -s takes them */
+static const int scales[] = { 50, 33, 25, 40, 20, 60 };
+
+static void initScreen(rfbScreenInfo *s, const rfbPixelFormat *pf,
+                       int width, int height, int stride)
+{
+  memset(s, 0, sizeof(*s));
+  s->width = width;
+  s->height = height;
+  s->bitsPerPixel = pf->bitsPerPixel;
+  s->paddedWidthInBytes = stride * pf->bitsPerPixel / 8;
+  s->serverFormat = *pf;
+  s->frameBuffer = calloc(height, s->paddedWidthInBytes);
+}
+
+static double scale(rfbScreenInfo *screen, rfbScreenInfo *scaled, rfbBool box,
+                    int frames)
+{
+  double t = now();
+  int i;
+
+  rfbBoxScale = box;
+  for (i = 0; i < frames; i++)
+    rfbScaledScreenUpdateRect(screen, scaled, 0, 0, WIDTH, HEIGHT);
+  return (now() - t) / frames;
+}
+
+static rfbBool same(rfbScreenInfo *a, rfbScreenInfo *b)
+{
+  int y, row = a->width * a->bitsPerPixel / 8;
+
+  for (y = 0; y < a->height; y++)
+    if (memcmp(a->frameBuffer + y * a->paddedWidthInBytes,
+               b->frameBuffer + y * b->paddedWidthInBytes, row) != 0)
+      return FALSE;
+  return TRUE;
+}
+
+int main(int argc, char **argv)
+{
+  int frames = argc > 1 ? atoi(argv[1]) : 20;
+  rfbScreenInfo screen, ref, out;
+  rfbScaleBoxTable table;
+  const char *kernel;
+  double loop, box;
+  int f, s, i, x, y, n, failed = 0;
+
+  rfbLogEnable(0);
+  srand(1);
+  printf("%dx%d, %d frames\n", WIDTH, HEIGHT, frames);
+  for (f = 0; f < (int)(sizeof(formats) / sizeof(formats[0])); f++) {
+    const rfbPixelFormat *pf = &formats[f].pf;
+
+    initScreen(&screen, pf, WIDTH, HEIGHT, STRIDE);
+    n = STRIDE * HEIGHT * pf->bitsPerPixel / 8;
+    for (i = 0; i < n; i++)
+      screen.frameBuffer[i] = rand() >> 4;
+
+    for (s = 0; s < (int)(sizeof(scales) / sizeof(scales[0])); s++) {
+      int w = WIDTH * scales[s] / 100, h = HEIGHT * scales[s] / 100;
+      int areaX, areaY;
+
+      /* odd strides here too */
+      initScreen(&ref, pf, w, h, w + 3);
+      initScreen(&out, pf, w, h, w + 5);
+      areaX = ScaleX(&ref, &screen, 1);
+      areaY = ScaleY(&ref, &screen, 1);
+      if (rfbInitScaleBox(&table, &screen.serverFormat, areaX, areaY,
+                          &kernel) == NULL)
+        kernel = "loop";
+
+      loop = scale(&screen, &ref, FALSE, frames);
+      box = scale(&screen, &out, TRUE, frames);
+      printf("%-8s %3d%% %dx%d %-4s  loop %7.3f ms  box %7.3f ms  %5.2fx",
+             formats[f].name, scales[s], areaX, areaY, kernel, loop, box,
+             loop / box);
+      if (!same(&ref, &out)) {
+        printf("  MISMATCH");
+        failed = 1;
+      }
+
+      /* dirty tiles land anywhere in the boxes */
+      for (i = 0; i < TILES; i++) {
+        x = rand() % (WIDTH - TILE);
+        y = rand() % (HEIGHT - TILE);
+        for (n = 0; n < TILE; n++)
+          memset(screen.frameBuffer + (y + n) * screen.paddedWidthInBytes +
+                 x * pf->bitsPerPixel / 8, rand(), TILE * pf->bitsPerPixel / 8);
+        rfbBoxScale = FALSE;
+        rfbScaledScreenUpdateRect(&screen, &ref, x, y, TILE, TILE);
+        rfbBoxScale = TRUE;
+        rfbScaledScreenUpdateRect(&screen, &out, x, y, TILE, TILE);
+      }
+      if (!same(&ref, &out)) {
+        printf("  TILE MISMATCH");
+        failed = 1;
+      }
+      printf("\n");
+      free(ref.frameBuffer);
+      free(out.frameBuffer);
+    }
+    free(screen.frameBuffer);
+  }
+
+  printf("%s\n", failed ? "FAILED" : "ok");
+  return failed;
+}
@@ -0,0 +1,430 @@
+/*
+droid VNC server  - a vnc server for android
+Copyright (C) 2011 Jose Pereira <onaips@gmail.com>
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Scroll detection benchmark: plays synthetic scroll sequences over a
+ * list between a fixed status bar and navigation bar, with a scrollbar
+ * thumb, through the same diff, findScroll and CopyRect steps as
+ * update_screen. Each sequence runs once without and once with scroll
+ * detection. A Tight viewer's byte count is reported for both runs. A
+ * raw viewer applies every update it gets, CopyRects included, and must
+ * match each frame.
+ *
+ *   scrollbench [repeats]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+
+#include "tileDiff.h"
+#include "harness.h"
+
+#define WIDTH 480
+#define HEIGHT 800
+#define BPP 4
+#define STATUS_BAR 48
+#define NAV_BAR 96
+#define ITEM 72
+#define THUMB 6
+/* the list is this many screens tall */
+#define PAGES 12
+/* rfbProcessEvents() calls a frame may take before it counts as lost */
+#define MAX_CALLS 1000
+
+typedef struct {
+  const char *name;
+  /* scroll position per frame, in list rows */
+  int frames;
+  int *pos;
+} sequence;
+
+typedef struct {
+  int fd;
+  uint8_t *fb;
+  int updates;
+  rfbBool broken;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} viewer;
+
+static uint8_t *page;
+
+static void fill(uint8_t *buf, int stride, int x, int y, int w, int h,
+                 uint32_t colour)
+{
+  int i, j;
+
+  for (j = y; j < y + h; j++)
+    for (i = x; i < x + w; i++)
+      memcpy(buf + j * stride + i * BPP, &colour, BPP);
+}
+
+/* List items: an icon, two lines of glyph-like specks and a separator. */
+static void drawPage(void)
+{
+  int stride = WIDTH * BPP, rows = HEIGHT * PAGES, item, x, line;
+
+  page = malloc((size_t)stride * rows);
+  fill(page, stride, 0, 0, WIDTH, rows, 0xFFFFFFFF);
+  srand(1);
+  for (item = 0; (item + 1) * ITEM <= rows; item++) {
+    int y = item * ITEM;
+
+    fill(page, stride, 16, y + 12, 48, 48, 0xFF000000 | (rand() & 0xFFFFFF));
+    for (line = 0; line < 2; line++)
+      for (x = 80; x < WIDTH - 32; x += 7)
+        if (rand() % 5 != 0)
+          fill(page, stride, x, y + 16 + line * 24 + rand() % 4, 5, 8 + rand() % 5,
+               line == 0 ? 0xFF202020 : 0xFF707070);
+    fill(page, stride, 0, y + ITEM - 1, WIDTH, 1, 0xFFD0D0D0);
+  }
+}
+
+/* The screen with the list scrolled down by pos rows. */
+static void drawFrame(uint8_t *fb, int pos)
+{
+  int stride = WIDTH * BPP, view = HEIGHT - STATUS_BAR - NAV_BAR;
+  int listRows = HEIGHT * PAGES, thumbH = view * view / listRows;
+
+  fill(fb, stride, 0, 0, WIDTH, STATUS_BAR, 0xFF3050A0);
+  fill(fb, stride, 12, 16, 60, 16, 0xFFFFFFFF);
+  memcpy(fb + STATUS_BAR * stride, page + (size_t)pos * stride, (size_t)view * stride);
+  fill(fb, stride, WIDTH - THUMB - 2,
+       STATUS_BAR + pos * (view - thumbH) / (listRows - view), THUMB, thumbH,
+       0xFF909090);
+  fill(fb, stride, 0, HEIGHT - NAV_BAR, WIDTH, NAV_BAR, 0xFF000000);
+  fill(fb, stride, WIDTH / 2 - 24, HEIGHT - NAV_BAR + 24, 48, 48, 0xFFC0C0C0);
+}
+
+static sequence makeSequence(const char *name, int frames)
+{
+  sequence s;
+
+  s.name = name;
+  s.frames = frames;
+  s.pos = malloc(frames * sizeof(int));
+  return s;
+}
+
+static int recvAll(int fd, void *buf, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0) {
+    n = recv(fd, buf, len, 0);
+    if (n <= 0)
+      return 0;
+    buf = (char *)buf + n;
+    len -= n;
+  }
+  return 1;
+}
+
+/* Applies the raw viewer's updates to its copy of the screen. */
+static void *readUpdates(void *arg)
+{
+  viewer *v = (viewer *)arg;
+  char version[sz_rfbProtocolVersionMsg];
+  rfbFramebufferUpdateMsg fu;
+  rfbFramebufferUpdateRectHeader rh;
+  rfbCopyRect cr;
+  int stride = WIDTH * BPP, n, row, x, y, w, h, sx, sy;
+  uint8_t *tmp = malloc((size_t)stride * HEIGHT);
+
+  if (!recvAll(v->fd, version, sizeof(version)))
+    return NULL;
+  while (recvAll(v->fd, &fu, sz_rfbFramebufferUpdateMsg)) {
+    if (fu.type != rfbFramebufferUpdate)
+      break;
+    for (n = Swap16IfLE(fu.nRects); n > 0; n--) {
+      if (!recvAll(v->fd, &rh, sz_rfbFramebufferUpdateRectHeader))
+        break;
+      x = Swap16IfLE(rh.r.x);
+      y = Swap16IfLE(rh.r.y);
+      w = Swap16IfLE(rh.r.w);
+      h = Swap16IfLE(rh.r.h);
+      if (x + w > WIDTH || y + h > HEIGHT) {
+        v->broken = TRUE;
+        break;
+      }
+      if (Swap32IfLE(rh.encoding) == rfbEncodingRaw) {
+        for (row = 0; row < h; row++)
+          if (!recvAll(v->fd, v->fb + (y + row) * stride + x * BPP, w * BPP))
+            break;
+      } else if (Swap32IfLE(rh.encoding) == rfbEncodingCopyRect) {
+        if (!recvAll(v->fd, &cr, sz_rfbCopyRect))
+          break;
+        sx = Swap16IfLE(cr.srcX);
+        sy = Swap16IfLE(cr.srcY);
+        if (sx + w > WIDTH || sy + h > HEIGHT) {
+          v->broken = TRUE;
+          break;
+        }
+        for (row = 0; row < h; row++)
+          memcpy(tmp + row * stride, v->fb + (sy + row) * stride + sx * BPP, w * BPP);
+        for (row = 0; row < h; row++)
+          memcpy(v->fb + (y + row) * stride + x * BPP, tmp + row * stride, w * BPP);
+      } else {
+        v->broken = TRUE;
+        break;
+      }
+    }
+    pthread_mutex_lock(&v->lock);
+    v->updates++;
+    pthread_cond_signal(&v->cond);
+    pthread_mutex_unlock(&v->lock);
+  }
+  free(tmp);
+  return NULL;
+}
+
+/* Throws the Tight viewer's updates away, the server counts the bytes. */
+static void *drain(void *arg)
+{
+  viewer *v = (viewer *)arg;
+  char buf[65536];
+
+  while (recv(v->fd, buf, sizeof(buf), 0) > 0)
+    ;
+  return NULL;
+}
+
+static rfbClientPtr addViewer(rfbScreenInfoPtr screen, int listener,
+                              struct sockaddr_in *addr, viewer *v,
+                              int encoding)
+{
+  rfbClientPtr cl;
+
+  memset(v, 0, sizeof(*v));
+  pthread_mutex_init(&v->lock, NULL);
+  pthread_cond_init(&v->cond, NULL);
+  v->fb = calloc(WIDTH * HEIGHT, BPP);
+  cl = connectViewer(screen, listener, addr, 0, &v->fd);
+  cl->preferredEncoding = encoding;
+  cl->useCopyRect = TRUE;
+  pthread_create(&v->thread, NULL,
+                 encoding == rfbEncodingRaw ? readUpdates : drain, v);
+  return cl;
+}
+
+static void request(viewer *v)
+{
+  requestUpdate(v->fd, TRUE, WIDTH, HEIGHT);
+}
+
+/* markDirtyTiles without the run merging, which doesn't matter here */
+static void markTiles(rfbScreenInfoPtr screen, const uint32_t *dirty)
+{
+  int tx, ty, t = 0;
+
+  for (ty = 0; ty < TILES_Y(HEIGHT); ty++)
+    for (tx = 0; tx < TILES_X(WIDTH); tx++, t++)
+      if (TILE_IS_DIRTY(dirty, t))
+        rfbMarkRectAsModified(screen, tx * TILE_SIZE, ty * TILE_SIZE,
+                              (tx + 1) * TILE_SIZE > WIDTH ? WIDTH : (tx + 1) * TILE_SIZE,
+                              (ty + 1) * TILE_SIZE > HEIGHT ? HEIGHT : (ty + 1) * TILE_SIZE);
+}
+
+/* update_screen's steps for one frame; returns the offset sent as CopyRect */
+static int capture(rfbScreenInfoPtr screen, uint8_t *cmpbuf, uint8_t *vncbuf,
+                   const uint8_t *frame, rfbBool detect, uint32_t *dirty,
+                   uint8_t *movedRows, double *detectMs)
+{
+  int n, offset = 0, y, run;
+  sraRegionPtr region, rect;
+  double t;
+
+  n = diffTiles(cmpbuf, frame, 1, WIDTH, WIDTH, HEIGHT, BPP, dirty);
+  if (n == 0)
+    return 0;
+
+  if (detect && n >= 2 * TILES_X(WIDTH)) {
+    t = now();
+    offset = findScroll(vncbuf, cmpbuf, 1, WIDTH, WIDTH, HEIGHT, BPP,
+                        HEIGHT, TILE_SIZE, movedRows);
+    if (offset != 0)
+      clearScrolledTiles(vncbuf, cmpbuf, 1, WIDTH, WIDTH, HEIGHT, BPP,
+                         movedRows, dirty);
+    *detectMs += now() - t;
+  }
+
+  if (offset != 0) {
+    scrollRows(vncbuf, WIDTH, HEIGHT, BPP, offset, movedRows);
+    region = sraRgnCreate();
+    for (y = 0; y < HEIGHT; y += run > 0 ? run : 1) {
+      for (run = 0; y + run < HEIGHT && movedRows[y + run]; run++)
+        ;
+      if (run > 0) {
+        rect = sraRgnCreateRect(0, y, WIDTH, y + run);
+        sraRgnOr(region, rect);
+        sraRgnDestroy(rect);
+      }
+    }
+    rfbScheduleCopyRegion(screen, region, 0, offset);
+    sraRgnDestroy(region);
+  }
+  copyDirtyTiles(vncbuf, cmpbuf, WIDTH, HEIGHT, BPP, dirty);
+  markTiles(screen, dirty);
+  return offset;
+}
+
+/* Plays seq; returns the Tight viewer's bytes, or -1 on a mismatch. */
+static long run(char **argv, const sequence *seq, rfbBool detect,
+                int *scrolls, double *detectMs)
+{
+  rfbScreenInfoPtr screen;
+  rfbClientPtr tightCl, rawCl;
+  viewer tight, raw;
+  struct sockaddr_in addr;
+  uint8_t *vncbuf = calloc(WIDTH * HEIGHT, BPP);
+  uint8_t *cmpbuf = calloc(WIDTH * HEIGHT, BPP);
+  uint8_t *frame = malloc(WIDTH * HEIGHT * BPP);
+  uint8_t movedRows[HEIGHT];
+  uint32_t dirty[TILE_BITMAP_WORDS(WIDTH, HEIGHT)];
+  int listener, fakeArgc = 1, f, calls, sent, failed = 0;
+  long bytes;
+
+  screen = rfbGetScreen(&fakeArgc, argv, WIDTH, HEIGHT, 8, 3, BPP);
+  screen->frameBuffer = (char *)vncbuf;
+  screen->port = 0;
+  screen->ipv6port = 0;
+  screen->cursor = NULL;
+  screen->deferUpdateTime = 0;
+  rfbInitServer(screen);
+
+  listener = listenLoopback(&addr, 2);
+  tightCl = addViewer(screen, listener, &addr, &tight, rfbEncodingTight);
+  rawCl = addViewer(screen, listener, &addr, &raw, rfbEncodingRaw);
+  close(listener);
+
+  *scrolls = 0;
+  *detectMs = 0;
+  for (f = 0; f < seq->frames && !failed; f++) {
+    drawFrame(frame, seq->pos[f]);
+    if (capture(screen, cmpbuf, vncbuf, frame, detect, dirty, movedRows,
+                detectMs) != 0)
+      (*scrolls)++;
+
+    sent = rfbStatGetMessageCountSent(rawCl, rfbFramebufferUpdate);
+    request(&tight);
+    request(&raw);
+    for (calls = 0; rfbStatGetMessageCountSent(rawCl, rfbFramebufferUpdate) == sent ||
+                    !sraRgnEmpty(tightCl->modifiedRegion) ||
+                    !sraRgnEmpty(tightCl->requestedRegion); calls++) {
+      if (calls == MAX_CALLS) {
+        failed = 1;
+        break;
+      }
+      rfbProcessEvents(screen, 1000);
+    }
+
+    pthread_mutex_lock(&raw.lock);
+    while (raw.updates < sent + 1 && !failed)
+      pthread_cond_wait(&raw.cond, &raw.lock);
+    pthread_mutex_unlock(&raw.lock);
+    if (raw.broken || memcmp(raw.fb, frame, WIDTH * HEIGHT * BPP) != 0)
+      failed = 1;
+  }
+  bytes = rfbStatGetSentBytes(tightCl);
+
+  rfbCloseClient(tightCl);
+  rfbClientConnectionGone(tightCl);
+  rfbCloseClient(rawCl);
+  rfbClientConnectionGone(rawCl);
+  pthread_join(tight.thread, NULL);
+  pthread_join(raw.thread, NULL);
+  close(tight.fd);
+  close(raw.fd);
+  free(tight.fb);
+  free(raw.fb);
+  rfbScreenCleanup(screen);
+  free(vncbuf);
+  free(cmpbuf);
+  free(frame);
+  return failed ? -1 : bytes;
+}
+
+int main(int argc, char **argv)
+{
+  int repeats = argc > 1 ? atoi(argv[1]) : 1;
+  int view = HEIGHT - STATUS_BAR - NAV_BAR, maxPos = HEIGHT * PAGES - view;
+  sequence seqs[5];
+  int i, f, speed, pos, scrolls, failed = 0;
+  long plain, scrolled;
+  double ms;
+
+  rfbLogEnable(0);
+  drawPage();
+
+  /* a finger dragging the list down slowly */
+  seqs[0] = makeSequence("slow drag", 60 * repeats);
+  for (f = 0; f < seqs[0].frames; f++)
+    seqs[0].pos[f] = f * 3 % maxPos;
+
+  /* a fling that slows down, then one back up */
+  seqs[1] = makeSequence("fling", 0);
+  seqs[1].pos = malloc(400 * repeats * sizeof(int));
+  for (i = 0, pos = 0; i < 2 * repeats; i++)
+    for (speed = 120; speed > 0; speed -= speed / 10 + 1) {
+      pos += i % 2 == 0 ? speed : -speed;
+      pos = pos < 0 ? 0 : pos > maxPos ? maxPos : pos;
+      seqs[1].pos[seqs[1].frames++] = pos;
+    }
+
+  /* steady scrolling by more than a tile per frame */
+  seqs[2] = makeSequence("fast scroll", 60 * repeats);
+  for (f = 0; f < seqs[2].frames; f++)
+    seqs[2].pos[f] = f * 90 % maxPos;
+
+  /* page down: nothing moves by less than a screen */
+  seqs[3] = makeSequence("page jumps", 20 * repeats);
+  for (f = 0; f < seqs[3].frames; f++)
+    seqs[3].pos[f] = f * view % maxPos;
+
+  /* scroll position bouncing between two spots a tile apart */
+  seqs[4] = makeSequence("jitter", 40 * repeats);
+  for (f = 0; f < seqs[4].frames; f++)
+    seqs[4].pos[f] = 200 + (f % 2) * TILE_SIZE + f % 3;
+
+  printf("%-12s %6s %12s %12s %7s %8s %10s\n", "sequence", "frames",
+         "plain bytes", "scroll bytes", "saved", "scrolls", "detect ms");
+  for (i = 0; i < 5; i++) {
+    plain = run(argv, &seqs[i], FALSE, &scrolls, &ms);
+    scrolled = run(argv, &seqs[i], TRUE, &scrolls, &ms);
+    printf("%-12s %6d %12ld %12ld %6.1f%% %8d %10.2f%s\n", seqs[i].name,
+           seqs[i].frames, plain, scrolled,
+           plain > 0 ? 100.0 - scrolled * 100.0 / plain : 0.0,
+           scrolls, ms / seqs[i].frames,
+           plain < 0 || scrolled < 0 ? "  MISMATCH" : "");
+    if (plain < 0 || scrolled < 0)
+      failed = 1;
+    free(seqs[i].pos);
+  }
+  free(page);
+  printf("%s\n", failed ? "FAILED" : "ok");
+  return failed;
+}
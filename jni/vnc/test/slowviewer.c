@@ -0,0 +1,251 @@
+/*
+droid VNC server  - a vnc server for android
+Copyright (C) 2011 Jose Pereira <onaips@gmail.com>
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Output queue test: a fast viewer that reads everything at once and a slow
+ * one that reads a little every round both ask for updates every round,
+ * over loopback sockets with small buffers, while a band of the screen
+ * changes. With rfbScreenInfo.maxClientQueue set, no rfbProcessEvents()
+ * call may wait for the slow viewer, its queue must stay near the bound and
+ * updates must be dropped from it. Once both have caught up, replaying the
+ * raw updates each got must give the final framebuffer. This is done once
+ * with select() and once with epoll.
+ *
+ *   slowviewer [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+
+#include "harness.h"
+
+#define WIDTH 320
+#define HEIGHT 240
+#define BPP 4
+#define BAND 16
+#define MAX_QUEUE (64 * 1024)
+/* socket buffer sizes asked for on both ends */
+#define SOCK_BUF (16 * 1024)
+/* what the slow viewer reads per round */
+#define SLOW_READ (16 * 1024)
+/* longest an rfbProcessEvents() call may take, in ms */
+#define MAX_CALL_MS 100
+
+typedef struct {
+  int fd;
+  char *data;
+  size_t len, size;
+  pthread_t thread;
+} viewer;
+
+static ssize_t readSome(viewer *v, size_t max, int flags)
+{
+  ssize_t n;
+
+  if (v->len + max > v->size) {
+    v->size = (v->len + max) * 2;
+    v->data = realloc(v->data, v->size);
+  }
+  n = recv(v->fd, v->data + v->len, max, flags);
+  if (n > 0)
+    v->len += n;
+  return n;
+}
+
+/* the fast viewer reads until the server closes the connection */
+static void *readAll(void *arg)
+{
+  viewer *v = (viewer *)arg;
+
+  while (readSome(v, 65536, 0) > 0)
+    ;
+  return NULL;
+}
+
+static void request(viewer *v)
+{
+  requestUpdate(v->fd, TRUE, WIDTH, HEIGHT);
+}
+
+static rfbClientPtr addViewer(rfbScreenInfoPtr screen, int listener,
+                              struct sockaddr_in *addr, viewer *v)
+{
+  memset(v, 0, sizeof(*v));
+  return connectViewer(screen, listener, addr, SOCK_BUF, &v->fd);
+}
+
+/* Applies the raw updates a viewer got to fb; FALSE if they don't parse. */
+static rfbBool replay(viewer *v, char *fb)
+{
+  unsigned char *p = (unsigned char *)v->data, *end = p + v->len;
+  rfbFramebufferUpdateRectHeader rh;
+  int n, row, x, y, w, h;
+
+  p += sz_rfbProtocolVersionMsg;
+  while (p < end) {
+    if (end - p < sz_rfbFramebufferUpdateMsg || p[0] != rfbFramebufferUpdate)
+      return FALSE;
+    n = p[2] << 8 | p[3];
+    p += sz_rfbFramebufferUpdateMsg;
+    while (n-- > 0) {
+      if (end - p < sz_rfbFramebufferUpdateRectHeader)
+        return FALSE;
+      memcpy(&rh, p, sz_rfbFramebufferUpdateRectHeader);
+      p += sz_rfbFramebufferUpdateRectHeader;
+      x = Swap16IfLE(rh.r.x);
+      y = Swap16IfLE(rh.r.y);
+      w = Swap16IfLE(rh.r.w);
+      h = Swap16IfLE(rh.r.h);
+      if (Swap32IfLE(rh.encoding) != rfbEncodingRaw ||
+          x + w > WIDTH || y + h > HEIGHT || end - p < w * h * BPP)
+        return FALSE;
+      for (row = 0; row < h; row++, p += w * BPP)
+        memcpy(fb + ((y + row) * WIDTH + x) * BPP, p, w * BPP);
+    }
+  }
+  return TRUE;
+}
+
+static int run(char **argv, rfbBool epoll, int rounds)
+{
+  rfbScreenInfoPtr screen;
+  rfbClientPtr fastCl, slowCl;
+  viewer fast, slow;
+  struct sockaddr_in addr;
+  char *fb = calloc(WIDTH * HEIGHT, BPP), *seen = malloc(WIDTH * HEIGHT * BPP);
+  int listener, fakeArgc = 1, failed = 0, quiet, r, y, fastUpdates, peak;
+  double t, slowest = 0;
+
+  screen = rfbGetScreen(&fakeArgc, argv, WIDTH, HEIGHT, 8, 3, BPP);
+  screen->frameBuffer = fb;
+  screen->port = 0;
+  screen->ipv6port = 0;
+  screen->cursor = NULL;
+  screen->deferUpdateTime = 0;
+  screen->useEpoll = epoll;
+  screen->maxClientQueue = MAX_QUEUE;
+  rfbInitServer(screen);
+  if (epoll && screen->epollFd < 0) {
+    printf("epoll    not available\n");
+    rfbScreenCleanup(screen);
+    return 0;
+  }
+
+  listener = listenLoopback(&addr, 2);
+  fastCl = addViewer(screen, listener, &addr, &fast);
+  slowCl = addViewer(screen, listener, &addr, &slow);
+  close(listener);
+  pthread_create(&fast.thread, NULL, readAll, &fast);
+
+  for (r = 0; r < rounds; r++) {
+    y = r % 4 * BAND / 2;
+    memset(fb + y * WIDTH * BPP, r * 7 + 1, BAND * WIDTH * BPP);
+    rfbMarkRectAsModified(screen, 0, y, WIDTH, y + BAND);
+    request(&fast);
+    request(&slow);
+
+    t = now();
+    rfbProcessEvents(screen, 0);
+    t = now() - t;
+    if (t > slowest)
+      slowest = t;
+    readSome(&slow, SLOW_READ, MSG_DONTWAIT);
+  }
+  fastUpdates = rfbStatGetMessageCountSent(fastCl, rfbFramebufferUpdate);
+
+  /* let both catch up */
+  for (quiet = 0; quiet < 3; ) {
+    request(&fast);
+    request(&slow);
+    rfbProcessEvents(screen, 1000);
+    if (readSome(&slow, 65536, MSG_DONTWAIT) > 0 ||
+        fastCl->outQueue != NULL || slowCl->outQueue != NULL ||
+        !sraRgnEmpty(fastCl->modifiedRegion) ||
+        !sraRgnEmpty(slowCl->modifiedRegion))
+      quiet = 0;
+    else
+      quiet++;
+  }
+
+  peak = slowCl->outQueuePeak;
+  printf("%-8s fast: %3d/%d updates  slow: %3d updates, %3d dropped, "
+         "queue peak %6d  slowest call %5.1f ms",
+         epoll ? "epoll" : "select", fastUpdates, rounds,
+         rfbStatGetMessageCountSent(slowCl, rfbFramebufferUpdate),
+         slowCl->updatesDropped, peak, slowest);
+
+  if (slowest > MAX_CALL_MS) {
+    printf("  BLOCKED");
+    failed = 1;
+  }
+  /* one update may be queued on top of a queue just under the bound */
+  if (peak > MAX_QUEUE + WIDTH * HEIGHT * BPP + 1024 ||
+      slowCl->updatesDropped == 0) {
+    printf("  QUEUE");
+    failed = 1;
+  }
+
+  rfbCloseClient(fastCl);
+  rfbClientConnectionGone(fastCl);
+  pthread_join(fast.thread, NULL);
+  rfbCloseClient(slowCl);
+  rfbClientConnectionGone(slowCl);
+  while (readSome(&slow, 65536, 0) > 0)
+    ;
+
+  memset(seen, 0, WIDTH * HEIGHT * BPP);
+  if (!replay(&fast, seen) || memcmp(seen, fb, WIDTH * HEIGHT * BPP) != 0) {
+    printf("  FAST MISMATCH");
+    failed = 1;
+  }
+  memset(seen, 0, WIDTH * HEIGHT * BPP);
+  if (!replay(&slow, seen) || memcmp(seen, fb, WIDTH * HEIGHT * BPP) != 0) {
+    printf("  SLOW MISMATCH");
+    failed = 1;
+  }
+  printf("\n");
+
+  close(fast.fd);
+  close(slow.fd);
+  free(fast.data);
+  free(slow.data);
+  rfbScreenCleanup(screen);
+  free(fb);
+  free(seen);
+  return failed;
+}
+
+int main(int argc, char **argv)
+{
+  int rounds = argc > 1 ? atoi(argv[1]) : 200;
+  int failed = 0;
+
+  rfbLogEnable(0);
+  failed |= run(argv, FALSE, rounds);
+  failed |= run(argv, TRUE, rounds);
+  printf("%s\n", failed ? "FAILED" : "ok");
+  return failed;
+}
@@ -0,0 +1,468 @@
+/*
+droid VNC server  - a vnc server for android
+Copyright (C) 2011 Jose Pereira <onaips@gmail.com>
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Tight encoder stress test: connects several simulated clients over
+ * loopback, each with its own compress/quality settings, and encodes the
+ * same rectangles for all of them, first one client at a time and then
+ * from one thread per client. Every client's byte stream must be identical
+ * between the two runs.
+ *
+ * It then sends the same framebuffer updates through screens with an
+ * encode pool of 1 and of [threads] threads, which must also match byte for
+ * byte, and against the plain serial path for clients without LastRect
+ * (with it, solid areas are only searched for within a band). The time per
+ * update is printed for each.
+ *
+ * Last, all clients get the same settings and the screen shares encoded
+ * rectangles between them: their streams must be identical, and decode,
+ * zlib streams and all, also while sharing is switched on and off between
+ * frames.
+ *
+ *   tightstress [clients] [rounds] [threads]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+
+#include "harness.h"
+
+#define WIDTH 480
+#define HEIGHT 320
+#define MAX_CLIENTS 16
+
+typedef struct {
+  int fd;
+  unsigned char *data;
+  size_t len, size;
+  pthread_t thread;
+} sink_t;
+
+typedef struct {
+  rfbClientPtr cl;
+  int rounds;
+  int updates;
+  int toggle;
+  pthread_t thread;
+} worker_t;
+
+/* if not negative, the settings every client gets */
+static int groupSettings = -1;
+/* Tight bytes per pixel on the wire, 3 for depth 24 */
+static int tightPixel = 4;
+
+static const struct { int x, y, w, h; } rects[] = {
+  { 0, 0, WIDTH, HEIGHT },      /* everything, split into subrects */
+  { 0, 0, 64, 64 },             /* solid */
+  { 96, 0, 96, 64 },            /* two colours */
+  { 200, 0, 120, 80 },          /* small palette */
+  { 0, 120, 240, 200 },         /* gradient, full colour / jpeg */
+  { 17, 33, 301, 157 },         /* unaligned, mixed */
+};
+
+static void quiet(const char *format, ...)
+{
+}
+
+static double clockMs(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* solid, mono, indexed and gradient regions so every Tight path is hit */
+static void fill(char *fb)
+{
+  uint32_t *p = (uint32_t *)fb;
+  int x, y;
+
+  for (y = 0; y < HEIGHT; y++)
+    for (x = 0; x < WIDTH; x++) {
+      uint32_t v;
+      if (y < 120 && x < 96)
+        v = 0x00204060;
+      else if (y < 120 && x < 192)
+        v = ((x / 7 + y / 5) & 1) ? 0x00ffffff : 0x00000000;
+      else if (y < 120)
+        v = 0x00101010 * ((x * 3 + y) % 12);
+      else
+        v = (x & 0xff) | ((y & 0xff) << 8) | (((x + y) & 0xff) << 16);
+      p[y * WIDTH + x] = v;
+    }
+}
+
+static void *drain(void *arg)
+{
+  sink_t *s = arg;
+  ssize_t n;
+
+  for (;;) {
+    if (s->len == s->size) {
+      s->size = s->size ? s->size * 2 : 65536;
+      s->data = realloc(s->data, s->size);
+    }
+    n = read(s->fd, s->data + s->len, s->size - s->len);
+    if (n <= 0)
+      break;
+    s->len += n;
+  }
+  return NULL;
+}
+
+static void *encode(void *arg)
+{
+  worker_t *w = arg;
+  int r, i;
+
+  for (r = 0; r < w->rounds; r++) {
+    if (w->toggle) {
+      /* a new frame, shared or not */
+      w->cl->screen->shareEncodedRects = r & 1;
+      rfbMarkRectAsModified(w->cl->screen, 0, 0, 1, 1);
+    }
+    for (i = 0; i < (int)(sizeof(rects) / sizeof(rects[0])); i++) {
+      rfbBool ok;
+
+      if (w->updates) {
+        sraRegionPtr region = sraRgnCreateRect(rects[i].x, rects[i].y,
+                                               rects[i].x + rects[i].w,
+                                               rects[i].y + rects[i].h);
+        sraRgnOr(w->cl->requestedRegion, region);
+        ok = rfbSendFramebufferUpdate(w->cl, region);
+        sraRgnDestroy(region);
+      } else {
+        ok = rfbSendRectEncodingTight(w->cl, rects[i].x, rects[i].y,
+                                      rects[i].w, rects[i].h) &&
+             rfbSendUpdateBuf(w->cl);
+      }
+      if (!ok) {
+        fprintf(stderr, "encode failed\n");
+        exit(1);
+      }
+    }
+  }
+  return NULL;
+}
+
+/* one loopback connection per client, server side handed to libvncserver */
+static rfbClientPtr connectClient(rfbScreenInfoPtr screen, int listener,
+                                  struct sockaddr_in *addr, sink_t *sink, int n)
+{
+  rfbClientPtr cl;
+
+  cl = connectViewer(screen, listener, addr, 0, &sink->fd);
+  pthread_create(&sink->thread, NULL, drain, sink);
+
+  if (groupSettings >= 0)
+    n = groupSettings;
+  cl->tightCompressLevel = n % 10;
+  cl->turboQualityLevel = (n % 3) ? 30 + n * 7 % 70 : -1;
+  cl->turboSubsampLevel = n % 4;
+  cl->enableLastRectEncoding = n & 1;
+  cl->preferredEncoding = rfbEncodingTight;
+  /* keep the cursor out of the framebuffer */
+  cl->enableCursorShapeUpdates = TRUE;
+  return cl;
+}
+
+static void run(rfbScreenInfoPtr screen, int clients, int rounds,
+                int parallel, int updates, int toggle, sink_t *sinks)
+{
+  worker_t workers[MAX_CLIENTS];
+  struct sockaddr_in addr;
+  int listener, i;
+
+  listener = listenLoopback(&addr, clients);
+
+  for (i = 0; i < clients; i++) {
+    memset(&sinks[i], 0, sizeof(sinks[i]));
+    workers[i].cl = connectClient(screen, listener, &addr, &sinks[i], i);
+    workers[i].rounds = rounds;
+    workers[i].updates = updates;
+    workers[i].toggle = toggle;
+  }
+  close(listener);
+
+  for (i = 0; i < clients; i++) {
+    if (parallel)
+      pthread_create(&workers[i].thread, NULL, encode, &workers[i]);
+    else
+      encode(&workers[i]);
+  }
+
+  for (i = 0; i < clients; i++) {
+    if (parallel)
+      pthread_join(workers[i].thread, NULL);
+    rfbCloseClient(workers[i].cl);
+    rfbClientConnectionGone(workers[i].cl);
+    pthread_join(sinks[i].thread, NULL);
+    close(sinks[i].fd);
+  }
+}
+
+static rfbScreenInfoPtr newScreen(char **argv, char *fb, int threads)
+{
+  rfbScreenInfoPtr screen;
+  int fakeArgc = 1;
+
+  screen = rfbGetScreen(&fakeArgc, argv, WIDTH, HEIGHT, 8, 3, 4);
+  screen->frameBuffer = fb;
+  screen->encodeThreads = threads;
+  tightPixel = screen->serverFormat.depth == 24 ? 3 : 4;
+  return screen;
+}
+
+static int compare(const char *what, sink_t *a, sink_t *b, int clients,
+                   int step)
+{
+  int failed = 0, i;
+
+  for (i = 0; i < clients; i += step) {
+    size_t n = 0;
+
+    while (n < a[i].len && n < b[i].len && a[i].data[n] == b[i].data[n])
+      n++;
+    if (n == a[i].len && n == b[i].len)
+      printf("%-18s client %2d  %8zu bytes  ok\n", what, i, n);
+    else {
+      printf("%-18s client %2d  %8zu bytes  MISMATCH at byte %zu\n", what, i,
+             a[i].len, n);
+      failed = 1;
+    }
+  }
+  return failed;
+}
+
+/*
+ * A Tight decoder that only goes as far as the zlib streams: it follows
+ * the stream resets and checks every zlib block inflates to the size the
+ * rectangle needs.
+ */
+
+static int compactLen(const unsigned char **p)
+{
+  int len = *(*p)++ & 0x7f;
+
+  if ((*p)[-1] & 0x80) {
+    len |= (*(*p)++ & 0x7f) << 7;
+    if ((*p)[-1] & 0x80)
+      len |= *(*p)++ << 14;
+  }
+  return len;
+}
+
+static int decodeTight(const unsigned char **pp, z_stream *zs, int *zsActive,
+                       int w, int h)
+{
+  static unsigned char out[WIDTH * HEIGHT * 4];
+  const unsigned char *p = *pp;
+  int ctrl = *p++, comp = ctrl >> 4, s, filter = rfbTightFilterCopy;
+  int size, len, colours = 0;
+
+  for (s = 0; s < 4; s++)
+    if ((ctrl & (1 << s)) && zsActive[s]) {
+      inflateEnd(&zs[s]);
+      zsActive[s] = 0;
+    }
+
+  if (comp == rfbTightFill) {
+    *pp = p + tightPixel;
+    return 0;
+  }
+  if (comp == rfbTightJpeg) {
+    len = compactLen(&p);
+    *pp = p + len;
+    return 0;
+  }
+
+  if (comp & rfbTightExplicitFilter)
+    filter = *p++;
+  if (filter == rfbTightFilterPalette) {
+    colours = *p++ + 1;
+    p += colours * tightPixel;
+    size = (colours == 2 ? (w + 7) / 8 : w) * h;
+  } else
+    size = w * h * tightPixel;
+
+  if (size < 12) {
+    *pp = p + size;
+    return 0;
+  }
+  len = compactLen(&p);
+  if (comp & 0x08) {            /* rfbTightNoZlib */
+    *pp = p + len;
+    return len != size;
+  }
+
+  s = comp & 0x03;
+  if (!zsActive[s]) {
+    memset(&zs[s], 0, sizeof(zs[s]));
+    inflateInit(&zs[s]);
+    zsActive[s] = 1;
+  }
+  zs[s].next_in = (Bytef *)p;
+  zs[s].avail_in = len;
+  zs[s].next_out = out;
+  zs[s].avail_out = sizeof(out);
+  if (inflate(&zs[s], Z_SYNC_FLUSH) != Z_OK || zs[s].avail_in != 0 ||
+      (int)(sizeof(out) - zs[s].avail_out) != size)
+    return 1;
+  *pp = p + len;
+  return 0;
+}
+
+static int decode(const char *what, sink_t *sinks, int clients)
+{
+  z_stream zs[4];
+  int zsActive[4];
+  int failed = 0, updates, i, s;
+
+  for (i = 0; i < clients; i++) {
+    const unsigned char *p = sinks[i].data + 12, *end = sinks[i].data + sinks[i].len;
+    int bad = 0;
+
+    memset(zsActive, 0, sizeof(zsActive));
+    for (updates = 0; !bad && p < end; updates++) {
+      int nRects = p[2] << 8 | p[3], r;
+
+      p += 4;
+      for (r = 0; !bad && r < nRects; r++) {
+        int w = p[4] << 8 | p[5], h = p[6] << 8 | p[7];
+        uint32_t encoding = (uint32_t)p[8] << 24 | p[9] << 16 | p[10] << 8 | p[11];
+
+        p += 12;
+        if (encoding == rfbEncodingLastRect)
+          break;
+        if (encoding == rfbEncodingRichCursor)
+          p += w * h * 4 + (w + 7) / 8 * h;
+        else if (encoding != rfbEncodingTight || decodeTight(&p, zs, zsActive, w, h))
+          bad = 1;
+      }
+    }
+    for (s = 0; s < 4; s++)
+      if (zsActive[s])
+        inflateEnd(&zs[s]);
+
+    if (bad || p != end) {
+      printf("%-18s client %2d  undecodable in update %d\n", what, i, updates);
+      failed = 1;
+    } else
+      printf("%-18s client %2d  %8d updates  ok\n", what, i, updates);
+  }
+  return failed;
+}
+
+static void release(sink_t *sinks, int clients)
+{
+  int i;
+
+  for (i = 0; i < clients; i++)
+    free(sinks[i].data);
+}
+
+int main(int argc, char **argv)
+{
+  int clients = argc > 1 ? atoi(argv[1]) : 8;
+  int rounds = argc > 2 ? atoi(argv[2]) : 4;
+  int threads = argc > 3 ? atoi(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+  sink_t serial[MAX_CLIENTS], parallel[MAX_CLIENTS], pooled[MAX_CLIENTS];
+  int poolThreads[3] = { 0, 1, threads < 2 ? 4 : threads };
+  rfbScreenInfoPtr screen;
+  char *fb;
+  double start;
+  int failed = 0, i;
+
+  if (clients < 1 || clients > MAX_CLIENTS || rounds < 1) {
+    fprintf(stderr, "usage: %s [clients 1-%d] [rounds] [threads]\n", argv[0],
+            MAX_CLIENTS);
+    return 1;
+  }
+
+  rfbLog = rfbErr = quiet;
+  fb = malloc(WIDTH * HEIGHT * 4);
+  fill(fb);
+
+  screen = newScreen(argv, fb, 0);
+  run(screen, clients, rounds, 0, 0, 0, serial);
+  run(screen, clients, rounds, 1, 0, 0, parallel);
+  rfbScreenCleanup(screen);
+  failed |= compare("concurrent clients", serial, parallel, clients, 1);
+  release(serial, clients);
+  release(parallel, clients);
+
+  for (i = 0; i < 3; i++) {
+    screen = newScreen(argv, fb, poolThreads[i]);
+    start = now();
+    run(screen, clients, rounds, 0, 1, 0,
+        i == 0 ? serial : i == 1 ? parallel : pooled);
+    printf("encode threads %d: %.2f ms per update\n", poolThreads[i],
+           (now() - start) / (clients * rounds * (sizeof(rects) / sizeof(rects[0]))));
+    rfbScreenCleanup(screen);
+  }
+  failed |= compare("pool of 1 vs n", parallel, pooled, clients, 1);
+  /* the even clients don't use LastRect */
+  failed |= compare("serial vs pool", serial, parallel, clients, 2);
+  release(serial, clients);
+  release(parallel, clients);
+  release(pooled, clients);
+
+  /* one group: compress level 6, no JPEG, no LastRect; all encoding is
+     done on this thread, so its CPU time is what sharing saves */
+  groupSettings = 6;
+  for (i = 0; i < 2; i++) {
+    screen = newScreen(argv, fb, 0);
+    screen->shareEncodedRects = i;
+    start = clockMs(CLOCK_THREAD_CPUTIME_ID);
+    run(screen, clients, rounds, 0, 1, 0, i ? pooled : serial);
+    printf("%s: %.2f ms CPU per update\n", i ? "shared" : "not shared",
+           (clockMs(CLOCK_THREAD_CPUTIME_ID) - start) /
+           (clients * rounds * (sizeof(rects) / sizeof(rects[0]))));
+    rfbScreenCleanup(screen);
+  }
+  for (i = 0; i < clients; i++)
+    parallel[i] = pooled[0];
+  failed |= compare("shared, same bytes", parallel, pooled, clients, 1);
+  failed |= decode("shared", pooled, clients);
+  failed |= decode("not shared", serial, clients);
+  release(serial, clients);
+  release(pooled, clients);
+
+  /* and sharing switched on and off, one frame at a time */
+  for (i = 0; i < 2; i++) {
+    screen = newScreen(argv, fb, i ? poolThreads[2] : 0);
+    run(screen, clients, rounds * 2, 0, 1, 1, i ? pooled : serial);
+    rfbScreenCleanup(screen);
+  }
+  failed |= decode("toggled", serial, clients);
+  failed |= decode("toggled, pool", pooled, clients);
+  release(serial, clients);
+  release(pooled, clients);
+
+  free(fb);
+  return failed;
+}
@@ -0,0 +1,238 @@
+/*
+droid VNC server  - a vnc server for android
+Copyright (C) 2011 Jose Pereira <onaips@gmail.com>
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Frame diff benchmark: reports ns/frame for the tile diff kernels and the
+ * tile hash kernels (marked #) on synthetic framebuffers, next to the old
+ * per-pixel compare loop.
+ *
+ *   tilebench [frames]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tileDiff.h"
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* The loop update_screen_32 used to run for rotation 0. */
+static int perPixelDiff(uint32_t *a, const uint32_t *b, int w, int h)
+{
+  int i, j, idle = 1;
+  int min_x = 99999, min_y = 99999, max_x = -1, max_y = -1;
+
+  for (j = 0; j < h; j++)
+    for (i = 0; i < w; i++)
+      if (a[i + j * w] != b[j * w + i]) {
+        a[i + j * w] = b[j * w + i];
+        if (i > max_x) max_x = i;
+        if (i < min_x) min_x = i;
+        if (j > max_y) max_y = j;
+        if (j < min_y) min_y = j;
+        idle = 0;
+      }
+  return !idle;
+}
+
+enum scene { STATIC, ONE_TILE, FULL };
+static const char *sceneName[] = { "static", "one tile", "full" };
+
+/* Touches the source so the next diff sees the requested amount of change. */
+static void animate(uint8_t *src, int w, int h, int bpp, enum scene s, int frame)
+{
+  int j;
+
+  if (s == ONE_TILE)
+    for (j = 0; j < 8; j++)
+      src[(h / 2 + j) * w * bpp + (w / 2) * bpp] = (uint8_t)frame;
+  else if (s == FULL)
+    for (j = 0; j < h; j++)
+      src[j * w * bpp + (j % w) * bpp] = (uint8_t)(frame + j);
+}
+
+static void bench(int w, int h, int bpp, int frames)
+{
+  size_t size = (size_t)w * h * bpp;
+  uint8_t *src = malloc(size), *shadow = malloc(size);
+  uint32_t *dirty = malloc(TILE_BITMAP_WORDS(w, h) * sizeof(uint32_t));
+  uint64_t *hashes = malloc(TILES_X(w) * TILES_Y(h) * sizeof(uint64_t));
+  static const char *names[] = { "c", "sse2", "neon" };
+  static const char *hashNames[] = { "c", "crc32c" };
+  char label[16];
+  int s, k, f, n, ok;
+  double t;
+
+  for (f = 0; f < (int)size; f++)
+    src[f] = (uint8_t)(f * 2654435761u >> 24);
+
+  printf("\n%dx%d %dbpp\n", w, h, bpp * 8);
+  for (s = STATIC; s <= FULL; s++) {
+    if (bpp == 4) {
+      memcpy(shadow, src, size);
+      t = now();
+      for (f = 0; f < frames; f++) {
+        animate(src, w, h, bpp, s, f);
+        perPixelDiff((uint32_t *)shadow, (const uint32_t *)src, w, h);
+      }
+      printf("  %-9s %-10s %12.0f ns/frame\n", sceneName[s], "per-pixel",
+             (now() - t) / frames);
+    }
+
+    for (k = 0; k < 3; k++) {
+      if (tileDiffUseKernel(names[k]) != 0)
+        continue;
+      memcpy(shadow, src, size);
+      t = now();
+      for (f = 0; f < frames; f++) {
+        animate(src, w, h, bpp, s, f);
+        diffTiles(shadow, src, 1, w, w, h, bpp, dirty);
+      }
+      t = (now() - t) / frames;
+      if (memcmp(shadow, src, size) != 0)
+        printf("  %-9s %-10s MISMATCH\n", sceneName[s], names[k]);
+      else
+        printf("  %-9s %-10s %12.0f ns/frame\n", sceneName[s], names[k], t);
+    }
+
+    /* -H and -Z: no shadow, just a hash per tile */
+    for (k = 0; k < 2; k++) {
+      if (tileHashUseKernel(hashNames[k]) != 0)
+        continue;
+      memset(hashes, 0, TILES_X(w) * TILES_Y(h) * sizeof(uint64_t));
+      hashTiles(hashes, src, 1, w, w, h, bpp, dirty);
+      ok = 1;
+      t = now();
+      for (f = 0; f < frames; f++) {
+        animate(src, w, h, bpp, s, f + 1);
+        n = hashTiles(hashes, src, 1, w, w, h, bpp, dirty);
+        if ((s == STATIC && n != 0) || (s == ONE_TILE && n != 1) || (s == FULL && n == 0))
+          ok = 0;
+      }
+      t = (now() - t) / frames;
+      snprintf(label, sizeof(label), "#%s", hashNames[k]);
+      if (!ok)
+        printf("  %-9s %-10s MISMATCH\n", sceneName[s], label);
+      else
+        printf("  %-9s %-10s %12.0f ns/frame\n", sceneName[s], label, t);
+    }
+  }
+
+  free(src);
+  free(shadow);
+  free(dirty);
+  free(hashes);
+}
+
+/* Same origin/step selection as update_screen, on a packed source. */
+static void rotationSteps(int rot, int srcW, int srcH, int *origin, int *dx, int *dy)
+{
+  switch (rot) {
+    case 90:  *origin = (srcH - 1) * srcW; *dx = -srcW; *dy = 1; break;
+    case 180: *origin = (srcH - 1) * srcW + srcW - 1; *dx = -1; *dy = -srcW; break;
+    case 270: *origin = srcW - 1; *dx = srcW; *dy = -1; break;
+    default:  *origin = 0; *dx = 1; *dy = srcW; break;
+  }
+}
+
+/* Full change every frame, so every tile goes through the rotation kernel. */
+static void benchRotation(int srcW, int srcH, int bpp, int frames)
+{
+  size_t size = (size_t)srcW * srcH * bpp;
+  uint8_t *src = malloc(size), *shadow = malloc(size), *expect = malloc(size);
+  uint32_t *dirty = malloc(TILE_BITMAP_WORDS(srcW, srcH) * sizeof(uint32_t));
+  uint64_t *hashes = malloc(TILES_X(srcW) * TILES_Y(srcH) * sizeof(uint64_t));
+  static const char *names[] = { "c", "sse2", "neon" };
+  static const int rots[] = { 0, 90, 180, 270 };
+  int r, k, f, x, y, origin, dx, dy;
+  double t;
+
+  for (f = 0; f < (int)size; f++)
+    src[f] = (uint8_t)(f * 2654435761u >> 24);
+
+  printf("\n%dx%d %dbpp, full change\n", srcW, srcH, bpp * 8);
+  for (r = 0; r < 4; r++) {
+    int w = rots[r] % 180 ? srcH : srcW, h = rots[r] % 180 ? srcW : srcH;
+
+    rotationSteps(rots[r], srcW, srcH, &origin, &dx, &dy);
+    for (y = 0; y < h; y++)
+      for (x = 0; x < w; x++)
+        memcpy(expect + ((size_t)y * w + x) * bpp,
+               src + (size_t)(origin + x * dx + y * dy) * bpp, bpp);
+
+    for (k = 0; k < 3; k++) {
+      if (tileDiffUseKernel(names[k]) != 0)
+        continue;
+      t = 0;
+      for (f = 0; f < frames; f++) {
+        memset(shadow, f, size);
+        t -= now();
+        diffTiles(shadow, src + (size_t)origin * bpp, dx, dy, w, h, bpp, dirty);
+        t += now();
+      }
+      if (memcmp(shadow, expect, size) != 0)
+        printf("  %3d deg   %-10s MISMATCH\n", rots[r], names[k]);
+      else
+        printf("  %3d deg   %-10s %12.0f ns/frame\n", rots[r], names[k], t / frames);
+    }
+
+    /* -H: hash the rotated source, then gather the dirty tiles */
+    memset(hashes, 0, TILES_X(w) * TILES_Y(h) * sizeof(uint64_t));
+    memset(shadow, 0, size);
+    t = now();
+    hashTiles(hashes, src + (size_t)origin * bpp, dx, dy, w, h, bpp, dirty);
+    gatherDirtyTiles(shadow, src + (size_t)origin * bpp, dx, dy, w, h, bpp, dirty);
+    t = now() - t;
+    if (memcmp(shadow, expect, size) != 0 ||
+        hashTiles(hashes, src + (size_t)origin * bpp, dx, dy, w, h, bpp, dirty) != 0 ||
+        verifyTiles(shadow, src + (size_t)origin * bpp, dx, dy, w, h, bpp, dirty) != 0)
+      printf("  %3d deg   %-10s MISMATCH\n", rots[r], "#+gather");
+    else
+      printf("  %3d deg   %-10s %12.0f ns/frame\n", rots[r], "#+gather", t);
+  }
+
+  free(src);
+  free(shadow);
+  free(expect);
+  free(dirty);
+  free(hashes);
+}
+
+int main(int argc, char **argv)
+{
+  int frames = argc > 1 ? atoi(argv[1]) : 50;
+
+  printf("default kernel: %s\n", initTileDiff());
+  bench(1080, 1920, 4, frames);
+  bench(1080, 1920, 2, frames);
+  bench(1440, 2560, 4, frames);
+  bench(2160, 3840, 4, frames);
+  benchRotation(1080, 1920, 4, frames);
+  benchRotation(1080, 1920, 2, frames);
+  benchRotation(1001, 1003, 4, frames);
+  benchRotation(1001, 1003, 2, frames);
+  return 0;
+}
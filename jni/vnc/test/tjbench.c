@@ -0,0 +1,131 @@
+/*
+droid VNC server  - a vnc server for android
+Copyright (C) 2011 Jose Pereira <onaips@gmail.com>
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * JPEG encoder benchmark: compresses synthetic RGBX frames through the
+ * turbojpeg shim the way Tight does, once with each libjpeg kernel set
+ * (see jpeg/jsimd.h), and reports ms/frame. The SIMD sets must produce
+ * the same bytes as the C code for every quality, subsampling and scene,
+ * including the noise scene that drives the DCTs to their extremes.
+ *
+ *   tjbench [frames]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jpeglib.h"
+#include "jsimd.h"
+#include "turbojpeg.h"
+
+#include "harness.h"
+
+#define WIDTH 480
+#define HEIGHT 800
+
+enum scene { PHOTO, UI, NOISE };
+static const char *sceneName[] = { "photo", "ui", "noise" };
+
+static void draw(unsigned char *fb, enum scene s)
+{
+  unsigned int seed = 12345;
+  int x, y, c;
+
+  for (y = 0; y < HEIGHT; y++)
+    for (x = 0; x < WIDTH; x++) {
+      unsigned char *p = fb + (y * WIDTH + x) * 4;
+      for (c = 0; c < 3; c++) {
+        seed = seed * 1103515245 + 12345;
+        if (s == PHOTO)
+          p[c] = (unsigned char)((x * (c + 1) + y * (3 - c)) / 5
+                                 + ((seed >> 16) & 15));
+        else if (s == UI)
+          p[c] = ((x / 7 + y / 11) % 9 == 0) ? 0x20 : 0xf0 - c * 0x30;
+        else if ((seed >> 16) & 8)
+          p[c] = (seed >> 20) & 0xff;
+        else
+          p[c] = ((x ^ y) & 1) ? 0xff : 0;
+      }
+      p[3] = 0xff;
+    }
+}
+
+static const int subsamps[] = { TJSAMP_444, TJSAMP_422, TJSAMP_420, TJSAMP_GRAY };
+static const char *subsampName[] = { "444", "422", "420", "gray" };
+/* below 96 the shim uses the fast DCT, from 96 the slow one */
+static const int qualities[] = { 30, 80, 100 };
+
+static double compressFrames(tjhandle j, const unsigned char *fb,
+                             int subsamp, int quality, int frames,
+                             unsigned char *out, unsigned long *size)
+{
+  double t = now();
+  int i;
+
+  for (i = 0; i < frames; i++)
+    if (tjCompress2(j, (unsigned char *)fb, WIDTH, 0, HEIGHT, TJPF_RGBX,
+                    &out, size, subsamp, quality, 0) == -1) {
+      fprintf(stderr, "tjCompress2: %s\n", tjGetErrorStr());
+      exit(1);
+    }
+  return (now() - t) / frames;
+}
+
+int main(int argc, char **argv)
+{
+  static const char *sets[] = { "c", "sse2", "neon" };
+  int frames = argc > 1 ? atoi(argv[1]) : 20;
+  unsigned char *fb = malloc(WIDTH * HEIGHT * 4);
+  unsigned long bufSize = tjBufSize(WIDTH, HEIGHT, TJSAMP_444), refSize, size;
+  unsigned char *ref = malloc(bufSize), *out = malloc(bufSize);
+  tjhandle j = tjInitCompress();
+  int s, q, k, n, failed = 0;
+  double ms;
+
+  if (fb == NULL || ref == NULL || out == NULL || j == NULL) {
+    fprintf(stderr, "setup failed\n");
+    return 1;
+  }
+
+  printf("%dx%d RGBX, %d frames\n", WIDTH, HEIGHT, frames);
+  for (s = PHOTO; s <= NOISE; s++) {
+    draw(fb, s);
+    for (q = 0; q < (int)(sizeof(qualities) / sizeof(qualities[0])); q++)
+      for (k = 0; k < (int)(sizeof(subsamps) / sizeof(subsamps[0])); k++) {
+        printf("%-6s q%-3d %-5s", sceneName[s], qualities[q], subsampName[k]);
+        for (n = 0; n < (int)(sizeof(sets) / sizeof(sets[0])); n++) {
+          if (!jpeg_simd_use(sets[n]))
+            continue;
+          ms = compressFrames(j, fb, subsamps[k], qualities[q], frames,
+                              n == 0 ? ref : out, n == 0 ? &refSize : &size);
+          printf("  %s %7.3f ms", sets[n], ms);
+          if (n > 0 && (size != refSize || memcmp(ref, out, size) != 0)) {
+            printf(" MISMATCH");
+            failed = 1;
+          }
+        }
+        printf("  %7lu bytes\n", refSize);
+      }
+  }
+
+  tjDestroy(j);
+  printf("%s\n", failed ? "FAILED" : "ok");
+  return failed;
+}
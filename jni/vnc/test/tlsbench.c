@@ -0,0 +1,423 @@
+/*
+droid VNC server  - a vnc server for android
+Copyright (C) 2011 Jose Pereira <onaips@gmail.com>
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * wss handshake benchmark: viewers in child processes connect over
+ * loopback one after another, each going through the TLS and WebSockets
+ * handshakes up to the RFB version before hanging up, first with a full
+ * TLS handshake every time and then resuming the session of their last
+ * connection. Meanwhile another viewer sends part of a ClientHello and
+ * stalls, which must not hold up the others. Prints handshakes per second
+ * and the slowest rfbProcessEvents() call of each round.
+ *
+ * Last, a viewer stops reading for a while as megabytes are written to it,
+ * which must be queued instead of waited for, and then has to get them all
+ * in order.
+ *
+ *   tlsbench [connections per viewer] [viewers]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <openssl/ssl.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+
+#include <rfb/rfb.h>
+
+#include "harness.h"
+
+#define CERT_FILE "tlsbench.pem"
+/* longest an rfbProcessEvents() call may take, in ms */
+#define MAX_CALL_MS 500
+
+/* what is written to the slow viewer, in writes of SLOW_CHUNK bytes, and
+   how long it stops reading for, in ms */
+#define SLOW_BYTES (4 << 20)
+#define SLOW_CHUNK 65536
+#define SLOW_PAUSE_MS 2000
+#define SLOW_BUF_SIZE 16384
+
+static const char request[] =
+  "GET /websockify HTTP/1.1\r\n"
+  "Host: localhost\r\n"
+  "Origin: https://localhost\r\n"
+  "Upgrade: websocket\r\n"
+  "Connection: Upgrade\r\n"
+  "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+  "Sec-WebSocket-Version: 13\r\n"
+  "Sec-WebSocket-Protocol: binary\r\n"
+  "\r\n";
+
+/* a self-signed RSA key and certificate like the one droidvncserver uses */
+static int writeCert(const char *path)
+{
+  EVP_PKEY_CTX *kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+  EVP_PKEY *key = NULL;
+  X509 *cert = X509_new();
+  X509_NAME *name;
+  FILE *f;
+  int ok = 0;
+
+  if (kctx == NULL || cert == NULL || EVP_PKEY_keygen_init(kctx) <= 0 ||
+      EVP_PKEY_CTX_set_rsa_keygen_bits(kctx, 2048) <= 0 ||
+      EVP_PKEY_keygen(kctx, &key) <= 0)
+    goto done;
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+  X509_gmtime_adj(X509_get_notBefore(cert), 0);
+  X509_gmtime_adj(X509_get_notAfter(cert), 24 * 60 * 60);
+  X509_set_pubkey(cert, key);
+  name = X509_get_subject_name(cert);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                             (const unsigned char *)"localhost", -1, -1, 0);
+  X509_set_issuer_name(cert, name);
+  if (!X509_sign(cert, key, EVP_sha256()) || (f = fopen(path, "w")) == NULL)
+    goto done;
+  ok = PEM_write_PrivateKey(f, key, NULL, NULL, 0, NULL, NULL) &&
+       PEM_write_X509(f, cert);
+  fclose(f);
+
+done:
+  EVP_PKEY_free(key);
+  EVP_PKEY_CTX_free(kctx);
+  X509_free(cert);
+  return ok;
+}
+
+/* Connects n times and writes how many sessions were resumed to out. */
+static void viewer(struct sockaddr_in *addr, int n, int resume, int out)
+{
+  SSL_CTX *ctx = SSL_CTX_new(SSLv23_client_method());
+  SSL_SESSION *session = NULL;
+  char buf[4096];
+  int i, fd, len, r, resumed = 0;
+  SSL *ssl;
+
+  for (i = 0; i < n; i++) {
+    fd = connectTo(addr);
+    ssl = SSL_new(ctx);
+    SSL_set_fd(ssl, fd);
+    if (session != NULL)
+      SSL_set_session(ssl, session);
+    if (SSL_connect(ssl) != 1 ||
+        SSL_write(ssl, request, sizeof(request) - 1) != sizeof(request) - 1)
+      _exit(1);
+    /* the 101 response, then the RFB version in a binary frame */
+    for (len = 0; len < (int)sizeof(buf) - 1; len += r) {
+      if ((r = SSL_read(ssl, buf + len, sizeof(buf) - 1 - len)) <= 0)
+        _exit(1);
+      buf[len + r] = 0;
+      if (strstr(buf, "\r\n\r\n") != NULL &&
+          memmem(buf, len + r, "RFB 00", 6) != NULL)
+        break;
+    }
+    if (SSL_session_reused(ssl))
+      resumed++;
+    if (resume) {
+      if (session != NULL)
+        SSL_SESSION_free(session);
+      session = SSL_get1_session(ssl);
+    }
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    close(fd);
+  }
+  if (write(out, &resumed, sizeof(resumed)) != sizeof(resumed))
+    _exit(1);
+  _exit(0);
+}
+
+/* byte k of what the slow viewer is sent */
+static unsigned char slowByte(long k)
+{
+  return k % 251;
+}
+
+static void sslReadExact(SSL *ssl, unsigned char *buf, int len)
+{
+  int r;
+
+  for (; len > 0; buf += r, len -= r)
+    if ((r = SSL_read(ssl, buf, len)) <= 0)
+      _exit(1);
+}
+
+/* Goes through the handshakes, tells ready, stops reading for a while and
+   then reads the SLOW_BYTES the server writes in WebSockets frames. */
+static void slowViewer(struct sockaddr_in *addr, int ready)
+{
+  SSL_CTX *ctx = SSL_CTX_new(SSLv23_client_method());
+  unsigned char buf[SLOW_CHUNK], *end;
+  int fd = socket(AF_INET, SOCK_STREAM, 0), size = SLOW_BUF_SIZE, len, r;
+  long got, frame, k;
+  SSL *ssl;
+
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  if (connect(fd, (struct sockaddr *)addr, sizeof(*addr)) < 0)
+    _exit(1);
+  ssl = SSL_new(ctx);
+  SSL_set_fd(ssl, fd);
+  if (SSL_connect(ssl) != 1 ||
+      SSL_write(ssl, request, sizeof(request) - 1) != sizeof(request) - 1)
+    _exit(1);
+  /* the 101 response, then the RFB version in a frame of 14 bytes */
+  for (len = 0; (end = memmem(buf, len, "\r\n\r\n", 4)) == NULL ||
+                buf + len < end + 4 + 14; len += r)
+    if ((r = SSL_read(ssl, buf + len, sizeof(buf) - len)) <= 0)
+      _exit(1);
+  if (write(ready, "", 1) != 1)
+    _exit(1);
+  usleep(SLOW_PAUSE_MS * 1000);
+
+  for (got = 0; got < SLOW_BYTES; got += frame) {
+    sslReadExact(ssl, buf, 2);
+    if (buf[0] != 0x82)
+      _exit(1);
+    frame = buf[1] & 0x7f;
+    if (frame == 126) {
+      sslReadExact(ssl, buf, 2);
+      frame = buf[0] << 8 | buf[1];
+    } else if (frame == 127) {
+      _exit(1);
+    }
+    sslReadExact(ssl, buf, frame);
+    for (k = 0; k < frame; k++)
+      if (buf[k] != slowByte(got + k))
+        _exit(1);
+  }
+  _exit(0);
+}
+
+/* Writes SLOW_BYTES to a viewer that is not reading them yet; FALSE if it
+   held up the server or didn't get them all. */
+static rfbBool slowRun(rfbScreenInfoPtr screen, int listener,
+                       struct sockaddr_in *addr)
+{
+  static char chunk[SLOW_CHUNK];
+  rfbClientPtr cl = NULL;
+  struct pollfd pfd;
+  int ready[2], fd, size = SLOW_BUF_SIZE, status, failed = 0, peak;
+  long sent, k;
+  double t, slowest = 0;
+  pid_t pid;
+  char c;
+
+  if (pipe(ready) < 0) {
+    perror("pipe");
+    exit(1);
+  }
+  fflush(stdout);
+  if ((pid = fork()) == 0) {
+    close(listener);
+    slowViewer(addr, ready[1]);
+  }
+  close(ready[1]);
+
+  pfd.fd = ready[0];
+  pfd.events = POLLIN;
+  while (poll(&pfd, 1, 0) == 0) {
+    while ((fd = accept(listener, NULL, NULL)) >= 0) {
+      setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+      cl = rfbNewClient(screen, fd);
+    }
+    rfbProcessEvents(screen, 10000);
+  }
+  if (read(ready[0], &c, 1) != 1 || cl == NULL) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    printf("slow viewer didn't connect  FAILED\n");
+    return FALSE;
+  }
+  close(ready[0]);
+
+  /* past the handshakes, it takes anything now */
+  cl->state = RFB_NORMAL;
+  for (sent = 0; sent < SLOW_BYTES; sent += SLOW_CHUNK) {
+    for (k = 0; k < SLOW_CHUNK; k++)
+      chunk[k] = slowByte(sent + k);
+    t = now();
+    if (rfbWriteExact(cl, chunk, SLOW_CHUNK) < 0)
+      failed = 1;
+    rfbProcessEvents(screen, 0);
+    t = now() - t;
+    if (t > slowest)
+      slowest = t;
+  }
+  peak = cl->outQueuePeak;
+
+  while (waitpid(pid, &status, WNOHANG) == 0) {
+    t = now();
+    rfbProcessEvents(screen, 10000);
+    t = now() - t;
+    if (t > slowest)
+      slowest = t;
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    failed = 1;
+
+  printf("slow    %4d KB queued at most          slowest call %6.1f ms",
+         peak / 1024, slowest);
+  if (failed)
+    printf("  FAILED");
+  if (slowest > MAX_CALL_MS) {
+    printf("  BLOCKED");
+    failed = 1;
+  }
+  printf("\n");
+  return !failed;
+}
+
+/* Runs viewers viewers of n connections each; FALSE if one failed. */
+static rfbBool run(rfbScreenInfoPtr screen, int listener,
+                   struct sockaddr_in *addr, int viewers, int n, int resume)
+{
+  int pipes[2], running = viewers, failed = 0, resumed = 0, i, r, fd, status;
+  double start = now(), t, slowest = 0;
+
+  if (pipe(pipes) < 0) {
+    perror("pipe");
+    exit(1);
+  }
+  fflush(stdout);
+  for (i = 0; i < viewers; i++)
+    if (fork() == 0) {
+      close(listener);
+      viewer(addr, n, resume, pipes[1]);
+    }
+  close(pipes[1]);
+
+  while (running > 0) {
+    while ((fd = accept(listener, NULL, NULL)) >= 0)
+      if (rfbNewClient(screen, fd) == NULL)
+        failed = 1;
+    t = now();
+    rfbProcessEvents(screen, 10000);
+    t = now() - t;
+    if (t > slowest)
+      slowest = t;
+    while (running > 0 && waitpid(-1, &status, WNOHANG) > 0) {
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        failed = 1;
+      running--;
+    }
+  }
+  t = now() - start;
+  while (read(pipes[0], &r, sizeof(r)) == sizeof(r))
+    resumed += r;
+  close(pipes[0]);
+
+  printf("%-7s %4d handshakes  %7.1f/s  %4d resumed  slowest call %6.1f ms",
+         resume ? "resumed" : "full", viewers * n, viewers * n * 1e3 / t,
+         resumed, slowest);
+  if (failed)
+    printf("  FAILED");
+  if (slowest > MAX_CALL_MS) {
+    printf("  BLOCKED");
+    failed = 1;
+  }
+  /* only the first connection of each viewer has nothing to resume */
+  if (resume && resumed < viewers * (n - 1)) {
+    printf("  NOT RESUMED");
+    failed = 1;
+  }
+  printf("\n");
+  return !failed;
+}
+
+int main(int argc, char **argv)
+{
+  int n = argc > 1 ? atoi(argv[1]) : 50;
+  int viewers = argc > 2 ? atoi(argv[2]) : 4;
+  rfbScreenInfoPtr screen;
+  rfbClientIteratorPtr i;
+  rfbClientPtr cl;
+  struct sockaddr_in addr;
+  int listener, stall, fakeArgc = 1, stalled = 0, failed = 0;
+  pid_t staller;
+
+  SSL_library_init();
+  if (!writeCert(CERT_FILE)) {
+    fprintf(stderr, "could not write %s\n", CERT_FILE);
+    return 1;
+  }
+
+  rfbLogEnable(0);
+  screen = rfbGetScreen(&fakeArgc, argv, 64, 64, 8, 3, 4);
+  screen->frameBuffer = calloc(64 * 64, 4);
+  screen->port = 0;
+  screen->ipv6port = 0;
+  screen->sslcertfile = CERT_FILE;
+  rfbInitServer(screen);
+
+  listener = listenLoopback(&addr, 64);
+  fcntl(listener, F_SETFL, O_NONBLOCK);
+
+  /* the staller sends a TLS record header and nothing of the record */
+  fflush(stdout);
+  if ((staller = fork()) == 0) {
+    stall = connectTo(&addr);
+    if (write(stall, "\x16\x03\x01\x02\x00", 5) != 5)
+      _exit(1);
+    pause();
+    _exit(0);
+  }
+  while ((stall = accept(listener, NULL, NULL)) < 0)
+    usleep(1000);
+  if (rfbNewClient(screen, stall) == NULL)
+    failed = 1;
+
+  printf("%d viewers, %d connections each\n", viewers, n);
+  failed |= !run(screen, listener, &addr, viewers, n, FALSE);
+  failed |= !run(screen, listener, &addr, viewers, n, TRUE);
+
+  i = rfbGetClientIterator(screen);
+  while ((cl = rfbClientIteratorNext(i)) != NULL)
+    if (cl->state == RFB_TLS_HANDSHAKE)
+      stalled++;
+  rfbReleaseClientIterator(i);
+  if (stalled != 1) {
+    printf("stalled viewer gone\n");
+    failed = 1;
+  }
+
+  screen->maxClientQueue = SLOW_BYTES;
+  failed |= !slowRun(screen, listener, &addr);
+
+  kill(staller, SIGTERM);
+  waitpid(staller, NULL, 0);
+  close(listener);
+  free(screen->frameBuffer);
+  rfbScreenCleanup(screen);
+  unlink(CERT_FILE);
+  printf("%s\n", failed ? "FAILED" : "ok");
+  return failed;
+}
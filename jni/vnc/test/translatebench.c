@@ -0,0 +1,133 @@
+/*
+droid VNC server  - a vnc server for android
+Copyright (C) 2011 Jose Pereira <onaips@gmail.com>
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Pixel translation benchmark: for each pair of server and client format,
+ * translates a random frame with the red, green and blue lookup tables and
+ * with the SIMD shift translators rfbSetTranslateFunction() picks instead
+ * when rfbShiftTranslate is set. Both must give the same pixels; ms/frame
+ * is printed for each. 16bpp servers use those tables, and so the shifts,
+ * only with rfbEconomicTranslate; otherwise they have a single table.
+ *
+ *   translatebench [frames]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rfb/rfb.h>
+
+#include "harness.h"
+
+/* odd, so that every row ends in a partial vector */
+#define WIDTH 477
+#define HEIGHT 800
+#define STRIDE 480
+
+typedef struct {
+  const char *name;
+  rfbPixelFormat pf;
+} format;
+
+/* bitsPerPixel, depth, bigEndian, trueColour, max r g b, shift r g b */
+static const format formats[] = {
+  { "RGBA8888", { 32, 24, 0, 1, 255, 255, 255,  0, 8, 16, 0, 0 } },
+  { "BGRA8888", { 32, 24, 0, 1, 255, 255, 255, 16, 8,  0, 0, 0 } },
+  { "RGB565",   { 16, 16, 0, 1,  31,  63,  31, 11, 5,  0, 0, 0 } },
+  { "BGR233",   {  8,  8, 0, 1,   7,   7,   3,  0, 3,  6, 0, 0 } },
+};
+
+/* server format -> client format */
+static const int pairs[][2] = {
+  { 0, 2 }, { 0, 1 }, { 0, 3 },
+  { 2, 0 }, { 2, 1 }, { 2, 3 },
+};
+
+static rfbBool setFormat(rfbClientRec *cl, int shift)
+{
+  rfbShiftTranslate = shift;
+  return rfbSetTranslateFunction(cl);
+}
+
+static double translate(rfbClientRec *cl, char *in, char *out, int frames)
+{
+  int bpp = cl->screen->serverFormat.bitsPerPixel / 8;
+  double t = now();
+  int i;
+
+  for (i = 0; i < frames; i++)
+    cl->translateFn(cl->translateLookupTable, &cl->screen->serverFormat,
+                    &cl->format, in, out, STRIDE * bpp, WIDTH, HEIGHT);
+  return (now() - t) / frames;
+}
+
+int main(int argc, char **argv)
+{
+  int frames = argc > 1 ? atoi(argv[1]) : 50;
+  rfbScreenInfo screen;
+  rfbClientRec cl;
+  char *in = malloc(STRIDE * HEIGHT * 4);
+  char *ref = malloc(WIDTH * HEIGHT * 4), *out = malloc(WIDTH * HEIGHT * 4);
+  double tables, shifts;
+  int i, failed = 0;
+
+  if (in == NULL || ref == NULL || out == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  srand(1);
+  for (i = 0; i < STRIDE * HEIGHT * 4; i++)
+    in[i] = rand() >> 4;
+
+  rfbLogEnable(0);
+  rfbEconomicTranslate = TRUE;
+  memset(&screen, 0, sizeof(screen));
+  memset(&cl, 0, sizeof(cl));
+  cl.screen = &screen;
+  cl.host = "translatebench";
+
+  printf("%dx%d, %d frames\n", WIDTH, HEIGHT, frames);
+  for (i = 0; i < (int)(sizeof(pairs) / sizeof(pairs[0])); i++) {
+    const format *s = &formats[pairs[i][0]], *c = &formats[pairs[i][1]];
+    int size = WIDTH * HEIGHT * c->pf.bitsPerPixel / 8;
+
+    screen.serverFormat = s->pf;
+    cl.format = c->pf;
+    if (!setFormat(&cl, FALSE))
+      return 1;
+    tables = translate(&cl, in, ref, frames);
+
+    printf("%-8s -> %-8s  tables %7.3f ms", s->name, c->name, tables);
+    if (!setFormat(&cl, TRUE))
+      return 1;
+    memset(out, 0, size);
+    shifts = translate(&cl, in, out, frames);
+    printf("  shifts %7.3f ms  %5.2fx", shifts, tables / shifts);
+    if (memcmp(ref, out, size) != 0) {
+      printf("  MISMATCH");
+      failed = 1;
+    }
+    printf("\n");
+  }
+
+  free(cl.translateLookupTable);
+  printf("%s\n", failed ? "FAILED" : "ok");
+  return failed;
+}
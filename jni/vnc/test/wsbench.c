@@ -0,0 +1,247 @@
+/*
+droid VNC server  - a vnc server for android
+Copyright (C) 2011 Jose Pereira <onaips@gmail.com>
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * WebSockets throughput benchmark: the server writes update-sized buffers
+ * and some bigger ones to a viewer in a child process over loopback, once
+ * over plain TCP, once in binary WebSockets frames and once in base64 text
+ * frames as legacy clients take them. The viewer unframes and decodes what
+ * it gets and checks it against what was written. Prints megabytes per
+ * second, the bytes on the wire per byte written and the CPU time the
+ * server spent per megabyte.
+ *
+ *   wsbench [megabytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <rfb/rfb.h>
+
+#include "harness.h"
+
+/* every fourth write is this big, as raw rectangles and cut text can be */
+#define BIG_WRITE (256 * 1024)
+
+enum { TCP, BINARY, BASE64 };
+static const char *modes[] = { "tcp", "binary", "base64" };
+
+static const char request[] =
+  "GET /websockify HTTP/1.1\r\n"
+  "Host: localhost\r\n"
+  "Origin: http://localhost\r\n"
+  "Upgrade: websocket\r\n"
+  "Connection: Upgrade\r\n"
+  "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+  "Sec-WebSocket-Version: 13\r\n"
+  "Sec-WebSocket-Protocol: %s\r\n"
+  "\r\n";
+
+static int base64Value(unsigned char c)
+{
+  if (c >= 'A' && c <= 'Z')
+    return c - 'A';
+  if (c >= 'a' && c <= 'z')
+    return c - 'a' + 26;
+  if (c >= '0' && c <= '9')
+    return c - '0' + 52;
+  return c == '+' ? 62 : c == '/' ? 63 : -1;
+}
+
+/* Decodes len base64 characters in place; returns the bytes decoded. */
+static int base64Decode(unsigned char *buf, int len)
+{
+  int i, v, bits = 0, out = 0;
+  unsigned int acc = 0;
+
+  for (i = 0; i < len && buf[i] != '='; i++) {
+    if ((v = base64Value(buf[i])) < 0)
+      _exit(1);
+    acc = (acc << 6) | v;
+    if ((bits += 6) >= 8) {
+      bits -= 8;
+      buf[out++] = acc >> bits;
+    }
+  }
+  return out;
+}
+
+/* Reads total bytes of the stream after the protocol version and checks
+   them against the pattern they were written with; exits 1 if they differ,
+   or writes how many bytes it read off the socket to out. */
+static void viewer(struct sockaddr_in *addr, int mode, long total, int out)
+{
+  static unsigned char buf[1024 * 1024];
+  unsigned char h[8];
+  char req[512];
+  long got = -12, wire = 0, len;
+  int fd = connectTo(addr), n, i;
+
+  if (mode != TCP) {
+    n = snprintf(req, sizeof(req), request,
+                 mode == BINARY ? "binary" : "base64");
+    if (write(fd, req, n) != n)
+      _exit(1);
+    /* the 101 response ends with an empty line */
+    for (n = 0; n < 4 || memcmp(buf + n - 4, "\r\n\r\n", 4) != 0; n++)
+      readExact(fd, buf + n, 1);
+  }
+
+  while (got < total) {
+    if (mode == TCP) {
+      len = total - got < (long)sizeof(buf) ? total - got : (long)sizeof(buf);
+      if ((len = read(fd, buf, len)) <= 0)
+        _exit(1);
+      wire += len;
+    } else {
+      readExact(fd, h, 2);
+      wire += 2;
+      if ((h[0] & 0x0f) != (mode == BINARY ? 2 : 1) || (h[1] & 0x80))
+        _exit(1);
+      len = h[1];
+      if (len == 126) {
+        readExact(fd, h, 2);
+        wire += 2;
+        len = (h[0] << 8) | h[1];
+      } else if (len == 127) {
+        readExact(fd, h, 8);
+        wire += 8;
+        for (len = 0, i = 0; i < 8; i++)
+          len = (len << 8) | h[i];
+      }
+      if (len > (long)sizeof(buf))
+        _exit(1);
+      readExact(fd, buf, len);
+      wire += len;
+      if (mode == BASE64)
+        len = base64Decode(buf, len);
+    }
+    for (i = 0; i < len; i++, got++)
+      if (got >= 0 && buf[i] != (unsigned char)(got % 251))
+        _exit(1);
+  }
+  close(fd);
+  if (write(out, &wire, sizeof(wire)) != sizeof(wire))
+    _exit(1);
+  _exit(0);
+}
+
+/* Writes about megabytes MB to a viewer over mode; FALSE if it failed. */
+static rfbBool run(rfbScreenInfoPtr screen, int listener,
+                   struct sockaddr_in *addr, int mode, int megabytes)
+{
+  static char data[BIG_WRITE + 251];
+  long total = 0, wire = 0, n;
+  int pipes[2], fd, i, status, failed = 0;
+  double start, t, cpu;
+  rfbClientPtr cl;
+  pid_t pid;
+  socklen_t len;
+  struct sockaddr_in peer;
+
+  for (i = 0; i < (int)sizeof(data); i++)
+    data[i] = i % 251;
+  for (i = 0; total < megabytes * 1024L * 1024; i++)
+    total += i % 4 == 3 ? BIG_WRITE : UPDATE_BUF_SIZE;
+
+  if (pipe(pipes) < 0) {
+    perror("pipe");
+    exit(1);
+  }
+  fflush(stdout);
+  if ((pid = fork()) == 0) {
+    close(listener);
+    viewer(addr, mode, total, pipes[1]);
+  }
+  close(pipes[1]);
+  len = sizeof(peer);
+  if ((fd = accept(listener, (struct sockaddr *)&peer, &len)) < 0 ||
+      (cl = rfbNewClient(screen, fd)) == NULL) {
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(pipes[0]);
+    return FALSE;
+  }
+
+  start = now();
+  cpu = cpuTime();
+  for (i = 0, n = 0; n < total; i++) {
+    /* each write goes on with the pattern from where the last one ended */
+    int size = i % 4 == 3 ? BIG_WRITE : UPDATE_BUF_SIZE;
+    if (rfbWriteExact(cl, data + n % 251, size) < 0) {
+      failed = 1;
+      break;
+    }
+    n += size;
+  }
+  cpu = cpuTime() - cpu;
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0)
+    failed = 1;
+  t = now() - start;
+  /* the protocol version comes before what was written */
+  if (read(pipes[0], &wire, sizeof(wire)) != sizeof(wire))
+    failed = 1;
+  close(pipes[0]);
+
+  printf("%-7s %6.1f MB/s  %4.2f wire bytes/byte  %5.2f ms CPU/MB",
+         modes[mode], total / 1048576.0 * 1e3 / t, (double)wire / total,
+         cpu / (total / 1048576.0));
+  if (failed)
+    printf("  FAILED");
+  printf("\n");
+
+  rfbCloseClient(cl);
+  rfbClientConnectionGone(cl);
+  return !failed;
+}
+
+int main(int argc, char **argv)
+{
+  int megabytes = argc > 1 ? atoi(argv[1]) : 256;
+  rfbScreenInfoPtr screen;
+  struct sockaddr_in addr;
+  int listener, mode, fakeArgc = 1, failed = 0;
+
+  rfbLogEnable(0);
+  screen = rfbGetScreen(&fakeArgc, argv, 64, 64, 8, 3, 4);
+  screen->frameBuffer = calloc(64 * 64, 4);
+  screen->port = 0;
+  screen->ipv6port = 0;
+  rfbInitServer(screen);
+
+  listener = listenLoopback(&addr, 4);
+
+  printf("%d MB each\n", megabytes);
+  for (mode = TCP; mode <= BASE64; mode++)
+    failed |= !run(screen, listener, &addr, mode, megabytes);
+
+  close(listener);
+  free(screen->frameBuffer);
+  rfbScreenCleanup(screen);
+  printf("%s\n", failed ? "FAILED" : "ok");
+  return failed;
+}
@@ -0,0 +1,878 @@
+/*
+droid VNC server  - a vnc server for android
+Copyright (C) 2011 Jose Pereira <onaips@gmail.com>
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+//this file implements the tiled frame diff used by update_screen
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>  /* CRC32C, used only after checking the cpu */
+#endif
+
+#include "tileDiff.h"
+
+#ifdef DVNC_HAVE_NEON
+int tileCmpCopyNEON(uint8_t *dst, int dstStride,
+                    const uint8_t *src, int srcStride,
+                    int rowBytes, int rows);
+void tileTranspose16NEON(uint8_t *dst, int dstStride,
+                         const uint8_t *src, int dx, int dy, int w, int h);
+void tileTranspose32NEON(uint8_t *dst, int dstStride,
+                         const uint8_t *src, int dx, int dy, int w, int h);
+void tileReverse16NEON(uint8_t *dst, int dstStride,
+                       const uint8_t *src, int dx, int dy, int w, int h);
+void tileReverse32NEON(uint8_t *dst, int dstStride,
+                       const uint8_t *src, int dx, int dy, int w, int h);
+#endif
+
+void tileCopyRows(uint8_t *dst, int dstStride,
+                  const uint8_t *src, int srcStride,
+                  int rowBytes, int rows)
+{
+  while (rows--) {
+    memcpy(dst, src, rowBytes);
+    dst += dstStride;
+    src += srcStride;
+  }
+}
+
+static int tileCmpCopyC(uint8_t *dst, int dstStride,
+                        const uint8_t *src, int srcStride,
+                        int rowBytes, int rows)
+{
+  int r;
+
+  for (r = 0; r < rows; r++) {
+    if (memcmp(dst, src, rowBytes) != 0) {
+      tileCopyRows(dst, dstStride, src, srcStride, rowBytes, rows - r);
+      return 1;
+    }
+    dst += dstStride;
+    src += srcStride;
+  }
+  return 0;
+}
+
+#ifdef __SSE2__
+static int tileCmpCopySSE2(uint8_t *dst, int dstStride,
+                           const uint8_t *src, int srcStride,
+                           int rowBytes, int rows)
+{
+  int r, i;
+  __m128i acc, zero = _mm_setzero_si128();
+
+  for (r = 0; r < rows; r++) {
+    acc = zero;
+    for (i = 0; i + 16 <= rowBytes; i += 16)
+      acc = _mm_or_si128(acc,
+        _mm_xor_si128(_mm_loadu_si128((const __m128i *)(dst + i)),
+                      _mm_loadu_si128((const __m128i *)(src + i))));
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF ||
+        (i < rowBytes && memcmp(dst + i, src + i, rowBytes - i) != 0)) {
+      tileCopyRows(dst, dstStride, src, srcStride, rowBytes, rows - r);
+      return 1;
+    }
+    dst += dstStride;
+    src += srcStride;
+  }
+  return 0;
+}
+#endif
+
+/* Scalar gather for any orientation: pixel (x,y) of the tile is
+   src[x*dx + y*dy], dx and dy in pixels. */
+#define TILE_GATHER(T)                                                    \
+void tileGather_##T(uint8_t *dst, int dstStride,                         \
+                    const uint8_t *src, int dx, int dy, int w, int h)    \
+{                                                                         \
+  int i, j;                                                               \
+  for (j = 0; j < h; j++) {                                               \
+    T *d = (T *)(dst + (ptrdiff_t)j * dstStride);                         \
+    const T *s = (const T *)src + (ptrdiff_t)j * dy;                      \
+    for (i = 0; i < w; i++, s += dx)                                      \
+      d[i] = *s;                                                          \
+  }                                                                       \
+}
+
+TILE_GATHER(uint8_t)
+TILE_GATHER(uint16_t)
+TILE_GATHER(uint32_t)
+
+#ifdef __SSE2__
+/*
+ * 90/270 degrees: tile row y is a source column, so transpose the source in
+ * 4x4 (32bpp) or 8x8 (16bpp) blocks held in registers. Source rows are dx
+ * pixels apart and dy (+1 or -1) walks along them; with dy == -1 each block
+ * is loaded from its low end and written out bottom-up.
+ */
+static void tileTranspose32SSE2(uint8_t *dst, int dstStride,
+                                const uint8_t *src, int dx, int dy, int w, int h)
+{
+  const uint32_t *s = (const uint32_t *)src;
+  int w4 = w & ~3, h4 = h & ~3, x, y, k;
+  __m128i r[4], t0, t1, t2, t3;
+
+  for (y = 0; y < h4; y += 4) {
+    for (x = 0; x < w4; x += 4) {
+      for (k = 0; k < 4; k++)
+        r[k] = _mm_loadu_si128((const __m128i *)
+          (s + (ptrdiff_t)(x + k) * dx + (dy > 0 ? y : -y - 3)));
+
+      t0 = _mm_unpacklo_epi32(r[0], r[1]);
+      t1 = _mm_unpacklo_epi32(r[2], r[3]);
+      t2 = _mm_unpackhi_epi32(r[0], r[1]);
+      t3 = _mm_unpackhi_epi32(r[2], r[3]);
+      r[0] = _mm_unpacklo_epi64(t0, t1);
+      r[1] = _mm_unpackhi_epi64(t0, t1);
+      r[2] = _mm_unpacklo_epi64(t2, t3);
+      r[3] = _mm_unpackhi_epi64(t2, t3);
+
+      for (k = 0; k < 4; k++)
+        _mm_storeu_si128((__m128i *)(dst + (ptrdiff_t)(dy > 0 ? y + k : y + 3 - k) * dstStride
+                                     + x * 4), r[k]);
+    }
+  }
+  if (w4 < w)
+    tileGather_uint32_t(dst + w4 * 4, dstStride, (const uint8_t *)(s + (ptrdiff_t)w4 * dx),
+                        dx, dy, w - w4, h);
+  if (h4 < h)
+    tileGather_uint32_t(dst + (ptrdiff_t)h4 * dstStride, dstStride,
+                        (const uint8_t *)(s + (ptrdiff_t)h4 * dy), dx, dy, w4, h - h4);
+}
+
+static void tileTranspose16SSE2(uint8_t *dst, int dstStride,
+                                const uint8_t *src, int dx, int dy, int w, int h)
+{
+  const uint16_t *s = (const uint16_t *)src;
+  int w8 = w & ~7, h8 = h & ~7, x, y, k;
+  __m128i r[8], a0, a1, a2, a3, a4, a5, a6, a7, b0, b1, b2, b3, b4, b5, b6, b7;
+
+  for (y = 0; y < h8; y += 8) {
+    for (x = 0; x < w8; x += 8) {
+      for (k = 0; k < 8; k++)
+        r[k] = _mm_loadu_si128((const __m128i *)
+          (s + (ptrdiff_t)(x + k) * dx + (dy > 0 ? y : -y - 7)));
+
+      a0 = _mm_unpacklo_epi16(r[0], r[1]);
+      a1 = _mm_unpackhi_epi16(r[0], r[1]);
+      a2 = _mm_unpacklo_epi16(r[2], r[3]);
+      a3 = _mm_unpackhi_epi16(r[2], r[3]);
+      a4 = _mm_unpacklo_epi16(r[4], r[5]);
+      a5 = _mm_unpackhi_epi16(r[4], r[5]);
+      a6 = _mm_unpacklo_epi16(r[6], r[7]);
+      a7 = _mm_unpackhi_epi16(r[6], r[7]);
+
+      b0 = _mm_unpacklo_epi32(a0, a2);
+      b1 = _mm_unpackhi_epi32(a0, a2);
+      b2 = _mm_unpacklo_epi32(a1, a3);
+      b3 = _mm_unpackhi_epi32(a1, a3);
+      b4 = _mm_unpacklo_epi32(a4, a6);
+      b5 = _mm_unpackhi_epi32(a4, a6);
+      b6 = _mm_unpacklo_epi32(a5, a7);
+      b7 = _mm_unpackhi_epi32(a5, a7);
+
+      r[0] = _mm_unpacklo_epi64(b0, b4);
+      r[1] = _mm_unpackhi_epi64(b0, b4);
+      r[2] = _mm_unpacklo_epi64(b1, b5);
+      r[3] = _mm_unpackhi_epi64(b1, b5);
+      r[4] = _mm_unpacklo_epi64(b2, b6);
+      r[5] = _mm_unpackhi_epi64(b2, b6);
+      r[6] = _mm_unpacklo_epi64(b3, b7);
+      r[7] = _mm_unpackhi_epi64(b3, b7);
+
+      for (k = 0; k < 8; k++)
+        _mm_storeu_si128((__m128i *)(dst + (ptrdiff_t)(dy > 0 ? y + k : y + 7 - k) * dstStride
+                                     + x * 2), r[k]);
+    }
+  }
+  if (w8 < w)
+    tileGather_uint16_t(dst + w8 * 2, dstStride, (const uint8_t *)(s + (ptrdiff_t)w8 * dx),
+                        dx, dy, w - w8, h);
+  if (h8 < h)
+    tileGather_uint16_t(dst + (ptrdiff_t)h8 * dstStride, dstStride,
+                        (const uint8_t *)(s + (ptrdiff_t)h8 * dy), dx, dy, w8, h - h8);
+}
+
+/* 180 degrees: rows stay rows but run backwards (dx == -1). */
+static void tileReverse32SSE2(uint8_t *dst, int dstStride,
+                              const uint8_t *src, int dx, int dy, int w, int h)
+{
+  int w4 = w & ~3, x, y;
+
+  for (y = 0; y < h; y++) {
+    const uint32_t *s = (const uint32_t *)src + (ptrdiff_t)y * dy;
+    uint32_t *d = (uint32_t *)(dst + (ptrdiff_t)y * dstStride);
+
+    for (x = 0; x < w4; x += 4)
+      _mm_storeu_si128((__m128i *)(d + x), _mm_shuffle_epi32(
+        _mm_loadu_si128((const __m128i *)(s - x - 3)), 0x1B));
+    for (; x < w; x++)
+      d[x] = s[-x];
+  }
+}
+
+static void tileReverse16SSE2(uint8_t *dst, int dstStride,
+                              const uint8_t *src, int dx, int dy, int w, int h)
+{
+  int w8 = w & ~7, x, y;
+  __m128i v;
+
+  for (y = 0; y < h; y++) {
+    const uint16_t *s = (const uint16_t *)src + (ptrdiff_t)y * dy;
+    uint16_t *d = (uint16_t *)(dst + (ptrdiff_t)y * dstStride);
+
+    for (x = 0; x < w8; x += 8) {
+      v = _mm_loadu_si128((const __m128i *)(s - x - 7));
+      v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0x1B), 0x1B);
+      _mm_storeu_si128((__m128i *)(d + x), _mm_shuffle_epi32(v, 0x4E));
+    }
+    for (; x < w; x++)
+      d[x] = s[-x];
+  }
+}
+#endif
+
+struct tileDiffKernel {
+  const char *name;
+  tileCmpCopyFn cmpCopy;
+  /* rotation kernels for 16 and 32bpp, NULL falls back to tileGather_* */
+  tileGatherFn transpose16, transpose32;
+  tileGatherFn reverse16, reverse32;
+};
+
+static const struct tileDiffKernel kernels[] = {
+#ifdef DVNC_HAVE_NEON
+  { "neon", tileCmpCopyNEON,
+    tileTranspose16NEON, tileTranspose32NEON,
+    tileReverse16NEON, tileReverse32NEON },
+#endif
+#ifdef __SSE2__
+  { "sse2", tileCmpCopySSE2,
+    tileTranspose16SSE2, tileTranspose32SSE2,
+    tileReverse16SSE2, tileReverse32SSE2 },
+#endif
+  { "c", tileCmpCopyC, NULL, NULL, NULL, NULL },
+};
+
+static const struct tileDiffKernel *kernel = &kernels[sizeof(kernels)/sizeof(kernels[0]) - 1];
+
+#ifdef DVNC_HAVE_NEON
+/* armeabi-v7a does not guarantee NEON, so ask the kernel before using it. */
+static int cpuHasNeon(void)
+{
+  char line[512];
+  int found = 0;
+  FILE *f = fopen("/proc/cpuinfo", "r");
+
+  if (f == NULL)
+    return 0;
+  while (!found && fgets(line, sizeof(line), f) != NULL)
+    if (strncmp(line, "Features", 8) == 0 && strstr(line, " neon") != NULL)
+      found = 1;
+  fclose(f);
+  return found;
+}
+#endif
+
+static int kernelUsable(const struct tileDiffKernel *k)
+{
+#ifdef DVNC_HAVE_NEON
+  if (k->cmpCopy == tileCmpCopyNEON)
+    return cpuHasNeon();
+#endif
+  return 1;
+}
+
+const char *initTileDiff(void)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(kernels)/sizeof(kernels[0]); i++)
+    if (kernelUsable(&kernels[i])) {
+      kernel = &kernels[i];
+      break;
+    }
+  tileHashUseKernel(NULL);
+  return kernel->name;
+}
+
+int tileDiffUseKernel(const char *name)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(kernels)/sizeof(kernels[0]); i++)
+    if (strcmp(kernels[i].name, name) == 0 && kernelUsable(&kernels[i])) {
+      kernel = &kernels[i];
+      return 0;
+    }
+  return -1;
+}
+
+const char *tileDiffKernelName(void)
+{
+  return kernel->name;
+}
+
+/* Picks how a rotated tile is straightened out, NULL if it needn't be. */
+static tileGatherFn pickGather(int srcDx, int srcDy, int bytesPerPixel)
+{
+  int transpose = srcDy == 1 || srcDy == -1;
+  tileGatherFn gather = NULL;
+
+  if (srcDx == 1)
+    return NULL;
+
+  switch (bytesPerPixel) {
+    case 2:
+      gather = transpose ? kernel->transpose16 :
+               srcDx == -1 ? kernel->reverse16 : NULL;
+      return gather ? gather : tileGather_uint16_t;
+    case 4:
+      gather = transpose ? kernel->transpose32 :
+               srcDx == -1 ? kernel->reverse32 : NULL;
+      return gather ? gather : tileGather_uint32_t;
+    default:
+      return tileGather_uint8_t;
+  }
+}
+
+int diffTiles(uint8_t *shadow, const uint8_t *src, int srcDx, int srcDy,
+              int width, int height, int bytesPerPixel, uint32_t *dirty)
+{
+  int n, tx, ty, t, count = 0;
+  int tilesX = TILES_X(width), tilesY = TILES_Y(height);
+  int shadowStride = width * bytesPerPixel;
+  int transpose = srcDy == 1 || srcDy == -1;
+  tileCmpCopyFn cmpCopy = kernel->cmpCopy;
+  /* pick the rotation kernel once for the whole frame */
+  tileGatherFn gather = pickGather(srcDx, srcDy, bytesPerPixel);
+  uint32_t scratch[TILE_SIZE * TILE_SIZE];
+
+  memset(dirty, 0, TILE_BITMAP_WORDS(width, height) * sizeof(uint32_t));
+
+  for (n = 0; n < tilesX * tilesY; n++) {
+    int x0, y0, tw, th, hit;
+    uint8_t *d;
+    const uint8_t *s;
+
+    /* A transposed tile column is a run of consecutive source rows, so walk
+       tiles column-major there to keep the source reads sequential. */
+    if (transpose) {
+      tx = n / tilesY;
+      ty = n % tilesY;
+    } else {
+      tx = n % tilesX;
+      ty = n / tilesX;
+    }
+    t = ty * tilesX + tx;
+    x0 = tx * TILE_SIZE;
+    y0 = ty * TILE_SIZE;
+    tw = width - x0 < TILE_SIZE ? width - x0 : TILE_SIZE;
+    th = height - y0 < TILE_SIZE ? height - y0 : TILE_SIZE;
+    d = shadow + (ptrdiff_t)y0 * shadowStride + x0 * bytesPerPixel;
+    s = src + ((ptrdiff_t)x0 * srcDx + (ptrdiff_t)y0 * srcDy) * bytesPerPixel;
+
+    if (gather == NULL) {
+      hit = cmpCopy(d, shadowStride, s, srcDy * bytesPerPixel,
+                    tw * bytesPerPixel, th);
+    } else {
+      /* straighten the tile out in L1 first, then compare it row-wise */
+      gather((uint8_t *)scratch, tw * bytesPerPixel, s, srcDx, srcDy, tw, th);
+      hit = cmpCopy(d, shadowStride, (const uint8_t *)scratch,
+                    tw * bytesPerPixel, tw * bytesPerPixel, th);
+    }
+
+    if (hit) {
+      dirty[t >> 5] |= 1u << (t & 31);
+      count++;
+    }
+  }
+  return count;
+}
+
+#define HASH_PRIME64 0x9E3779B97F4A7C15ull
+
+/* Mixes the lanes so every input bit reaches every output bit. */
+static uint64_t hashFinish(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDull;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ull;
+  return h ^ (h >> 33);
+}
+
+/* Two independent lanes so the multiplies don't wait on each other. */
+static uint64_t tileHashC(const uint8_t *src, int stride, int rowBytes, int rows)
+{
+  uint64_t h0 = 1, h1 = 2, w0, w1;
+  int r, i;
+
+  for (r = 0; r < rows; r++, src += stride) {
+    for (i = 0; i + 16 <= rowBytes; i += 16) {
+      memcpy(&w0, src + i, 8);
+      memcpy(&w1, src + i + 8, 8);
+      h0 = (h0 ^ w0) * HASH_PRIME64;
+      h1 = (h1 ^ w1) * HASH_PRIME64;
+    }
+    for (; i < rowBytes; i++)
+      h0 = (h0 ^ src[i]) * HASH_PRIME64;
+  }
+  return hashFinish(h0 ^ (h1 << 31 | h1 >> 33));
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* CRC32C in hardware, two lanes of 32 bits to fill the 64-bit signature. */
+__attribute__((target("sse4.2")))
+static uint64_t tileHashCRC32C(const uint8_t *src, int stride, int rowBytes, int rows)
+{
+  uint32_t c0 = 0xFFFFFFFF, c1 = 0x12345678;
+  int r, i;
+
+  for (r = 0; r < rows; r++, src += stride) {
+#ifdef __x86_64__
+    uint64_t w0, w1;
+    for (i = 0; i + 16 <= rowBytes; i += 16) {
+      memcpy(&w0, src + i, 8);
+      memcpy(&w1, src + i + 8, 8);
+      c0 = (uint32_t)_mm_crc32_u64(c0, w0);
+      c1 = (uint32_t)_mm_crc32_u64(c1, w1);
+    }
+#else
+    uint32_t w0, w1;
+    for (i = 0; i + 8 <= rowBytes; i += 8) {
+      memcpy(&w0, src + i, 4);
+      memcpy(&w1, src + i + 4, 4);
+      c0 = _mm_crc32_u32(c0, w0);
+      c1 = _mm_crc32_u32(c1, w1);
+    }
+#endif
+    for (; i < rowBytes; i++)
+      c0 = _mm_crc32_u8(c0, src[i]);
+  }
+  return (uint64_t)c0 << 32 | c1;
+}
+#endif
+
+static const struct {
+  const char *name;
+  tileHashFn hash;
+} hashKernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+  { "crc32c", tileHashCRC32C },
+#endif
+  { "c", tileHashC },
+};
+
+static tileHashFn hashKernel = tileHashC;
+static const char *hashKernelName = "c";
+
+static int hashKernelUsable(tileHashFn hash)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  if (hash == tileHashCRC32C)
+    return __builtin_cpu_supports("sse4.2");
+#endif
+  return 1;
+}
+
+int tileHashUseKernel(const char *name)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(hashKernels)/sizeof(hashKernels[0]); i++)
+    if ((name == NULL || strcmp(hashKernels[i].name, name) == 0) &&
+        hashKernelUsable(hashKernels[i].hash)) {
+      hashKernel = hashKernels[i].hash;
+      hashKernelName = hashKernels[i].name;
+      return 0;
+    }
+  return -1;
+}
+
+const char *tileHashKernelName(void)
+{
+  return hashKernelName;
+}
+
+int hashTiles(uint64_t *hashes, const uint8_t *src, int srcDx, int srcDy,
+              int width, int height, int bytesPerPixel, uint32_t *dirty)
+{
+  int n, tx, ty, t, count = 0;
+  int tilesX = TILES_X(width), tilesY = TILES_Y(height);
+  int transpose = srcDy == 1 || srcDy == -1;
+  tileGatherFn gather = pickGather(srcDx, srcDy, bytesPerPixel);
+  tileHashFn hash = hashKernel;
+  uint32_t scratch[TILE_SIZE * TILE_SIZE];
+  uint64_t h;
+
+  memset(dirty, 0, TILE_BITMAP_WORDS(width, height) * sizeof(uint32_t));
+
+  for (n = 0; n < tilesX * tilesY; n++) {
+    int x0, y0, tw, th;
+    const uint8_t *s;
+
+    /* same walk as diffTiles, column-major when transposing */
+    if (transpose) {
+      tx = n / tilesY;
+      ty = n % tilesY;
+    } else {
+      tx = n % tilesX;
+      ty = n / tilesX;
+    }
+    t = ty * tilesX + tx;
+    x0 = tx * TILE_SIZE;
+    y0 = ty * TILE_SIZE;
+    tw = width - x0 < TILE_SIZE ? width - x0 : TILE_SIZE;
+    th = height - y0 < TILE_SIZE ? height - y0 : TILE_SIZE;
+    s = src + ((ptrdiff_t)x0 * srcDx + (ptrdiff_t)y0 * srcDy) * bytesPerPixel;
+
+    if (gather == NULL) {
+      h = hash(s, srcDy * bytesPerPixel, tw * bytesPerPixel, th);
+    } else {
+      gather((uint8_t *)scratch, tw * bytesPerPixel, s, srcDx, srcDy, tw, th);
+      h = hash((const uint8_t *)scratch, tw * bytesPerPixel, tw * bytesPerPixel, th);
+    }
+
+    if (h != hashes[t]) {
+      hashes[t] = h;
+      dirty[t >> 5] |= 1u << (t & 31);
+      count++;
+    }
+  }
+  return count;
+}
+
+int verifyTiles(const uint8_t *shadow, const uint8_t *src, int srcDx, int srcDy,
+                int width, int height, int bytesPerPixel, uint32_t *dirty)
+{
+  int tx, ty, t = 0, r, count = 0;
+  int tilesX = TILES_X(width), tilesY = TILES_Y(height);
+  int shadowStride = width * bytesPerPixel;
+  tileGatherFn gather = pickGather(srcDx, srcDy, bytesPerPixel);
+  uint32_t scratch[TILE_SIZE * TILE_SIZE];
+
+  for (ty = 0; ty < tilesY; ty++) {
+    int y0 = ty * TILE_SIZE;
+    int th = height - y0 < TILE_SIZE ? height - y0 : TILE_SIZE;
+
+    for (tx = 0; tx < tilesX; tx++, t++) {
+      int x0 = tx * TILE_SIZE;
+      int tw = width - x0 < TILE_SIZE ? width - x0 : TILE_SIZE;
+      int rowBytes = tw * bytesPerPixel, stride = srcDy * bytesPerPixel;
+      const uint8_t *d = shadow + (ptrdiff_t)y0 * shadowStride + x0 * bytesPerPixel;
+      const uint8_t *s = src + ((ptrdiff_t)x0 * srcDx + (ptrdiff_t)y0 * srcDy) * bytesPerPixel;
+
+      if (TILE_IS_DIRTY(dirty, t))
+        continue;
+      if (gather != NULL) {
+        gather((uint8_t *)scratch, rowBytes, s, srcDx, srcDy, tw, th);
+        s = (const uint8_t *)scratch;
+        stride = rowBytes;
+      }
+      for (r = 0; r < th; r++)
+        if (memcmp(d + (ptrdiff_t)r * shadowStride, s + (ptrdiff_t)r * stride, rowBytes) != 0) {
+          dirty[t >> 5] |= 1u << (t & 31);
+          count++;
+          break;
+        }
+    }
+  }
+  return count;
+}
+
+size_t gatherDirtyTiles(uint8_t *dst, const uint8_t *src, int srcDx, int srcDy,
+                        int width, int height, int bytesPerPixel,
+                        const uint32_t *dirty)
+{
+  int tx, ty, t = 0;
+  int tilesX = TILES_X(width), tilesY = TILES_Y(height);
+  int stride = width * bytesPerPixel;
+  tileGatherFn gather = pickGather(srcDx, srcDy, bytesPerPixel);
+  size_t copied = 0;
+
+  for (ty = 0; ty < tilesY; ty++) {
+    int y0 = ty * TILE_SIZE;
+    int th = height - y0 < TILE_SIZE ? height - y0 : TILE_SIZE;
+
+    for (tx = 0; tx < tilesX; tx++, t++) {
+      int x0 = tx * TILE_SIZE;
+      int tw = width - x0 < TILE_SIZE ? width - x0 : TILE_SIZE;
+      uint8_t *d = dst + (ptrdiff_t)y0 * stride + x0 * bytesPerPixel;
+      const uint8_t *s = src + ((ptrdiff_t)x0 * srcDx + (ptrdiff_t)y0 * srcDy) * bytesPerPixel;
+
+      if (!TILE_IS_DIRTY(dirty, t))
+        continue;
+      if (gather == NULL)
+        tileCopyRows(d, stride, s, srcDy * bytesPerPixel, tw * bytesPerPixel, th);
+      else
+        gather(d, stride, s, srcDx, srcDy, tw, th);
+      copied += (size_t)tw * bytesPerPixel * th;
+    }
+  }
+  return copied;
+}
+
+size_t copyDirtyTiles(uint8_t *dst, const uint8_t *src,
+                      int width, int height, int bytesPerPixel,
+                      const uint32_t *dirty)
+{
+  int tx, ty, t = 0, run;
+  int tilesX = TILES_X(width), tilesY = TILES_Y(height);
+  int stride = width * bytesPerPixel;
+  size_t copied = 0;
+
+  for (ty = 0; ty < tilesY; ty++) {
+    int y0 = ty * TILE_SIZE;
+    int th = height - y0 < TILE_SIZE ? height - y0 : TILE_SIZE;
+
+    for (tx = 0; tx < tilesX; tx++, t++) {
+      int x0, w;
+      ptrdiff_t off;
+
+      if (!TILE_IS_DIRTY(dirty, t))
+        continue;
+
+      /* copy a whole run of dirty tiles with one memcpy per row */
+      for (run = 1; tx + run < tilesX && TILE_IS_DIRTY(dirty, t + run); run++)
+        ;
+      x0 = tx * TILE_SIZE;
+      w = (tx + run) * TILE_SIZE > width ? width - x0 : run * TILE_SIZE;
+      off = (ptrdiff_t)y0 * stride + x0 * bytesPerPixel;
+
+      tileCopyRows(dst + off, stride, src + off, stride, w * bytesPerPixel, th);
+      copied += (size_t)w * bytesPerPixel * th;
+      tx += run - 1;
+      t += run - 1;
+    }
+  }
+  return copied;
+}
+
+/* Rows y0 to y0+rows of the new frame, straight from src if it isn't
+   rotated, otherwise straightened out tile by tile into `strip`. */
+static const uint8_t *stripRows(uint8_t *strip, const uint8_t *src, int srcDx, int srcDy,
+                                int width, int y0, int rows, int bytesPerPixel,
+                                tileGatherFn gather, int *stride)
+{
+  int x0, tw, rowBytes = width * bytesPerPixel;
+
+  if (gather == NULL) {
+    *stride = srcDy * bytesPerPixel;
+    return src + (ptrdiff_t)y0 * srcDy * bytesPerPixel;
+  }
+  for (x0 = 0; x0 < width; x0 += TILE_SIZE) {
+    tw = width - x0 < TILE_SIZE ? width - x0 : TILE_SIZE;
+    gather(strip + x0 * bytesPerPixel, rowBytes,
+           src + ((ptrdiff_t)x0 * srcDx + (ptrdiff_t)y0 * srcDy) * bytesPerPixel,
+           srcDx, srcDy, tw, rows);
+  }
+  *stride = rowBytes;
+  return strip;
+}
+
+/*
+ * Every row of both frames is hashed whole. Each changed row whose hash
+ * occurs exactly once in the old frame votes for the offset it moved by;
+ * blank rows occur everywhere and are left out. The winning offset then
+ * claims the runs of rows that match at it, as long as a run changed at
+ * all, and each claimed row is compared for real before it is reported.
+ */
+int findScroll(const uint8_t *old, const uint8_t *src, int srcDx, int srcDy,
+               int width, int height, int bytesPerPixel,
+               int maxOffset, int minRows, uint8_t *movedRows)
+{
+  int rowBytes = width * bytesPerPixel;
+  tileGatherFn gather = pickGather(srcDx, srcDy, bytesPerPixel);
+  tileHashFn hash = hashKernel;
+  int slots, mask, i, y, y0, yo, th, d, run, changed, stride, best = 0, found = 0;
+  uint64_t *oldRows, *newRows, *keys, h;
+  int *rows, *votes;
+  uint8_t *strip = NULL;
+  const uint8_t *s;
+
+  memset(movedRows, 0, height);
+  if (maxOffset >= height)
+    maxOffset = height - 1;
+  if (maxOffset <= 0 || minRows > height)
+    return 0;
+
+  for (slots = 1; slots < 2 * height; slots <<= 1)
+    ;
+  mask = slots - 1;
+  oldRows = malloc((2 * (size_t)height + slots) * sizeof(uint64_t) +
+                   (slots + 2 * (size_t)maxOffset + 1) * sizeof(int));
+  if (oldRows == NULL)
+    return 0;
+  newRows = oldRows + height;
+  keys = newRows + height;
+  rows = (int *)(keys + slots);
+  votes = rows + slots;
+  if (gather != NULL && (strip = malloc((size_t)rowBytes * TILE_SIZE)) == NULL) {
+    free(oldRows);
+    return 0;
+  }
+
+  for (y = 0; y < height; y++)
+    oldRows[y] = hash(old + (ptrdiff_t)y * rowBytes, rowBytes, rowBytes, 1);
+  for (y0 = 0; y0 < height; y0 += TILE_SIZE) {
+    th = height - y0 < TILE_SIZE ? height - y0 : TILE_SIZE;
+    s = stripRows(strip, src, srcDx, srcDy, width, y0, th, bytesPerPixel, gather, &stride);
+    for (y = 0; y < th; y++)
+      newRows[y0 + y] = hash(s + (ptrdiff_t)y * stride, stride, rowBytes, 1);
+  }
+
+  /* old rows by hash, -1 for a free slot and -2 for a hash seen twice */
+  for (i = 0; i < slots; i++)
+    rows[i] = -1;
+  for (y = 0; y < height; y++) {
+    h = oldRows[y];
+    for (i = h & mask; rows[i] != -1 && keys[i] != h; i = (i + 1) & mask)
+      ;
+    if (rows[i] == -1) {
+      keys[i] = h;
+      rows[i] = y;
+    } else {
+      rows[i] = -2;
+    }
+  }
+
+  memset(votes, 0, (2 * maxOffset + 1) * sizeof(int));
+  for (y = 0; y < height; y++) {
+    h = newRows[y];
+    if (h == oldRows[y])
+      continue;
+    for (i = h & mask; rows[i] != -1 && keys[i] != h; i = (i + 1) & mask)
+      ;
+    if (rows[i] < 0)
+      continue;
+    d = y - rows[i];
+    if (d >= -maxOffset && d <= maxOffset)
+      votes[d + maxOffset]++;
+  }
+  for (d = -maxOffset; d <= maxOffset; d++)
+    if (votes[d + maxOffset] > votes[best + maxOffset])
+      best = d;
+
+  for (y = 0; best != 0 && y < height; y += run > 0 ? run : 1) {
+    for (run = 0, changed = 0; y + run < height; run++) {
+      yo = y + run - best;
+      if (yo < 0 || yo >= height || newRows[y + run] != oldRows[yo])
+        break;
+      if (newRows[y + run] != oldRows[y + run])
+        changed = 1;
+    }
+    if (run >= minRows && changed) {
+      memset(movedRows + y, 1, run);
+      found = 1;
+    }
+  }
+
+  /* a 64-bit collision would move the wrong pixels, so make sure */
+  for (y0 = 0; found && y0 < height; y0 += TILE_SIZE) {
+    th = height - y0 < TILE_SIZE ? height - y0 : TILE_SIZE;
+    if (memchr(movedRows + y0, 1, th) == NULL)
+      continue;
+    s = stripRows(strip, src, srcDx, srcDy, width, y0, th, bytesPerPixel, gather, &stride);
+    for (y = 0; y < th; y++)
+      if (movedRows[y0 + y] &&
+          memcmp(s + (ptrdiff_t)y * stride,
+                 old + (ptrdiff_t)(y0 + y - best) * rowBytes, rowBytes) != 0)
+        found = 0;
+  }
+
+  free(strip);
+  free(oldRows);
+  if (!found) {
+    memset(movedRows, 0, height);
+    return 0;
+  }
+  return best;
+}
+
+int clearScrolledTiles(const uint8_t *old, const uint8_t *src, int srcDx, int srcDy,
+                       int width, int height, int bytesPerPixel,
+                       const uint8_t *movedRows, uint32_t *dirty)
+{
+  int tx, ty, t = 0, r, count = 0;
+  int tilesX = TILES_X(width), tilesY = TILES_Y(height);
+  int oldStride = width * bytesPerPixel;
+  tileGatherFn gather = pickGather(srcDx, srcDy, bytesPerPixel);
+  uint32_t scratch[TILE_SIZE * TILE_SIZE];
+
+  for (ty = 0; ty < tilesY; ty++) {
+    int y0 = ty * TILE_SIZE;
+    int th = height - y0 < TILE_SIZE ? height - y0 : TILE_SIZE;
+    int moved = memchr(movedRows + y0, 1, th) != NULL;
+
+    for (tx = 0; tx < tilesX; tx++, t++) {
+      int x0 = tx * TILE_SIZE;
+      int tw = width - x0 < TILE_SIZE ? width - x0 : TILE_SIZE;
+      int rowBytes = tw * bytesPerPixel, stride = srcDy * bytesPerPixel;
+      const uint8_t *o = old + (ptrdiff_t)y0 * oldStride + x0 * bytesPerPixel;
+      const uint8_t *s = src + ((ptrdiff_t)x0 * srcDx + (ptrdiff_t)y0 * srcDy) * bytesPerPixel;
+
+      if (!TILE_IS_DIRTY(dirty, t))
+        continue;
+      if (!moved) {
+        count++;
+        continue;
+      }
+      if (gather != NULL) {
+        gather((uint8_t *)scratch, rowBytes, s, srcDx, srcDy, tw, th);
+        s = (const uint8_t *)scratch;
+        stride = rowBytes;
+      }
+      /* moved rows already matched whole, the others must not have changed */
+      for (r = 0; r < th; r++)
+        if (!movedRows[y0 + r] &&
+            memcmp(o + (ptrdiff_t)r * oldStride, s + (ptrdiff_t)r * stride, rowBytes) != 0)
+          break;
+      if (r < th)
+        count++;
+      else
+        dirty[t >> 5] &= ~(1u << (t & 31));
+    }
+  }
+  return count;
+}
+
+void scrollRows(uint8_t *buf, int width, int height, int bytesPerPixel,
+                int offset, const uint8_t *movedRows)
+{
+  size_t rowBytes = (size_t)width * bytesPerPixel;
+  int y;
+
+  /* work against the move so every source row is read before it's replaced */
+  if (offset > 0) {
+    for (y = height - 1; y >= 0; y--)
+      if (movedRows[y])
+        memcpy(buf + y * rowBytes, buf + (y - offset) * rowBytes, rowBytes);
+  } else {
+    for (y = 0; y < height; y++)
+      if (movedRows[y])
+        memcpy(buf + y * rowBytes, buf + (y - offset) * rowBytes, rowBytes);
+  }
+}
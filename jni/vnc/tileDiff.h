@@ -0,0 +1,129 @@
+/*
+droid VNC server  - a vnc server for android
+Copyright (C) 2011 Jose Pereira <onaips@gmail.com>
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef TILE_DIFF_H
+#define TILE_DIFF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Side of a square diff tile, in pixels. */
+#define TILE_SIZE 32
+
+#define TILES_X(w) (((w) + TILE_SIZE - 1) / TILE_SIZE)
+#define TILES_Y(h) (((h) + TILE_SIZE - 1) / TILE_SIZE)
+#define TILE_BITMAP_WORDS(w,h) ((TILES_X(w) * TILES_Y(h) + 31) / 32)
+#define TILE_IS_DIRTY(bm,t) ((bm)[(t) >> 5] & (1u << ((t) & 31)))
+
+/* Compares `rows` rows of `rowBytes` bytes and copies src over dst from the
+   first differing row on. Returns non-zero if anything differed. */
+typedef int (*tileCmpCopyFn)(uint8_t *dst, int dstStride,
+                             const uint8_t *src, int srcStride,
+                             int rowBytes, int rows);
+
+/* Fills a packed w*h tile whose pixel (x,y) is src[x*dx + y*dy] (in pixels),
+   i.e. undoes the rotation of the source. */
+typedef void (*tileGatherFn)(uint8_t *dst, int dstStride,
+                             const uint8_t *src, int dx, int dy, int w, int h);
+
+void tileGather_uint8_t(uint8_t *dst, int dstStride,
+                        const uint8_t *src, int dx, int dy, int w, int h);
+void tileGather_uint16_t(uint8_t *dst, int dstStride,
+                         const uint8_t *src, int dx, int dy, int w, int h);
+void tileGather_uint32_t(uint8_t *dst, int dstStride,
+                         const uint8_t *src, int dx, int dy, int w, int h);
+
+void tileCopyRows(uint8_t *dst, int dstStride,
+                  const uint8_t *src, int srcStride,
+                  int rowBytes, int rows);
+
+const char *initTileDiff(void);
+int tileDiffUseKernel(const char *name);
+const char *tileDiffKernelName(void);
+
+/*
+ * Diffs a frame against the shadow buffer, tile by tile.
+ *
+ * `shadow` is a packed width*height buffer in VNC (rotated) orientation.
+ * `src` points at the source pixel that lands on VNC pixel (0,0); srcDx and
+ * srcDy are the source steps, in pixels, for one VNC column and one VNC row,
+ * so every rotation is expressed by picking the origin and the two steps.
+ *
+ * Dirty tiles are refreshed in the shadow and flagged in `dirty`, which must
+ * hold TILE_BITMAP_WORDS(width,height) words. Returns the dirty tile count.
+ */
+int diffTiles(uint8_t *shadow, const uint8_t *src, int srcDx, int srcDy,
+              int width, int height, int bytesPerPixel, uint32_t *dirty);
+
+/* Hashes `rows` rows of `rowBytes` bytes into a 64-bit tile signature. */
+typedef uint64_t (*tileHashFn)(const uint8_t *src, int stride,
+                               int rowBytes, int rows);
+
+int tileHashUseKernel(const char *name);
+const char *tileHashKernelName(void);
+
+/*
+ * Change detection without a shadow copy. Keeps one hash per tile in
+ * `hashes`, which must hold TILES_X(width)*TILES_Y(height) entries, flags
+ * the tiles whose hash moved since the last call in `dirty` and returns
+ * their count. `src`, srcDx and srcDy are as for diffTiles.
+ */
+int hashTiles(uint64_t *hashes, const uint8_t *src, int srcDx, int srcDy,
+              int width, int height, int bytesPerPixel, uint32_t *dirty);
+
+/* Compares the tiles not yet flagged in `dirty` byte by byte against a
+   packed copy of the last frame and flags the ones that differ, which is
+   what catches hash collisions. Returns how many it flagged. */
+int verifyTiles(const uint8_t *shadow, const uint8_t *src, int srcDx, int srcDy,
+                int width, int height, int bytesPerPixel, uint32_t *dirty);
+
+/* Like copyDirtyTiles, but straight from the (possibly rotated) source. */
+size_t gatherDirtyTiles(uint8_t *dst, const uint8_t *src, int srcDx, int srcDy,
+                        int width, int height, int bytesPerPixel,
+                        const uint32_t *dirty);
+
+/* Copies only the tiles flagged in `dirty` between two packed buffers of the
+   same geometry. Returns the number of bytes copied. */
+size_t copyDirtyTiles(uint8_t *dst, const uint8_t *src,
+                      int width, int height, int bytesPerPixel,
+                      const uint32_t *dirty);
+
+/*
+ * Scroll detection. Looks for content that moved up or down between `old`,
+ * a packed copy of the last frame, and the new frame at `src` (srcDx and
+ * srcDy as for diffTiles). Returns how far it moved down, negative for up,
+ * or 0 if nothing did, and sets movedRows[y] for every row y of the new
+ * frame that is row y - offset of `old`, byte for byte. Only runs of at
+ * least minRows such rows count, and only offsets up to maxOffset.
+ */
+int findScroll(const uint8_t *old, const uint8_t *src, int srcDx, int srcDy,
+               int width, int height, int bytesPerPixel,
+               int maxOffset, int minRows, uint8_t *movedRows);
+
+/* Unflags the dirty tiles that will match `old` once the rows findScroll
+   reported are moved in it. Returns how many tiles stay dirty. */
+int clearScrolledTiles(const uint8_t *old, const uint8_t *src, int srcDx, int srcDy,
+                       int width, int height, int bytesPerPixel,
+                       const uint8_t *movedRows, uint32_t *dirty);
+
+/* Moves the rows findScroll reported by `offset` within a packed buffer. */
+void scrollRows(uint8_t *buf, int width, int height, int bytesPerPixel,
+                int offset, const uint8_t *movedRows);
+
+#endif
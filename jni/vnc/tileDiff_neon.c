@@ -0,0 +1,168 @@
+/*
+droid VNC server  - a vnc server for android
+Copyright (C) 2011 Jose Pereira <onaips@gmail.com>
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+//NEON kernels for tileDiff.c, only built (with -mfpu=neon) for armeabi-v7a
+
+#include <string.h>
+#include <arm_neon.h>
+
+#include "tileDiff.h"
+
+int tileCmpCopyNEON(uint8_t *dst, int dstStride,
+                    const uint8_t *src, int srcStride,
+                    int rowBytes, int rows)
+{
+  int r, i;
+  uint8x16_t acc;
+  uint64x2_t acc64;
+
+  for (r = 0; r < rows; r++) {
+    acc = vdupq_n_u8(0);
+    for (i = 0; i + 16 <= rowBytes; i += 16)
+      acc = vorrq_u8(acc, veorq_u8(vld1q_u8(dst + i), vld1q_u8(src + i)));
+
+    acc64 = vreinterpretq_u64_u8(acc);
+    if ((vgetq_lane_u64(acc64, 0) | vgetq_lane_u64(acc64, 1)) != 0 ||
+        (i < rowBytes && memcmp(dst + i, src + i, rowBytes - i) != 0)) {
+      tileCopyRows(dst, dstStride, src, srcStride, rowBytes, rows - r);
+      return 1;
+    }
+    dst += dstStride;
+    src += srcStride;
+  }
+  return 0;
+}
+
+/* Same block layout as the SSE2 versions in tileDiff.c. */
+void tileTranspose32NEON(uint8_t *dst, int dstStride,
+                         const uint8_t *src, int dx, int dy, int w, int h)
+{
+  const uint32_t *s = (const uint32_t *)src;
+  int w4 = w & ~3, h4 = h & ~3, x, y, k;
+  uint32x4_t r[4];
+  uint32x4x2_t t01, t23;
+
+  for (y = 0; y < h4; y += 4) {
+    for (x = 0; x < w4; x += 4) {
+      for (k = 0; k < 4; k++)
+        r[k] = vld1q_u32(s + (ptrdiff_t)(x + k) * dx + (dy > 0 ? y : -y - 3));
+
+      t01 = vtrnq_u32(r[0], r[1]);
+      t23 = vtrnq_u32(r[2], r[3]);
+      r[0] = vcombine_u32(vget_low_u32(t01.val[0]), vget_low_u32(t23.val[0]));
+      r[1] = vcombine_u32(vget_low_u32(t01.val[1]), vget_low_u32(t23.val[1]));
+      r[2] = vcombine_u32(vget_high_u32(t01.val[0]), vget_high_u32(t23.val[0]));
+      r[3] = vcombine_u32(vget_high_u32(t01.val[1]), vget_high_u32(t23.val[1]));
+
+      for (k = 0; k < 4; k++)
+        vst1q_u32((uint32_t *)(dst + (ptrdiff_t)(dy > 0 ? y + k : y + 3 - k) * dstStride
+                               + x * 4), r[k]);
+    }
+  }
+  if (w4 < w)
+    tileGather_uint32_t(dst + w4 * 4, dstStride, (const uint8_t *)(s + (ptrdiff_t)w4 * dx),
+                        dx, dy, w - w4, h);
+  if (h4 < h)
+    tileGather_uint32_t(dst + (ptrdiff_t)h4 * dstStride, dstStride,
+                        (const uint8_t *)(s + (ptrdiff_t)h4 * dy), dx, dy, w4, h - h4);
+}
+
+void tileTranspose16NEON(uint8_t *dst, int dstStride,
+                         const uint8_t *src, int dx, int dy, int w, int h)
+{
+  const uint16_t *s = (const uint16_t *)src;
+  int w8 = w & ~7, h8 = h & ~7, x, y, k;
+  uint16x8_t r[8];
+  uint16x8x2_t t0, t1, t2, t3;
+  uint32x4x2_t u0, u1, u2, u3;
+
+  for (y = 0; y < h8; y += 8) {
+    for (x = 0; x < w8; x += 8) {
+      for (k = 0; k < 8; k++)
+        r[k] = vld1q_u16(s + (ptrdiff_t)(x + k) * dx + (dy > 0 ? y : -y - 7));
+
+      t0 = vtrnq_u16(r[0], r[1]);
+      t1 = vtrnq_u16(r[2], r[3]);
+      t2 = vtrnq_u16(r[4], r[5]);
+      t3 = vtrnq_u16(r[6], r[7]);
+
+      u0 = vtrnq_u32(vreinterpretq_u32_u16(t0.val[0]), vreinterpretq_u32_u16(t1.val[0]));
+      u1 = vtrnq_u32(vreinterpretq_u32_u16(t0.val[1]), vreinterpretq_u32_u16(t1.val[1]));
+      u2 = vtrnq_u32(vreinterpretq_u32_u16(t2.val[0]), vreinterpretq_u32_u16(t3.val[0]));
+      u3 = vtrnq_u32(vreinterpretq_u32_u16(t2.val[1]), vreinterpretq_u32_u16(t3.val[1]));
+
+      r[0] = vreinterpretq_u16_u32(vcombine_u32(vget_low_u32(u0.val[0]), vget_low_u32(u2.val[0])));
+      r[1] = vreinterpretq_u16_u32(vcombine_u32(vget_low_u32(u1.val[0]), vget_low_u32(u3.val[0])));
+      r[2] = vreinterpretq_u16_u32(vcombine_u32(vget_low_u32(u0.val[1]), vget_low_u32(u2.val[1])));
+      r[3] = vreinterpretq_u16_u32(vcombine_u32(vget_low_u32(u1.val[1]), vget_low_u32(u3.val[1])));
+      r[4] = vreinterpretq_u16_u32(vcombine_u32(vget_high_u32(u0.val[0]), vget_high_u32(u2.val[0])));
+      r[5] = vreinterpretq_u16_u32(vcombine_u32(vget_high_u32(u1.val[0]), vget_high_u32(u3.val[0])));
+      r[6] = vreinterpretq_u16_u32(vcombine_u32(vget_high_u32(u0.val[1]), vget_high_u32(u2.val[1])));
+      r[7] = vreinterpretq_u16_u32(vcombine_u32(vget_high_u32(u1.val[1]), vget_high_u32(u3.val[1])));
+
+      for (k = 0; k < 8; k++)
+        vst1q_u16((uint16_t *)(dst + (ptrdiff_t)(dy > 0 ? y + k : y + 7 - k) * dstStride
+                               + x * 2), r[k]);
+    }
+  }
+  if (w8 < w)
+    tileGather_uint16_t(dst + w8 * 2, dstStride, (const uint8_t *)(s + (ptrdiff_t)w8 * dx),
+                        dx, dy, w - w8, h);
+  if (h8 < h)
+    tileGather_uint16_t(dst + (ptrdiff_t)h8 * dstStride, dstStride,
+                        (const uint8_t *)(s + (ptrdiff_t)h8 * dy), dx, dy, w8, h - h8);
+}
+
+void tileReverse32NEON(uint8_t *dst, int dstStride,
+                       const uint8_t *src, int dx, int dy, int w, int h)
+{
+  int w4 = w & ~3, x, y;
+  uint32x4_t v;
+
+  for (y = 0; y < h; y++) {
+    const uint32_t *s = (const uint32_t *)src + (ptrdiff_t)y * dy;
+    uint32_t *d = (uint32_t *)(dst + (ptrdiff_t)y * dstStride);
+
+    for (x = 0; x < w4; x += 4) {
+      v = vrev64q_u32(vld1q_u32(s - x - 3));
+      vst1q_u32(d + x, vcombine_u32(vget_high_u32(v), vget_low_u32(v)));
+    }
+    for (; x < w; x++)
+      d[x] = s[-x];
+  }
+}
+
+void tileReverse16NEON(uint8_t *dst, int dstStride,
+                       const uint8_t *src, int dx, int dy, int w, int h)
+{
+  int w8 = w & ~7, x, y;
+  uint16x8_t v;
+
+  for (y = 0; y < h; y++) {
+    const uint16_t *s = (const uint16_t *)src + (ptrdiff_t)y * dy;
+    uint16_t *d = (uint16_t *)(dst + (ptrdiff_t)y * dstStride);
+
+    for (x = 0; x < w8; x += 8) {
+      v = vrev64q_u16(vld1q_u16(s - x - 7));
+      vst1q_u16(d + x, vcombine_u16(vget_high_u16(v), vget_low_u16(v)));
+    }
+    for (; x < w; x++)
+      d[x] = s[-x];
+  }
+}
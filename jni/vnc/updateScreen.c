@@ -22,170 +22,154 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 void FUNCTION(void)
 {  
-  int i,j,r;
-  int offset=0,pixelToVirtual;
-  OUT_T* a;
+  int rot,stride,origin,dx,dy,w,h;
+  int srcW=screenformat.width, srcH=screenformat.height;
+  size_t copied;
+  int refresh,dirty;
   OUT_T* b=0;
   struct fb_var_screeninfo scrinfo; //we'll need this to detect double FB on framebuffer
 
-  if (display_rotate_180){
-    r=rotation;
-    rotation+=180;
-  }
-
   if (method==FRAMEBUFFER) {
     scrinfo = FB_getscrinfo();
     b = (OUT_T*) readBufferFB();
+    stride = scrinfo.xres_virtual;
+    origin = scrinfo.yoffset * stride + scrinfo.xoffset;
   }
-  else if (method==ADB)
-    b = (OUT_T*) readBufferADB();
-  else if (method==GRALLOC)
-    b = (OUT_T*) readBufferGralloc();
-  else if (method==FLINGER)
-    b = (OUT_T*) readBufferFlinger();
-
-  a = (OUT_T*)cmpbuf;
-//  memcpy(vncbuf,b,screenformat.width*screenformat.height*screenformat.bitsPerPixel/CHAR_BIT);
-//  rfbMarkRectAsModified(vncscr, 0, 0, vncscr->width, vncscr->height);
-//  return;
-
-  int max_x=-1,max_y=-1, min_x=99999, min_y=99999;
-  int h;
-  idle=1;
-
-  if (rotation==0) {
-    for (j = 0; j < vncscr->height; j++) {
-      for (i = 0; i < vncscr->width; i++) {
-        offset = j * vncscr->width;
-
-        if (method==FRAMEBUFFER)
-        pixelToVirtual = PIXEL_TO_VIRTUALPIXEL_FB(i,j);
-        else
-        pixelToVirtual = PIXEL_TO_VIRTUALPIXEL(i,j);
-
-        if (a[i + offset]!=b[pixelToVirtual]) {
-          a[i + offset]=b[pixelToVirtual];
-          if (i>max_x)
-          max_x=i;
-          if (i<min_x)
-          min_x=i;
-
-          if (j>max_y)
-          max_y=j;
-          if (j<min_y)
-          min_y=j;
-
-          idle=0;
-        }
-      }
-    }
-  }
-  else if (rotation==90) {
-    for (j = 0; j < vncscr->width; j++) {
-      for (i = 0; i < vncscr->height; i++) {
-        offset = i * vncscr->width;
-
-        if (method==FRAMEBUFFER)
-        pixelToVirtual = PIXEL_TO_VIRTUALPIXEL_FB(i,j);
-        else
-        pixelToVirtual = PIXEL_TO_VIRTUALPIXEL(i,j);		  
-
-        if (a[(vncscr->width - 1 - j + offset)] != b[pixelToVirtual])
-        {
-          a[(vncscr->width - 1 - j + offset)] = b[pixelToVirtual];
-
-          if (i>max_y)
-          max_y=i;
-          if (i<min_y)
-          min_y=i;
-
-          h=vncscr->width-j;
-
-          if (h < min_x)
-          min_x=vncscr->width-j;
-          if (h > max_x)
-          max_x=vncscr->width-j;
-
-          idle=0;
-        }
-      }
-    }
+  else {
+    if (method==ADB)
+      b = (OUT_T*) readBufferADB();
+    else if (method==GRALLOC)
+      b = (OUT_T*) readBufferGralloc();
+    else if (method==FLINGER)
+      b = (OUT_T*) readBufferFlinger();
+    stride = srcW;
+    origin = 0;
   }
-  else if (rotation==180) {
-    for (j = 0; j < vncscr->height; j++) {
-      for (i = 0; i < vncscr->width; i++) {
-        offset = (vncscr->height - 1 - j) * vncscr->width;
 
-        if (method==FRAMEBUFFER)
-        pixelToVirtual = PIXEL_TO_VIRTUALPIXEL_FB(i,j);
-        else
-        pixelToVirtual = PIXEL_TO_VIRTUALPIXEL(i,j);
+  if (b == NULL)
+    return;
+
+  refresh = time(NULL) >= nextHashRefresh;
+  if (refresh)
+    nextHashRefresh = time(NULL) + HASH_REFRESH_SECONDS;
+
+  if (zero_copy) {
+    /* libvncserver reads b in place, all that's left is spotting changes */
+    idle = hashTiles(tileHashes, (const uint8_t*)(b + origin), 1, stride,
+                     srcW, srcH, sizeof(OUT_T), dirtyTiles) == 0;
+
+    pthread_mutex_lock(&frameLock);
+    /* rotate() may have switched back to copying while we hashed */
+    if (zero_copy) {
+      /* a pan moves the front buffer, follow it */
+      vncscr->frameBuffer = (char*)(b + origin);
+      countCopiedBytes(0, srcW*srcH*sizeof(OUT_T));
+      if (refresh)
+        rfbMarkRectAsModified(vncscr, 0, 0, vncscr->width, vncscr->height);
+      else if (!idle)
+        markDirtyTiles();
+    }
+    pthread_mutex_unlock(&frameLock);
 
-        if (a[((vncscr->width - 1 - i) + offset )]!=b[pixelToVirtual]) {
-          a[((vncscr->width - 1 - i) + offset )]=b[pixelToVirtual];
+    if (!idle || refresh)
+      wakeNetworkLoop();
+    return;
+  }
 
+  /* rotate() runs on the network thread, take a consistent snapshot */
+  pthread_mutex_lock(&frameLock);
+  rot = display_rotate_180 ? (rotation + 180) % 360 : rotation;
+  w = vncscr->width;
+  h = vncscr->height;
+  pthread_mutex_unlock(&frameLock);
+
+  /* Source pixel for VNC (x,y) is b[origin + x*dx + y*dy]; work out where
+     VNC (0,0) comes from once per frame instead of once per pixel. */
+  switch (rot) {
+    case 90:
+      origin += (srcH - 1) * stride;
+      dx = -stride;
+      dy = 1;
+      break;
+    case 180:
+      origin += (srcH - 1) * stride + srcW - 1;
+      dx = -1;
+      dy = -stride;
+      break;
+    case 270:
+      origin += srcW - 1;
+      dx = stride;
+      dy = -1;
+      break;
+    default:
+      dx = 1;
+      dy = stride;
+      break;
+  }
 
-          if (i>max_x)
-          max_x=i;
-          if (i<min_x)
-          min_x=i;
+  if (hash_tiles) {
+    /* after a rotation vncbuf is laid out differently, so resend it all */
+    pthread_mutex_lock(&frameLock);
+    if (hashesStale) {
+      memset(tileHashes, 0, TILES_X(w) * TILES_Y(h) * sizeof(uint64_t));
+      hashesStale = 0;
+    }
+    pthread_mutex_unlock(&frameLock);
+
+    /* hashing reads only the grabbed frame and our own hashes */
+    dirty = hashTiles(tileHashes, (const uint8_t*)(b + origin), dx, dy,
+                      w, h, sizeof(OUT_T), dirtyTiles);
+    if (refresh) {
+      /* The network thread draws the cursor into vncbuf for viewers without
+         cursor shape updates and takes it out again before it lets go of
+         frameLock, so vncbuf only holds what we copied in under the lock. */
+      pthread_mutex_lock(&frameLock);
+      dirty += verifyTiles((const uint8_t*)vncbuf, (const uint8_t*)(b + origin),
+                           dx, dy, w, h, sizeof(OUT_T), dirtyTiles);
+      pthread_mutex_unlock(&frameLock);
+    }
+    idle = dirty == 0;
 
-          h=vncscr->height-j;
+    if (!idle) {
+      pthread_mutex_lock(&frameLock);
+      detectScroll((const uint8_t*)(b + origin), dx, dy, w, h, sizeof(OUT_T), dirty);
+      copied = applyScroll(w, h, sizeof(OUT_T));
+      copied += gatherDirtyTiles((uint8_t*)vncbuf, (const uint8_t*)(b + origin),
+                                 dx, dy, w, h, sizeof(OUT_T), dirtyTiles);
+      countCopiedBytes(copied, screenformat.width*screenformat.height*sizeof(OUT_T));
 
-          if (h < min_y)
-          min_y=vncscr->height-j;
-          if (h > max_y)
-          max_y=vncscr->height-j;
+      if (w == vncscr->width && h == vncscr->height)
+        markDirtyTiles();
+      pthread_mutex_unlock(&frameLock);
 
-          idle=0;
-        }
-      }
+      wakeNetworkLoop();
     }
+    return;
   }
-  else if (rotation==270) {
-    for (j = 0; j < vncscr->width; j++) {
-      for (i = 0; i < vncscr->height; i++) {
-        offset = (vncscr->height - 1 - i) * vncscr->width;
-
-        if (method==FRAMEBUFFER)
-        pixelToVirtual = PIXEL_TO_VIRTUALPIXEL_FB(i,j);
-        else
-        pixelToVirtual = PIXEL_TO_VIRTUALPIXEL(i,j);
-
-        if(a[j + offset] != b[pixelToVirtual]) {
-          a[j + offset] = b[pixelToVirtual];
-
-          if (i>max_y)
-          max_y=i;
-          if (i<min_y)
-          min_y=i;
-
-          if (j < min_x)
-          min_x=j;
-          if (j > max_x)
-          max_x=j;
-
-          idle=0;
-        }
-      }
-    }
-  }
-
-  if (!idle) {
-    memcpy(vncbuf,a,screenformat.width*screenformat.height*screenformat.bitsPerPixel/CHAR_BIT);
-
-    min_x--;
-    min_x--;
-    max_x++;
-    max_y++;
 
-          //  L("Changed x(%d-%d) y(%d-%d)\n",min_x,max_x,min_y,max_y);
+  /* cmpbuf belongs to the capture thread, so the grab and the diff run
+     without holding up the network thread */
+  dirty = diffTiles((uint8_t*)cmpbuf, (const uint8_t*)(b + origin), dx, dy,
+                    w, h, sizeof(OUT_T), dirtyTiles);
+  idle = dirty == 0;
 
-    rfbMarkRectAsModified(vncscr, min_x, min_y, max_x, max_y);
+  if (!idle) {
+    /* Only dirty tiles reach the framebuffer libvncserver reads from, and
+       only under frameLock, which the network thread holds while it sends.
+       The copy keeps vncbuf identical to cmpbuf even if a rotation slipped
+       in meanwhile; rotate() has already marked the whole screen then. */
+    pthread_mutex_lock(&frameLock);
+    /* cmpbuf holds the new frame now, packed like vncbuf */
+    detectScroll((const uint8_t*)cmpbuf, 1, w, w, h, sizeof(OUT_T), dirty);
+    copied = applyScroll(w, h, sizeof(OUT_T));
+    copied += copyDirtyTiles((uint8_t*)vncbuf, (const uint8_t*)cmpbuf,
+                             w, h, sizeof(OUT_T), dirtyTiles);
+    countCopiedBytes(copied, screenformat.width*screenformat.height*sizeof(OUT_T));
+
+    if (w == vncscr->width && h == vncscr->height)
+      markDirtyTiles();
+    pthread_mutex_unlock(&frameLock);
+
+    wakeNetworkLoop();
   }
-  if (display_rotate_180)
-    rotation=r;
 }
-
-
-
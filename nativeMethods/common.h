@@ -72,6 +72,7 @@ void rotate(int);
 int getCurrentRotation();
 int isIdle();
 void setIdle(int i);
+int isCaptureForced(void);
 void close_app();
 screenFormat screenformat;
 